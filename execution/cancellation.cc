@@ -0,0 +1,68 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/cancellation.h"
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind::code_contests {
+
+void CancellationToken::Cancel() {
+  absl::MutexLock l(&mu_);
+  if (cancelled_) {
+    return;
+  }
+  cancelled_ = true;
+  // Callbacks are called with the lock held, so that Unregister waits for
+  // them to return.
+  for (auto& [id, callback] : callbacks_) {
+    callback();
+  }
+  callbacks_.clear();
+}
+
+bool CancellationToken::IsCancelled() const {
+  absl::MutexLock l(&mu_);
+  return cancelled_;
+}
+
+int64_t CancellationToken::Register(std::function<void()> callback) {
+  absl::MutexLock l(&mu_);
+  const int64_t id = next_id_++;
+  if (cancelled_) {
+    callback();
+  } else {
+    callbacks_[id] = std::move(callback);
+  }
+  return id;
+}
+
+void CancellationToken::Unregister(int64_t id) {
+  absl::MutexLock l(&mu_);
+  callbacks_.erase(id);
+}
+
+ScopedCancellationCallback::ScopedCancellationCallback(
+    CancellationToken& token, std::function<void()> callback)
+    : token_(token), id_(token.Register(std::move(callback))) {}
+
+ScopedCancellationCallback::~ScopedCancellationCallback() {
+  token_.Unregister(id_);
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,76 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A token for cancelling work that is running on other threads, e.g. to kill
+// the sandboxes of a submission that is no longer needed.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CANCELLATION_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CANCELLATION_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind::code_contests {
+
+class CancellationToken {
+ public:
+  CancellationToken() = default;
+
+  CancellationToken(const CancellationToken&) = delete;
+  CancellationToken& operator=(const CancellationToken&) = delete;
+
+  // Cancels the token, and calls all registered callbacks. Does nothing if the
+  // token is already cancelled.
+  void Cancel();
+  bool IsCancelled() const;
+
+ private:
+  friend class ScopedCancellationCallback;
+
+  int64_t Register(std::function<void()> callback);
+  void Unregister(int64_t id);
+
+  mutable absl::Mutex mu_;
+  bool cancelled_ ABSL_GUARDED_BY(mu_) = false;
+  int64_t next_id_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::flat_hash_map<int64_t, std::function<void()>> callbacks_
+      ABSL_GUARDED_BY(mu_);
+};
+
+// Calls `callback` when `token` is cancelled while this object is alive, or
+// right away if it already is. Once the destructor returns, the callback is
+// not running and will not be called, so it may refer to objects that are
+// destroyed afterwards. The callback must not use `token` itself.
+class ScopedCancellationCallback {
+ public:
+  ScopedCancellationCallback(CancellationToken& token,
+                             std::function<void()> callback);
+  ~ScopedCancellationCallback();
+
+  ScopedCancellationCallback(const ScopedCancellationCallback&) = delete;
+  ScopedCancellationCallback& operator=(const ScopedCancellationCallback&) =
+      delete;
+
+ private:
+  CancellationToken& token_;
+  const int64_t id_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CANCELLATION_H_
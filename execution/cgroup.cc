@@ -0,0 +1,232 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/status_macros.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+constexpr int64_t kCpuPeriodMicros = 100000;
+// Removing a cgroup fails while the kernel is still tearing down its killed
+// processes, so removal waits for them for at most this long.
+constexpr absl::Duration kMaxRemoveDelay = absl::Seconds(1);
+
+absl::Status ErrnoStatus(absl::string_view action, const std::string& path,
+                         int error) {
+  const std::string message =
+      absl::Substitute("$0 $1 failed with errno $2", action, path, error);
+  return error == ENOENT ? absl::NotFoundError(message)
+                         : absl::UnknownError(message);
+}
+
+absl::Status WriteFile(const std::string& path, absl::string_view contents) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return ErrnoStatus("Opening", path, errno);
+  }
+  const ssize_t n = write(fd, contents.data(), contents.size());
+  const int write_errno = errno;
+  close(fd);
+  if (n != static_cast<ssize_t>(contents.size())) {
+    return ErrnoStatus("Writing", path, write_errno);
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::string> ReadFile(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return ErrnoStatus("Opening", path, errno);
+  }
+  std::string contents;
+  char buffer[4096];
+  for (;;) {
+    const ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      const int read_errno = errno;
+      close(fd);
+      return ErrnoStatus("Reading", path, read_errno);
+    }
+    if (n == 0) {
+      break;
+    }
+    contents.append(buffer, n);
+  }
+  close(fd);
+  return contents;
+}
+
+// Returns whether the "populated" field of the cgroup.events file open as
+// `fd` is 0. Reading the file also acknowledges its change notifications.
+bool ReadUnpopulated(int fd) {
+  char buffer[256];
+  ssize_t n;
+  do {
+    n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return false;
+  }
+  for (absl::string_view line :
+       absl::StrSplit(absl::string_view(buffer, n), '\n')) {
+    if (line == "populated 0") {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Waits until the cgroup at `path` has no processes left, or `timeout` has
+// passed. The kernel notifies changes of cgroup.events with POLLPRI.
+bool WaitUntilUnpopulated(const std::string& path, absl::Duration timeout) {
+  const std::string events_path = absl::StrCat(path, "/cgroup.events");
+  const int fd = open(events_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const absl::Time deadline = absl::Now() + timeout;
+  bool unpopulated;
+  while (!(unpopulated = ReadUnpopulated(fd))) {
+    const absl::Duration remaining = deadline - absl::Now();
+    if (remaining <= absl::ZeroDuration()) {
+      break;
+    }
+    pollfd poll_fd = {.fd = fd, .events = POLLPRI};
+    poll(&poll_fd, 1,
+         static_cast<int>(absl::ToInt64Milliseconds(
+             absl::Ceil(remaining, absl::Milliseconds(1)))));
+  }
+  close(fd);
+  return unpopulated;
+}
+
+// Returns a name that is unique among the cgroups created by all processes.
+std::string UniqueName() {
+  static std::atomic<int64_t> counter{0};
+  return absl::StrCat("test_", getpid(), "_", counter++);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<Cgroup>> Cgroup::Create(
+    const CgroupOptions& options, int64_t memory_limit_bytes) {
+  if (options.parent.empty()) {
+    return absl::InvalidArgumentError("The parent cgroup must be set.");
+  }
+  std::string path = absl::StrCat(options.parent, "/", UniqueName());
+  if (mkdir(path.c_str(), 0755) != 0) {
+    return ErrnoStatus("Creating cgroup", path, errno);
+  }
+  // From here on, the destructor removes the cgroup.
+  std::unique_ptr<Cgroup> cgroup(new Cgroup(std::move(path)));
+  const std::string& dir = cgroup->path();
+  RETURN_IF_ERROR(WriteFile(absl::StrCat(dir, "/memory.max"),
+                            absl::StrCat(memory_limit_bytes)));
+  // Swap would hide memory usage, but the file only exists if swap accounting
+  // is enabled.
+  const absl::Status swap_status =
+      WriteFile(absl::StrCat(dir, "/memory.swap.max"), "0");
+  if (!swap_status.ok() && !absl::IsNotFound(swap_status)) {
+    return swap_status;
+  }
+  // Kill all processes of a test when one of them runs out of memory.
+  RETURN_IF_ERROR(WriteFile(absl::StrCat(dir, "/memory.oom.group"), "1"));
+  RETURN_IF_ERROR(WriteFile(absl::StrCat(dir, "/pids.max"),
+                            absl::StrCat(options.max_pids)));
+  const int64_t quota_micros = std::max<int64_t>(
+      1000, static_cast<int64_t>(options.max_cpus * kCpuPeriodMicros));
+  RETURN_IF_ERROR(WriteFile(absl::StrCat(dir, "/cpu.max"),
+                            absl::StrCat(quota_micros, " ", kCpuPeriodMicros)));
+  return cgroup;
+}
+
+Cgroup::~Cgroup() {
+  // cgroup.kill is only available from Linux 5.14. Otherwise the sandbox is
+  // expected to have killed its processes already.
+  WriteFile(absl::StrCat(path_, "/cgroup.kill"), "1").IgnoreError();
+  // A cgroup that is still populated after the wait is left behind.
+  if (WaitUntilUnpopulated(path_, kMaxRemoveDelay)) {
+    rmdir(path_.c_str());
+  }
+}
+
+absl::Status Cgroup::AddProcess(pid_t pid) {
+  if (pid <= 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid pid for cgroup: ", pid));
+  }
+  return WriteFile(absl::StrCat(path_, "/cgroup.procs"), absl::StrCat(pid));
+}
+
+absl::StatusOr<Cgroup::Usage> Cgroup::ReadUsage() const {
+  Usage usage;
+  // memory.peak is only available from Linux 5.19.
+  absl::StatusOr<std::string> peak =
+      ReadFile(absl::StrCat(path_, "/memory.peak"));
+  if (peak.ok()) {
+    int64_t peak_memory_bytes;
+    if (!absl::SimpleAtoi(absl::StripAsciiWhitespace(*peak),
+                          &peak_memory_bytes)) {
+      return absl::InternalError(
+          absl::StrCat("Malformed memory.peak: ", *peak));
+    }
+    usage.peak_memory_bytes = peak_memory_bytes;
+  } else if (!absl::IsNotFound(peak.status())) {
+    return peak.status();
+  }
+  ASSIGN_OR_RETURN(const std::string events,
+                   ReadFile(absl::StrCat(path_, "/memory.events")));
+  for (absl::string_view line : absl::StrSplit(events, '\n')) {
+    const std::vector<absl::string_view> fields =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    if (fields.size() == 2 && fields[0] == "oom_kill" &&
+        !absl::SimpleAtoi(fields[1], &usage.oom_kills)) {
+      return absl::InternalError(
+          absl::StrCat("Malformed memory.events: ", events));
+    }
+  }
+  return usage;
+}
+
+}  // namespace deepmind::code_contests
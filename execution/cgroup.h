@@ -0,0 +1,83 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A cgroup v2 that limits the memory, number of processes and CPU bandwidth of
+// a single test.
+//
+// Unlike RLIMIT_AS, the memory limit applies to the memory that the test's
+// processes actually use, rather than to the address space that they reserve,
+// which is often much larger for interpreters such as Python and V8.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CGROUP_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CGROUP_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace deepmind::code_contests {
+
+struct CgroupOptions {
+  // The cgroup under which a cgroup is created for each test. It must be
+  // writable by this process, and have the memory, pids and cpu controllers
+  // enabled in its cgroup.subtree_control.
+  std::string parent;
+  // The maximum number of processes and threads of a test.
+  int64_t max_pids = 64;
+  // The number of CPUs that the threads of a test may use at once.
+  double max_cpus = 1.0;
+};
+
+class Cgroup {
+ public:
+  struct Usage {
+    // The peak memory usage of the cgroup, if the kernel reports it.
+    std::optional<int64_t> peak_memory_bytes;
+    // The number of processes killed for exceeding the memory limit.
+    int64_t oom_kills = 0;
+  };
+
+  // Creates a new cgroup under `options.parent`, which limits memory to
+  // `memory_limit_bytes` without swapping.
+  static absl::StatusOr<std::unique_ptr<Cgroup>> Create(
+      const CgroupOptions& options, int64_t memory_limit_bytes);
+  // Kills any processes left in the cgroup, and removes it.
+  ~Cgroup();
+
+  Cgroup(const Cgroup&) = delete;
+  Cgroup& operator=(const Cgroup&) = delete;
+
+  // Moves `pid` into the cgroup. Its future children are created in the cgroup
+  // too. Memory that it used before the move is not counted.
+  absl::Status AddProcess(pid_t pid);
+  absl::StatusOr<Usage> ReadUsage() const;
+
+  const std::string& path() const { return path_; }
+
+ private:
+  explicit Cgroup(std::string path) : path_(std::move(path)) {}
+
+  const std::string path_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CGROUP_H_
@@ -0,0 +1,245 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/concurrency_controller.h"
+
+#include <sched.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/execution_scheduler.h"
+#include "execution/fd_budget.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+int NumUsableCpus() {
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+    return 1;
+  }
+  return std::max(1, CPU_COUNT(&cpus));
+}
+
+// Returns the number of runnable threads of the machine, from /proc/loadavg,
+// or -1 if it can't be read.
+int64_t ReadRunnableThreads() {
+  std::ifstream file("/proc/loadavg");
+  double load1, load5, load15;
+  int64_t running;
+  char slash;
+  if (!(file >> load1 >> load5 >> load15 >> running >> slash)) {
+    return -1;
+  }
+  return running;
+}
+
+// Returns the fraction of the file descriptor limit that is free, or 1 if it
+// can't be read.
+double ReadFdHeadroom() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+      limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur == 0) {
+    return 1;
+  }
+  const double limit_fds = limit.rlim_cur;
+  return std::max(0.0, (limit_fds - CountOpenFds()) / limit_fds);
+}
+
+// Runs a fixed amount of CPU work, and returns how long it took.
+absl::Duration RunCanary(int64_t iterations) {
+  const absl::Time start = absl::Now();
+  volatile uint64_t value = 1;
+  for (int64_t i = 0; i < iterations; ++i) {
+    value = value * 6364136223846793005u + 1442695040888963407u;
+  }
+  return absl::Now() - start;
+}
+
+}  // namespace
+
+std::ostream& operator<<(std::ostream& os, const ConcurrencyMetrics& metrics) {
+  const ConcurrencySignals& signals = metrics.signals;
+  return os << "concurrency limit: " << metrics.concurrency_limit
+            << "\nincreases: " << metrics.num_increases
+            << "\ndecreases: " << metrics.num_decreases
+            << "\nlast decision: " << metrics.last_decision
+            << "\ncpu utilization: " << signals.cpu_utilization
+            << "\nrun queue per cpu: " << signals.run_queue_per_cpu
+            << "\nfd headroom: " << signals.fd_headroom
+            << "\ninfrastructure errors: " << signals.infrastructure_errors
+            << "\ncanary slowdown: " << signals.canary_slowdown
+            << "\nqueue depth: " << signals.queue_depth;
+}
+
+ConcurrencyController::ConcurrencyController(
+    ExecutionScheduler* scheduler, ConcurrencyControllerOptions options)
+    : scheduler_(scheduler), options_(std::move(options)) {
+  if (options_.max_concurrency <= 0 ||
+      options_.max_concurrency > scheduler_->num_slots()) {
+    options_.max_concurrency = scheduler_->num_slots();
+  }
+  options_.min_concurrency =
+      std::clamp(options_.min_concurrency, 1, options_.max_concurrency);
+  if (options_.initial_concurrency <= 0) {
+    options_.initial_concurrency = NumUsableCpus();
+  }
+  const int initial_limit =
+      std::clamp(options_.initial_concurrency, options_.min_concurrency,
+                 options_.max_concurrency);
+  scheduler_->set_concurrency_limit(initial_limit);
+  last_infrastructure_errors_ = scheduler_->stats().num_infrastructure_errors;
+  // Takes the first sample, so that the first interval has a baseline.
+  ReadSignals();
+  {
+    absl::MutexLock l(&mu_);
+    metrics_.concurrency_limit = initial_limit;
+    metrics_.last_decision = "initial limit";
+  }
+  thread_ = std::thread(&ConcurrencyController::ControlLoop, this);
+}
+
+ConcurrencyController::~ConcurrencyController() {
+  {
+    absl::MutexLock l(&mu_);
+    stopping_ = true;
+  }
+  thread_.join();
+}
+
+ConcurrencyMetrics ConcurrencyController::metrics() const {
+  absl::MutexLock l(&mu_);
+  return metrics_;
+}
+
+int ConcurrencyController::NextLimit(
+    int limit, const ConcurrencySignals& signals,
+    const ConcurrencyControllerOptions& options, std::string* reason) {
+  const char* congestion = nullptr;
+  if (signals.infrastructure_errors > 0) {
+    congestion = "infrastructure errors";
+  } else if (signals.fd_headroom < options.min_fd_headroom) {
+    congestion = "few free file descriptors";
+  } else if (signals.run_queue_per_cpu > options.max_run_queue_per_cpu) {
+    congestion = "long run queue";
+  } else if (signals.canary_slowdown > options.max_canary_slowdown) {
+    congestion = "slow canary";
+  }
+  int next_limit = limit;
+  if (congestion != nullptr) {
+    next_limit = std::min<int>(
+        limit - 1, std::floor(limit * options.decrease_factor));
+    *reason = absl::StrCat("decreased: ", congestion);
+  } else if (signals.queue_depth > 0 &&
+             signals.cpu_utilization < options.target_cpu_utilization) {
+    next_limit = limit + 1;
+    *reason = "increased: idle CPUs and queued tests";
+  } else {
+    *reason = signals.queue_depth > 0 ? "kept: CPUs are busy"
+                                      : "kept: no queued tests";
+  }
+  const int min_limit = std::max(1, options.min_concurrency);
+  return std::clamp(next_limit, min_limit,
+                    std::max(min_limit, options.max_concurrency));
+}
+
+ConcurrencySignals ConcurrencyController::ReadSignals() {
+  ConcurrencySignals signals;
+  // The first line of /proc/stat sums the jiffies of all CPUs, as user, nice,
+  // system, idle, iowait, irq, softirq, steal, ...
+  std::ifstream stat("/proc/stat");
+  std::string cpu;
+  if (stat >> cpu && cpu == "cpu") {
+    CpuTimes times;
+    int64_t value;
+    for (int field = 0; field < 8 && stat >> value; ++field) {
+      times.total += value;
+      // Idle and iowait.
+      if (field == 3 || field == 4) {
+        times.idle += value;
+      }
+    }
+    const int64_t total = times.total - last_cpu_times_.total;
+    const int64_t idle = times.idle - last_cpu_times_.idle;
+    if (total > 0) {
+      signals.cpu_utilization =
+          std::clamp(1.0 - static_cast<double>(idle) / total, 0.0, 1.0);
+    }
+    last_cpu_times_ = times;
+  }
+
+  const int64_t runnable = ReadRunnableThreads();
+  if (runnable > 0) {
+    // The controller is running while it reads this.
+    signals.run_queue_per_cpu =
+        static_cast<double>(runnable - 1) / NumUsableCpus();
+  }
+  signals.fd_headroom = ReadFdHeadroom();
+
+  const ExecutionScheduler::Stats stats = scheduler_->stats();
+  signals.infrastructure_errors =
+      stats.num_infrastructure_errors - last_infrastructure_errors_;
+  last_infrastructure_errors_ = stats.num_infrastructure_errors;
+  signals.queue_depth = stats.queue_depth;
+
+  if (options_.canary_iterations > 0) {
+    const absl::Duration canary = RunCanary(options_.canary_iterations);
+    fastest_canary_ = std::min(fastest_canary_, canary);
+    if (fastest_canary_ > absl::ZeroDuration()) {
+      signals.canary_slowdown = canary / fastest_canary_;
+    }
+  }
+  return signals;
+}
+
+void ConcurrencyController::ControlLoop() {
+  for (;;) {
+    {
+      absl::MutexLock l(&mu_);
+      if (mu_.AwaitWithTimeout(absl::Condition(&stopping_),
+                               options_.interval)) {
+        return;
+      }
+    }
+    const ConcurrencySignals signals = ReadSignals();
+    const int limit = scheduler_->stats().concurrency_limit;
+    std::string reason;
+    const int next_limit = NextLimit(limit, signals, options_, &reason);
+    scheduler_->set_concurrency_limit(next_limit);
+
+    absl::MutexLock l(&mu_);
+    metrics_.concurrency_limit = next_limit;
+    metrics_.signals = signals;
+    metrics_.last_decision = std::move(reason);
+    if (next_limit > limit) {
+      ++metrics_.num_increases;
+    } else if (next_limit < limit) {
+      ++metrics_.num_decreases;
+    }
+  }
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,140 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tunes how many tests an ExecutionScheduler runs at once, from signals of
+// how loaded the machine is.
+//
+// Running too many sandboxes at once exhausts file descriptors and makes
+// timing noisy, while running too few leaves CPUs idle. The controller
+// increases the limit by one while tests are queued and CPUs are idle, and
+// decreases it multiplicatively as soon as any signal shows congestion (AIMD).
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CONCURRENCY_CONTROLLER_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CONCURRENCY_CONTROLLER_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "execution/execution_scheduler.h"
+
+namespace deepmind::code_contests {
+
+struct ConcurrencyControllerOptions {
+  // Bounds of the concurrency limit. A non-positive maximum means the number
+  // of slots of the scheduler.
+  int min_concurrency = 1;
+  int max_concurrency = 0;
+  // The limit to start from. A non-positive value means the number of CPUs
+  // that the process may use.
+  int initial_concurrency = 0;
+  // How often signals are sampled and the limit adjusted.
+  absl::Duration interval = absl::Seconds(1);
+  // The limit is only increased while CPU utilization is below this fraction.
+  double target_cpu_utilization = 0.9;
+  // The limit is decreased if there are more runnable threads per CPU than
+  // this.
+  double max_run_queue_per_cpu = 1.5;
+  // The limit is decreased if less than this fraction of the file descriptor
+  // limit is free.
+  double min_fd_headroom = 0.2;
+  // The limit is decreased if the canary takes this many times longer than
+  // its fastest run.
+  double max_canary_slowdown = 1.5;
+  // How many iterations of a fixed loop the canary runs. The canary is not
+  // run if zero.
+  int64_t canary_iterations = 1000000;
+  // The limit is multiplied by this factor when it is decreased.
+  double decrease_factor = 0.7;
+};
+
+// The signals of one interval. Signals that can't be read keep their default,
+// which never decreases the limit.
+struct ConcurrencySignals {
+  // Fraction of the time that all CPUs of the machine were busy.
+  double cpu_utilization = 0;
+  // Runnable threads per CPU, excluding the controller.
+  double run_queue_per_cpu = 0;
+  // Fraction of the file descriptor limit that is free.
+  double fd_headroom = 1;
+  // Infrastructure errors reported to the scheduler during the interval.
+  int64_t infrastructure_errors = 0;
+  // Runtime of the canary relative to its fastest run.
+  double canary_slowdown = 1;
+  // Tests waiting for a slot.
+  int64_t queue_depth = 0;
+};
+
+struct ConcurrencyMetrics {
+  int concurrency_limit = 0;
+  ConcurrencySignals signals;
+  int64_t num_increases = 0;
+  int64_t num_decreases = 0;
+  // Why the limit was last changed or kept.
+  std::string last_decision;
+};
+
+std::ostream& operator<<(std::ostream& os, const ConcurrencyMetrics& metrics);
+
+class ConcurrencyController {
+ public:
+  // Starts adjusting the concurrency limit of `scheduler`, which must outlive
+  // the controller.
+  ConcurrencyController(ExecutionScheduler* scheduler,
+                        ConcurrencyControllerOptions options);
+  // Stops adjusting the limit, leaving it at its last value.
+  ~ConcurrencyController();
+
+  ConcurrencyController(const ConcurrencyController&) = delete;
+  ConcurrencyController& operator=(const ConcurrencyController&) = delete;
+
+  ConcurrencyMetrics metrics() const;
+
+  // Returns the limit for the next interval, given the limit of the last one
+  // and its signals, and sets `reason` to why.
+  static int NextLimit(int limit, const ConcurrencySignals& signals,
+                       const ConcurrencyControllerOptions& options,
+                       std::string* reason);
+
+ private:
+  // Jiffies spent by all CPUs in total and idle, from /proc/stat.
+  struct CpuTimes {
+    int64_t total = 0;
+    int64_t idle = 0;
+  };
+
+  ConcurrencySignals ReadSignals();
+  void ControlLoop();
+
+  ExecutionScheduler* const scheduler_;
+  ConcurrencyControllerOptions options_;
+
+  // Only used by the control thread.
+  CpuTimes last_cpu_times_;
+  int64_t last_infrastructure_errors_ = 0;
+  absl::Duration fastest_canary_ = absl::InfiniteDuration();
+
+  mutable absl::Mutex mu_;
+  bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+  ConcurrencyMetrics metrics_ ABSL_GUARDED_BY(mu_);
+  std::thread thread_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CONCURRENCY_CONTROLLER_H_
@@ -0,0 +1,219 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/cpu_affinity.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/substitute.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+constexpr absl::string_view kSysfsCpuDir = "/sys/devices/system/cpu";
+constexpr absl::string_view kSysfsNodeDir = "/sys/devices/system/node";
+
+// Reads a CPU list from sysfs. Returns an empty list if it can't be read.
+std::vector<int> ReadCpuList(const std::string& path) {
+  std::ifstream file(path);
+  std::string list;
+  if (!std::getline(file, list)) {
+    return {};
+  }
+  absl::StatusOr<std::vector<int>> cpus = ParseCpuList(list);
+  return cpus.ok() ? *std::move(cpus) : std::vector<int>();
+}
+
+bool IsValidCpu(int cpu) { return cpu >= 0 && cpu < CPU_SETSIZE; }
+
+// Puts the first thread of every core before the other threads.
+std::vector<int> OrderByCore(const std::vector<int>& cpus) {
+  std::vector<int> first_threads;
+  std::vector<int> other_threads;
+  for (int cpu : cpus) {
+    const std::vector<int> siblings = SmtSiblings(cpu);
+    if (cpu == *std::min_element(siblings.begin(), siblings.end())) {
+      first_threads.push_back(cpu);
+    } else {
+      other_threads.push_back(cpu);
+    }
+  }
+  first_threads.insert(first_threads.end(), other_threads.begin(),
+                       other_threads.end());
+  return first_threads;
+}
+
+}  // namespace
+
+CpuTopology ReadCpuTopology(const cpu_set_t& available) {
+  std::vector<std::vector<int>> node_cpus;
+  for (int node : ReadCpuList(absl::StrCat(kSysfsNodeDir, "/online"))) {
+    node_cpus.push_back(
+        ReadCpuList(absl::StrCat(kSysfsNodeDir, "/node", node, "/cpulist")));
+  }
+  if (node_cpus.empty()) {
+    node_cpus.push_back(CpusInSet(available));
+  }
+  CpuTopology topology;
+  for (const std::vector<int>& cpus : node_cpus) {
+    std::vector<int> available_cpus;
+    for (int cpu : cpus) {
+      if (IsValidCpu(cpu) && CPU_ISSET(cpu, &available)) {
+        available_cpus.push_back(cpu);
+      }
+    }
+    if (!available_cpus.empty()) {
+      topology.nodes.push_back(OrderByCore(available_cpus));
+    }
+  }
+  return topology;
+}
+
+std::vector<std::vector<int>> AllocateSlotCpus(const CpuTopology& topology,
+                                               int num_slots,
+                                               int cpus_per_slot) {
+  std::vector<std::vector<int>> slots;
+  const int num_nodes = topology.nodes.size();
+  if (num_nodes == 0) {
+    return slots;
+  }
+  // The number of CPUs of each node that have been handed out.
+  std::vector<int> num_used(num_nodes, 0);
+  int node = 0;
+  while (slots.size() < num_slots) {
+    // Find the next node with enough free CPUs for a slot. A node with fewer
+    // CPUs than a slot needs gets a smaller slot when it is unused.
+    int chosen_node = -1;
+    for (int i = 0; i < num_nodes && chosen_node < 0; ++i) {
+      const int candidate = (node + i) % num_nodes;
+      const int size = topology.nodes[candidate].size();
+      const int needed = std::min(cpus_per_slot, size);
+      if (size - num_used[candidate] >= needed) {
+        chosen_node = candidate;
+      }
+    }
+    if (chosen_node < 0) {
+      // All CPUs are handed out, so further slots share them.
+      std::fill(num_used.begin(), num_used.end(), 0);
+      continue;
+    }
+    const std::vector<int>& cpus = topology.nodes[chosen_node];
+    const int needed =
+        std::min(cpus_per_slot, static_cast<int>(cpus.size()));
+    slots.emplace_back(cpus.begin() + num_used[chosen_node],
+                       cpus.begin() + num_used[chosen_node] + needed);
+    num_used[chosen_node] += needed;
+    node = (chosen_node + 1) % num_nodes;
+  }
+  return slots;
+}
+
+const TimingCpus& GetTimingCpus() {
+  static const TimingCpus* const timing_cpus = [] {
+    auto* cpus = new TimingCpus();
+    CPU_ZERO(&cpus->timing_set);
+    CPU_ZERO(&cpus->other_set);
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      return cpus;
+    }
+    const std::vector<int> allowed_cpus = CpusInSet(allowed);
+    if (allowed_cpus.empty()) {
+      return cpus;
+    }
+    cpus->timing_cpu = allowed_cpus.back();
+    CPU_SET(cpus->timing_cpu, &cpus->timing_set);
+    cpus->other_set = allowed;
+    for (int sibling : SmtSiblings(cpus->timing_cpu)) {
+      if (IsValidCpu(sibling)) {
+        CPU_CLR(sibling, &cpus->other_set);
+      }
+    }
+    cpus->has_other_cpus = CPU_COUNT(&cpus->other_set) > 0;
+    return cpus;
+  }();
+  return *timing_cpus;
+}
+
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view list) {
+  std::vector<int> cpus;
+  for (absl::string_view range :
+       absl::StrSplit(list, ',', absl::SkipWhitespace())) {
+    const std::vector<absl::string_view> bounds = absl::StrSplit(range, '-');
+    int first, last;
+    if (bounds.size() > 2 || !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first > last) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Malformed CPU list: ", list));
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<int> SmtSiblings(int cpu) {
+  std::vector<int> siblings = ReadCpuList(absl::StrCat(
+      kSysfsCpuDir, "/cpu", cpu, "/topology/thread_siblings_list"));
+  if (std::find(siblings.begin(), siblings.end(), cpu) == siblings.end()) {
+    siblings.push_back(cpu);
+  }
+  return siblings;
+}
+
+std::vector<int> CpusInSet(const cpu_set_t& cpus) {
+  std::vector<int> result;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      result.push_back(cpu);
+    }
+  }
+  return result;
+}
+
+cpu_set_t CpuSetOf(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (IsValidCpu(cpu)) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return set;
+}
+
+absl::Status SetCpuAffinity(pid_t pid, const cpu_set_t& cpus) {
+  if (sched_setaffinity(pid, sizeof(cpus), &cpus) != 0 && errno != ESRCH) {
+    return absl::UnknownError(absl::Substitute(
+        "Setting the CPU affinity of $0 failed with errno $1", pid, errno));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace deepmind::code_contests
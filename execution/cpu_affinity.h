@@ -0,0 +1,84 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Helpers for pinning tests to CPUs, so that their timing does not depend on
+// where the kernel happens to schedule them.
+//
+// Pinned execution slots get CPUs of a single NUMA node, so that the memory
+// of their tests is allocated on that node too by the kernel's default policy.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CPU_AFFINITY_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CPU_AFFINITY_H_
+
+#include <sched.h>
+#include <sys/types.h>
+
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+
+namespace deepmind::code_contests {
+
+// The CPUs that this process may use, grouped by NUMA node.
+struct CpuTopology {
+  // The CPUs of each node. Within a node, the first thread of every core comes
+  // before any SMT siblings, so that slots get whole cores while there are
+  // enough of them.
+  std::vector<std::vector<int>> nodes;
+};
+
+// Reads the topology of the CPUs in `available` from sysfs. All CPUs are in a
+// single node if the NUMA topology is unknown.
+CpuTopology ReadCpuTopology(const cpu_set_t& available);
+
+// Returns `num_slots` sets of `cpus_per_slot` CPUs, each from a single node.
+// Slots are spread over the nodes in turn, and only share CPUs once every CPU
+// has been handed out. Returns no sets if `topology` has no CPUs.
+std::vector<std::vector<int>> AllocateSlotCpus(const CpuTopology& topology,
+                                               int num_slots,
+                                               int cpus_per_slot);
+
+// The CPU that borderline timeouts are rechecked on, and the CPUs that other
+// tests run on while rechecks are enabled. Other tests are kept off the SMT
+// siblings of the timing CPU too, since those share its execution units.
+struct TimingCpus {
+  int timing_cpu = -1;
+  cpu_set_t timing_set;
+  cpu_set_t other_set;
+  bool has_other_cpus = false;
+};
+
+// Returns the timing CPUs of the process. The timing CPU is the last CPU that
+// the process may run on.
+const TimingCpus& GetTimingCpus();
+
+// Parses a list of CPUs in the format used by sysfs, e.g. "0-3,8".
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view list);
+
+// Returns the CPUs that share a core with `cpu`, including `cpu` itself.
+std::vector<int> SmtSiblings(int cpu);
+
+std::vector<int> CpusInSet(const cpu_set_t& cpus);
+cpu_set_t CpuSetOf(const std::vector<int>& cpus);
+
+// Restricts `pid` to `cpus`, or the calling thread if `pid` is 0. Processes and
+// threads that it starts afterwards inherit the restriction. It is not an
+// error if `pid` already exited.
+absl::Status SetCpuAffinity(pid_t pid, const cpu_set_t& cpus);
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_CPU_AFFINITY_H_
@@ -0,0 +1,475 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/dataset_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "contest_problem.pb.h"
+#include "execution/dataset_index.h"
+#include "execution/status_macros.h"
+#include "farmhash.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/records/record_reader.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+// Images are only read on the host that built them, by the same binary, so
+// they are laid out in native byte order. The data of all problems comes
+// first, followed by the table of tests and the table of problems.
+constexpr char kImageMagic[8] = {'C', 'C', 'I', 'M', 'A', 'G', 'E', '\0'};
+constexpr uint64_t kImageVersion = 1;
+// Data is written in chunks of about this size.
+constexpr size_t kWriteBufferBytes = size_t{1} << 20;
+
+struct ImageSlice {
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+struct ImageHeader {
+  char magic[8] = {};
+  uint64_t version = 0;
+  // The size of the whole image, so that truncated images are detected.
+  uint64_t size = 0;
+  uint64_t num_problems = 0;
+  uint64_t problems_offset = 0;
+  uint64_t num_tests = 0;
+  uint64_t tests_offset = 0;
+};
+
+struct ImageTest {
+  ImageSlice input;
+  ImageSlice output;
+};
+
+struct ImageProblem {
+  ImageSlice name;
+  ImageSlice metadata;
+  // The index of the first test of the problem in the table of tests.
+  uint64_t first_test = 0;
+  uint64_t num_public_tests = 0;
+  uint64_t num_private_tests = 0;
+  uint64_t num_generated_tests = 0;
+};
+
+static_assert(std::is_trivially_copyable_v<ImageHeader> &&
+              std::is_trivially_copyable_v<ImageTest> &&
+              std::is_trivially_copyable_v<ImageProblem>);
+
+template <typename T>
+absl::string_view AsBytes(const T* data, size_t count) {
+  return absl::string_view(reinterpret_cast<const char*>(data),
+                           count * sizeof(T));
+}
+
+bool InBounds(uint64_t offset, uint64_t size, uint64_t image_size) {
+  return offset <= image_size && size <= image_size - offset;
+}
+
+absl::Status WriteAll(int fd, absl::string_view data) {
+  while (!data.empty()) {
+    const ssize_t n = write(fd, data.data(), data.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return errno == ENOSPC
+                 ? absl::ResourceExhaustedError(
+                       "Not enough space for the dataset image.")
+                 : absl::UnknownError(absl::StrCat(
+                       "Writing the dataset image failed with errno ", errno));
+    }
+    data.remove_prefix(n);
+  }
+  return absl::OkStatus();
+}
+
+// Writes an image to a file, appending the data of each problem as it is
+// added, and the tables and header when it is finished.
+class ImageWriter {
+ public:
+  explicit ImageWriter(int fd)
+      : fd_(fd),
+        buffer_(sizeof(ImageHeader), '\0'),
+        offset_(sizeof(ImageHeader)) {}
+
+  // Adds `problem`, clearing its tests.
+  absl::Status AddProblem(ContestProblem* problem) {
+    ImageProblem entry;
+    entry.first_test = tests_.size();
+    entry.num_public_tests = problem->public_tests_size();
+    entry.num_private_tests = problem->private_tests_size();
+    entry.num_generated_tests = problem->generated_tests_size();
+    for (const auto* tests :
+         {&problem->public_tests(), &problem->private_tests(),
+          &problem->generated_tests()}) {
+      for (const ContestProblem::Test& test : *tests) {
+        ImageTest image_test;
+        ASSIGN_OR_RETURN(image_test.input, Append(test.input()));
+        ASSIGN_OR_RETURN(image_test.output, Append(test.output()));
+        tests_.push_back(image_test);
+      }
+    }
+    ASSIGN_OR_RETURN(entry.name, Append(problem->name()));
+    problem->clear_public_tests();
+    problem->clear_private_tests();
+    problem->clear_generated_tests();
+    ASSIGN_OR_RETURN(entry.metadata, Append(problem->SerializeAsString()));
+    problems_.push_back(entry);
+    return absl::OkStatus();
+  }
+
+  absl::Status Finish() {
+    // The tables are read in place, so they are aligned.
+    RETURN_IF_ERROR(
+        Append(std::string(-offset_ % alignof(uint64_t), '\0')).status());
+    ImageHeader header;
+    std::memcpy(header.magic, kImageMagic, sizeof(kImageMagic));
+    header.version = kImageVersion;
+    header.num_tests = tests_.size();
+    ASSIGN_OR_RETURN(const ImageSlice tests,
+                     Append(AsBytes(tests_.data(), tests_.size())));
+    header.tests_offset = tests.offset;
+    header.num_problems = problems_.size();
+    ASSIGN_OR_RETURN(const ImageSlice problems,
+                     Append(AsBytes(problems_.data(), problems_.size())));
+    header.problems_offset = problems.offset;
+    header.size = offset_;
+    RETURN_IF_ERROR(Flush());
+    const absl::string_view header_bytes = AsBytes(&header, 1);
+    if (pwrite(fd_, header_bytes.data(), header_bytes.size(), 0) !=
+        static_cast<ssize_t>(header_bytes.size())) {
+      return absl::UnknownError(absl::StrCat(
+          "Writing the dataset image header failed with errno ", errno));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  absl::StatusOr<ImageSlice> Append(absl::string_view data) {
+    const ImageSlice slice{.offset = offset_, .size = data.size()};
+    offset_ += data.size();
+    if (data.size() >= kWriteBufferBytes) {
+      RETURN_IF_ERROR(Flush());
+      RETURN_IF_ERROR(WriteAll(fd_, data));
+      return slice;
+    }
+    buffer_.append(data.data(), data.size());
+    if (buffer_.size() >= kWriteBufferBytes) {
+      RETURN_IF_ERROR(Flush());
+    }
+    return slice;
+  }
+
+  absl::Status Flush() {
+    RETURN_IF_ERROR(WriteAll(fd_, buffer_));
+    buffer_.clear();
+    return absl::OkStatus();
+  }
+
+  const int fd_;
+  std::string buffer_;
+  uint64_t offset_;
+  std::vector<ImageTest> tests_;
+  std::vector<ImageProblem> problems_;
+};
+
+// Decodes the dataset at `dataset_path` into an image at `image_path`. The
+// image is written to a temporary file first, so that it is never seen
+// half-written.
+absl::Status BuildImage(const std::string& dataset_path,
+                        const std::string& image_path) {
+  const std::string temp_path = absl::StrCat(image_path, ".tmp.", getpid());
+  const int fd =
+      open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
+  if (fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat("Creating ", temp_path, " failed with errno ", errno));
+  }
+  ImageWriter writer(fd);
+  riegeli::RecordReader<riegeli::FdReader<>> reader(
+      std::forward_as_tuple(dataset_path));
+  ContestProblem problem;
+  absl::Status status;
+  while (status.ok() && reader.ReadRecord(problem)) {
+    status = writer.AddProblem(&problem);
+  }
+  if (status.ok() && !reader.Close()) {
+    status = reader.status();
+  }
+  if (status.ok()) {
+    status = writer.Finish();
+  }
+  if (close(fd) != 0 && status.ok()) {
+    status = absl::UnknownError(
+        absl::StrCat("Closing ", temp_path, " failed with errno ", errno));
+  }
+  if (status.ok() && rename(temp_path.c_str(), image_path.c_str()) != 0) {
+    status = absl::UnknownError(
+        absl::StrCat("Replacing ", image_path, " failed with errno ", errno));
+  }
+  if (!status.ok()) {
+    unlink(temp_path.c_str());
+  }
+  return status;
+}
+
+// Removes the images of other versions of a dataset, whose paths start with
+// `prefix`. Processes that map them keep them until they unmap them.
+void RemoveStaleImages(const std::string& directory, const std::string& prefix,
+                       const std::string& image_path) {
+  std::error_code error;
+  for (const std::filesystem::directory_entry& entry :
+       std::filesystem::directory_iterator(directory, error)) {
+    const std::string path = entry.path().string();
+    if (path != image_path && absl::StartsWith(path, prefix) &&
+        absl::EndsWith(path, ".image")) {
+      std::filesystem::remove(path, error);
+    }
+  }
+}
+
+// Removes the temporary files of images of a dataset, whose paths start with
+// `prefix`, that were left behind by processes that died while building them.
+// Must be called with the dataset's lock held, when no image is being built.
+void RemoveAbandonedTempFiles(const std::string& directory,
+                              const std::string& prefix) {
+  std::error_code error;
+  for (const std::filesystem::directory_entry& entry :
+       std::filesystem::directory_iterator(directory, error)) {
+    const std::string path = entry.path().string();
+    if (absl::StartsWith(path, prefix) &&
+        absl::StrContains(path, ".image.tmp.")) {
+      std::filesystem::remove(path, error);
+    }
+  }
+}
+
+}  // namespace
+
+absl::StatusOr<ContestProblem>
+DatasetImage::ProblemView::ParseMetadata() const {
+  ContestProblem problem;
+  if (!problem.ParseFromArray(metadata.data(), metadata.size())) {
+    return absl::DataLossError(
+        absl::StrCat("Failed to parse the metadata of problem ", name));
+  }
+  return problem;
+}
+
+absl::StatusOr<std::unique_ptr<DatasetImage>> DatasetImage::Attach(
+    const std::string& dataset_path, const DatasetImageOptions& options) {
+  ASSIGN_OR_RETURN(const DatasetFileStamp stamp, StatDataset(dataset_path));
+  // Processes that name the dataset differently share its image.
+  std::error_code error;
+  std::string canonical_path =
+      std::filesystem::weakly_canonical(dataset_path, error).string();
+  if (error) {
+    canonical_path = dataset_path;
+  }
+  const std::string prefix =
+      absl::StrCat(options.directory, "/code_contests_",
+                   absl::Hex(farmhash::Fingerprint64(canonical_path)), "_");
+  const std::string image_path = absl::StrCat(
+      prefix,
+      absl::Hex(farmhash::Fingerprint64(absl::StrCat(
+          stamp.size, "/", stamp.mtime_nanos, "/", stamp.inode))),
+      ".image");
+  std::unique_ptr<DatasetImage> image(
+      new DatasetImage(dataset_path, image_path));
+  if (image->Map().ok()) {
+    return image;
+  }
+
+  // Processes that attach at the same time take turns, so that only the
+  // first one builds the image.
+  const std::string lock_path = absl::StrCat(prefix, "lock");
+  const int lock_fd =
+      open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat("Opening ", lock_path, " failed with errno ", errno));
+  }
+  int result;
+  do {
+    result = flock(lock_fd, LOCK_EX);
+  } while (result != 0 && errno == EINTR);
+  if (result != 0) {
+    close(lock_fd);
+    return absl::UnknownError(
+        absl::StrCat("Locking ", lock_path, " failed with errno ", errno));
+  }
+  absl::Status attached = image->Map();
+  if (!attached.ok()) {
+    RemoveAbandonedTempFiles(options.directory, prefix);
+    attached = BuildImage(dataset_path, image_path);
+    if (attached.ok()) {
+      RemoveStaleImages(options.directory, prefix, image_path);
+      image->built_ = true;
+      attached = image->Map();
+    }
+  }
+  // Releases the lock.
+  close(lock_fd);
+  RETURN_IF_ERROR(attached);
+  return image;
+}
+
+DatasetImage::~DatasetImage() { Unmap(); }
+
+absl::StatusOr<DatasetImage::ProblemView> DatasetImage::FindByName(
+    absl::string_view name) const {
+  const auto it = by_name_.find(name);
+  if (it == by_name_.end()) {
+    return absl::NotFoundError(absl::StrCat("Problem '", name,
+                                            "' not found in ", dataset_path_));
+  }
+  return View(it->second);
+}
+
+absl::Status DatasetImage::Map() {
+  Unmap();
+  const int fd = open(image_path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return absl::NotFoundError(
+        absl::StrCat("Opening ", image_path_, " failed with errno ", errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < static_cast<off_t>(sizeof(ImageHeader))) {
+    close(fd);
+    return absl::DataLossError(
+        absl::StrCat("Dataset image ", image_path_, " is truncated."));
+  }
+  void* const data =
+      mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, /*offset=*/0);
+  // The mapping keeps the file alive.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return absl::UnknownError(
+        absl::StrCat("Mapping ", image_path_, " failed with errno ", errno));
+  }
+  data_ = static_cast<const char*>(data);
+  size_ = st.st_size;
+
+  ImageHeader header;
+  std::memcpy(&header, data_, sizeof(header));
+  bool valid =
+      std::memcmp(header.magic, kImageMagic, sizeof(kImageMagic)) == 0 &&
+      header.version == kImageVersion && header.size == size_ &&
+      header.tests_offset % alignof(ImageTest) == 0 &&
+      header.problems_offset % alignof(ImageProblem) == 0 &&
+      header.num_tests <= size_ / sizeof(ImageTest) &&
+      header.num_problems <= size_ / sizeof(ImageProblem) &&
+      InBounds(header.tests_offset, header.num_tests * sizeof(ImageTest),
+               size_) &&
+      InBounds(header.problems_offset,
+               header.num_problems * sizeof(ImageProblem), size_);
+  if (valid) {
+    problems_offset_ = header.problems_offset;
+    tests_offset_ = header.tests_offset;
+    const auto* problems =
+        reinterpret_cast<const ImageProblem*>(data_ + problems_offset_);
+    const auto* tests =
+        reinterpret_cast<const ImageTest*>(data_ + tests_offset_);
+    by_name_.reserve(header.num_problems);
+    for (uint64_t i = 0; valid && i < header.num_problems; ++i) {
+      const ImageProblem& problem = problems[i];
+      const uint64_t num_tests = problem.num_public_tests +
+                                 problem.num_private_tests +
+                                 problem.num_generated_tests;
+      valid = InBounds(problem.name.offset, problem.name.size, size_) &&
+              InBounds(problem.metadata.offset, problem.metadata.size,
+                       size_) &&
+              InBounds(problem.first_test, num_tests, header.num_tests);
+      for (uint64_t j = 0; valid && j < num_tests; ++j) {
+        const ImageTest& test = tests[problem.first_test + j];
+        valid = InBounds(test.input.offset, test.input.size, size_) &&
+                InBounds(test.output.offset, test.output.size, size_);
+      }
+      if (valid) {
+        // As when reading the dataset in order, the first problem wins.
+        by_name_.emplace(Slice(problem.name.offset, problem.name.size), i);
+      }
+    }
+  }
+  if (!valid) {
+    Unmap();
+    return absl::DataLossError(
+        absl::StrCat("Dataset image ", image_path_, " is corrupt."));
+  }
+  num_problems_ = header.num_problems;
+  return absl::OkStatus();
+}
+
+void DatasetImage::Unmap() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  num_problems_ = 0;
+  by_name_.clear();
+}
+
+DatasetImage::ProblemView DatasetImage::View(int problem) const {
+  const ImageProblem& entry = reinterpret_cast<const ImageProblem*>(
+      data_ + problems_offset_)[problem];
+  const ImageTest* const tests =
+      reinterpret_cast<const ImageTest*>(data_ + tests_offset_) +
+      entry.first_test;
+  ProblemView view;
+  view.name = Slice(entry.name.offset, entry.name.size);
+  view.metadata = Slice(entry.metadata.offset, entry.metadata.size);
+  view.num_public_tests = entry.num_public_tests;
+  view.num_private_tests = entry.num_private_tests;
+  view.num_generated_tests = entry.num_generated_tests;
+  const int num_tests = view.num_public_tests + view.num_private_tests +
+                        view.num_generated_tests;
+  view.inputs.reserve(num_tests);
+  view.outputs.reserve(num_tests);
+  for (int i = 0; i < num_tests; ++i) {
+    view.inputs.push_back(Slice(tests[i].input.offset, tests[i].input.size));
+    view.outputs.push_back(
+        Slice(tests[i].output.offset, tests[i].output.size));
+  }
+  return view;
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,124 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A read-only image of a dataset in shared memory, for evaluators that run
+// side by side on a host.
+//
+// The tests of a dataset take hundreds of MB, so decoding them into protos in
+// every evaluator multiplies both the time and the memory that they take.
+// Instead, the first evaluator to attach to a dataset decodes it into a flat
+// file on a tmpfs, and all evaluators map that file. Test inputs and outputs
+// are views into the mapping, so the page cache holds the only copy.
+//
+// The image file is named after the dataset's path and version, so images of
+// a changed dataset are built again; the image of the previous version is
+// removed then, and stays valid for evaluators that still map it. Temporary
+// files of builds that died are removed by the next build. The image of the
+// latest version of each dataset and the lock file that builds of its images
+// take turns on are never removed, so they stay in the image directory until
+// it is cleared, e.g. by a reboot for a tmpfs.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_DATASET_IMAGE_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_DATASET_IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "contest_problem.pb.h"
+
+namespace deepmind::code_contests {
+
+struct DatasetImageOptions {
+  // The directory that images are kept in. It should be on a tmpfs, so that
+  // images are in memory.
+  std::string directory = "/dev/shm";
+};
+
+class DatasetImage {
+ public:
+  // A problem of the image. Views into the image, so it must not outlive it.
+  struct ProblemView {
+    absl::string_view name;
+    // The problem without its tests, serialized.
+    absl::string_view metadata;
+    int num_public_tests = 0;
+    int num_private_tests = 0;
+    int num_generated_tests = 0;
+    // The inputs and expected outputs of all tests: public tests, then
+    // private tests, then generated tests.
+    std::vector<absl::string_view> inputs;
+    std::vector<absl::string_view> outputs;
+
+    // Parses `metadata`.
+    absl::StatusOr<ContestProblem> ParseMetadata() const;
+  };
+
+  // Maps the image of the riegeli dataset at `dataset_path`, building it
+  // first if no process has. Processes that attach while the image is built
+  // wait for it.
+  static absl::StatusOr<std::unique_ptr<DatasetImage>> Attach(
+      const std::string& dataset_path,
+      const DatasetImageOptions& options = DatasetImageOptions());
+  ~DatasetImage();
+
+  DatasetImage(const DatasetImage&) = delete;
+  DatasetImage& operator=(const DatasetImage&) = delete;
+
+  // Returns the first problem named `name`, or a NotFoundError.
+  absl::StatusOr<ProblemView> FindByName(absl::string_view name) const;
+
+  const std::string& dataset_path() const { return dataset_path_; }
+  const std::string& image_path() const { return image_path_; }
+  int num_problems() const { return num_problems_; }
+  // Whether this process built the image, rather than attaching to an image
+  // that another process built.
+  bool built() const { return built_; }
+
+ private:
+  DatasetImage(std::string dataset_path, std::string image_path)
+      : dataset_path_(std::move(dataset_path)),
+        image_path_(std::move(image_path)) {}
+
+  // Maps the image at image_path_ and checks that it is complete.
+  absl::Status Map();
+  void Unmap();
+  ProblemView View(int problem) const;
+  absl::string_view Slice(uint64_t offset, uint64_t size) const {
+    return absl::string_view(data_ + offset, size);
+  }
+
+  const std::string dataset_path_;
+  const std::string image_path_;
+  bool built_ = false;
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  int num_problems_ = 0;
+  // Where the tables of problems and tests start in the image.
+  size_t problems_offset_ = 0;
+  size_t tests_offset_ = 0;
+  // Problem numbers by name, viewing names in the image.
+  absl::flat_hash_map<absl::string_view, int> by_name_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_DATASET_IMAGE_H_
@@ -0,0 +1,312 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/dataset_index.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <utility>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "contest_problem.pb.h"
+#include "execution/status_macros.h"
+#include "nlohmann/json.hpp"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/records/record_reader.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+using json = nlohmann::json;
+
+constexpr int kIndexVersion = 1;
+
+std::string CodeforcesKey(int contest_id, absl::string_view index) {
+  return absl::StrCat(contest_id, "/", index);
+}
+
+// Fills `positions` from an object of numeric positions by key.
+bool ParsePositions(const json& object,
+                    absl::flat_hash_map<std::string, uint64_t>& positions) {
+  if (!object.is_object()) {
+    return false;
+  }
+  positions.clear();
+  positions.reserve(object.size());
+  for (const auto& [key, position] : object.items()) {
+    if (!position.is_number_unsigned()) {
+      return false;
+    }
+    positions[key] = position.get<uint64_t>();
+  }
+  return true;
+}
+
+// Returns whether `text` is valid UTF-8, which is what JSON strings must be.
+bool IsValidUtf8(absl::string_view text) {
+  size_t i = 0;
+  while (i < text.size()) {
+    const unsigned char lead = text[i];
+    int length;
+    uint32_t code_point;
+    if (lead < 0x80) {
+      ++i;
+      continue;
+    } else if ((lead & 0xe0) == 0xc0) {
+      length = 2;
+      code_point = lead & 0x1f;
+    } else if ((lead & 0xf0) == 0xe0) {
+      length = 3;
+      code_point = lead & 0x0f;
+    } else if ((lead & 0xf8) == 0xf0) {
+      length = 4;
+      code_point = lead & 0x07;
+    } else {
+      return false;
+    }
+    if (text.size() - i < static_cast<size_t>(length)) {
+      return false;
+    }
+    for (int j = 1; j < length; ++j) {
+      const unsigned char continuation = text[i + j];
+      if ((continuation & 0xc0) != 0x80) {
+        return false;
+      }
+      code_point = (code_point << 6) | (continuation & 0x3f);
+    }
+    // Rejects overlong encodings, surrogates and code points past U+10FFFF.
+    constexpr uint32_t kMinCodePoint[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (code_point < kMinCodePoint[length] || code_point > 0x10ffff ||
+        (code_point >= 0xd800 && code_point <= 0xdfff)) {
+      return false;
+    }
+    i += length;
+  }
+  return true;
+}
+
+}  // namespace
+
+absl::StatusOr<DatasetFileStamp> StatDataset(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return absl::NotFoundError(
+        absl::StrCat("Failed to stat dataset ", path, ", errno ", errno));
+  }
+  return DatasetFileStamp{
+      .size = st.st_size,
+      .mtime_nanos = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                     st.st_mtim.tv_nsec,
+      .inode = static_cast<int64_t>(st.st_ino),
+  };
+}
+
+absl::StatusOr<std::unique_ptr<DatasetIndex>> DatasetIndex::Open(
+    std::string dataset_path, std::string index_path) {
+  if (index_path.empty()) {
+    index_path = absl::StrCat(dataset_path, ".index");
+  }
+  std::unique_ptr<DatasetIndex> index(
+      new DatasetIndex(std::move(dataset_path), std::move(index_path)));
+  {
+    absl::MutexLock l(&index->mu_);
+    RETURN_IF_ERROR(index->Refresh());
+  }
+  return index;
+}
+
+absl::StatusOr<ContestProblem> DatasetIndex::FindByName(
+    absl::string_view name) {
+  absl::MutexLock l(&mu_);
+  return Find(by_name_, std::string(name), absl::StrCat("'", name, "'"));
+}
+
+absl::StatusOr<ContestProblem> DatasetIndex::FindByCodeforcesId(
+    int contest_id, absl::string_view index) {
+  absl::MutexLock l(&mu_);
+  const std::string key = CodeforcesKey(contest_id, index);
+  return Find(by_codeforces_id_, key, key);
+}
+
+int DatasetIndex::num_problems() const {
+  absl::MutexLock l(&mu_);
+  return by_name_.size();
+}
+
+DatasetIndex::Stats DatasetIndex::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+absl::Status DatasetIndex::Refresh() {
+  ASSIGN_OR_RETURN(const DatasetFileStamp stamp, StatDataset(dataset_path_));
+  if (reader_ != nullptr && stamp == stamp_) {
+    return absl::OkStatus();
+  }
+  reader_ = std::make_unique<riegeli::RecordReader<riegeli::FdReader<>>>(
+      std::forward_as_tuple(dataset_path_));
+  if (!reader_->status().ok()) {
+    const absl::Status status = reader_->status();
+    reader_ = nullptr;
+    return status;
+  }
+  stamp_ = stamp;
+  if (Load(stamp)) {
+    return absl::OkStatus();
+  }
+  if (absl::Status status = Build(); !status.ok()) {
+    reader_ = nullptr;
+    return status;
+  }
+  // Failing to save only means that the next process builds it again.
+  Save().IgnoreError();
+  return absl::OkStatus();
+}
+
+bool DatasetIndex::Load(const DatasetFileStamp& stamp) {
+  std::ifstream ifs(index_path_);
+  if (!ifs) {
+    return false;
+  }
+  std::stringstream contents;
+  contents << ifs.rdbuf();
+  const json index = json::parse(contents.str(), /*cb=*/nullptr,
+                                 /*allow_exceptions=*/false);
+  if (index.is_discarded() || !index.is_object() ||
+      index.value("version", 0) != kIndexVersion ||
+      !index.contains("dataset") || !index["dataset"].is_object()) {
+    return false;
+  }
+  const json& dataset = index["dataset"];
+  const DatasetFileStamp indexed_stamp{
+      .size = dataset.value("size", int64_t{-1}),
+      .mtime_nanos = dataset.value("mtime_nanos", int64_t{-1}),
+      .inode = dataset.value("inode", int64_t{-1}),
+  };
+  if (!(indexed_stamp == stamp) || !index.contains("by_name") ||
+      !index.contains("by_codeforces_id") ||
+      !ParsePositions(index["by_name"], by_name_) ||
+      !ParsePositions(index["by_codeforces_id"], by_codeforces_id_)) {
+    return false;
+  }
+  ++stats_.num_loads;
+  return true;
+}
+
+absl::Status DatasetIndex::Build() {
+  by_name_.clear();
+  by_codeforces_id_.clear();
+  ContestProblem problem;
+  while (reader_->ReadRecord(problem)) {
+    const uint64_t position = reader_->last_pos().numeric();
+    // As when reading the dataset in order, the first problem wins.
+    by_name_.emplace(problem.name(), position);
+    if (problem.has_cf_contest_id()) {
+      by_codeforces_id_.emplace(
+          CodeforcesKey(problem.cf_contest_id(), problem.cf_index()),
+          position);
+    }
+  }
+  if (!reader_->status().ok()) {
+    return reader_->status();
+  }
+  ++stats_.num_builds;
+  return absl::OkStatus();
+}
+
+absl::Status DatasetIndex::Save() const {
+  // JSON can't hold keys that are not UTF-8, so such an index is not saved
+  // rather than saved with keys that no longer match after loading it.
+  for (const auto* positions : {&by_name_, &by_codeforces_id_}) {
+    for (const auto& [key, position] : *positions) {
+      if (!IsValidUtf8(key)) {
+        return absl::FailedPreconditionError(absl::StrCat(
+            "Not saving dataset index ", index_path_,
+            ", which has a key that is not valid UTF-8"));
+      }
+    }
+  }
+  json index;
+  index["version"] = kIndexVersion;
+  index["dataset"] = {{"size", stamp_.size},
+                      {"mtime_nanos", stamp_.mtime_nanos},
+                      {"inode", stamp_.inode}};
+  index["by_name"] = json::object();
+  for (const auto& [name, position] : by_name_) {
+    index["by_name"][name] = position;
+  }
+  index["by_codeforces_id"] = json::object();
+  for (const auto& [key, position] : by_codeforces_id_) {
+    index["by_codeforces_id"][key] = position;
+  }
+  // Replace the index atomically, so that other processes never see it
+  // half-written.
+  const std::string temp_path = absl::StrCat(index_path_, ".tmp.", getpid());
+  std::ofstream ofs(temp_path);
+  ofs << index.dump();
+  ofs.close();
+  if (!ofs) {
+    std::error_code error;
+    std::filesystem::remove(temp_path, error);
+    return absl::UnknownError(
+        absl::StrCat("Failed to write dataset index to ", temp_path));
+  }
+  if (rename(temp_path.c_str(), index_path_.c_str()) != 0) {
+    return absl::UnknownError(
+        absl::StrCat("Failed to replace dataset index ", index_path_));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<ContestProblem> DatasetIndex::Find(
+    const absl::flat_hash_map<std::string, uint64_t>& positions,
+    const std::string& key, absl::string_view description) {
+  ++stats_.num_lookups;
+  RETURN_IF_ERROR(Refresh());
+  const auto it = positions.find(key);
+  if (it == positions.end()) {
+    return absl::NotFoundError(absl::StrCat("Problem ", description,
+                                            " not found in ", dataset_path_));
+  }
+  ContestProblem problem;
+  if (!reader_->Seek(it->second) || !reader_->ReadRecord(problem)) {
+    const absl::Status status = reader_->status();
+    // Reopened by the next lookup.
+    reader_ = nullptr;
+    return absl::DataLossError(absl::StrCat("Failed to read problem ",
+                                            description, " from ",
+                                            dataset_path_, ": ",
+                                            status.message()));
+  }
+  return problem;
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,123 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Random access to the problems of a riegeli dataset.
+//
+// Finding a problem by reading the dataset from its start decodes every
+// problem before it, so looking up each problem of a dataset that way takes
+// quadratic time. Instead, the position of each problem's record is indexed
+// once per dataset file, and lookups seek straight to it. The index is kept in
+// a JSON file next to the dataset, and is rebuilt when the dataset changes.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_DATASET_INDEX_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_DATASET_INDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "contest_problem.pb.h"
+#include "riegeli/bytes/fd_reader.h"
+#include "riegeli/records/record_reader.h"
+
+namespace deepmind::code_contests {
+
+// Identifies a version of a dataset file.
+struct DatasetFileStamp {
+  int64_t size = -1;
+  int64_t mtime_nanos = -1;
+  int64_t inode = -1;
+
+  bool operator==(const DatasetFileStamp& other) const {
+    return size == other.size && mtime_nanos == other.mtime_nanos &&
+           inode == other.inode;
+  }
+};
+
+// Returns the stamp of the current version of the dataset file at `path`.
+absl::StatusOr<DatasetFileStamp> StatDataset(const std::string& path);
+
+class DatasetIndex {
+ public:
+  struct Stats {
+    // Number of times the index was read from its file, and built by reading
+    // the whole dataset.
+    int64_t num_loads = 0;
+    int64_t num_builds = 0;
+    int64_t num_lookups = 0;
+  };
+
+  // Opens the dataset at `dataset_path`, with the index at `index_path`, or
+  // at the dataset path with ".index" appended if it is empty. The index is
+  // built if it is missing or was built for another version of the dataset,
+  // and saved if possible; datasets in read-only directories, or with
+  // problem names that are not valid UTF-8, are indexed again by every
+  // process.
+  static absl::StatusOr<std::unique_ptr<DatasetIndex>> Open(
+      std::string dataset_path, std::string index_path = "");
+
+  DatasetIndex(const DatasetIndex&) = delete;
+  DatasetIndex& operator=(const DatasetIndex&) = delete;
+
+  // Returns the first problem named `name`, or a NotFoundError.
+  absl::StatusOr<ContestProblem> FindByName(absl::string_view name);
+  // Returns the first problem with the given cf_contest_id and cf_index, or a
+  // NotFoundError.
+  absl::StatusOr<ContestProblem> FindByCodeforcesId(int contest_id,
+                                                    absl::string_view index);
+
+  const std::string& dataset_path() const { return dataset_path_; }
+  int num_problems() const;
+  Stats stats() const;
+
+ private:
+  DatasetIndex(std::string dataset_path, std::string index_path)
+      : dataset_path_(std::move(dataset_path)),
+        index_path_(std::move(index_path)) {}
+
+  // Reopens the dataset and loads or builds its index if the dataset changed
+  // since it was last indexed.
+  absl::Status Refresh() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Loads the index, returning false if it is missing or stale.
+  bool Load(const DatasetFileStamp& stamp) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::Status Build() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::Status Save() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::StatusOr<ContestProblem> Find(
+      const absl::flat_hash_map<std::string, uint64_t>& positions,
+      const std::string& key, absl::string_view description)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const std::string dataset_path_;
+  const std::string index_path_;
+  mutable absl::Mutex mu_;
+  DatasetFileStamp stamp_ ABSL_GUARDED_BY(mu_);
+  std::unique_ptr<riegeli::RecordReader<riegeli::FdReader<>>> reader_
+      ABSL_GUARDED_BY(mu_);
+  // Numeric record positions, by name and by Codeforces id.
+  absl::flat_hash_map<std::string, uint64_t> by_name_ ABSL_GUARDED_BY(mu_);
+  absl::flat_hash_map<std::string, uint64_t> by_codeforces_id_
+      ABSL_GUARDED_BY(mu_);
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_DATASET_INDEX_H_
@@ -0,0 +1,330 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/execution_scheduler.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/cpu_affinity.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+constexpr int kPriorityLevel = 0;
+constexpr int kNumLevels = 2;
+
+// The slot of the current worker thread, if it is pinned.
+thread_local const ExecutionScheduler::SlotCpus* current_slot_cpus = nullptr;
+}  // namespace
+
+ExecutionScheduler::Submission::Submission(ExecutionScheduler* scheduler,
+                                           int max_concurrency, int weight,
+                                           int64_t memory_bytes)
+    : scheduler_(scheduler),
+      max_concurrency_(std::max(1, max_concurrency)),
+      weight_(std::max(1, weight)),
+      memory_bytes_(std::max<int64_t>(0, memory_bytes)) {}
+
+ExecutionScheduler::Submission::~Submission() {
+  absl::MutexLock l(&scheduler_->mu_);
+  scheduler_->mu_.Await(absl::Condition(this, &Submission::Done));
+  scheduler_->RemoveSubmission(this);
+}
+
+void ExecutionScheduler::Submission::Schedule(std::function<void()> task,
+                                              bool priority) {
+  absl::MutexLock l(&scheduler_->mu_);
+  queues_[priority ? kPriorityLevel : kPriorityLevel + 1].push_back(
+      Task{.function = std::move(task), .scheduled = absl::Now()});
+  Stats& stats = scheduler_->stats_;
+  ++stats.queue_depth;
+  stats.max_queue_depth = std::max(stats.max_queue_depth, stats.queue_depth);
+}
+
+bool ExecutionScheduler::Submission::CanStart(int level) const {
+  return !queues_[level].empty() && num_running_ < max_concurrency_;
+}
+
+bool ExecutionScheduler::Submission::Done() const {
+  return queues_[0].empty() && queues_[1].empty() && num_running_ == 0;
+}
+
+ExecutionScheduler& ExecutionScheduler::Default() {
+  static auto* const scheduler = new ExecutionScheduler(
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+  return *scheduler;
+}
+
+ExecutionScheduler::ExecutionScheduler(int num_slots, int cpus_per_slot) {
+  num_slots = std::max(1, num_slots);
+  if (cpus_per_slot > 0) {
+    const TimingCpus& timing_cpus = GetTimingCpus();
+    cpu_set_t available;
+    if (timing_cpus.has_other_cpus) {
+      available = timing_cpus.other_set;
+    } else if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+      CPU_ZERO(&available);
+    }
+    for (std::vector<int>& cpus :
+         AllocateSlotCpus(ReadCpuTopology(available), num_slots,
+                          cpus_per_slot)) {
+      const cpu_set_t set = CpuSetOf(cpus);
+      slot_cpus_.push_back(SlotCpus{.cpus = std::move(cpus), .set = set});
+    }
+  }
+  {
+    absl::MutexLock l(&mu_);
+    stats_.concurrency_limit = num_slots;
+  }
+  for (int i = 0; i < num_slots; ++i) {
+    workers_.emplace_back(&ExecutionScheduler::WorkLoop, this, i);
+  }
+}
+
+ExecutionScheduler::~ExecutionScheduler() {
+  {
+    absl::MutexLock l(&mu_);
+    shutting_down_ = true;
+  }
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::unique_ptr<ExecutionScheduler::Submission> ExecutionScheduler::Submit(
+    int max_concurrency, int weight, int64_t memory_bytes) {
+  std::unique_ptr<Submission> submission(
+      new Submission(this, max_concurrency, weight, memory_bytes));
+  absl::MutexLock l(&mu_);
+  submissions_.push_back(submission.get());
+  ++stats_.num_submissions;
+  if (submissions_.size() == 1) {
+    cursor_ = 0;
+    cursor_turns_ = submission->weight_;
+  }
+  return submission;
+}
+
+ExecutionScheduler::Stats ExecutionScheduler::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+void ExecutionScheduler::set_concurrency_limit(int limit) {
+  absl::MutexLock l(&mu_);
+  stats_.concurrency_limit = std::clamp(limit, 1, num_slots());
+}
+
+void ExecutionScheduler::set_memory_budget(int64_t budget_bytes,
+                                           absl::Duration max_backfill_delay) {
+  absl::MutexLock l(&mu_);
+  stats_.memory_budget_bytes = std::max<int64_t>(0, budget_bytes);
+  max_backfill_delay_ = max_backfill_delay;
+}
+
+bool ExecutionScheduler::TryReserveMemory(int64_t bytes) {
+  absl::MutexLock l(&mu_);
+  if (stats_.memory_budget_bytes > 0 &&
+      stats_.reserved_memory_bytes + 2 * bytes > stats_.memory_budget_bytes) {
+    return false;
+  }
+  stats_.reserved_memory_bytes += bytes;
+  return true;
+}
+
+void ExecutionScheduler::ReleaseMemory(int64_t bytes) {
+  absl::MutexLock l(&mu_);
+  stats_.reserved_memory_bytes -= bytes;
+}
+
+void ExecutionScheduler::ReportInfrastructureError(bool retryable) {
+  absl::MutexLock l(&mu_);
+  ++(retryable ? stats_.num_infrastructure_errors
+               : stats_.num_fatal_infrastructure_errors);
+}
+
+void ExecutionScheduler::ReportRetry(absl::Duration backoff) {
+  absl::MutexLock l(&mu_);
+  ++stats_.num_retries;
+  stats_.total_retry_backoff += backoff;
+}
+
+const ExecutionScheduler::SlotCpus* ExecutionScheduler::CurrentSlotCpus() {
+  return current_slot_cpus;
+}
+
+bool ExecutionScheduler::FitsInMemory(const Submission* submission) const {
+  return stats_.memory_budget_bytes <= 0 ||
+         stats_.reserved_memory_bytes == 0 ||
+         stats_.reserved_memory_bytes + submission->memory_bytes_ <=
+             stats_.memory_budget_bytes;
+}
+
+const ExecutionScheduler::Submission* ExecutionScheduler::MemoryReservation(
+    absl::Time now) const {
+  const Submission* reservation = nullptr;
+  for (const Submission* submission : submissions_) {
+    if (now - submission->memory_blocked_since_ > max_backfill_delay_ &&
+        (reservation == nullptr || submission->memory_blocked_since_ <
+                                       reservation->memory_blocked_since_)) {
+      reservation = submission;
+    }
+  }
+  return reservation;
+}
+
+bool ExecutionScheduler::CanStart(const Submission* submission, int level,
+                                  const Submission* reservation) const {
+  return submission->CanStart(level) && FitsInMemory(submission) &&
+         (reservation == nullptr || reservation == submission);
+}
+
+bool ExecutionScheduler::HasRunnableTask() const {
+  if (stats_.num_running >= stats_.concurrency_limit) {
+    return false;
+  }
+  const Submission* reservation = MemoryReservation(absl::Now());
+  for (const Submission* submission : submissions_) {
+    for (int level = 0; level < kNumLevels; ++level) {
+      if (CanStart(submission, level, reservation)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool ExecutionScheduler::ShouldWake() const {
+  return shutting_down_ || HasRunnableTask();
+}
+
+ExecutionScheduler::Submission* ExecutionScheduler::TakeTask(
+    Submission::Task& task) {
+  if (stats_.num_running >= stats_.concurrency_limit) {
+    return nullptr;
+  }
+  const absl::Time now = absl::Now();
+  // Track which submissions are waiting for memory, and since when.
+  bool memory_blocked = false;
+  for (Submission* submission : submissions_) {
+    const bool blocked = (submission->CanStart(kPriorityLevel) ||
+                          submission->CanStart(kPriorityLevel + 1)) &&
+                         !FitsInMemory(submission);
+    const bool was_blocked =
+        submission->memory_blocked_since_ != absl::InfiniteFuture();
+    if (blocked && !was_blocked) {
+      submission->memory_blocked_since_ = now;
+      ++stats_.num_memory_blocked;
+    } else if (!blocked && was_blocked) {
+      stats_.total_memory_blocked_time +=
+          now - submission->memory_blocked_since_;
+      submission->memory_blocked_since_ = absl::InfiniteFuture();
+    }
+    memory_blocked = memory_blocked || blocked;
+  }
+  const Submission* reservation = MemoryReservation(now);
+  const size_t num_submissions = submissions_.size();
+  for (int level = 0; level < kNumLevels; ++level) {
+    for (size_t i = 0; i < num_submissions; ++i) {
+      const size_t index = (cursor_ + i) % num_submissions;
+      Submission* submission = submissions_[index];
+      if (!CanStart(submission, level, reservation)) {
+        continue;
+      }
+      if (index != cursor_) {
+        // Skipped submissions with nothing to run lose their turn.
+        cursor_ = index;
+        cursor_turns_ = submission->weight_;
+      }
+      task = std::move(submission->queues_[level].front());
+      submission->queues_[level].pop_front();
+      ++submission->num_running_;
+      stats_.reserved_memory_bytes += submission->memory_bytes_;
+      if (memory_blocked) {
+        ++stats_.num_backfilled;
+      }
+      if (--cursor_turns_ <= 0) {
+        cursor_ = (index + 1) % num_submissions;
+        cursor_turns_ = submissions_[cursor_]->weight_;
+      }
+      return submission;
+    }
+  }
+  return nullptr;
+}
+
+void ExecutionScheduler::RemoveSubmission(Submission* submission) {
+  auto it = std::find(submissions_.begin(), submissions_.end(), submission);
+  const size_t index = it - submissions_.begin();
+  submissions_.erase(it);
+  --stats_.num_submissions;
+  if (submissions_.empty()) {
+    cursor_ = 0;
+    return;
+  }
+  if (index < cursor_) {
+    --cursor_;
+  } else if (index == cursor_) {
+    cursor_ %= submissions_.size();
+    cursor_turns_ = submissions_[cursor_]->weight_;
+  }
+}
+
+void ExecutionScheduler::WorkLoop(int slot) {
+  // Slots that can't be pinned run their tests unpinned.
+  if (slot < slot_cpus_.size() &&
+      SetCpuAffinity(/*pid=*/0, slot_cpus_[slot].set).ok()) {
+    current_slot_cpus = &slot_cpus_[slot];
+  }
+  for (;;) {
+    Submission::Task task;
+    Submission* submission;
+    {
+      absl::MutexLock l(&mu_);
+      mu_.Await(absl::Condition(this, &ExecutionScheduler::ShouldWake));
+      submission = TakeTask(task);
+      if (submission == nullptr) {
+        if (!shutting_down_) {
+          continue;
+        }
+        // Shutting down, and there is nothing left to run.
+        return;
+      }
+      ++stats_.num_running;
+      const absl::Duration wait_time = absl::Now() - task.scheduled;
+      --stats_.queue_depth;
+      ++stats_.num_started;
+      stats_.total_wait_time += wait_time;
+      stats_.max_wait_time = std::max(stats_.max_wait_time, wait_time);
+    }
+    task.function();
+    // Release anything the task holds before its submission may finish.
+    task.function = nullptr;
+    absl::MutexLock l(&mu_);
+    --submission->num_running_;
+    --stats_.num_running;
+    stats_.reserved_memory_bytes -= submission->memory_bytes_;
+  }
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,217 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A scheduler that runs tests from all concurrent Test calls on a fixed number
+// of slots.
+//
+// Each Test call makes a submission, which caps how many of its tests run at
+// once. Free slots are handed out to submissions in weighted round-robin
+// order, so that a submission with many tests does not hold up the others.
+// Priority tasks (e.g. public tests, which reject most wrong solutions) of all
+// submissions run before any other tasks.
+//
+// Tasks can also reserve memory of a budget for the host while they run. A
+// task only starts if its reservation fits in what is left of the budget, so
+// that sandboxes don't overcommit the host. Small tasks of other submissions
+// backfill around a task that doesn't fit, but only for a while, after which
+// the blocked task gets the next memory that is freed.
+//
+// Slots can be pinned to CPUs of a single NUMA node each, in which case tests
+// pin their sandboxees to the CPUs of the slot that runs them.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_EXECUTION_SCHEDULER_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_EXECUTION_SCHEDULER_H_
+
+#include <cstdint>
+#include <sched.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace deepmind::code_contests {
+
+class ExecutionScheduler {
+ public:
+  struct Stats {
+    // Number of tasks waiting for a slot.
+    int64_t queue_depth = 0;
+    int64_t max_queue_depth = 0;
+    // Number of tasks that have been started.
+    int64_t num_started = 0;
+    // Time from scheduling to starting tasks.
+    absl::Duration total_wait_time;
+    absl::Duration max_wait_time;
+    // Number of submissions that have not been destroyed yet.
+    int num_submissions = 0;
+    // Number of tasks running, and how many may run at once.
+    int num_running = 0;
+    int concurrency_limit = 0;
+    // Number of failures to run tests that were not caused by the code being
+    // tested, and were worth retrying (e.g. running out of file descriptors)
+    // or not (e.g. invalid arguments).
+    int64_t num_infrastructure_errors = 0;
+    int64_t num_fatal_infrastructure_errors = 0;
+    // Number of tests that were retried, and how long they waited in total.
+    int64_t num_retries = 0;
+    absl::Duration total_retry_backoff;
+    // The memory budget, or 0 if unlimited, and how much of it running tasks
+    // and TryReserveMemory have reserved.
+    int64_t memory_budget_bytes = 0;
+    int64_t reserved_memory_bytes = 0;
+    // Number of times that the next task of a submission had to wait for
+    // memory, and for how long in total.
+    int64_t num_memory_blocked = 0;
+    absl::Duration total_memory_blocked_time;
+    // Number of tasks started while another submission waited for memory.
+    int64_t num_backfilled = 0;
+  };
+
+  class Submission {
+   public:
+    // Waits for all tasks of the submission to finish.
+    ~Submission();
+
+    Submission(const Submission&) = delete;
+    Submission& operator=(const Submission&) = delete;
+
+    // Schedules `task` to run on one of the scheduler's slots.
+    void Schedule(std::function<void()> task, bool priority = false);
+
+   private:
+    friend class ExecutionScheduler;
+
+    struct Task {
+      std::function<void()> function;
+      absl::Time scheduled;
+    };
+
+    Submission(ExecutionScheduler* scheduler, int max_concurrency, int weight,
+               int64_t memory_bytes);
+
+    // The following members are guarded by scheduler_->mu_.
+    bool CanStart(int level) const;
+    bool Done() const;
+
+    ExecutionScheduler* const scheduler_;
+    const int max_concurrency_;
+    const int weight_;
+    const int64_t memory_bytes_;
+    // Priority tasks, then other tasks.
+    std::deque<Task> queues_[2];
+    int num_running_ = 0;
+    // When the next task started to wait for memory, if it is waiting.
+    absl::Time memory_blocked_since_ = absl::InfiniteFuture();
+  };
+
+  // The CPUs that a slot is pinned to.
+  struct SlotCpus {
+    std::vector<int> cpus;
+    cpu_set_t set;
+  };
+
+  // Returns the scheduler shared by the whole process, with an unpinned slot
+  // per CPU.
+  static ExecutionScheduler& Default();
+
+  // If `cpus_per_slot` is positive, the worker thread of each slot is pinned
+  // to that many CPUs of one NUMA node. Slots only share CPUs if there are not
+  // enough of them. They don't use the timing CPU of GetTimingCpus(), unless
+  // the process may not use any other core.
+  explicit ExecutionScheduler(int num_slots, int cpus_per_slot = 0);
+  // All submissions must have been destroyed.
+  ~ExecutionScheduler();
+
+  ExecutionScheduler(const ExecutionScheduler&) = delete;
+  ExecutionScheduler& operator=(const ExecutionScheduler&) = delete;
+
+  // Starts a submission that runs at most `max_concurrency` tasks at once, and
+  // gets `weight` turns in each round of the round-robin. Each of its tasks
+  // reserves `memory_bytes` of the memory budget while it runs.
+  std::unique_ptr<Submission> Submit(int max_concurrency, int weight = 1,
+                                     int64_t memory_bytes = 0);
+
+  int num_slots() const { return workers_.size(); }
+  // Limits how many tasks run at once, between 1 and num_slots(). Tasks that
+  // are already running are not stopped. Defaults to num_slots().
+  void set_concurrency_limit(int limit);
+  // Limits the memory that running tasks reserve to `budget_bytes`, or lifts
+  // the limit if it is not positive. A task that needs more than the whole
+  // budget runs alone. Tasks of other submissions may start ahead of a task
+  // that waits for memory for at most `max_backfill_delay`.
+  void set_memory_budget(int64_t budget_bytes,
+                         absl::Duration max_backfill_delay = absl::Seconds(1));
+  // Reserves `bytes` of the memory budget outside of any task, e.g. for a
+  // sandbox that is started ahead of its test. Only succeeds if at least
+  // `bytes` more would still fit, so that such reservations never keep tasks
+  // of the same size from starting. Always succeeds without a budget.
+  bool TryReserveMemory(int64_t bytes);
+  // Releases a reservation made by TryReserveMemory.
+  void ReleaseMemory(int64_t bytes);
+  // Records a failure to run a test that was not caused by the code being
+  // tested. Retryable failures are a signal that too many tests run at once.
+  void ReportInfrastructureError(bool retryable);
+  // Records that a test is retried after waiting for `backoff`.
+  void ReportRetry(absl::Duration backoff);
+  // The CPUs of each slot, or an empty vector if slots are not pinned.
+  const std::vector<SlotCpus>& slot_cpus() const { return slot_cpus_; }
+  Stats stats() const;
+
+  // Returns the CPUs of the pinned slot that is running the calling thread's
+  // task, or nullptr if it is not running on a pinned slot.
+  static const SlotCpus* CurrentSlotCpus();
+
+ private:
+  bool FitsInMemory(const Submission* submission) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Returns the submission that has waited for memory for longer than
+  // max_backfill_delay_, if any, which is the only one that may start a task.
+  const Submission* MemoryReservation(absl::Time now) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool CanStart(const Submission* submission, int level,
+                const Submission* reservation) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool HasRunnableTask() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool ShouldWake() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Removes the next task to run from its submission.
+  Submission* TakeTask(Submission::Task& task)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RemoveSubmission(Submission* submission)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void WorkLoop(int slot);
+
+  mutable absl::Mutex mu_;
+  std::vector<Submission*> submissions_ ABSL_GUARDED_BY(mu_);
+  // The submission whose turn it is, and how many turns it has left.
+  size_t cursor_ ABSL_GUARDED_BY(mu_) = 0;
+  int cursor_turns_ ABSL_GUARDED_BY(mu_) = 0;
+  bool shutting_down_ ABSL_GUARDED_BY(mu_) = false;
+  absl::Duration max_backfill_delay_ ABSL_GUARDED_BY(mu_) = absl::Seconds(1);
+  // Also holds the concurrency limit and memory budget, and their usage.
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+
+  // Set before the workers start.
+  std::vector<SlotCpus> slot_cpus_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_EXECUTION_SCHEDULER_H_
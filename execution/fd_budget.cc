@@ -0,0 +1,148 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/fd_budget.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+// File descriptors left for the rest of the process, e.g. for reading inputs
+// and writing results.
+constexpr int64_t kFdHeadroom = 64;
+// The budget is not larger than this, even if RLIMIT_NOFILE is.
+constexpr int64_t kMaxCapacity = INT64_C(1) << 20;
+
+}  // namespace
+
+FdBudget::Reservation::Reservation(Reservation&& other) noexcept
+    : budget_(std::exchange(other.budget_, nullptr)),
+      fds_(std::exchange(other.fds_, 0)) {}
+
+FdBudget::Reservation& FdBudget::Reservation::operator=(
+    Reservation&& other) noexcept {
+  if (this != &other) {
+    Release();
+    budget_ = std::exchange(other.budget_, nullptr);
+    fds_ = std::exchange(other.fds_, 0);
+  }
+  return *this;
+}
+
+void FdBudget::Reservation::Release() {
+  if (budget_ != nullptr) {
+    budget_->Release(fds_);
+    budget_ = nullptr;
+    fds_ = 0;
+  }
+}
+
+FdBudget& FdBudget::Default() {
+  static auto* const budget = [] {
+    rlimit limit;
+    int64_t max_fds = kMaxCapacity;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+      max_fds = std::min<int64_t>(max_fds, limit.rlim_cur);
+    }
+    return new FdBudget(max_fds - CountOpenFds() - kFdHeadroom);
+  }();
+  return *budget;
+}
+
+FdBudget::FdBudget(int64_t capacity) {
+  stats_.capacity = std::max<int64_t>(1, capacity);
+}
+
+absl::StatusOr<FdBudget::Reservation> FdBudget::Acquire(
+    int64_t fds, absl::Duration timeout) {
+  fds = std::max<int64_t>(0, fds);
+  const Request request{.budget = this, .fds = fds};
+  absl::MutexLock l(&mu_);
+  if (!Fits(&request)) {
+    ++stats_.num_waits;
+    const absl::Time start = absl::Now();
+    const bool fits =
+        mu_.AwaitWithTimeout(absl::Condition(&Fits, &request), timeout);
+    stats_.total_wait_time += absl::Now() - start;
+    if (!fits) {
+      ++stats_.num_timeouts;
+      return absl::ResourceExhaustedError(absl::StrCat(
+          "Timed out waiting for ", fds, " file descriptors, with ",
+          stats_.reserved, " of ", stats_.capacity, " reserved."));
+    }
+  }
+  stats_.reserved += fds;
+  stats_.max_reserved = std::max(stats_.max_reserved, stats_.reserved);
+  return Reservation(this, fds);
+}
+
+std::optional<FdBudget::Reservation> FdBudget::TryAcquire(int64_t fds) {
+  fds = std::max<int64_t>(0, fds);
+  absl::MutexLock l(&mu_);
+  if (2 * (stats_.reserved + fds) > stats_.capacity) {
+    return std::nullopt;
+  }
+  stats_.reserved += fds;
+  stats_.max_reserved = std::max(stats_.max_reserved, stats_.reserved);
+  return Reservation(this, fds);
+}
+
+FdBudget::Stats FdBudget::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+bool FdBudget::Fits(const Request* request) ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  const Stats& stats = request->budget->stats_;
+  return stats.reserved == 0 ||
+         stats.reserved + request->fds <= stats.capacity;
+}
+
+void FdBudget::Release(int64_t fds) {
+  absl::MutexLock l(&mu_);
+  stats_.reserved -= fds;
+}
+
+int64_t CountOpenFds() {
+  DIR* dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    return 0;
+  }
+  int64_t num_open = 0;
+  while (const dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      ++num_open;
+    }
+  }
+  closedir(dir);
+  return num_open;
+}
+
+}  // namespace deepmind::code_contests
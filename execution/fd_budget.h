@@ -0,0 +1,112 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A budget of file descriptors that sandboxes reserve before they are created.
+//
+// Every sandbox holds pipes, sockets and other file descriptors in this
+// process while it exists. Without a budget, enough concurrent sandboxes run
+// into RLIMIT_NOFILE, and fail in ways that are hard to tell apart from other
+// errors. With a budget, sandboxes wait for each other instead.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_FD_BUDGET_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_FD_BUDGET_H_
+
+#include <cstdint>
+#include <optional>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace deepmind::code_contests {
+
+class FdBudget {
+ public:
+  struct Stats {
+    // The number of file descriptors that may be reserved at once, and how
+    // many are.
+    int64_t capacity = 0;
+    int64_t reserved = 0;
+    int64_t max_reserved = 0;
+    // Number of reservations that had to wait, and for how long in total.
+    int64_t num_waits = 0;
+    absl::Duration total_wait_time;
+    // Number of reservations that timed out.
+    int64_t num_timeouts = 0;
+  };
+
+  // Holds file descriptors of a budget until it is destroyed.
+  class Reservation {
+   public:
+    Reservation() = default;
+    ~Reservation() { Release(); }
+
+    Reservation(Reservation&& other) noexcept;
+    Reservation& operator=(Reservation&& other) noexcept;
+
+    int64_t fds() const { return fds_; }
+
+   private:
+    friend class FdBudget;
+
+    Reservation(FdBudget* budget, int64_t fds) : budget_(budget), fds_(fds) {}
+    void Release();
+
+    FdBudget* budget_ = nullptr;
+    int64_t fds_ = 0;
+  };
+
+  // Returns the budget shared by the whole process. Its capacity is
+  // RLIMIT_NOFILE, less the file descriptors that were open when it was first
+  // used, and some headroom for the rest of the process.
+  static FdBudget& Default();
+
+  explicit FdBudget(int64_t capacity);
+
+  FdBudget(const FdBudget&) = delete;
+  FdBudget& operator=(const FdBudget&) = delete;
+
+  // Reserves `fds` file descriptors, waiting for them for up to `timeout`.
+  // Reservations larger than the capacity are only granted while nothing else
+  // is reserved. Returns a ResourceExhaustedError on timeout.
+  absl::StatusOr<Reservation> Acquire(int64_t fds, absl::Duration timeout);
+  // Reserves `fds` file descriptors without waiting, if at most half of the
+  // capacity is then reserved. Meant for reservations that are held for long,
+  // e.g. by caches, which must not keep sandboxes from starting. Returns
+  // nullopt if the reservation does not fit.
+  std::optional<Reservation> TryAcquire(int64_t fds);
+
+  Stats stats() const;
+
+ private:
+  struct Request {
+    const FdBudget* budget;
+    int64_t fds;
+  };
+  static bool Fits(const Request* request);
+
+  void Release(int64_t fds);
+
+  mutable absl::Mutex mu_;
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+// Returns the number of file descriptors open in this process, or 0 if they
+// can't be listed.
+int64_t CountOpenFds();
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_FD_BUDGET_H_
@@ -0,0 +1,188 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/input_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "execution/fd_budget.h"
+#include "execution/status_macros.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+constexpr int64_t kDefaultMaxBytes = INT64_C(512) << 20;
+
+// Opens a new file description for `fd`. Unlike dup, this does not share the
+// file offset, so that several sandboxes can read the same input at once.
+absl::StatusOr<int> ReopenReadOnly(int fd) {
+  const int new_fd =
+      open(absl::StrCat("/proc/self/fd/", fd).c_str(), O_RDONLY | O_CLOEXEC);
+  if (new_fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat("Reopening input memfd failed with errno ", errno));
+  }
+  return new_fd;
+}
+
+}  // namespace
+
+InputCache& InputCache::Default() {
+  static auto* const cache =
+      new InputCache(kDefaultMaxBytes, &FdBudget::Default());
+  return *cache;
+}
+
+InputCache::InputCache(int64_t max_bytes, FdBudget* fd_budget)
+    : max_bytes_(max_bytes), fd_budget_(fd_budget) {}
+
+InputCache::~InputCache() {
+  absl::MutexLock l(&mu_);
+  for (const Entry& entry : entries_) {
+    DestroyEntry(entry);
+  }
+}
+
+absl::StatusOr<int> InputCache::Open(absl::string_view input) {
+  if (input.empty() || input.size() > max_bytes_) {
+    return OpenUncached(input);
+  }
+
+  {
+    absl::MutexLock l(&mu_);
+    auto it = index_.find(input);
+    if (it != index_.end()) {
+      ++stats_.hits;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return ReopenReadOnly(it->second->fd);
+    }
+    ++stats_.misses;
+  }
+
+  std::optional<FdBudget::Reservation> fd_reservation;
+  if (fd_budget_ != nullptr) {
+    fd_reservation = fd_budget_->TryAcquire(1);
+    if (!fd_reservation.has_value()) {
+      return OpenUncached(input);
+    }
+  }
+  // Copy the input without holding the lock.
+  ASSIGN_OR_RETURN(Entry entry, CreateEntry(input));
+  if (fd_reservation.has_value()) {
+    entry.fd_reservation = *std::move(fd_reservation);
+  }
+
+  absl::MutexLock l(&mu_);
+  auto it = index_.find(input);
+  if (it != index_.end()) {
+    // Another thread cached the same input in the meantime.
+    DestroyEntry(entry);
+    return ReopenReadOnly(it->second->fd);
+  }
+  entries_.push_front(std::move(entry));
+  const Entry& cached = entries_.front();
+  index_[absl::string_view(cached.data, cached.size)] = entries_.begin();
+  stats_.cached_bytes += cached.size;
+  EvictIfNeeded();
+  return ReopenReadOnly(cached.fd);
+}
+
+absl::StatusOr<int> InputCache::OpenUncached(absl::string_view data) {
+  ASSIGN_OR_RETURN(const Entry entry, CreateEntry(data));
+  absl::StatusOr<int> fd = ReopenReadOnly(entry.fd);
+  DestroyEntry(entry);
+  return fd;
+}
+
+InputCache::Stats InputCache::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+absl::StatusOr<InputCache::Entry> InputCache::CreateEntry(
+    absl::string_view input) {
+  const int fd =
+      syscall(__NR_memfd_create, "stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat("memfd_create failed with errno ", errno));
+  }
+  absl::string_view remaining = input;
+  while (!remaining.empty()) {
+    const ssize_t n = ::write(fd, remaining.data(), remaining.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      close(fd);
+      return absl::UnknownError(
+          absl::StrCat("Writing input failed with errno ", errno));
+    }
+    remaining.remove_prefix(n);
+  }
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    close(fd);
+    return absl::UnknownError(
+        absl::StrCat("Sealing input memfd failed with errno ", errno));
+  }
+  Entry entry{.fd = fd, .data = nullptr, .size = 0};
+  if (!input.empty()) {
+    void* data = mmap(nullptr, input.size(), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return absl::UnknownError(
+          absl::StrCat("Mapping input memfd failed with errno ", errno));
+    }
+    entry.data = static_cast<const char*>(data);
+    entry.size = input.size();
+  }
+  return entry;
+}
+
+void InputCache::DestroyEntry(const Entry& entry) {
+  if (entry.data != nullptr) {
+    munmap(const_cast<char*>(entry.data), entry.size);
+  }
+  close(entry.fd);
+}
+
+void InputCache::EvictIfNeeded() {
+  // The most recently added entry always fits, so it is never evicted.
+  while (stats_.cached_bytes > max_bytes_) {
+    const Entry& entry = entries_.back();
+    index_.erase(absl::string_view(entry.data, entry.size));
+    stats_.cached_bytes -= entry.size;
+    ++stats_.evictions;
+    DestroyEntry(entry);
+    entries_.pop_back();
+  }
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,99 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A cache of test inputs in sealed memfds, to be used as stdin of sandboxees.
+//
+// The same inputs are typically run against many programs, and against each
+// program several times when tests are retried. Each distinct input is copied
+// into a memfd once, which is then sealed so that it can be shared between
+// sandboxes. Every sandbox gets its own read-only file description for the
+// memfd, so that reading it does not move the offset seen by other sandboxes.
+// Cached memfds stay open, so they can be counted in a FdBudget.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_INPUT_CACHE_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_INPUT_CACHE_H_
+
+#include <cstdint>
+#include <list>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "execution/fd_budget.h"
+
+namespace deepmind::code_contests {
+
+class InputCache {
+ public:
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t evictions = 0;
+    // Total size of the cached inputs.
+    int64_t cached_bytes = 0;
+  };
+
+  // Returns the cache shared by the whole process, whose memfds are counted in
+  // FdBudget::Default().
+  static InputCache& Default();
+
+  // Keeps the most recently used inputs, up to a total of `max_bytes`. Larger
+  // inputs are not cached. If `fd_budget` is set, each cached input holds a
+  // file descriptor of it, and inputs are not cached while it is too full, see
+  // FdBudget::TryAcquire.
+  explicit InputCache(int64_t max_bytes, FdBudget* fd_budget = nullptr);
+  ~InputCache();
+
+  InputCache(const InputCache&) = delete;
+  InputCache& operator=(const InputCache&) = delete;
+
+  // Returns a new read-only file descriptor for a memfd holding `input`,
+  // positioned at its start. The caller takes ownership of the descriptor,
+  // which remains valid if the input is evicted.
+  absl::StatusOr<int> Open(absl::string_view input);
+  // As Open, but for data that is only used once, such as the output of a
+  // program, which is not cached.
+  static absl::StatusOr<int> OpenUncached(absl::string_view data);
+
+  Stats stats() const;
+
+ private:
+  struct Entry {
+    int fd;
+    // A read-only mapping of the memfd, which the map key points into.
+    const char* data;
+    int64_t size;
+    FdBudget::Reservation fd_reservation;
+  };
+
+  // Creates a sealed memfd holding `input`.
+  static absl::StatusOr<Entry> CreateEntry(absl::string_view input);
+  static void DestroyEntry(const Entry& entry);
+  void EvictIfNeeded() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const int64_t max_bytes_;
+  FdBudget* const fd_budget_;
+  mutable absl::Mutex mu_;
+  // Most recently used first.
+  std::list<Entry> entries_ ABSL_GUARDED_BY(mu_);
+  absl::flat_hash_map<absl::string_view, std::list<Entry>::iterator> index_
+      ABSL_GUARDED_BY(mu_);
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_INPUT_CACHE_H_
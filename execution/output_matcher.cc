@@ -0,0 +1,244 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/output_matcher.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <system_error>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/charconv.h"
+#include "absl/strings/match.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/strip.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+constexpr double kDoublePrecision = 1e-5;
+
+// Returns the position of the first character at or after `pos` that is
+// whitespace if `kWhitespace`, or that is not if not, or s.size() if there is
+// none.
+template <bool kWhitespace>
+size_t FindFirst(absl::string_view s, size_t pos) {
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i carriage_return = _mm_set1_epi8('\r');
+  const __m128i vertical_tab = _mm_set1_epi8('\v');
+  for (; pos + 16 <= s.size(); pos += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(s.data() + pos));
+    const __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                     _mm_cmpeq_epi8(chunk, newline)),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, tab),
+                                  _mm_cmpeq_epi8(chunk, carriage_return)),
+                     _mm_cmpeq_epi8(chunk, vertical_tab)));
+    int mask = _mm_movemask_epi8(whitespace);
+    if (!kWhitespace) {
+      mask ^= 0xffff;
+    }
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#endif
+  while (pos < s.size() && IsOutputWhitespace(s[pos]) != kWhitespace) {
+    ++pos;
+  }
+  return pos;
+}
+
+// Whether a token with this value matches a token that is equal to it up to
+// case. Only infinite and NaN numbers don't, since they are not close to
+// themselves.
+bool MatchesItself(const internal::ParsedNumber& number) {
+  return number.kind != internal::ParsedNumber::Kind::kDouble ||
+         std::isfinite(number.value);
+}
+
+bool EqualTokensMatch(absl::string_view token) {
+  // Finite numbers are not this long, and don't contain these letters.
+  if (token.size() <= 300 && token.find_first_of("eEiInN") == token.npos) {
+    return true;
+  }
+  return MatchesItself(internal::ParseNumber(token));
+}
+
+// Whether tokens that differ even when ignoring case match, where `y` is
+// the parsed second token.
+bool DifferentTokensMatch(absl::string_view a,
+                          const internal::ParsedNumber& y) {
+  using Kind = internal::ParsedNumber::Kind;
+  if (y.kind == Kind::kNotANumber) {
+    return false;
+  }
+  const internal::ParsedNumber x = internal::ParseNumber(a);
+  if (x.kind == Kind::kNotANumber) {
+    return false;
+  }
+  if (x.kind == Kind::kInteger && y.kind == Kind::kInteger) {
+    return x.integer == y.integer;
+  }
+  return std::abs(x.value - y.value) < kDoublePrecision;
+}
+
+}  // namespace
+
+bool OutputTokenizer::Next(absl::string_view* token) {
+  const size_t start = FindFirst</*kWhitespace=*/false>(s_, pos_);
+  if (start == s_.size()) {
+    pos_ = start;
+    return false;
+  }
+  pos_ = FindFirst</*kWhitespace=*/true>(s_, start);
+  *token = s_.substr(start, pos_ - start);
+  return true;
+}
+
+bool TokensMatch(absl::string_view a, absl::string_view b) {
+  return absl::EqualsIgnoreCase(a, b)
+             ? EqualTokensMatch(a)
+             : DifferentTokensMatch(a, internal::ParseNumber(b));
+}
+
+bool OutputsMatch(absl::string_view output, absl::string_view expected) {
+  if (output == expected) {
+    return true;
+  }
+  OutputTokenizer output_tokens(output);
+  OutputTokenizer expected_tokens(expected);
+  // Outputs whose tokens are all equal up to case match, even if some of the
+  // tokens don't (e.g. "nan").
+  bool all_equal = true;
+  bool all_match = true;
+  absl::string_view a, b;
+  for (;;) {
+    const bool has_a = output_tokens.Next(&a);
+    const bool has_b = expected_tokens.Next(&b);
+    if (has_a != has_b) {
+      return false;
+    }
+    if (!has_a) {
+      return all_equal || all_match;
+    }
+    if (a == b || absl::EqualsIgnoreCase(a, b)) {
+      all_match = all_match && EqualTokensMatch(a);
+    } else {
+      all_equal = false;
+      all_match =
+          all_match && DifferentTokensMatch(a, internal::ParseNumber(b));
+    }
+    if (!all_equal && !all_match) {
+      return false;
+    }
+  }
+}
+
+namespace internal {
+
+ParsedNumber ParseNumber(absl::string_view token) {
+  // Only a form feed can be left, since it does not separate tokens.
+  token = absl::StripAsciiWhitespace(token);
+  // std::from_chars does not accept a leading '+'.
+  if (absl::ConsumePrefix(&token, "+") && absl::StartsWith(token, "-")) {
+    return ParsedNumber();
+  }
+  const char* const end = token.data() + token.size();
+  ParsedNumber number;
+  const std::from_chars_result integer =
+      std::from_chars(token.data(), end, number.integer);
+  if (integer.ec == std::errc() && integer.ptr == end) {
+    number.kind = ParsedNumber::Kind::kInteger;
+    number.value = number.integer;
+    return number;
+  }
+  // Unlike std::from_chars, this also parses "inf" and "nan", as SimpleAtod.
+  const absl::from_chars_result value =
+      absl::from_chars(token.data(), end, number.value);
+  if (value.ec == std::errc::invalid_argument || value.ptr != end) {
+    return ParsedNumber();
+  }
+  if (value.ec == std::errc::result_out_of_range) {
+    if (number.value > 1.0) {
+      number.value = std::numeric_limits<double>::infinity();
+    } else if (number.value < -1.0) {
+      number.value = -std::numeric_limits<double>::infinity();
+    }
+  }
+  number.kind = ParsedNumber::Kind::kDouble;
+  return number;
+}
+
+}  // namespace internal
+
+CompiledOutput::CompiledOutput(absl::string_view expected) : text_(expected) {
+  OutputTokenizer tokenizer(expected);
+  Token token;
+  while (tokenizer.Next(&token.text)) {
+    token.number = internal::ParseNumber(token.text);
+    token.matches_equal = MatchesItself(token.number);
+    tokens_.push_back(token);
+  }
+}
+
+bool CompiledOutput::Matches(absl::string_view output) const {
+  if (output == text_) {
+    return true;
+  }
+  OutputTokenizer output_tokens(output);
+  // As in OutputsMatch.
+  bool all_equal = true;
+  bool all_match = true;
+  absl::string_view a;
+  for (const Token& token : tokens_) {
+    if (!output_tokens.Next(&a)) {
+      return false;
+    }
+    if (a == token.text || absl::EqualsIgnoreCase(a, token.text)) {
+      all_match = all_match && token.matches_equal;
+    } else {
+      all_equal = false;
+      all_match = all_match && DifferentTokensMatch(a, token.number);
+    }
+    if (!all_equal && !all_match) {
+      return false;
+    }
+  }
+  return !output_tokens.Next(&a) && (all_equal || all_match);
+}
+
+ExpectedOutputs::ExpectedOutputs(
+    const std::vector<absl::string_view>& expected_outputs)
+    : texts_(expected_outputs) {
+  outputs_.reserve(texts_.size());
+  for (absl::string_view expected : texts_) {
+    outputs_.emplace_back(expected);
+  }
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,121 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the output of a program with its expected output.
+//
+// Outputs are compared token by token, where tokens are separated by
+// whitespace, case is ignored, and numbers match if they are close. Every test
+// of every program is checked this way, so tokens are views into the outputs,
+// and each number is parsed at most once.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_OUTPUT_MATCHER_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_OUTPUT_MATCHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+
+namespace deepmind::code_contests {
+
+// Whether `c` separates tokens.
+inline bool IsOutputWhitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v';
+}
+
+// Splits a string into tokens, without copying them.
+class OutputTokenizer {
+ public:
+  explicit OutputTokenizer(absl::string_view s) : s_(s) {}
+
+  // Sets `token` to the next token and returns true, or returns false if
+  // there are no more tokens.
+  bool Next(absl::string_view* token);
+
+ private:
+  absl::string_view s_;
+  size_t pos_ = 0;
+};
+
+// Whether two tokens match. Tokens that are equal up to case match, unless
+// they are infinite or NaN. Otherwise, they match if both are numbers, and are
+// equal if both are 64-bit integers, or are less than 1e-5 apart if not.
+bool TokensMatch(absl::string_view a, absl::string_view b);
+
+// Checks whether output is the same, up to whitespace and floating point
+// errors.
+bool OutputsMatch(absl::string_view output, absl::string_view expected);
+
+namespace internal {
+
+struct ParsedNumber {
+  enum class Kind { kNotANumber, kInteger, kDouble };
+  Kind kind = Kind::kNotANumber;
+  int64_t integer = 0;
+  double value = 0;
+};
+
+// Parses `token` as an integer, or failing that as a double, accepting what
+// absl::SimpleAtoi and absl::SimpleAtod accept.
+ParsedNumber ParseNumber(absl::string_view token);
+
+}  // namespace internal
+
+// An expected output that is tokenized, and whose numbers are parsed, once, so
+// that it can be compared with the outputs of many programs.
+class CompiledOutput {
+ public:
+  // Views `expected`, which must outlive this object.
+  explicit CompiledOutput(absl::string_view expected);
+
+  // Equivalent to OutputsMatch(output, text()).
+  bool Matches(absl::string_view output) const;
+
+  absl::string_view text() const { return text_; }
+  int num_tokens() const { return tokens_.size(); }
+
+ private:
+  struct Token {
+    absl::string_view text;
+    internal::ParsedNumber number;
+    // Whether the token matches tokens that are equal to it up to case, which
+    // infinite and NaN numbers don't.
+    bool matches_equal = true;
+  };
+
+  absl::string_view text_;
+  std::vector<Token> tokens_;
+};
+
+// The compiled expected outputs of all tests of a problem.
+class ExpectedOutputs {
+ public:
+  // The strings viewed by `expected_outputs` must outlive this object.
+  explicit ExpectedOutputs(
+      const std::vector<absl::string_view>& expected_outputs);
+
+  const CompiledOutput& operator[](int i) const { return outputs_[i]; }
+  int size() const { return outputs_.size(); }
+  // The expected outputs as they were passed in.
+  const std::vector<absl::string_view>& texts() const { return texts_; }
+
+ private:
+  std::vector<absl::string_view> texts_;
+  std::vector<CompiledOutput> outputs_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_OUTPUT_MATCHER_H_
@@ -0,0 +1,236 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/output_reactor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <future>  // NOLINT(build/c++11)
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/strings/substitute.h"
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+constexpr int kDefaultNumThreads = 2;
+constexpr int kMaxEvents = 64;
+constexpr size_t kBufferSize = 64 * 1024;
+// Limits how long a single chatty program can keep a thread busy before the
+// thread moves on to other ready streams.
+constexpr size_t kMaxBytesPerWakeup = 1024 * 1024;
+}  // namespace
+
+struct OutputReactor::PendingOutputs {
+  std::promise<Outputs> promise;
+  Outputs outputs;
+  std::atomic<int> num_open{2};
+};
+
+struct OutputReactor::Stream {
+  int fd;
+  std::string contents;
+  absl::StatusOr<std::string>* result;
+  std::shared_ptr<PendingOutputs> pending;
+  ChunkCallback on_chunk;
+};
+
+OutputReactor& OutputReactor::Default() {
+  static auto* const reactor = new OutputReactor(kDefaultNumThreads);
+  return *reactor;
+}
+
+OutputReactor::OutputReactor(int num_threads) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  shutdown_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (epoll_fd_ < 0 || shutdown_fd_ < 0) {
+    return;
+  }
+  // Level-triggered and not one-shot, so that every thread sees it.
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, shutdown_fd_, &event) != 0) {
+    return;
+  }
+  for (int i = 0; i < std::max(1, num_threads); ++i) {
+    threads_.emplace_back(&OutputReactor::Loop, this);
+  }
+}
+
+OutputReactor::~OutputReactor() {
+  if (!threads_.empty()) {
+    const uint64_t one = 1;
+    while (write(shutdown_fd_, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+  std::vector<Stream*> remaining;
+  {
+    absl::MutexLock l(&mu_);
+    remaining.assign(streams_.begin(), streams_.end());
+  }
+  for (Stream* stream : remaining) {
+    Finish(stream, absl::CancelledError("Output reactor shut down."));
+  }
+  if (shutdown_fd_ >= 0) {
+    close(shutdown_fd_);
+  }
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+}
+
+std::future<OutputReactor::Outputs> OutputReactor::Drain(
+    int stdout_fd, int stderr_fd, ChunkCallback on_stdout) {
+  auto pending = std::make_shared<PendingOutputs>();
+  std::future<Outputs> future = pending->promise.get_future();
+  Watch(stdout_fd, &pending->outputs.stdout, pending, std::move(on_stdout));
+  Watch(stderr_fd, &pending->outputs.stderr, pending, /*on_chunk=*/nullptr);
+  return future;
+}
+
+void OutputReactor::Watch(int fd, absl::StatusOr<std::string>* result,
+                          std::shared_ptr<PendingOutputs> pending,
+                          ChunkCallback on_chunk) {
+  auto* stream =
+      new Stream{fd, "", result, std::move(pending), std::move(on_chunk)};
+  if (fd < 0) {
+    Finish(stream, absl::FailedPreconditionError("File descriptor not set."));
+    return;
+  }
+  if (threads_.empty()) {
+    Finish(stream, absl::UnavailableError("Output reactor failed to start."));
+    return;
+  }
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    Finish(stream, absl::UnknownError(absl::Substitute(
+                       "Making FD $0 non-blocking failed with errno $1", fd,
+                       errno)));
+    return;
+  }
+  {
+    absl::MutexLock l(&mu_);
+    streams_.insert(stream);
+  }
+  // One-shot, so that a stream is only ever read by one thread at a time. It
+  // is re-armed after each read.
+  epoll_event event = {};
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = stream;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    Finish(stream, absl::UnknownError(absl::Substitute(
+                       "Watching FD $0 failed with errno $1", fd, errno)));
+  }
+}
+
+void OutputReactor::Loop() {
+  std::vector<char> buffer(kBufferSize);
+  epoll_event events[kMaxEvents];
+  for (;;) {
+    const int n = epoll_wait(epoll_fd_, events, kMaxEvents, /*timeout=*/-1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.ptr == nullptr) {
+        return;
+      }
+      auto* stream = static_cast<Stream*>(events[i].data.ptr);
+      if (!ReadAvailable(*stream, buffer)) {
+        continue;
+      }
+      epoll_event event = {};
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.ptr = stream;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, stream->fd, &event) != 0) {
+        Finish(stream, absl::UnknownError(absl::Substitute(
+                           "Watching FD $0 failed with errno $1", stream->fd,
+                           errno)));
+      }
+    }
+  }
+}
+
+bool OutputReactor::ReadAvailable(Stream& stream, std::vector<char>& buffer) {
+  size_t bytes_read = 0;
+  while (bytes_read < kMaxBytesPerWakeup) {
+    const ssize_t n = read(stream.fd, buffer.data(), buffer.size());
+    if (n > 0) {
+      stream.contents.append(buffer.data(), n);
+      if (stream.on_chunk != nullptr) {
+        stream.on_chunk(absl::string_view(buffer.data(), n));
+      }
+      bytes_read += n;
+      continue;
+    }
+    if (n == 0) {
+      Finish(&stream, std::move(stream.contents));
+      return false;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return true;
+    }
+    Finish(&stream,
+           absl::UnknownError(absl::Substitute(
+               "Reading FD $0 failed with errno $1", stream.fd, errno)));
+    return false;
+  }
+  return true;
+}
+
+void OutputReactor::Finish(Stream* stream,
+                           absl::StatusOr<std::string> contents) {
+  {
+    absl::MutexLock l(&mu_);
+    streams_.erase(stream);
+  }
+  if (stream->fd >= 0) {
+    if (epoll_fd_ >= 0) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, stream->fd, nullptr);
+    }
+    close(stream->fd);
+  }
+  *stream->result = std::move(contents);
+  std::shared_ptr<PendingOutputs> pending = std::move(stream->pending);
+  delete stream;
+  if (pending->num_open.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    pending->promise.set_value(std::move(pending->outputs));
+  }
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,94 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reads the stdout and stderr of running programs from a few epoll threads.
+//
+// Reading each output with blocking reads takes two threads per running test.
+// The reactor instead sets the file descriptors to non-blocking mode and reads
+// whatever is available whenever epoll reports them as readable, so that the
+// outputs of all tests in the process are drained by the same threads.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_OUTPUT_REACTOR_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_OUTPUT_REACTOR_H_
+
+#include <functional>
+#include <future>  // NOLINT(build/c++11)
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind::code_contests {
+
+class OutputReactor {
+ public:
+  struct Outputs {
+    absl::StatusOr<std::string> stdout;
+    absl::StatusOr<std::string> stderr;
+  };
+
+  // Called on a reactor thread with each chunk read from an output, in order.
+  // Must not block.
+  using ChunkCallback = std::function<void(absl::string_view chunk)>;
+
+  // Returns the reactor shared by the whole process.
+  static OutputReactor& Default();
+
+  explicit OutputReactor(int num_threads);
+  // Stops the threads. Outputs that are still being drained are completed with
+  // a cancelled status.
+  ~OutputReactor();
+
+  OutputReactor(const OutputReactor&) = delete;
+  OutputReactor& operator=(const OutputReactor&) = delete;
+
+  // Takes ownership of the two file descriptors and reads them until both
+  // reach EOF, at which point they are closed and the future becomes ready.
+  // If set, `on_stdout` is called with stdout as it is read.
+  std::future<Outputs> Drain(int stdout_fd, int stderr_fd,
+                             ChunkCallback on_stdout = nullptr);
+
+ private:
+  struct Stream;
+  struct PendingOutputs;
+
+  // Starts reading `fd` into `*result`. Takes ownership of `fd`.
+  void Watch(int fd, absl::StatusOr<std::string>* result,
+             std::shared_ptr<PendingOutputs> pending, ChunkCallback on_chunk);
+  void Loop();
+  // Reads what is available from `stream`. Returns whether the stream should
+  // be watched for more data.
+  bool ReadAvailable(Stream& stream, std::vector<char>& buffer);
+  // Closes and deletes `stream` after storing its result.
+  void Finish(Stream* stream, absl::StatusOr<std::string> contents);
+
+  int epoll_fd_ = -1;
+  // Written to on destruction to wake up the threads.
+  int shutdown_fd_ = -1;
+  std::vector<std::thread> threads_;
+
+  absl::Mutex mu_;
+  // Streams that haven't reached EOF yet.
+  absl::flat_hash_set<Stream*> streams_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_OUTPUT_REACTOR_H_
@@ -0,0 +1,68 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/policy_cache.h"
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "absl/functional/function_ref.h"
+#include "absl/synchronization/mutex.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+
+namespace deepmind::code_contests {
+
+static_assert(std::is_copy_constructible_v<sandbox2::PolicyBuilder>,
+              "PolicyCache hands out copies of cached policy builders.");
+
+PolicyCache::PolicyCache(int capacity) : capacity_(std::max(1, capacity)) {}
+
+sandbox2::PolicyBuilder PolicyCache::Get(
+    const std::string& key,
+    absl::FunctionRef<sandbox2::PolicyBuilder()> create) {
+  {
+    absl::MutexLock l(&mu_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      ++stats_.hits;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return it->second->second;
+    }
+    ++stats_.misses;
+  }
+
+  sandbox2::PolicyBuilder builder = create();
+
+  absl::MutexLock l(&mu_);
+  if (index_.contains(key)) {
+    // Another thread populated the same key in the meantime.
+    return builder;
+  }
+  entries_.emplace_front(key, builder);
+  index_[key] = entries_.begin();
+  if (entries_.size() > capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+  return builder;
+}
+
+PolicyCache::Stats PolicyCache::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,81 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A cache of populated sandbox2 policy builders.
+//
+// Populating a builder is expensive: AddLibrariesForBinary parses the binary's
+// ELF headers and resolves its shared libraries, and every file and directory
+// adds a mount. sandbox2 policies can't be copied, but builders can, so we
+// cache builders and only run PolicyBuilder::TryBuild (which assembles the BPF
+// program) for each sandbox.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_POLICY_CACHE_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_POLICY_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <utility>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+
+namespace deepmind::code_contests {
+
+class PolicyCache {
+ public:
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+
+    double HitRate() const {
+      return hits + misses == 0 ? 0.0
+                                : static_cast<double>(hits) / (hits + misses);
+    }
+  };
+
+  // Keeps the `capacity` most recently used builders.
+  explicit PolicyCache(int capacity);
+
+  PolicyCache(const PolicyCache&) = delete;
+  PolicyCache& operator=(const PolicyCache&) = delete;
+
+  // Returns a copy of the builder cached under `key`, populating it with
+  // `create` first if it is not cached. `create` is called without holding any
+  // locks, so concurrent misses for the same key may each call it.
+  sandbox2::PolicyBuilder Get(
+      const std::string& key,
+      absl::FunctionRef<sandbox2::PolicyBuilder()> create);
+
+  Stats stats() const;
+
+ private:
+  using Entry = std::pair<std::string, sandbox2::PolicyBuilder>;
+
+  const int capacity_;
+  mutable absl::Mutex mu_;
+  // Most recently used first.
+  std::list<Entry> entries_ ABSL_GUARDED_BY(mu_);
+  absl::flat_hash_map<std::string, std::list<Entry>::iterator> index_
+      ABSL_GUARDED_BY(mu_);
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_POLICY_CACHE_H_
@@ -0,0 +1,42 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/problem_limits.h"
+
+#include "absl/time/time.h"
+#include "contest_problem.pb.h"
+#include "execution/tester_sandboxer.h"
+
+namespace deepmind::code_contests {
+
+TestOptions TestOptionsForProblem(const ContestProblem& problem,
+                                  const ProblemLimitsOptions& limits,
+                                  TestOptions base) {
+  if (problem.has_time_limit()) {
+    const absl::Duration time_limit =
+        absl::Seconds(problem.time_limit().seconds()) +
+        absl::Nanoseconds(problem.time_limit().nanos());
+    if (time_limit > absl::ZeroDuration()) {
+      base.max_execution_duration = time_limit * limits.time_limit_multiplier;
+      base.walltime_limit_multiplier = limits.walltime_limit_multiplier;
+      base.check_cpu_time = true;
+    }
+  }
+  if (problem.memory_limit_bytes() > 0) {
+    base.memory_limit_bytes = problem.memory_limit_bytes();
+  }
+  return base;
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,44 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Derives the limits that tests are run with from the limits of a problem.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_PROBLEM_LIMITS_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_PROBLEM_LIMITS_H_
+
+#include "absl/time/time.h"
+#include "contest_problem.pb.h"
+#include "execution/tester_sandboxer.h"
+
+namespace deepmind::code_contests {
+
+struct ProblemLimitsOptions {
+  // Multiplies the time limit of problems, e.g. to allow for interpreted
+  // languages or slower machines than those of the original contest.
+  double time_limit_multiplier = 1.0;
+  // Tests are killed after this multiple of their (multiplied) time limit of
+  // wall time.
+  double walltime_limit_multiplier = 2.0;
+};
+
+// Returns `base` with the time and memory limits of `problem`, where it has
+// them. CPU time is checked precisely, since problem time limits are often
+// fractions of a second.
+TestOptions TestOptionsForProblem(const ContestProblem& problem,
+                                  const ProblemLimitsOptions& limits,
+                                  TestOptions base = TestOptions());
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_PROBLEM_LIMITS_H_
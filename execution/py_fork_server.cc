@@ -0,0 +1,763 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/py_fork_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/seccomp.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/cancellation.h"
+#include "execution/fd_budget.h"
+#include "execution/input_cache.h"
+#include "execution/status_macros.h"
+#include "execution/tester_sandboxer.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+#include "sandboxed_api/sandbox2/result.h"
+#include "sandboxed_api/sandbox2/util/bpf_helper.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+// The server reads requests of a fixed size, so that a request never has to be
+// split across reads that carry file descriptors.
+constexpr int kRequestSize = 64;
+constexpr int kNumRequestFds = 3;
+// File descriptors that running a test holds in this process: its input memfd
+// and the memfd that it is copied into while it is opened (2), and both ends
+// of its stdout and stderr pipes (4).
+constexpr int64_t kFdsPerTest = 6;
+
+// How long to wait for the server to report a test beyond the test's own wall
+// time limit, before assuming that the server is stuck.
+constexpr absl::Duration kServerResponseSlack = absl::Seconds(10);
+
+#if defined(__x86_64__)
+constexpr uint32_t kAuditArch = AUDIT_ARCH_X86_64;
+#elif defined(__aarch64__)
+constexpr uint32_t kAuditArch = AUDIT_ARCH_AARCH64;
+#else
+#error "Unsupported architecture for the fork server's test filter."
+#endif
+
+constexpr absl::string_view kForkServerScript = R"py(
+import array
+import builtins
+import ctypes
+import errno
+import marshal
+import os
+import resource
+import select
+import signal
+import socket
+import sys
+import time
+import traceback
+
+# Modules commonly used by solutions, preloaded so that tests don't have to
+# import them.
+import bisect
+import collections
+import heapq
+import itertools
+import math
+
+REQUEST_SIZE = 64
+NUM_REQUEST_FDS = 3
+
+# Tests run under a seccomp filter of their own, on top of the server's
+# sandbox, which lets them create threads, signal themselves and read their
+# resource limits, but not fork, signal the server or other tests, or change
+# their limits. SYSCALLS and AUDIT_ARCH are set by WritePyForkServerScript.
+SECCOMP_SET_MODE_FILTER = 1
+SECCOMP_RET_KILL_PROCESS = 0x80000000
+SECCOMP_RET_ERRNO = 0x00050000
+SECCOMP_RET_ALLOW = 0x7fff0000
+CLONE_THREAD = 0x00010000
+BPF_LD_W_ABS = 0x20
+BPF_JEQ_K = 0x15
+BPF_JSET_K = 0x45
+BPF_RET_K = 0x06
+# Offsets into struct seccomp_data, with arguments in little-endian halves.
+NR_OFFSET = 0
+ARCH_OFFSET = 4
+ARGS_OFFSET = 16
+
+LIBC = ctypes.CDLL(None, use_errno=True)
+
+
+class SockFilter(ctypes.Structure):
+  _fields_ = [('code', ctypes.c_ushort), ('jt', ctypes.c_ubyte),
+              ('jf', ctypes.c_ubyte), ('k', ctypes.c_uint32)]
+
+
+class SockFprog(ctypes.Structure):
+  _fields_ = [('len', ctypes.c_ushort),
+              ('filter', ctypes.POINTER(SockFilter))]
+
+
+def test_filter(pid):
+  """Returns the instructions of the seccomp filter of the test `pid`."""
+  def load(offset):
+    return (BPF_LD_W_ABS, 0, 0, offset)
+
+  def arg(i, high=False):
+    return load(ARGS_OFFSET + 8 * i + (4 if high else 0))
+
+  def unless_equal(k, skip):
+    return (BPF_JEQ_K, 0, skip, k)
+
+  allow = (BPF_RET_K, 0, 0, SECCOMP_RET_ALLOW)
+  deny = (BPF_RET_K, 0, 0, SECCOMP_RET_ERRNO | errno.EPERM)
+  only_self = [arg(0), unless_equal(pid, 1), allow, deny]
+  rules = {
+      # Threads only.
+      'clone': [arg(0), (BPF_JSET_K, 1, 0, CLONE_THREAD), deny, allow],
+      # glibc falls back to clone() if clone3() is missing.
+      'clone3': [(BPF_RET_K, 0, 0, SECCOMP_RET_ERRNO | errno.ENOSYS)],
+      'fork': [deny],
+      'vfork': [deny],
+      'kill': only_self,
+      'tgkill': only_self,
+      'tkill': [deny],
+      'setrlimit': [deny],
+      # Only with a null new limit.
+      'prlimit64': [arg(2), unless_equal(0, 3), arg(2, high=True),
+                    unless_equal(0, 1), allow, deny],
+  }
+  program = [
+      load(ARCH_OFFSET),
+      (BPF_JEQ_K, 1, 0, AUDIT_ARCH),
+      (BPF_RET_K, 0, 0, SECCOMP_RET_KILL_PROCESS),
+      load(NR_OFFSET),
+  ]
+  for name, rule in rules.items():
+    if SYSCALLS[name] >= 0:
+      program.append(unless_equal(SYSCALLS[name], len(rule)))
+      program.extend(rule)
+  program.append(allow)
+  return program
+
+
+def restrict_test():
+  """Installs the seccomp filter of the calling test."""
+  program = test_filter(os.getpid())
+  prog = SockFprog(len(program), (SockFilter * len(program))(*program))
+  if LIBC.syscall(ctypes.c_long(SYSCALLS['seccomp']),
+                  ctypes.c_long(SECCOMP_SET_MODE_FILTER), ctypes.c_long(0),
+                  ctypes.byref(prog)) != 0:
+    err = ctypes.get_errno()
+    raise OSError(err, os.strerror(err))
+
+
+def check_test_restrictions():
+  """Returns whether a test can't signal the server once restricted."""
+  pid = os.fork()
+  if pid == 0:
+    try:
+      restrict_test()
+      os.kill(os.getppid(), 0)
+    except PermissionError:
+      os._exit(0)
+    except BaseException:
+      pass
+    os._exit(1)
+  _, status = os.waitpid(pid, 0)
+  return status == 0
+
+
+def receive_request(control):
+  data = b''
+  fds = array.array('i')
+  while len(data) < REQUEST_SIZE:
+    msg, ancdata, _, _ = control.recvmsg(
+        REQUEST_SIZE - len(data), socket.CMSG_SPACE(NUM_REQUEST_FDS * 4))
+    if not msg:
+      return None, None
+    data += msg
+    for level, kind, cdata in ancdata:
+      if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+        fds.frombytes(cdata[:len(cdata) - len(cdata) % fds.itemsize])
+  return data.split(), list(fds)
+
+
+def exit_code_for(e):
+  if e.code is None:
+    return 0
+  if isinstance(e.code, int):
+    return e.code & 0xff
+  print(e.code, file=sys.stderr)
+  return 1
+
+
+def run_program(program, program_path, fds, cpu_seconds):
+  for target, fd in enumerate(fds):
+    os.dup2(fd, target)
+    os.close(fd)
+  try:
+    resource.setrlimit(resource.RLIMIT_CPU, (cpu_seconds, cpu_seconds))
+    restrict_test()
+  except BaseException:
+    # Never run the program unrestricted.
+    traceback.print_exc()
+    os._exit(1)
+  sys.argv = [program_path]
+  namespace = {
+      '__name__': '__main__',
+      '__builtins__': builtins,
+      '__file__': program_path,
+  }
+  exit_code = 0
+  try:
+    exec(program, namespace)
+  except SystemExit as e:
+    exit_code = exit_code_for(e)
+  except BaseException:
+    # Skip this function's frame, so that the traceback matches running the
+    # program directly.
+    etype, value, tb = sys.exc_info()
+    traceback.print_exception(etype, value, tb.tb_next)
+    exit_code = 1
+  try:
+    threading = sys.modules.get('threading')
+    if threading is not None:
+      threading._shutdown()
+    import atexit
+    atexit._run_exitfuncs()
+  except BaseException:
+    traceback.print_exc()
+  for stream in (sys.stdout, sys.stderr):
+    try:
+      stream.flush()
+    except BaseException:
+      pass
+  os._exit(exit_code)
+
+
+def main():
+  program_path = sys.argv[1]
+  with open(program_path, 'rb') as f:
+    # Skip the header of the .pyc file.
+    program = marshal.loads(f.read()[16:])
+  if not check_test_restrictions():
+    # Without the filter, tests could escape to the server. Exiting makes
+    # them run in sandboxes of their own instead.
+    sys.exit('Failed to restrict tests.')
+  control = socket.socket(fileno=os.dup(0))
+  wakeup_r, wakeup_w = os.pipe()
+  os.set_blocking(wakeup_w, False)
+  signal.signal(signal.SIGCHLD, lambda *_: None)
+  signal.set_wakeup_fd(wakeup_w)
+
+  children = {}  # pid -> [test id, deadline, timed out]
+  while True:
+    timeout = None
+    if children:
+      deadline = min(child[1] for child in children.values())
+      timeout = max(0, deadline - time.monotonic())
+    readable, _, _ = select.select([control, wakeup_r], [], [], timeout)
+    if wakeup_r in readable:
+      os.read(wakeup_r, 4096)
+    if control in readable:
+      request, fds = receive_request(control)
+      if request is None:
+        break
+      if request[0] == b'kill':
+        # Cancelled tests are killed with those past their deadline below.
+        test_id = int(request[1])
+        for child in children.values():
+          if child[0] == test_id:
+            child[1] = 0
+      else:
+        test_id, cpu_seconds, walltime_ms = (int(x) for x in request[1:])
+        pid = os.fork()
+        if pid == 0:
+          control.close()
+          os.close(wakeup_r)
+          os.close(wakeup_w)
+          signal.set_wakeup_fd(-1)
+          signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+          run_program(program, program_path, fds, cpu_seconds)
+        children[pid] = [test_id, time.monotonic() + walltime_ms / 1000,
+                         False]
+      for fd in fds:
+        os.close(fd)
+    while children:
+      pid, status, usage = os.wait4(-1, os.WNOHANG)
+      if pid == 0:
+        break
+      test_id, _, timed_out = children.pop(pid)
+      if timed_out:
+        kind, value = 'timeout', 0
+      elif os.WIFSIGNALED(status):
+        kind, value = 'signal', os.WTERMSIG(status)
+      else:
+        kind, value = 'exit', os.WEXITSTATUS(status)
+      control.sendall(('%d %s %d %.6f %.6f %d %d %d\n' % (
+          test_id, kind, value, usage.ru_utime, usage.ru_stime,
+          usage.ru_maxrss, usage.ru_nvcsw, usage.ru_nivcsw)).encode())
+    now = time.monotonic()
+    for pid, child in children.items():
+      if child[1] <= now and not child[2]:
+        os.kill(pid, signal.SIGKILL)
+        child[2] = True
+
+  for pid in children:
+    os.kill(pid, signal.SIGKILL)
+
+
+if __name__ == '__main__':
+  main()
+)py";
+
+// How a test run by the server ended.
+struct ChildExit {
+  enum class Kind { kExited, kSignaled, kTimedOut };
+  Kind kind = Kind::kExited;
+  // The exit code or signal number.
+  int value = 0;
+  ResourceUsage resource_usage;
+};
+
+absl::StatusOr<std::pair<int64_t, ChildExit>> ParseReply(
+    absl::string_view line) {
+  std::vector<absl::string_view> parts = absl::StrSplit(line, ' ');
+  int64_t id;
+  ChildExit exit;
+  double user_cpu_seconds;
+  double system_cpu_seconds;
+  int64_t peak_rss_kib;
+  ResourceUsage& usage = exit.resource_usage;
+  if (parts.size() < 8 || !absl::SimpleAtoi(parts[0], &id) ||
+      !absl::SimpleAtoi(parts[2], &exit.value) ||
+      !absl::SimpleAtod(parts[3], &user_cpu_seconds) ||
+      !absl::SimpleAtod(parts[4], &system_cpu_seconds) ||
+      !absl::SimpleAtoi(parts[5], &peak_rss_kib) ||
+      !absl::SimpleAtoi(parts[6], &usage.voluntary_context_switches) ||
+      !absl::SimpleAtoi(parts[7], &usage.involuntary_context_switches)) {
+    return absl::InternalError(
+        absl::StrCat("Malformed fork server reply: ", line));
+  }
+  usage.user_cpu_time = absl::Seconds(user_cpu_seconds);
+  usage.system_cpu_time = absl::Seconds(system_cpu_seconds);
+  usage.peak_rss_bytes = peak_rss_kib * 1024;
+  if (parts[1] == "exit") {
+    exit.kind = ChildExit::Kind::kExited;
+  } else if (parts[1] == "signal") {
+    exit.kind = ChildExit::Kind::kSignaled;
+  } else if (parts[1] == "timeout") {
+    exit.kind = ChildExit::Kind::kTimedOut;
+  } else {
+    return absl::InternalError(
+        absl::StrCat("Malformed fork server reply: ", line));
+  }
+  return std::make_pair(id, exit);
+}
+
+// Returns the result that the test would have had in a sandbox of its own.
+ExecutionResult ExecutionResultFromChildExit(const ChildExit& exit) {
+  sandbox2::Result sandbox_result;
+  switch (exit.kind) {
+    case ChildExit::Kind::kExited:
+      sandbox_result.SetExitStatusCode(sandbox2::Result::OK, exit.value);
+      break;
+    case ChildExit::Kind::kSignaled:
+      sandbox_result.SetExitStatusCode(sandbox2::Result::SIGNALED, exit.value);
+      break;
+    case ChildExit::Kind::kTimedOut:
+      sandbox_result.SetExitStatusCode(sandbox2::Result::TIMEOUT, 0);
+      break;
+  }
+  ExecutionResult execution_result =
+      internal::ExecutionResultFromTestSandboxResult(sandbox_result);
+  // The sandbox result has no usage of the child.
+  execution_result.resource_usage = exit.resource_usage;
+  return execution_result;
+}
+
+// Returns the Python definitions of the syscall numbers and architecture that
+// the server's test filter needs, with -1 for syscalls that don't exist.
+std::string TestFilterConstants() {
+#ifdef __NR_fork
+  constexpr int kFork = __NR_fork;
+#else
+  constexpr int kFork = -1;
+#endif
+#ifdef __NR_vfork
+  constexpr int kVfork = __NR_vfork;
+#else
+  constexpr int kVfork = -1;
+#endif
+#ifdef __NR_clone3
+  constexpr int kClone3 = __NR_clone3;
+#else
+  constexpr int kClone3 = -1;
+#endif
+  return absl::StrFormat(
+      "AUDIT_ARCH = %d\n"
+      "SYSCALLS = {'clone': %d, 'clone3': %d, 'fork': %d, 'vfork': %d, "
+      "'kill': %d, 'tgkill': %d, 'tkill': %d, 'setrlimit': %d, "
+      "'prlimit64': %d, 'seccomp': %d}\n",
+      kAuditArch, __NR_clone, kClone3, kFork, kVfork, __NR_kill, __NR_tgkill,
+      __NR_tkill, __NR_setrlimit, __NR_prlimit64, __NR_seccomp);
+}
+
+}  // namespace
+
+absl::Status WritePyForkServerScript(absl::string_view path) {
+  std::ofstream ofs{std::string(path)};
+  ofs << TestFilterConstants() << kForkServerScript;
+  ofs.close();
+  if (!ofs) {
+    return absl::UnknownError(
+        absl::StrCat("Failed to write fork server script to ", path));
+  }
+  return absl::OkStatus();
+}
+
+// A single running server sandbox.
+class PyForkServer::Instance {
+ public:
+  static absl::StatusOr<std::shared_ptr<Instance>> Start(
+      SandboxWithOutputFds sandbox) {
+    if (!sandbox.Sandbox().RunAsync()) {
+      return absl::UnknownError("Failed to run fork server sandbox.");
+    }
+    return std::shared_ptr<Instance>(new Instance(std::move(sandbox)));
+  }
+
+  ~Instance() {
+    Terminate();
+    reader_.join();
+    sandbox_.Sandbox().AwaitResult();
+    close(control_fd_);
+  }
+
+  bool terminated() {
+    absl::MutexLock l(&mu_);
+    return terminated_;
+  }
+
+  absl::StatusOr<ExecutionResult> Run(absl::string_view test_input,
+                                      const TestOptions& test_options,
+                                      CancellationToken& cancellation) {
+    // Tests of the server share the budget with sandboxes, and are reserved
+    // before any of their file descriptors are opened.
+    ASSIGN_OR_RETURN(const FdBudget::Reservation fd_reservation,
+                     internal::ReserveFds(kFdsPerTest));
+    ASSIGN_OR_RETURN(const int input_fd,
+                     InputCache::Default().Open(test_input));
+    int stdout_pipe[2];
+    int stderr_pipe[2];
+    if (pipe2(stdout_pipe, O_CLOEXEC) != 0) {
+      close(input_fd);
+      return absl::UnknownError(
+          absl::StrCat("pipe2 failed with errno ", errno));
+    }
+    if (pipe2(stderr_pipe, O_CLOEXEC) != 0) {
+      close(input_fd);
+      close(stdout_pipe[0]);
+      close(stdout_pipe[1]);
+      return absl::UnknownError(
+          absl::StrCat("pipe2 failed with errno ", errno));
+    }
+    // Reading the outputs closes the read ends.
+    SandboxWithOutputFds outputs(nullptr, stdout_pipe[0], stderr_pipe[0]);
+
+    // As in sandboxes, the wall time limit also stops the test at the
+    // deadline.
+    const absl::Duration walltime_limit = std::min(
+        internal::WalltimeLimit(test_options),
+        std::max(test_options.deadline - absl::Now(), absl::Milliseconds(1)));
+    auto pending = std::make_shared<PendingTest>();
+    absl::Status send_status =
+        absl::UnavailableError("Fork server terminated.");
+    int64_t id = -1;
+    {
+      absl::MutexLock l(&mu_);
+      if (!terminated_) {
+        id = next_id_++;
+        pending_[id] = pending;
+      }
+    }
+    if (id >= 0) {
+      send_status = SendRequest(
+          absl::StrFormat("run %d %d %d", id,
+                          internal::CpuTimeLimitSeconds(test_options),
+                          absl::ToInt64Milliseconds(walltime_limit)),
+          {input_fd, stdout_pipe[1], stderr_pipe[1]});
+    }
+    close(input_fd);
+    close(stdout_pipe[1]);
+    close(stderr_pipe[1]);
+    if (!send_status.ok()) {
+      Terminate();
+      return absl::UnavailableError(send_status.message());
+    }
+
+    const absl::Time start_time = absl::Now();
+    // The server kills the test, which then reports as usual. If the server
+    // can't be reached, it is stuck or gone, and the wait below ends anyway.
+    const ScopedCancellationCallback kill_on_cancel(cancellation, [this, id] {
+      SendRequest(absl::StrFormat("kill %d", id), /*fds=*/{}).IgnoreError();
+    });
+    outputs.DrainOutputsAsync();
+    if (!pending->done.WaitForNotificationWithTimeout(
+            walltime_limit + kServerResponseSlack)) {
+      // The server is stuck. Killing it also kills the test, which closes its
+      // outputs.
+      Terminate();
+    }
+    pending->done.WaitForNotification();
+    const absl::Time end_time = absl::Now();
+    absl::StatusOr<std::string> stdout_contents = outputs.Stdout();
+    absl::StatusOr<std::string> stderr_contents = outputs.Stderr();
+    if (cancellation.IsCancelled()) {
+      return absl::CancelledError("Test was cancelled.");
+    }
+    ASSIGN_OR_RETURN(const ChildExit exit, pending->exit);
+    RETURN_IF_ERROR(stdout_contents.status());
+    RETURN_IF_ERROR(stderr_contents.status());
+    ExecutionResult execution_result = ExecutionResultFromChildExit(exit);
+    if (execution_result.program_status == ProgramStatus::kTimeout &&
+        end_time >= test_options.deadline) {
+      return absl::DeadlineExceededError(
+          "Testing did not finish before its deadline.");
+    }
+    execution_result.stdout = *std::move(stdout_contents);
+    execution_result.stderr = *std::move(stderr_contents);
+    execution_result.execution_duration = end_time - start_time;
+    internal::ClassifyMemoryLimitExceeded(test_options.memory_limit_bytes,
+                                          execution_result);
+    internal::CheckCpuTime(test_options, execution_result);
+    return execution_result;
+  }
+
+ private:
+  struct PendingTest {
+    absl::Notification done;
+    absl::StatusOr<ChildExit> exit;
+  };
+
+  explicit Instance(SandboxWithOutputFds sandbox)
+      : sandbox_(std::move(sandbox)),
+        control_fd_(sandbox_.ReleaseStdinFd()),
+        reader_(&Instance::ReadReplies, this) {
+    // Nothing is expected on the server's own outputs, but they must not fill
+    // up.
+    sandbox_.DrainOutputsAsync();
+  }
+
+  // Sends `request`, along with `fds`, which must be empty or have
+  // kNumRequestFds file descriptors.
+  absl::Status SendRequest(std::string request, const std::vector<int>& fds) {
+    if (request.size() > kRequestSize) {
+      return absl::InternalError("Fork server request too long.");
+    }
+    request.resize(kRequestSize, ' ');
+
+    iovec iov = {.iov_base = request.data(), .iov_len = request.size()};
+    constexpr size_t kFdsSize = kNumRequestFds * sizeof(int);
+    alignas(cmsghdr) char control[CMSG_SPACE(kFdsSize)] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!fds.empty()) {
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(kFdsSize);
+      std::memcpy(CMSG_DATA(cmsg), fds.data(), kFdsSize);
+    }
+
+    absl::MutexLock l(&send_mu_);
+    ssize_t n;
+    do {
+      n = sendmsg(control_fd_, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    // The file descriptors are sent with the first byte, so the remainder of a
+    // partial write can be sent on its own.
+    while (n >= 0 && n < static_cast<ssize_t>(request.size())) {
+      const ssize_t m = send(control_fd_, request.data() + n,
+                             request.size() - n, MSG_NOSIGNAL);
+      if (m < 0 && errno == EINTR) {
+        continue;
+      }
+      n = m < 0 ? m : n + m;
+    }
+    if (n < 0) {
+      return absl::UnknownError(
+          absl::StrCat("Sending to fork server failed with errno ", errno));
+    }
+    return absl::OkStatus();
+  }
+
+  void ReadReplies() {
+    std::string buffer;
+    char chunk[4096];
+    for (;;) {
+      const ssize_t n = ::read(control_fd_, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      buffer.append(chunk, n);
+      size_t newline;
+      while ((newline = buffer.find('\n')) != std::string::npos) {
+        absl::StatusOr<std::pair<int64_t, ChildExit>> reply =
+            ParseReply(absl::string_view(buffer).substr(0, newline));
+        buffer.erase(0, newline + 1);
+        if (!reply.ok()) {
+          continue;
+        }
+        std::shared_ptr<PendingTest> pending;
+        {
+          absl::MutexLock l(&mu_);
+          auto it = pending_.find(reply->first);
+          if (it == pending_.end()) {
+            continue;
+          }
+          pending = std::move(it->second);
+          pending_.erase(it);
+        }
+        pending->exit = reply->second;
+        pending->done.Notify();
+      }
+    }
+    // The server has exited. Any tests it was running are reported as
+    // unavailable, so that they are re-run in their own sandboxes.
+    Terminate();
+    absl::MutexLock l(&mu_);
+    terminated_ = true;
+    for (auto& [id, pending] : pending_) {
+      pending->exit = absl::UnavailableError("Fork server terminated.");
+      pending->done.Notify();
+    }
+    pending_.clear();
+  }
+
+  void Terminate() {
+    shutdown(control_fd_, SHUT_RDWR);
+    sandbox_.Sandbox().Kill();
+  }
+
+  SandboxWithOutputFds sandbox_;
+  const int control_fd_;
+  absl::Mutex send_mu_;
+  absl::Mutex mu_;
+  int64_t next_id_ ABSL_GUARDED_BY(mu_) = 0;
+  absl::flat_hash_map<int64_t, std::shared_ptr<PendingTest>> pending_
+      ABSL_GUARDED_BY(mu_);
+  bool terminated_ ABSL_GUARDED_BY(mu_) = false;
+  std::thread reader_;
+};
+
+PyForkServer::PyForkServer(ServerFactory factory)
+    : factory_(std::move(factory)) {}
+
+PyForkServer::~PyForkServer() = default;
+
+absl::StatusOr<ExecutionResult> PyForkServer::Run(
+    absl::string_view test_input, const TestOptions& test_options,
+    CancellationToken& cancellation) {
+  absl::StatusOr<std::shared_ptr<Instance>> instance = GetOrStartInstance();
+  if (!instance.ok()) {
+    return absl::UnavailableError(instance.status().message());
+  }
+  return (*instance)->Run(test_input, test_options, cancellation);
+}
+
+absl::StatusOr<std::shared_ptr<PyForkServer::Instance>>
+PyForkServer::GetOrStartInstance() {
+  absl::MutexLock l(&mu_);
+  if (instance_ == nullptr || instance_->terminated()) {
+    // Tests still running on a terminated instance keep it alive until they
+    // have finished.
+    instance_ = nullptr;
+    ASSIGN_OR_RETURN(SandboxWithOutputFds sandbox, factory_());
+    ASSIGN_OR_RETURN(instance_, Instance::Start(std::move(sandbox)));
+  }
+  return instance_;
+}
+
+void AddPyForkServerPolicy(sandbox2::PolicyBuilder& builder) {
+  // The server runs no untrusted code itself: before running the program, each
+  // forked test installs a stricter filter of its own, which denies forking,
+  // signals to other processes and changing limits (see the server script).
+  // The server checks that the filter works before serving any tests.
+  builder.AddPolicyOnSyscall(__NR_seccomp,
+                             {
+                                 ARG_32(0),
+                                 JNE32(SECCOMP_SET_MODE_FILTER, DENY),
+                                 ARG_32(1),
+                                 JEQ32(0, ALLOW),
+                             });
+  // fork(), as implemented by glibc.
+  builder.AddPolicyOnSyscall(
+      __NR_clone, {
+                      ARG_32(0),
+                      JEQ32(CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID | SIGCHLD,
+                            ALLOW),
+                  });
+  // Waiting for, and killing, tests.
+  builder.AllowSyscalls({__NR_wait4, __NR_kill});
+  // Receiving requests with file descriptors, and sending replies.
+  builder.AllowSyscalls({__NR_recvmsg, __NR_sendto});
+  // Redirecting a test's stdin, stdout and stderr.
+  builder.AllowSyscalls({__NR_dup2, __NR_dup3});
+  // Lowering the CPU limit of a test before its filter is installed. Only this
+  // process's own limits may be changed, and they can't be raised above the
+  // sandbox's hard limits.
+  builder.AllowSyscall(__NR_setrlimit);
+  builder.AddPolicyOnSyscall(__NR_prlimit64, {
+                                                 ARG_32(0),
+                                                 JEQ32(0, ALLOW),
+                                             });
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,87 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A TestRunner that runs every test of a compiled Python 3 program from a
+// single sandboxed interpreter.
+//
+// The interpreter runs a small server script that loads the program's byte
+// code and preloads commonly used modules once. For each test it receives the
+// test's stdin, stdout and stderr over a Unix socket, forks a child that runs
+// the program with fresh globals and its own resource limits, and reports how
+// the child exited. Tests thereby skip the interpreter startup. The server
+// kills children that exceed their wall time limit, which is capped at the
+// test's deadline, or whose test is cancelled.
+//
+// The server's sandbox must allow forking, signals and changing limits, so
+// each child confines itself with a seccomp filter before running the program:
+// creating processes, signalling any process but itself and changing resource
+// limits fail with EPERM. A server whose children can't install the filter
+// exits before running any tests.
+//
+// A sandbox2 violation kills the whole server, including tests that were
+// running concurrently. Those tests are reported as unavailable, so that the
+// caller re-runs each of them in its own sandbox and gets the same verdict as
+// without the fork server. The server is restarted for later tests.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_PY_FORK_SERVER_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_PY_FORK_SERVER_H_
+
+#include <functional>
+#include <memory>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "execution/cancellation.h"
+#include "execution/tester_sandboxer.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
+
+namespace deepmind::code_contests {
+
+// Writes the fork server script to `path`. The script expects the path of the
+// compiled program as its only argument.
+absl::Status WritePyForkServerScript(absl::string_view path);
+
+// Adds the syscalls needed by the fork server to a policy for running tests.
+void AddPyForkServerPolicy(sandbox2::PolicyBuilder& builder);
+
+class PyForkServer : public TestRunner {
+ public:
+  // Creates the (not yet started) server sandbox. The returned object must
+  // keep the writing end of stdin, which is used as the control socket.
+  using ServerFactory = std::function<absl::StatusOr<SandboxWithOutputFds>()>;
+
+  explicit PyForkServer(ServerFactory factory);
+  ~PyForkServer() override;
+
+  absl::StatusOr<ExecutionResult> Run(absl::string_view test_input,
+                                      const TestOptions& test_options,
+                                      CancellationToken& cancellation) override;
+
+ private:
+  class Instance;
+
+  // Returns the running server, starting a new one if it has terminated.
+  absl::StatusOr<std::shared_ptr<Instance>> GetOrStartInstance();
+
+  const ServerFactory factory_;
+  absl::Mutex mu_;
+  std::shared_ptr<Instance> instance_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_PY_FORK_SERVER_H_
@@ -15,14 +15,19 @@
 #include "execution/py_tester_sandboxer.h"
 
 #include <asm/unistd_64.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <sys/syscall.h>
+#include <unistd.h>
 
 #include <filesystem>
 #include <fstream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "absl/status/status.h"
@@ -32,9 +37,12 @@
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
+#include "execution/policy_cache.h"
+#include "execution/py_fork_server.h"
 #include "execution/status_macros.h"
 #include "execution/temp_path.h"
 #include "execution/tester_sandboxer.h"
+#include "execution/workspace_pool.h"
 #include "farmhash.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/policybuilder.h"
@@ -46,16 +54,49 @@ namespace deepmind::code_contests {
 namespace {
 constexpr absl::string_view kCodeFile = "code.py";
 constexpr absl::string_view kBinaryFile = "code.pyc";
+constexpr absl::string_view kForkServerFile = "fork_server.py";
+
+// Run by pooled sandboxes with the path of the compiled program. Waits for the
+// gate on file descriptor 3 to be opened, then runs the program as if it had
+// been passed to the interpreter. Exits without running it if the gate is
+// closed without being opened, e.g. because the test failed to start.
+constexpr absl::string_view kGateScript =
+    "import os, runpy, sys\n"
+    "if not os.read(3, 1):\n"
+    "  os._exit(1)\n"
+    "os.close(3)\n"
+    "del sys.argv[0]\n"
+    "runpy.run_path(sys.argv[0], run_name='__main__')\n";
+
+// The fork server lowers the CPU limit of each test it runs, but may itself
+// live for as long as there are tests to run.
+constexpr absl::Duration kForkServerMaxCpuDuration = absl::Hours(1);
+
+// Separates the parts of policy cache keys; can't occur in paths.
+constexpr absl::string_view kKeySeparator("\0", 1);
+
+// Policies only depend on the interpreter and the files mapped for the
+// program, so builders are shared by all PyTesterSandboxers in the process.
+PolicyCache& InterpreterPolicyCache() {
+  static auto* const cache = new PolicyCache(/*capacity=*/8);
+  return *cache;
+}
+
+PolicyCache& ProgramPolicyCache() {
+  static auto* const cache = new PolicyCache(/*capacity=*/8);
+  return *cache;
+}
 }  // namespace
 
 Py3TesterSandboxer::Py3TesterSandboxer(
     const std::string& interpreter_path,
-    const std::vector<std::string>& library_paths)
+    const std::vector<std::string>& library_paths,
+    PyExecutionMode execution_mode)
     : PyTesterSandboxer(
           /*compilation_command=*/{interpreter_path, "-m", "py_compile"},
           /*execution_command=*/{interpreter_path},
           /*library_paths=*/library_paths,
-          /*code_preamble=*/"") {}
+          /*code_preamble=*/"", execution_mode) {}
 
 Py2TesterSandboxer::Py2TesterSandboxer(
     const std::string& interpreter_path,
@@ -70,9 +111,8 @@ absl::StatusOr<ExecutionResult> PyTesterSandboxer::CompileCode(
     absl::string_view code, absl::string_view temp_path,
     absl::Duration max_compilation_duration) const {
   const std::filesystem::path temp_fs_path(temp_path);
-  std::ofstream ofs(temp_fs_path / kCodeFile);
-  ofs << absl::StrCat(code_preamble_, code);
-  ofs.close();
+  RETURN_IF_ERROR(WriteFileContents((temp_fs_path / kCodeFile).string(),
+                                    absl::StrCat(code_preamble_, code)));
   std::vector<std::string> compilation_command = compilation_command_;
   compilation_command.push_back((temp_fs_path / kCodeFile).string());
 
@@ -87,6 +127,7 @@ absl::StatusOr<ExecutionResult> PyTesterSandboxer::CompileCode(
   if (!sandbox_with_fds.Sandbox().RunAsync()) {
     return absl::UnknownError("Failed to run sandbox on compilation.");
   }
+  sandbox_with_fds.DrainOutputsAsync();
   sandbox2::Result sandbox_result = sandbox_with_fds.Sandbox().AwaitResult();
   ExecutionResult execution_result =
       internal::ExecutionResultFromCompilationSandboxResult(sandbox_result);
@@ -153,43 +194,155 @@ absl::StatusOr<SandboxWithOutputFds> PyTesterSandboxer::CreateTestSandbox(
       /*ro_dirs=*/{}, /*rw_dirs=*/{std::string(temp_path)}, test_options);
 }
 
+absl::StatusOr<SandboxWithOutputFds>
+PyTesterSandboxer::CreatePooledTestSandbox(const TestOptions& test_options,
+                                           absl::string_view temp_path) const {
+  const std::filesystem::path temp_fs_path(temp_path);
+  std::vector<std::string> execution_command = execution_command_;
+  execution_command.push_back("-c");
+  execution_command.push_back(std::string(kGateScript));
+  execution_command.push_back((temp_fs_path / kBinaryFile).string());
+  // Both ends of the gate are held until the sandbox is gone.
+  ASSIGN_OR_RETURN(FdBudget::Reservation fd_reservation,
+                   internal::ReserveSandboxFds(/*num_mapped_fds=*/2));
+  int gate[2];
+  if (pipe2(gate, O_CLOEXEC) != 0) {
+    return absl::UnknownError(absl::StrCat("pipe2 failed with errno ", errno));
+  }
+  absl::StatusOr<SandboxWithOutputFds> sandbox = CreateSandboxWithFds(
+      /*command=*/execution_command,
+      /*stdin_data=*/std::nullopt,
+      /*ro_files=*/
+      {(temp_fs_path / kCodeFile).string(),
+       (temp_fs_path / kBinaryFile).string()},
+      /*ro_dirs=*/{}, /*rw_dirs=*/{std::string(temp_path)}, test_options,
+      /*cwd=*/"", CopyEnviron(), /*mapped_fds=*/{gate[0]},
+      std::move(fd_reservation));
+  if (!sandbox.ok()) {
+    close(gate[1]);
+    return sandbox.status();
+  }
+  sandbox->set_gate_fd(gate[1]);
+  return sandbox;
+}
+
+absl::StatusOr<std::unique_ptr<TestRunner>>
+PyTesterSandboxer::CreateTestRunner(const TestOptions& test_options,
+                                    absl::string_view temp_path) const {
+  // The server's tests can't be moved into cgroups of their own, so tests
+  // with a cgroup run in their own sandboxes instead.
+  if (execution_mode_ != PyExecutionMode::kForkServer ||
+      test_options.cgroup.has_value()) {
+    return nullptr;
+  }
+  const std::filesystem::path temp_fs_path(temp_path);
+  const std::string server_path = (temp_fs_path / kForkServerFile).string();
+  RETURN_IF_ERROR(WritePyForkServerScript(server_path));
+
+  std::vector<std::string> command = execution_command_;
+  command.push_back(server_path);
+  command.push_back((temp_fs_path / kBinaryFile).string());
+  const std::vector<std::string> ro_files = {
+      (temp_fs_path / kCodeFile).string(),
+      (temp_fs_path / kBinaryFile).string(), server_path};
+  const std::vector<std::string> rw_dirs = {std::string(temp_path)};
+  TestOptions server_options = test_options;
+  server_options.max_execution_duration = kForkServerMaxCpuDuration;
+  return std::make_unique<PyForkServer>(
+      [this, command, ro_files, rw_dirs,
+       server_options]() -> absl::StatusOr<SandboxWithOutputFds> {
+        sandbox2::PolicyBuilder builder =
+            CreatePolicyBuilder(command[0], ro_files, /*ro_dirs=*/{}, rw_dirs);
+        AddPyForkServerPolicy(builder);
+        ASSIGN_OR_RETURN(std::unique_ptr<sandbox2::Policy> policy,
+                         builder.TryBuild());
+        return CreateSandboxWithPolicy(command, /*stdin_data=*/std::nullopt,
+                                       std::move(policy), server_options);
+      });
+}
+
+absl::StatusOr<SandboxWithOutputFds> PyTesterSandboxer::CreateCheckerSandbox(
+    const std::vector<int>& checker_fds, FdBudget::Reservation fd_reservation,
+    const TestOptions& test_options, absl::string_view temp_path) const {
+  const std::filesystem::path temp_fs_path(temp_path);
+  std::vector<std::string> execution_command = execution_command_;
+  execution_command.push_back((temp_fs_path / kBinaryFile).string());
+  // Checkers are shared by concurrent tests, so they may not write to their
+  // directory.
+  return CreateSandboxWithFds(
+      /*command=*/execution_command,
+      /*stdin_data=*/"",
+      /*ro_files=*/
+      {(temp_fs_path / kCodeFile).string(),
+       (temp_fs_path / kBinaryFile).string()},
+      /*ro_dirs=*/{}, /*rw_dirs=*/{}, test_options, /*cwd=*/"", CopyEnviron(),
+      checker_fds, std::move(fd_reservation));
+}
+
 absl::StatusOr<std::unique_ptr<sandbox2::Policy>>
 PyTesterSandboxer::CreatePolicy(absl::string_view binary_path,
                                 const std::vector<std::string>& ro_files,
                                 const std::vector<std::string>& ro_dirs,
                                 const std::vector<std::string>& rw_dirs) const {
-  sandbox2::PolicyBuilder builder = internal::CreateBasePolicy(
-      binary_path,
-      internal::Mappings{
-          .ro_files = ro_files, .ro_dirs = ro_dirs, .rw_dirs = rw_dirs});
-
-  builder.AllowSyscall(__NR_arch_prctl);
-  builder.AllowSyscall(__NR_mprotect);
-  builder.AllowSyscall(__NR_mremap);
-  builder.AllowSyscall(__NR_select);
-  builder.AllowSyscall(__NR_pselect6);
-  builder.AllowSyscall(__NR_mkdir);
-  builder.AllowSyscall(__NR_rename);
-
-  // Python fails if /dev/urandom is mounted as read-only, despite opening it as
-  // O_RDONLY. For now, just mount it as read-write.
-  builder.AddFile("/dev/urandom", /*is_ro=*/false);
-
-  for (const std::string& path : library_paths_) {
-    builder.AddDirectory(path);
-  }
+  return CreatePolicyBuilder(binary_path, ro_files, ro_dirs, rw_dirs)
+      .TryBuild();
+}
 
-  std::filesystem::path cwd_path;
-  {
-    std::string cwd;
-    CHECK(internal::GetCurrentWorkingDirectory(&cwd));
-    cwd_path = cwd;
-  }
+PyTesterSandboxer::PolicyCacheStats PyTesterSandboxer::GetPolicyCacheStats() {
+  return PolicyCacheStats{.interpreter = InterpreterPolicyCache().stats(),
+                          .program = ProgramPolicyCache().stats()};
+}
 
-  // Map the binary so it can be executed with execveat.
-  builder.AddFileAt(cwd_path.append(binary_path).string(), "/dev/fd/1022");
+sandbox2::PolicyBuilder PyTesterSandboxer::CreatePolicyBuilder(
+    absl::string_view binary_path, const std::vector<std::string>& ro_files,
+    const std::vector<std::string>& ro_dirs,
+    const std::vector<std::string>& rw_dirs) const {
+  std::string cwd;
+  CHECK(internal::GetCurrentWorkingDirectory(&cwd));
 
-  return builder.TryBuild();
+  // The mappings are mostly paths in the workspace of a single Test call, so
+  // they are added to each copy rather than being part of the cached builder.
+  const std::string program_key =
+      absl::StrCat(cwd, kKeySeparator, binary_path);
+  sandbox2::PolicyBuilder builder = ProgramPolicyCache().Get(program_key, [&] {
+    sandbox2::PolicyBuilder program_builder =
+        CreateInterpreterPolicyBuilder(binary_path);
+    // Map the binary so it can be executed with execveat.
+    program_builder.AddFileAt(
+        (std::filesystem::path(cwd) / binary_path).string(), "/dev/fd/1022");
+    return program_builder;
+  });
+  internal::AddMappings(builder, internal::Mappings{.ro_files = ro_files,
+                                                    .ro_dirs = ro_dirs,
+                                                    .rw_dirs = rw_dirs});
+  return builder;
+}
+
+sandbox2::PolicyBuilder PyTesterSandboxer::CreateInterpreterPolicyBuilder(
+    absl::string_view binary_path) const {
+  const std::string interpreter_key =
+      absl::StrCat(binary_path, kKeySeparator,
+                   absl::StrJoin(library_paths_, kKeySeparator));
+  return InterpreterPolicyCache().Get(interpreter_key, [&] {
+    sandbox2::PolicyBuilder builder = internal::CreateBasePolicy(binary_path);
+
+    builder.AllowSyscall(__NR_arch_prctl);
+    builder.AllowSyscall(__NR_mprotect);
+    builder.AllowSyscall(__NR_mremap);
+    builder.AllowSyscall(__NR_select);
+    builder.AllowSyscall(__NR_pselect6);
+    builder.AllowSyscall(__NR_mkdir);
+    builder.AllowSyscall(__NR_rename);
+
+    // Python fails if /dev/urandom is mounted as read-only, despite opening it
+    // as O_RDONLY. For now, just mount it as read-write.
+    builder.AddFile("/dev/urandom", /*is_ro=*/false);
+
+    for (const std::string& path : library_paths_) {
+      builder.AddDirectory(path);
+    }
+    return builder;
+  });
 }
 
 }  // namespace deepmind::code_contests
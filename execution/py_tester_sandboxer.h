@@ -24,25 +24,51 @@
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
+#include "execution/fd_budget.h"
+#include "execution/policy_cache.h"
 #include "execution/temp_path.h"
 #include "execution/tester_sandboxer.h"
 #include "sandboxed_api/sandbox2/policy.h"
+#include "sandboxed_api/sandbox2/policybuilder.h"
 
 namespace deepmind::code_contests {
 
+enum class PyExecutionMode {
+  // Every test starts a fresh interpreter in its own sandbox.
+  kInterpreterPerTest,
+  // Tests are forked from a single preloaded interpreter per compiled program.
+  // Only supported for Python 3, see PyForkServer. Tests with a cgroup still
+  // run in sandboxes of their own.
+  kForkServer,
+};
+
 class PyTesterSandboxer : public TesterSandboxer {
  public:
   // The commands should not include the code/binary filename, which will be
   // appended automatically.
-  PyTesterSandboxer(absl::Span<const std::string> compilation_command,
-                    absl::Span<const std::string> execution_command,
-                    const std::vector<std::string>& library_paths,
-                    std::string code_preamble)
+  PyTesterSandboxer(
+      absl::Span<const std::string> compilation_command,
+      absl::Span<const std::string> execution_command,
+      const std::vector<std::string>& library_paths, std::string code_preamble,
+      PyExecutionMode execution_mode = PyExecutionMode::kInterpreterPerTest)
       : compilation_command_(compilation_command.begin(),
                              compilation_command.end()),
         execution_command_(execution_command.begin(), execution_command.end()),
         library_paths_(library_paths.begin(), library_paths.end()),
-        code_preamble_(std::move(code_preamble)) {}
+        code_preamble_(std::move(code_preamble)),
+        execution_mode_(execution_mode) {}
+
+  struct PolicyCacheStats {
+    // Policy parts that depend only on the interpreter and library paths.
+    PolicyCache::Stats interpreter;
+    // Policies that also map the binary being run. The files of each Test
+    // call are mapped on top of a copy.
+    PolicyCache::Stats program;
+  };
+
+  // Returns the hit rates of the policy caches shared by all
+  // PyTesterSandboxers in this process.
+  static PolicyCacheStats GetPolicyCacheStats();
 
  private:
   absl::StatusOr<ExecutionResult> CompileCode(
@@ -51,21 +77,41 @@ class PyTesterSandboxer : public TesterSandboxer {
   absl::StatusOr<SandboxWithOutputFds> CreateTestSandbox(
       absl::string_view test_input, const TestOptions& test_options,
       absl::string_view temp_path) const override;
+  absl::StatusOr<SandboxWithOutputFds> CreatePooledTestSandbox(
+      const TestOptions& test_options,
+      absl::string_view temp_path) const override;
   absl::StatusOr<std::unique_ptr<sandbox2::Policy>> CreatePolicy(
       absl::string_view binary_path, const std::vector<std::string>& ro_files,
       const std::vector<std::string>& ro_dirs,
       const std::vector<std::string>& rw_dirs) const override;
+  absl::StatusOr<std::unique_ptr<TestRunner>> CreateTestRunner(
+      const TestOptions& test_options,
+      absl::string_view temp_path) const override;
+  absl::StatusOr<SandboxWithOutputFds> CreateCheckerSandbox(
+      const std::vector<int>& checker_fds, FdBudget::Reservation fd_reservation,
+      const TestOptions& test_options,
+      absl::string_view temp_path) const override;
+
+  sandbox2::PolicyBuilder CreatePolicyBuilder(
+      absl::string_view binary_path, const std::vector<std::string>& ro_files,
+      const std::vector<std::string>& ro_dirs,
+      const std::vector<std::string>& rw_dirs) const;
+  sandbox2::PolicyBuilder CreateInterpreterPolicyBuilder(
+      absl::string_view binary_path) const;
 
   std::vector<std::string> compilation_command_;
   std::vector<std::string> execution_command_;
   std::vector<std::string> library_paths_;
   std::string code_preamble_;
+  PyExecutionMode execution_mode_;
 };
 
 class Py3TesterSandboxer : public PyTesterSandboxer {
  public:
-  explicit Py3TesterSandboxer(const std::string& interpreter_path,
-                              const std::vector<std::string>& library_paths);
+  explicit Py3TesterSandboxer(
+      const std::string& interpreter_path,
+      const std::vector<std::string>& library_paths,
+      PyExecutionMode execution_mode = PyExecutionMode::kInterpreterPerTest);
 };
 
 class Py2TesterSandboxer : public PyTesterSandboxer {
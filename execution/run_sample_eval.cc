@@ -27,6 +27,9 @@
 #include <algorithm>
 #include <random>
 #include <iterator>
+#include <cstdint>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
 
 #include "absl/flags/parse.h"
 #include "absl/flags/flag.h"
@@ -35,12 +38,18 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "contest_problem.pb.h"
+#include "execution/concurrency_controller.h"
+#include "execution/dataset_image.h"
+#include "execution/dataset_index.h"
+#include "execution/execution_scheduler.h"
+#include "execution/output_matcher.h"
+#include "execution/problem_limits.h"
 #include "execution/py_locations.h"
 #include "execution/py_tester_sandboxer.h"
 #include "execution/status_macros.h"
 #include "execution/tester_sandboxer.h"
-#include "riegeli/bytes/fd_reader.h"
-#include "riegeli/records/record_reader.h"
+#include "execution/timeout_calibrator.h"
+#include "execution/workspace_pool.h"
 
 // For .json processing
 #include "nlohmann/json.hpp"
@@ -48,7 +57,42 @@
 using json = nlohmann::json;
 
 ABSL_FLAG(std::string, test_path, "", "Path to test dataset.");
+ABSL_FLAG(std::string, test_index_path, "",
+          "Where the index of the test dataset is kept. Defaults to the "
+          "dataset path with .index appended.");
+ABSL_FLAG(bool, use_dataset_image, false,
+          "Whether to read tests from an image of the test dataset that is "
+          "shared with other evaluators on this host.");
+ABSL_FLAG(std::string, dataset_image_dir, "/dev/shm",
+          "Where images of test datasets are kept, if --use_dataset_image.");
 ABSL_FLAG(std::string, output_dir, "", "Where the .json with results should be saved.");
+ABSL_FLAG(bool, use_problem_limits, false,
+          "Whether to run tests with the time and memory limits of each "
+          "problem, instead of the defaults.");
+ABSL_FLAG(double, time_limit_multiplier, 1.0,
+          "Multiplies the time limits of problems, if --use_problem_limits.");
+ABSL_FLAG(double, timeout_recheck_band, 0,
+          "If positive, tests are timed on CPU time, and tests within this "
+          "fraction of the time limit are rerun on a reserved CPU.");
+ABSL_FLAG(int, cpus_per_slot, 0,
+          "If positive, each test runs pinned to this many CPUs of a NUMA "
+          "node.");
+ABSL_FLAG(bool, adaptive_concurrency, false,
+          "Whether to tune how many tests run at once from the load of the "
+          "machine, instead of running 4 tests per problem.");
+ABSL_FLAG(int64_t, memory_budget_mb, 0,
+          "If positive, tests only start while the memory limits of all "
+          "running tests fit in this many MiB.");
+ABSL_FLAG(std::string, workspace_root, "",
+          "If set, code is compiled and run in workspaces on a tmpfs mounted "
+          "on this directory, instead of the default pool's.");
+ABSL_FLAG(int64_t, workspace_quota_mb, 1024,
+          "The size of the tmpfs, if --workspace_root.");
+ABSL_FLAG(bool, calibrate_timeouts, false,
+          "Whether to limit the time of tests to a multiple of the runtime of "
+          "the problem's correct solutions on this machine.");
+ABSL_FLAG(std::string, calibration_cache, "",
+          "Where reference runtimes are cached, if --calibrate_timeouts.");
 
 namespace deepmind::code_contests {
 namespace {
@@ -71,21 +115,59 @@ std::string soln_lang;
 int num_public_tests;
 int cnt_passed_public_tests;
 
+// Tunes the number of concurrent tests, if --adaptive_concurrency.
+ConcurrencyController* concurrency_controller = nullptr;
+// The workspaces of all tests, if --workspace_root.
+std::unique_ptr<WorkspacePool> workspace_pool;
+// The index of the test dataset, opened by the first lookup.
+std::unique_ptr<DatasetIndex> dataset_index;
+// The image of the test dataset, if --use_dataset_image.
+std::unique_ptr<DatasetImage> dataset_image;
+// Runs reference solutions for --calibrate_timeouts, and keeps their runtimes
+// for the whole run. Created by the first calibration.
+std::unique_ptr<Py3TesterSandboxer> calibration_tester;
+std::unique_ptr<TimeoutCalibrator> timeout_calibrator;
+
 int number_passed_problems = 0;
 int number_passed_ten_at_k_problems = 0;
 int number_evaluated_problems = 0;
 
 absl::StatusOr<ContestProblem> FindProblem(
     const absl::string_view filename, std::string target_problem_name) {
-  riegeli::RecordReader<riegeli::FdReader<>> reader(
-      std::forward_as_tuple(filename));
-  ContestProblem problem;
-  while (reader.ReadRecord(problem)) {
-    if (problem.name() == target_problem_name) return problem;
+  if (dataset_index == nullptr || dataset_index->dataset_path() != filename) {
+    ASSIGN_OR_RETURN(dataset_index,
+                     DatasetIndex::Open(std::string(filename),
+                                        absl::GetFlag(FLAGS_test_index_path)));
+  }
+  return dataset_index->FindByName(target_problem_name);
+}
+
+absl::StatusOr<TestOptions> CalibratedTestOptions(
+    const ContestProblem& problem, const std::vector<absl::string_view>& inputs,
+    const std::vector<absl::string_view>& outputs,
+    const TestOptions& base_options) {
+  if (timeout_calibrator == nullptr) {
+    calibration_tester = std::make_unique<Py3TesterSandboxer>(
+        Py3InterpreterPath(), Py3LibraryPaths());
+    CalibrationOptions calibration;
+    calibration.cache_path = absl::GetFlag(FLAGS_calibration_cache);
+    ASSIGN_OR_RETURN(timeout_calibrator,
+                     TimeoutCalibrator::Create(calibration_tester.get(),
+                                               calibration));
   }
-  std::cout << "Problem " << target_problem_name;
-  return absl::NotFoundError(
-      " not found inside of the test dataset");
+  return timeout_calibrator->CalibratedTestOptions(problem, inputs, outputs,
+                                                   base_options);
+}
+
+absl::StatusOr<DatasetImage::ProblemView> FindProblemInImage(
+    const absl::string_view filename, std::string target_problem_name) {
+  if (dataset_image == nullptr || dataset_image->dataset_path() != filename) {
+    DatasetImageOptions options;
+    options.directory = absl::GetFlag(FLAGS_dataset_image_dir);
+    ASSIGN_OR_RETURN(dataset_image,
+                     DatasetImage::Attach(std::string(filename), options));
+  }
+  return dataset_image->FindByName(target_problem_name);
 }
 
 std::vector<absl::string_view> GetInputs(const ContestProblem& problem,
@@ -256,25 +338,86 @@ json calculate_metrics(json single_problem) {
   return single_problem;
 }
 
+// Returns the scheduler that tests are run on, or nullptr to use the default.
+ExecutionScheduler* Scheduler() {
+  const int cpus_per_slot = absl::GetFlag(FLAGS_cpus_per_slot);
+  const bool adaptive_concurrency = absl::GetFlag(FLAGS_adaptive_concurrency);
+  const int64_t memory_budget_mb = absl::GetFlag(FLAGS_memory_budget_mb);
+  if (cpus_per_slot <= 0 && !adaptive_concurrency && memory_budget_mb <= 0) {
+    return nullptr;
+  }
+  static auto* const scheduler = [&] {
+    int num_slots = std::max<int>(1, std::thread::hardware_concurrency() /
+                                         std::max(1, cpus_per_slot));
+    // Leave the controller room to run more tests than CPUs, while tests wait
+    // on I/O.
+    if (adaptive_concurrency) {
+      num_slots *= 2;
+    }
+    auto* scheduler = new ExecutionScheduler(num_slots, cpus_per_slot);
+    scheduler->set_memory_budget(memory_budget_mb << 20);
+    return scheduler;
+  }();
+  if (adaptive_concurrency && concurrency_controller == nullptr) {
+    concurrency_controller =
+        new ConcurrencyController(scheduler, ConcurrencyControllerOptions());
+  }
+  return scheduler;
+}
+
 absl::Status SolveProblem(
     const absl::string_view test_filename) {
 
   std::string problem_name = solutions["problem_name"].get<std::string>();
   
-  ASSIGN_OR_RETURN(ContestProblem problem_being_solved,
-                   FindProblem(test_filename, problem_name));
-  const std::vector<absl::string_view> inputs =
-      GetInputs(problem_being_solved,
-                /*max_size=*/3);
-  const std::vector<absl::string_view> outputs =
-      GetOutputs(problem_being_solved,
-                 /*max_size=*/3);
+  ContestProblem problem_being_solved;
+  std::vector<absl::string_view> inputs;
+  std::vector<absl::string_view> outputs;
+  if (absl::GetFlag(FLAGS_use_dataset_image)) {
+    // The tests are views into the image, which outlives the problem.
+    ASSIGN_OR_RETURN(DatasetImage::ProblemView view,
+                     FindProblemInImage(test_filename, problem_name));
+    ASSIGN_OR_RETURN(problem_being_solved, view.ParseMetadata());
+    num_public_tests = view.num_public_tests;
+    inputs = std::move(view.inputs);
+    outputs = std::move(view.outputs);
+    if (fast_run == true) {
+      inputs.resize(3);
+      outputs.resize(3);
+    }
+  } else {
+    ASSIGN_OR_RETURN(problem_being_solved,
+                     FindProblem(test_filename, problem_name));
+    inputs = GetInputs(problem_being_solved,
+                       /*max_size=*/3);
+    outputs = GetOutputs(problem_being_solved,
+                         /*max_size=*/3);
+  }
+  // Shared by all solutions of the problem.
+  const ExpectedOutputs expected_outputs(outputs);
 
 
   Py3TesterSandboxer tester(Py3InterpreterPath(), Py3LibraryPaths());
   TestOptions options;
-  options.num_threads = 4;
+  options.num_public_tests = num_public_tests;
   options.stop_on_first_failure = true;
+  options.scheduler = Scheduler();
+  options.workspace_pool = workspace_pool.get();
+  // The controller limits how many tests run at once instead.
+  options.num_threads = absl::GetFlag(FLAGS_adaptive_concurrency)
+                            ? options.scheduler->num_slots()
+                            : 4;
+  options.timeout_recheck_band = absl::GetFlag(FLAGS_timeout_recheck_band);
+  options.check_cpu_time = options.timeout_recheck_band > 0;
+  if (absl::GetFlag(FLAGS_use_problem_limits)) {
+    ProblemLimitsOptions limits;
+    limits.time_limit_multiplier = absl::GetFlag(FLAGS_time_limit_multiplier);
+    options = TestOptionsForProblem(problem_being_solved, limits, options);
+  }
+  if (absl::GetFlag(FLAGS_calibrate_timeouts)) {
+    ASSIGN_OR_RETURN(options, CalibratedTestOptions(problem_being_solved,
+                                                    inputs, outputs, options));
+  }
 
   std::cout << "\n Working on problem: '" << problem_name << "'\n";
 
@@ -309,7 +452,7 @@ There are 3 options for the outcome of the tests:
     if (soln_lang == "python3") {
       absl::string_view soln_code = soln["code"].get<absl::string_view>();
       ASSIGN_OR_RETURN(MultiTestResult result_output,
-                    tester.Test(soln_code, inputs, options, outputs));
+                    tester.Test(soln_code, inputs, options, expected_outputs));
       if (debug == true) {
         std::cout << "\nSolution " << i << " (" << soln_lang << "): ";
         // std::cout << "\nSolution " << i << " (" << soln_lang <<", " << soln_correct << "): ";
@@ -360,6 +503,9 @@ There are 3 options for the outcome of the tests:
   }
 
   single_problem_results = calculate_metrics(single_problem_results);
+  if (debug && concurrency_controller != nullptr) {
+    std::cout << "\n" << concurrency_controller->metrics() << "\n";
+  }
 
   // exclude from output if no solutions in supported language were found
   if (single_problem_results["test_metrics"]["sample_size"] != 0) {
@@ -396,6 +542,21 @@ int main(int argc, char* argv[]) {
   std::string output_filename;
   std::string output_path;
 
+  if (const std::string workspace_root = absl::GetFlag(FLAGS_workspace_root);
+      !workspace_root.empty()) {
+    absl::StatusOr<std::unique_ptr<deepmind::code_contests::WorkspacePool>>
+        workspace_pool = deepmind::code_contests::WorkspacePool::Create(
+            deepmind::code_contests::WorkspacePoolOptions{
+                .root = workspace_root,
+                .quota_bytes = absl::GetFlag(FLAGS_workspace_quota_mb) << 20,
+            });
+    if (!workspace_pool.ok()) {
+      std::cerr << "Failed: " << workspace_pool.status().message() << std::endl;
+      return 1;
+    }
+    deepmind::code_contests::workspace_pool = *std::move(workspace_pool);
+  }
+
   while (std::getline(sample_solutions_file, line)) {
     single_problem = json::parse(line);
     // std::cout << "\n" << single_problem["generated_solutions"].front() << "\n";
@@ -497,6 +658,9 @@ int main(int argc, char* argv[]) {
   std::cout << "Codex pass@1 = " << codex_pass_at_1 << "\n";
   std::cout << "Codex pass@10 = " << codex_pass_at_10 << "\n";
   std::cout << "Codex pass@100 = " << codex_pass_at_100 << "\n";
+
+  // Unmounts the tmpfs.
+  deepmind::code_contests::workspace_pool.reset();
   
 
 }
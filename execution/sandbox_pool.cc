@@ -0,0 +1,147 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/sandbox_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/execution_scheduler.h"
+#include "execution/status_macros.h"
+#include "execution/tester_sandboxer.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+// How often the pool checks whether the memory budget has room for a sandbox
+// that it put off starting.
+constexpr absl::Duration kMemoryRetryInterval = absl::Milliseconds(50);
+}  // namespace
+
+SandboxPool::SandboxPool(Factory factory, int capacity,
+                         int64_t expected_acquires,
+                         ExecutionScheduler* scheduler, int64_t memory_bytes)
+    : factory_(std::move(factory)),
+      capacity_(std::max(1, capacity)),
+      expected_acquires_(expected_acquires),
+      scheduler_(scheduler),
+      memory_bytes_(memory_bytes),
+      refill_thread_(&SandboxPool::RefillLoop, this) {}
+
+SandboxPool::~SandboxPool() {
+  {
+    absl::MutexLock l(&mu_);
+    shutting_down_ = true;
+  }
+  refill_thread_.join();
+  for (ReadySandbox& ready : ready_) {
+    if (ready.sandbox.ok()) {
+      ready.sandbox->Sandbox().Kill();
+      ready.sandbox->Sandbox().AwaitResult();
+    }
+    if (ready.reserved_memory) {
+      scheduler_->ReleaseMemory(memory_bytes_);
+    }
+  }
+}
+
+absl::StatusOr<SandboxWithOutputFds> SandboxPool::Acquire() {
+  absl::MutexLock l(&mu_);
+  if (!CanAcquire()) {
+    const absl::Time wait_start = absl::Now();
+    ++num_waiting_;
+    mu_.Await(absl::Condition(this, &SandboxPool::CanAcquire));
+    --num_waiting_;
+    ++stats_.num_waits;
+    stats_.total_wait_time += absl::Now() - wait_start;
+  }
+  ReadySandbox ready = std::move(ready_.front());
+  ready_.pop_front();
+  ++stats_.num_acquired;
+  // The caller's test has reserved memory for the sandbox from now on.
+  if (ready.reserved_memory) {
+    scheduler_->ReleaseMemory(memory_bytes_);
+  }
+  return std::move(ready.sandbox);
+}
+
+SandboxPool::Stats SandboxPool::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+bool SandboxPool::MustRefill() const {
+  return shutting_down_ || static_cast<int64_t>(ready_.size()) < num_waiting_;
+}
+
+bool SandboxPool::ShouldRefill() const {
+  if (MustRefill()) {
+    return true;
+  }
+  return stats_.num_created < expected_acquires_ &&
+         static_cast<int64_t>(ready_.size()) < capacity_;
+}
+
+bool SandboxPool::CanAcquire() const { return !ready_.empty(); }
+
+absl::StatusOr<SandboxWithOutputFds> SandboxPool::StartSandbox() {
+  ASSIGN_OR_RETURN(SandboxWithOutputFds sandbox, factory_());
+  if (!sandbox.Sandbox().RunAsync()) {
+    return absl::UnknownError("Failed to run pooled sandbox.");
+  }
+  // Without a wall time limit until it is acquired; the destructor kills it
+  // if it never is.
+  return sandbox;
+}
+
+void SandboxPool::RefillLoop() {
+  while (true) {
+    bool ahead_of_time;
+    {
+      absl::MutexLock l(&mu_);
+      mu_.Await(absl::Condition(this, &SandboxPool::ShouldRefill));
+      if (shutting_down_) {
+        return;
+      }
+      ahead_of_time = !MustRefill();
+    }
+    // Callers that wait for a sandbox have already reserved memory for it.
+    bool reserved_memory = false;
+    if (ahead_of_time && scheduler_ != nullptr && memory_bytes_ > 0) {
+      reserved_memory = scheduler_->TryReserveMemory(memory_bytes_);
+      if (!reserved_memory) {
+        absl::MutexLock l(&mu_);
+        ++stats_.num_memory_deferred;
+        mu_.AwaitWithTimeout(absl::Condition(this, &SandboxPool::MustRefill),
+                             kMemoryRetryInterval);
+        continue;
+      }
+    }
+    // Sandboxes are started without holding the lock, so that Acquire() can
+    // hand out the sandboxes that are already ready in the meantime.
+    absl::StatusOr<SandboxWithOutputFds> sandbox = StartSandbox();
+    absl::MutexLock l(&mu_);
+    ++stats_.num_created;
+    ready_.push_back(ReadySandbox{.sandbox = std::move(sandbox),
+                                  .reserved_memory = reserved_memory});
+  }
+}
+
+}  // namespace deepmind::code_contests
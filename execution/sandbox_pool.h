@@ -0,0 +1,122 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A pool of pre-started sandboxes for a single compiled program.
+//
+// Creating a sandbox (building the executor and policy, setting up namespaces,
+// forking and installing the seccomp filter) often takes longer than running a
+// short test. The pool does this work ahead of time on a background thread:
+// each pooled sandbox is already running, but waits at its gate before it runs
+// the tested code, so a test only needs to open the gate and write its input.
+// The code therefore uses none of its CPU or wall time before its test starts.
+//
+// Sandboxes that are ready but not handed out yet reserve memory of the
+// scheduler's budget, as if their tests were running. The pool only starts
+// sandboxes ahead of time while the budget has room for them.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_SANDBOX_POOL_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_SANDBOX_POOL_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <thread>  // NOLINT(build/c++11)
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "execution/execution_scheduler.h"
+#include "execution/tester_sandboxer.h"
+
+namespace deepmind::code_contests {
+
+class SandboxPool {
+ public:
+  // Creates a sandbox that reads stdin from a pipe and has a gate, without
+  // starting it.
+  using Factory = std::function<absl::StatusOr<SandboxWithOutputFds>()>;
+
+  struct Stats {
+    // Number of sandboxes created by the pool.
+    int64_t num_created = 0;
+    // Number of sandboxes handed out by Acquire().
+    int64_t num_acquired = 0;
+    // Number of times that starting a sandbox ahead of time was put off,
+    // because the memory budget had no room for it.
+    int64_t num_memory_deferred = 0;
+    // Number of Acquire() calls that had to wait for a sandbox to be started.
+    int64_t num_waits = 0;
+    // Total time spent waiting in Acquire().
+    absl::Duration total_wait_time;
+  };
+
+  // Keeps up to `capacity` started sandboxes ready. Once `expected_acquires`
+  // sandboxes have been started, new ones are only started for callers that
+  // are waiting (e.g. retries). Ready sandboxes have no wall time limit, as
+  // their tests may wait long for a slot or memory; their tests set one. Each
+  // ready sandbox reserves `memory_bytes` of the memory budget of
+  // `scheduler`, if it is set.
+  SandboxPool(Factory factory, int capacity, int64_t expected_acquires,
+              ExecutionScheduler* scheduler = nullptr,
+              int64_t memory_bytes = 0);
+  // Kills any sandboxes that were never handed out.
+  ~SandboxPool();
+
+  SandboxPool(const SandboxPool&) = delete;
+  SandboxPool& operator=(const SandboxPool&) = delete;
+
+  // Returns a started sandbox, waiting for one to become ready if necessary.
+  // The caller must release it with SandboxWithOutputFds::WriteStdinAndClose,
+  // which opens its gate.
+  // Errors encountered while starting a sandbox are returned here, so that the
+  // caller can retry.
+  absl::StatusOr<SandboxWithOutputFds> Acquire();
+
+  Stats stats() const;
+
+ private:
+  struct ReadySandbox {
+    absl::StatusOr<SandboxWithOutputFds> sandbox;
+    // Whether it reserved memory of the scheduler's budget.
+    bool reserved_memory = false;
+  };
+
+  // Whether a sandbox must be started right away, because a caller is
+  // waiting for it or the pool is shutting down.
+  bool MustRefill() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Whether a sandbox should be started, possibly ahead of time.
+  bool ShouldRefill() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool CanAcquire() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::StatusOr<SandboxWithOutputFds> StartSandbox();
+  void RefillLoop();
+
+  const Factory factory_;
+  const int capacity_;
+  const int64_t expected_acquires_;
+  ExecutionScheduler* const scheduler_;
+  const int64_t memory_bytes_;
+
+  mutable absl::Mutex mu_;
+  std::deque<ReadySandbox> ready_ ABSL_GUARDED_BY(mu_);
+  bool shutting_down_ ABSL_GUARDED_BY(mu_) = false;
+  int num_waiting_ ABSL_GUARDED_BY(mu_) = 0;
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+
+  std::thread refill_thread_;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_SANDBOX_POOL_H_
@@ -0,0 +1,113 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures test throughput with and without the sandbox pool.
+//
+// The default workload matches the CanTestInParallel test: a program that
+// loops forever, run on 8 empty inputs with 4 threads and a 2 second limit.
+// Use --workload=hello to measure a workload dominated by sandbox startup.
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/py_locations.h"
+#include "execution/py_tester_sandboxer.h"
+#include "execution/status_macros.h"
+#include "execution/tester_sandboxer.h"
+
+ABSL_FLAG(std::string, workload, "loops_forever",
+          "Program to run: 'loops_forever' or 'hello'.");
+ABSL_FLAG(int, num_tests, 8, "Number of test inputs per Test call.");
+ABSL_FLAG(int, num_threads, 4, "Value of TestOptions::num_threads.");
+ABSL_FLAG(absl::Duration, max_execution_duration, absl::Seconds(2),
+          "Value of TestOptions::max_execution_duration.");
+ABSL_FLAG(int, repetitions, 3, "Number of Test calls per configuration.");
+
+namespace deepmind::code_contests {
+namespace {
+
+constexpr absl::string_view kLoopsForever = R"py(
+import math
+x = 1.
+while True:
+  x += math.sin(x)
+)py";
+
+constexpr absl::string_view kHello = "print('hello')";
+
+absl::StatusOr<double> MeasureTestsPerSecond(absl::string_view code,
+                                             const TestOptions& options) {
+  Py3TesterSandboxer tester(Py3InterpreterPath(), Py3LibraryPaths());
+  const std::vector<absl::string_view> inputs(absl::GetFlag(FLAGS_num_tests),
+                                              "");
+  const int repetitions = absl::GetFlag(FLAGS_repetitions);
+  absl::Duration total;
+  for (int i = 0; i < repetitions; ++i) {
+    const absl::Time start = absl::Now();
+    ASSIGN_OR_RETURN(MultiTestResult result,
+                     tester.Test(code, inputs, options));
+    total += absl::Now() - start;
+    if (result.compilation_result.program_status != ProgramStatus::kSuccess) {
+      return absl::InternalError("Benchmark program failed to compile.");
+    }
+  }
+  return (repetitions * inputs.size()) / absl::ToDoubleSeconds(total);
+}
+
+absl::Status RunBenchmark() {
+  const std::string workload = absl::GetFlag(FLAGS_workload);
+  absl::string_view code;
+  if (workload == "loops_forever") {
+    code = kLoopsForever;
+  } else if (workload == "hello") {
+    code = kHello;
+  } else {
+    return absl::InvalidArgumentError("Unknown workload: " + workload);
+  }
+
+  TestOptions options;
+  options.num_threads = absl::GetFlag(FLAGS_num_threads);
+  options.max_execution_duration = absl::GetFlag(FLAGS_max_execution_duration);
+
+  ASSIGN_OR_RETURN(const double baseline, MeasureTestsPerSecond(code, options));
+  options.use_sandbox_pool = true;
+  ASSIGN_OR_RETURN(const double pooled, MeasureTestsPerSecond(code, options));
+
+  std::cout << "workload: " << workload << "\n"
+            << "without sandbox pool: " << baseline << " tests/sec\n"
+            << "with sandbox pool:    " << pooled << " tests/sec\n"
+            << "speedup: " << pooled / baseline << "x\n";
+  return absl::OkStatus();
+}
+
+}  // namespace
+}  // namespace deepmind::code_contests
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  if (absl::Status status = deepmind::code_contests::RunBenchmark();
+      !status.ok()) {
+    std::cerr << "Failed: " << status.message() << std::endl;
+    return 1;
+  }
+  return 0;
+}
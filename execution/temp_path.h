@@ -21,6 +21,7 @@
 #include <cstdlib>
 #include <filesystem>
 #include <string>
+#include <system_error>
 
 #include "absl/random/random.h"
 #include "absl/strings/str_format.h"
@@ -43,7 +44,10 @@ class TempPath {
     }
   }
 
-  ~TempPath() {}
+  ~TempPath() {
+    std::error_code error;
+    std::filesystem::remove_all(path_, error);
+  }
 
   TempPath(const TempPath&) = delete;
   TempPath& operator=(const TempPath&) = delete;
@@ -28,37 +28,46 @@
 #include <cstdio>
 #include <filesystem>
 #include <functional>
-#include <iterator>
+#include <future>  // NOLINT(build/c++11)
 #include <memory>
 #include <optional>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <tuple>
 #include <utility>
 #include <vector>
 
 #include "absl/algorithm/container.h"
 #include "absl/memory/memory.h"
+#include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/ascii.h"
-#include "absl/strings/numbers.h"
-#include "absl/strings/str_split.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/string_view.h"
 #include "absl/strings/substitute.h"
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
+#include "execution/cancellation.h"
+#include "execution/cgroup.h"
+#include "execution/cpu_affinity.h"
+#include "execution/fd_budget.h"
+#include "execution/input_cache.h"
+#include "execution/output_matcher.h"
+#include "execution/sandbox_pool.h"
 #include "execution/status_macros.h"
-#include "execution/temp_path.h"
-#include "sandboxed_api/sandbox2/buffer.h"
+#include "execution/work_stealing_pool.h"
+#include "execution/workspace_pool.h"
 #include "sandboxed_api/sandbox2/executor.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/policybuilder.h"
 #include "sandboxed_api/sandbox2/result.h"
 #include "sandboxed_api/sandbox2/sandbox2.h"
 #include "sandboxed_api/sandbox2/util/bpf_helper.h"
-#include "execution/simple_threadpool.h"
 
 // Defined as extern per https://man7.org/linux/man-pages/man7/environ.7.html.
 extern char** environ;
@@ -70,28 +79,147 @@ namespace {
 // The max compilation time is not currently configurable. Hopefully 60 seconds
 // is more than enough time for our programs.
 constexpr absl::Duration kMaxCompilationDuration = absl::Seconds(60);
-
-// Number of retries in the case of failures during testing. This is empirically
-// enough to deflake in testing.
+// The CPU time that a checker may use for a single test, and the multiple of
+// it that it may take in wall time.
+constexpr absl::Duration kMaxCheckerDuration = absl::Seconds(10);
+constexpr double kCheckerWalltimeLimitMultiplier = 3;
+// The most that rechecks may take of their time limit in wall time. Rechecked
+// tests have the timing CPU to themselves, so that their wall time is close
+// to their CPU time, and the lower limit keeps tests that sleep from holding
+// that CPU, which all rechecks of the process wait for.
+constexpr double kRecheckWalltimeLimitMultiplier = 2;
+// File descriptors that running a checker opens: its test input, the output
+// and the expected output, and the memfd that one of them is copied into
+// while it is opened.
+constexpr int64_t kCheckerFds = 4;
+// Number of compiled checkers that a TesterSandboxer keeps.
+constexpr int kMaxCachedCheckers = 16;
+// Messages that programs print to stderr when they fail to allocate memory.
+// They only count if the program's peak RSS reached this fraction of its
+// memory limit: failing allocations are at least as large as what the program
+// already holds when it grows its data by doubling, while programs that print
+// such messages for other reasons rarely use that much memory.
+constexpr double kOutOfMemoryMinRssFraction = 0.25;
+constexpr absl::string_view kOutOfMemoryMessages[] = {
+    "MemoryError",             // Python
+    "std::bad_alloc",          // C++
+    "heap out of memory",      // Node.js
+    "Cannot allocate memory",  // strerror(ENOMEM)
+};
+
+// Memory that a test may use on top of its limit, for the interpreter or
+// binary itself.
+constexpr int64_t kSandboxMemoryOverheadBytes = INT64_C(32) << 20;
+
+// File descriptors that a sandbox holds in this process until it is destroyed:
+// - our ends of the stdin, stdout and stderr pipes, and the sandboxee's ends
+//   until they are sent to it (6),
+// - the input memfd, until it is sent to the sandboxee, and the memfd that it
+//   is copied into while it is opened (2),
+// - the comms socket with the sandboxee, and the fork server's (2),
+// - the monitor's pidfd, and its seccomp notification and wakeup fds (3).
+// Mounts are set up in the sandboxee's namespace, and hold none of ours.
+// Memfds of cached inputs are counted by InputCache, and file descriptors that
+// are mapped into the sandboxee by the callers that open them.
+constexpr int64_t kFdsPerSandbox = 13;
+// How long creating a sandbox waits for file descriptors before it fails with
+// a retryable error.
+constexpr absl::Duration kMaxFdBudgetWait = absl::Seconds(10);
+
+// Number of attempts in the case of retryable failures during testing. This is
+// empirically enough to deflake in testing.
 constexpr int kMaxTestAttempts = 3;
+constexpr absl::Duration kInitialRetryBackoff = absl::Milliseconds(2);
+constexpr absl::Duration kMaxRetryBackoff = absl::Milliseconds(100);
 
+// Calls `fn` until it succeeds, or fails for a reason that retrying won't fix.
+// Failures are reported to `scheduler`, if it is set.
 absl::StatusOr<ExecutionResult> RetryIfFail(
-    std::function<absl::StatusOr<ExecutionResult>()> fn) {
+    std::function<absl::StatusOr<ExecutionResult>()> fn,
+    ExecutionScheduler* scheduler = nullptr) {
   absl::StatusOr<ExecutionResult> result =
       absl::InternalError("No attempts made.");
-  for (int retry = 0; retry < kMaxTestAttempts; ++retry) {
+  for (int attempt = 0; attempt < kMaxTestAttempts; ++attempt) {
     result = fn();
-    // We don't retry cancellations to allow stopping on first failure.
-    if (result.ok() || result.status().code() == absl::StatusCode::kCancelled) {
+    // We don't retry cancellations to allow stopping on first failure, nor
+    // tests that ran out of time.
+    if (result.ok() || result.status().code() == absl::StatusCode::kCancelled ||
+        result.status().code() == absl::StatusCode::kDeadlineExceeded) {
       break;
     }
-    // Otherwise, it's possible that this is an ephemeral issue such as not
-    // having available file descriptors. We retry after a brief pause.
-    absl::SleepFor(absl::Milliseconds(2));
+    const bool retryable = internal::IsRetryableError(result.status());
+    if (scheduler != nullptr) {
+      scheduler->ReportInfrastructureError(retryable);
+    }
+    if (!retryable || attempt + 1 == kMaxTestAttempts) {
+      break;
+    }
+    // Otherwise, it's possible that this is an ephemeral issue such as a
+    // sandbox failing to start. Tests that failed together should not all
+    // retry at the same time.
+    absl::BitGen gen;
+    const absl::Duration backoff = internal::RetryBackoff(attempt, gen);
+    if (scheduler != nullptr) {
+      scheduler->ReportRetry(backoff);
+    }
+    absl::SleepFor(backoff);
   }
   return result;
 }
 
+// Returns an error if testing should stop because it was cancelled or ran past
+// its deadline.
+absl::Status CheckNotInterrupted(const CancellationToken* cancellation,
+                                 absl::Time deadline) {
+  if (cancellation != nullptr && cancellation->IsCancelled()) {
+    return absl::CancelledError("Testing was cancelled.");
+  }
+  if (absl::Now() >= deadline) {
+    return absl::DeadlineExceededError(
+        "Testing did not finish before its deadline.");
+  }
+  return absl::OkStatus();
+}
+
+void CloseFds(const std::vector<int>& fds) {
+  for (const int fd : fds) {
+    close(fd);
+  }
+}
+
+// Opens the files that a checker reads, in the order of their file
+// descriptors. Inputs and expected outputs are shared by all programs tested
+// on a problem, so they are cached.
+absl::StatusOr<std::vector<int>> OpenCheckerFds(
+    absl::string_view test_input, absl::string_view output,
+    absl::string_view expected_output) {
+  const absl::StatusOr<int> opened[] = {
+      InputCache::Default().Open(test_input),
+      InputCache::OpenUncached(output),
+      InputCache::Default().Open(expected_output),
+  };
+  std::vector<int> fds;
+  absl::Status status;
+  for (const absl::StatusOr<int>& fd : opened) {
+    if (fd.ok()) {
+      fds.push_back(*fd);
+    } else {
+      status.Update(fd.status());
+    }
+  }
+  if (!status.ok()) {
+    CloseFds(fds);
+    return status;
+  }
+  return fds;
+}
+
+// Held while a test runs on the timing CPU.
+absl::Mutex& TimingCpuMutex() {
+  static auto* const mutex = new absl::Mutex();
+  return *mutex;
+}
+
 ssize_t BlockingReadIgnoringInterruptions(int fd, char* buf, size_t count) {
   ssize_t bytes_read;
   do {
@@ -118,6 +246,25 @@ absl::StatusOr<std::string> ReadFd(int fd) {
   }
 }
 
+absl::Status WriteFd(int fd, absl::string_view data) {
+  while (!data.empty()) {
+    const ssize_t n = ::write(fd, data.data(), data.size());
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      // The sandboxee exited or closed stdin without reading all of it.
+      if (errno == EPIPE || errno == ECONNRESET) {
+        return absl::OkStatus();
+      }
+      return absl::UnknownError(
+          absl::Substitute("Writing FD $0 failed with errno $1", fd, errno));
+    }
+    data.remove_prefix(n);
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<std::string> UseCacheOrReadAndClose(
     int& fd, std::optional<absl::StatusOr<std::string>>& cache) {
   if (cache.has_value()) {
@@ -133,39 +280,79 @@ absl::StatusOr<std::string> UseCacheOrReadAndClose(
 }
 
 std::vector<std::string> SplitAndLowercase(absl::string_view s) {
-  std::vector<std::string> parts =
-      absl::StrSplit(s, absl::ByAnyChar(" \n\t\r\v"), absl::SkipEmpty());
   std::vector<std::string> lower;
-  std::transform(parts.begin(), parts.end(), std::back_inserter(lower),
-                 [](const std::string& s) -> std::string {
-                   return absl::AsciiStrToLower(s);
-                 });
+  OutputTokenizer tokens(s);
+  absl::string_view token;
+  while (tokens.Next(&token)) {
+    lower.push_back(absl::AsciiStrToLower(token));
+  }
   return lower;
 }
 
-bool ValuesMatch(absl::string_view a, absl::string_view b) {
-  constexpr double kDoublePrecision = 1e-5;
-  int ai, bi;
-  double ad, bd;
-  const bool a_is_int = absl::SimpleAtoi(a, &ai);
-  const bool b_is_int = absl::SimpleAtoi(b, &bi);
-  const bool a_is_double = absl::SimpleAtod(a, &ad);
-  const bool b_is_double = absl::SimpleAtod(b, &bd);
-  const bool a_is_string = (!a_is_int) && (!a_is_double);
-  const bool b_is_string = (!b_is_int) && (!b_is_double);
-  if (a_is_string || b_is_string) {
-    return a == b;
+// Sets the verdict of a test whose stdout was checked by `comparator`.
+// `diverged` is whether Consume returned false, i.e. the output stopped
+// matching before it was complete.
+void SetStreamingVerdict(StreamingOutputComparator& comparator, bool diverged,
+                         ExecutionResult& execution_result) {
+  if (diverged) {
+    // The program was killed, or would have been if it had been running.
+    execution_result.program_status = ProgramStatus::kFailed;
+    execution_result.passed = false;
+    execution_result.sandbox_result = absl::StrCat(
+        "Stopped after output diverged from the expected output at byte ",
+        comparator.mismatch_offset(), ". ", execution_result.sandbox_result);
+  } else {
+    execution_result.passed = comparator.Finish();
   }
-  // Both are numeric values: tolerate up to a precision for floats.
-  if (a_is_double || b_is_double) {
-    return std::abs(ad - bd) < kDoublePrecision;
+  if (!*execution_result.passed) {
+    execution_result.output_mismatch_offset = comparator.mismatch_offset();
   }
-  // Both integers - require equality.
-  return ai == bi;
+}
+
+// Runs the calls of TestAsync. Calls mostly wait for their tests, which run on
+// the scheduler, so there are more threads than CPUs, but calls beyond that
+// wait for a free thread instead of each getting one of its own. Calls made
+// from many threads at once don't contend on a single queue.
+WorkStealingPool& AsyncTestPool() {
+  static auto* const pool = new WorkStealingPool(
+      std::max(4, 2 * static_cast<int>(std::thread::hardware_concurrency())));
+  return *pool;
+}
+
+// Runs `test` on AsyncTestPool(), with the cancellation token of the returned
+// handle.
+TestHandle StartAsync(
+    std::function<absl::StatusOr<MultiTestResult>(CancellationToken*)> test) {
+  TestHandle handle;
+  handle.cancellation = std::make_shared<CancellationToken>();
+  auto task = std::make_shared<
+      std::packaged_task<absl::StatusOr<MultiTestResult>()>>(
+      [test = std::move(test), cancellation = handle.cancellation] {
+        return test(cancellation.get());
+      });
+  handle.result = task->get_future();
+  // Only holds a pointer, so the pool stores it without another allocation.
+  AsyncTestPool().Schedule([task] { (*task)(); });
+  return handle;
 }
 
 }  // namespace
 
+TestHandle& TestHandle::operator=(TestHandle&& other) {
+  if (result.valid()) {
+    result.wait();
+  }
+  result = std::move(other.result);
+  cancellation = std::move(other.cancellation);
+  return *this;
+}
+
+TestHandle::~TestHandle() {
+  if (result.valid()) {
+    result.wait();
+  }
+}
+
 absl::Status ExecutionResult::SandboxResultStatus() const {
   switch (program_status) {
     case ProgramStatus::kUnknown:
@@ -176,6 +363,8 @@ absl::Status ExecutionResult::SandboxResultStatus() const {
       return absl::DeadlineExceededError(sandbox_result);
     case ProgramStatus::kFailed:
       return absl::InternalError(sandbox_result);
+    case ProgramStatus::kMemoryLimitExceeded:
+      return absl::ResourceExhaustedError(sandbox_result);
   }
 }
 
@@ -188,6 +377,31 @@ std::ostream& operator<<(std::ostream& os, const ExecutionResult& result) {
      << "  duration: " << result.execution_duration << "\n"
      << "  sandbox result: \"" << result.sandbox_result << "\"\n"
      << "  passed: " << (result.passed ? "true" : "false") << "\n";
+  if (result.output_mismatch_offset.has_value()) {
+    os << "  output mismatch offset: " << *result.output_mismatch_offset
+       << "\n";
+  }
+  if (result.checker_error.has_value()) {
+    os << "  checker error: \"" << *result.checker_error << "\"\n";
+  }
+  if (result.resource_usage.has_value()) {
+    const ResourceUsage& usage = *result.resource_usage;
+    os << "  user cpu time: " << usage.user_cpu_time << "\n"
+       << "  system cpu time: " << usage.system_cpu_time << "\n"
+       << "  peak rss bytes: " << usage.peak_rss_bytes << "\n"
+       << "  context switches: " << usage.voluntary_context_switches
+       << " voluntary, " << usage.involuntary_context_switches
+       << " involuntary\n";
+  }
+  if (result.exit_signal.has_value()) {
+    os << "  exit signal: " << *result.exit_signal << "\n";
+  }
+  if (result.exit_code.has_value()) {
+    os << "  exit code: " << *result.exit_code << "\n";
+  }
+  if (!result.pinned_cpus.empty()) {
+    os << "  pinned cpus: " << absl::StrJoin(result.pinned_cpus, ",") << "\n";
+  }
   return os;
 }
 
@@ -205,10 +419,12 @@ std::ostream& operator<<(std::ostream& os,
 }
 
 SandboxWithOutputFds::SandboxWithOutputFds(
-    std::unique_ptr<sandbox2::Sandbox2> sandbox, int stdout_fd, int stderr_fd)
+    std::unique_ptr<sandbox2::Sandbox2> sandbox, int stdout_fd, int stderr_fd,
+    int stdin_fd)
     : sandbox_(std::move(sandbox)),
       stdout_fd_(stdout_fd),
-      stderr_fd_(stderr_fd) {}
+      stderr_fd_(stderr_fd),
+      stdin_fd_(stdin_fd) {}
 
 SandboxWithOutputFds::~SandboxWithOutputFds() {
   if (stdout_fd_ != kInvalidFd) {
@@ -217,50 +433,174 @@ SandboxWithOutputFds::~SandboxWithOutputFds() {
   if (stderr_fd_ != kInvalidFd) {
     close(stderr_fd_);
   }
+  if (stdin_fd_ != kInvalidFd) {
+    close(stdin_fd_);
+  }
+  if (gate_fd_ != kInvalidFd) {
+    close(gate_fd_);
+  }
 }
 
 SandboxWithOutputFds::SandboxWithOutputFds(SandboxWithOutputFds&& other)
-    : sandbox_(std::move(other.sandbox_)),
+    : fd_reservation_(std::move(other.fd_reservation_)),
+      sandbox_(std::move(other.sandbox_)),
       stdout_fd_(other.stdout_fd_),
       stderr_fd_(other.stderr_fd_),
+      stdin_fd_(other.stdin_fd_),
+      gate_fd_(other.gate_fd_),
       stdout_cache_(std::move(other.stdout_cache_)),
-      stderr_cache_(std::move(other.stderr_cache_)) {
+      stderr_cache_(std::move(other.stderr_cache_)),
+      pending_outputs_(std::move(other.pending_outputs_)) {
   other.stdout_fd_ = kInvalidFd;
   other.stderr_fd_ = kInvalidFd;
+  other.stdin_fd_ = kInvalidFd;
+  other.gate_fd_ = kInvalidFd;
 }
 
 SandboxWithOutputFds& SandboxWithOutputFds::operator=(
     SandboxWithOutputFds&& other) {
   sandbox_ = std::move(other.sandbox_);
+  fd_reservation_ = std::move(other.fd_reservation_);
   stdout_fd_ = other.stdout_fd_;
   stderr_fd_ = other.stderr_fd_;
+  stdin_fd_ = other.stdin_fd_;
+  gate_fd_ = other.gate_fd_;
   stdout_cache_ = std::move(other.stdout_cache_);
   stderr_cache_ = std::move(other.stderr_cache_);
+  pending_outputs_ = std::move(other.pending_outputs_);
   other.stdout_fd_ = kInvalidFd;
   other.stderr_fd_ = kInvalidFd;
+  other.stdin_fd_ = kInvalidFd;
+  other.gate_fd_ = kInvalidFd;
   return *this;
 }
 
 absl::StatusOr<std::string> SandboxWithOutputFds::Stdout() {
+  AwaitPendingOutputs();
   return UseCacheOrReadAndClose(stdout_fd_, stdout_cache_);
 }
 
 absl::StatusOr<std::string> SandboxWithOutputFds::Stderr() {
+  AwaitPendingOutputs();
   return UseCacheOrReadAndClose(stderr_fd_, stderr_cache_);
 }
 
+void SandboxWithOutputFds::DrainOutputsAsync(
+    OutputReactor::ChunkCallback on_stdout) {
+  if (pending_outputs_.valid() || stdout_cache_.has_value() ||
+      stderr_cache_.has_value()) {
+    return;
+  }
+  // The reactor takes ownership of the file descriptors.
+  pending_outputs_ = OutputReactor::Default().Drain(stdout_fd_, stderr_fd_,
+                                                    std::move(on_stdout));
+  stdout_fd_ = kInvalidFd;
+  stderr_fd_ = kInvalidFd;
+}
+
+void SandboxWithOutputFds::AwaitPendingOutputs() {
+  if (!pending_outputs_.valid()) {
+    return;
+  }
+  OutputReactor::Outputs outputs = pending_outputs_.get();
+  stdout_cache_ = std::move(outputs.stdout);
+  stderr_cache_ = std::move(outputs.stderr);
+}
+
+absl::Status SandboxWithOutputFds::WriteStdinAndClose(absl::string_view data) {
+  if (stdin_fd_ == kInvalidFd) {
+    return absl::FailedPreconditionError("File descriptor not set.");
+  }
+  // The gate is opened first, as the sandboxee only reads stdin after it.
+  absl::Status status;
+  if (gate_fd_ != kInvalidFd) {
+    status = WriteFd(gate_fd_, "\n");
+    close(gate_fd_);
+    gate_fd_ = kInvalidFd;
+  }
+  status.Update(WriteFd(stdin_fd_, data));
+  close(stdin_fd_);
+  stdin_fd_ = kInvalidFd;
+  return status;
+}
+
+int SandboxWithOutputFds::ReleaseStdinFd() {
+  const int fd = stdin_fd_;
+  stdin_fd_ = kInvalidFd;
+  return fd;
+}
+
 std::vector<std::string> CopyEnviron() {
   return sandbox2::util::CharPtrArray(environ).ToStringVector();
 }
 
-bool OutputsMatch(absl::string_view output, absl::string_view expected) {
-  std::vector<std::string> output_parts = SplitAndLowercase(output);
-  std::vector<std::string> expected_parts = SplitAndLowercase(expected);
-  if (output_parts == expected_parts) return true;
-  if (output_parts.size() != expected_parts.size()) return false;
-  return std::transform_reduce(output_parts.begin(), output_parts.end(),
-                               expected_parts.begin(), true,
-                               std::logical_and<>(), ValuesMatch);
+TokenOutputComparator::TokenOutputComparator(absl::string_view expected)
+    : TokenOutputComparator(expected, /*max_output_bytes=*/
+                            16 * static_cast<int64_t>(expected.size()) +
+                                (1 << 20)) {}
+
+TokenOutputComparator::TokenOutputComparator(absl::string_view expected,
+                                             int64_t max_output_bytes)
+    : expected_tokens_(SplitAndLowercase(expected)),
+      max_output_bytes_(max_output_bytes) {}
+
+bool TokenOutputComparator::Consume(absl::string_view chunk) {
+  for (const char c : chunk) {
+    const int64_t offset = num_consumed_bytes_++;
+    if (IsOutputWhitespace(c)) {
+      if (!partial_token_.empty() && !CompleteToken()) {
+        return false;
+      }
+      continue;
+    }
+    if (partial_token_.empty()) {
+      if (next_token_ >= expected_tokens_.size()) {
+        return Mismatch(offset);
+      }
+      partial_token_offset_ = offset;
+    }
+    partial_token_.push_back(absl::ascii_tolower(c));
+  }
+  if (num_consumed_bytes_ > max_output_bytes_) {
+    return Mismatch(max_output_bytes_);
+  }
+  return true;
+}
+
+bool TokenOutputComparator::Finish() {
+  if (mismatch_offset_ >= 0) {
+    return false;
+  }
+  if (!partial_token_.empty() && !CompleteToken()) {
+    return false;
+  }
+  if (next_token_ < expected_tokens_.size()) {
+    return Mismatch(num_consumed_bytes_);
+  }
+  return true;
+}
+
+bool TokenOutputComparator::CompleteToken() {
+  const std::string& expected = expected_tokens_[next_token_++];
+  const bool values_match = TokensMatch(partial_token_, expected);
+  if (partial_token_ != expected) {
+    identical_so_far_ = false;
+    if (!values_match) {
+      return Mismatch(partial_token_offset_);
+    }
+  } else if (!values_match && !identical_token_mismatch_offset_.has_value()) {
+    identical_token_mismatch_offset_ = partial_token_offset_;
+  }
+  partial_token_.clear();
+  if (!identical_so_far_ && identical_token_mismatch_offset_.has_value()) {
+    return Mismatch(*identical_token_mismatch_offset_);
+  }
+  return true;
+}
+
+bool TokenOutputComparator::Mismatch(int64_t offset) {
+  mismatch_offset_ = offset;
+  return false;
 }
 
 TesterSandboxer::TesterSandboxer() {
@@ -271,16 +611,58 @@ TesterSandboxer::TesterSandboxer() {
 }
 
 absl::StatusOr<SandboxWithOutputFds> TesterSandboxer::CreateSandboxWithFds(
-    const std::vector<std::string>& command, absl::string_view stdin_data,
+    const std::vector<std::string>& command,
+    std::optional<absl::string_view> stdin_data,
     const std::vector<std::string>& ro_files,
     const std::vector<std::string>& ro_dirs,
     const std::vector<std::string>& rw_dirs, const TestOptions& test_options,
-    const std::string& cwd, const std::vector<std::string>& env) const {
+    const std::string& cwd, const std::vector<std::string>& env,
+    const std::vector<int>& mapped_fds,
+    FdBudget::Reservation fd_reservation) const {
+  if (command.empty()) {
+    CloseFds(mapped_fds);
+    return absl::InvalidArgumentError("Empty command provided");
+  }
+  absl::StatusOr<std::unique_ptr<sandbox2::Policy>> policy =
+      CreatePolicy(command[0], ro_files, ro_dirs, rw_dirs);
+  if (!policy.ok()) {
+    CloseFds(mapped_fds);
+    return policy.status();
+  }
+  return CreateSandboxWithPolicy(command, stdin_data, *std::move(policy),
+                                 test_options, cwd, env, mapped_fds,
+                                 std::move(fd_reservation));
+}
+
+absl::StatusOr<SandboxWithOutputFds> TesterSandboxer::CreateSandboxWithPolicy(
+    const std::vector<std::string>& command,
+    std::optional<absl::string_view> stdin_data,
+    std::unique_ptr<sandbox2::Policy> policy, const TestOptions& test_options,
+    const std::string& cwd, const std::vector<std::string>& env,
+    const std::vector<int>& mapped_fds,
+    FdBudget::Reservation fd_reservation) const {
   if (command.empty()) {
+    CloseFds(mapped_fds);
     return absl::InvalidArgumentError("Empty command provided");
   }
+  // Waits until the file descriptors of the sandbox fit in the budget, rather
+  // than failing to create it.
+  if (fd_reservation.fds() == 0) {
+    absl::StatusOr<FdBudget::Reservation> reserved =
+        internal::ReserveSandboxFds(mapped_fds.size());
+    if (!reserved.ok()) {
+      CloseFds(mapped_fds);
+      return reserved.status();
+    }
+    fd_reservation = *std::move(reserved);
+  }
   auto executor =
       absl::make_unique<sandbox2::Executor>(command[0], command, env);
+  // MapFd takes ownership of the file descriptors.
+  for (size_t i = 0; i < mapped_fds.size(); ++i) {
+    executor->ipc()->MapFd(mapped_fds[i],
+                           STDERR_FILENO + 1 + static_cast<int>(i));
+  }
   if (!cwd.empty()) {
     executor->set_cwd(cwd);
   }
@@ -289,28 +671,29 @@ absl::StatusOr<SandboxWithOutputFds> TesterSandboxer::CreateSandboxWithFds(
       .limits()
       // Restrictions on the size of address-space of sandboxed processes, to
       // limit memory usage. Limit is set to the limit of the test + 32 MB for
-      // the interpreter / binary itself.
-      ->set_rlimit_as(sapi::sanitizers::IsAny()
+      // the interpreter / binary itself. Cgroups limit memory usage directly,
+      // for sandboxes that wait at a gate until they are moved into one.
+      ->set_rlimit_as(sapi::sanitizers::IsAny() ||
+                              test_options.cgroup.has_value()
                           ? RLIM64_INFINITY
-                          : test_options.memory_limit_bytes + (32ULL << 20))
+                          : test_options.memory_limit_bytes +
+                                kSandboxMemoryOverheadBytes)
       // Don't create core files.
       .set_rlimit_core(0)
       // Kill sandboxed processes with a signal (SIGXFSZ) if it writes more than
       // these many bytes to the file-system
       .set_rlimit_fsize(64ULL << 20)  // 64 MiB
-      .set_rlimit_cpu(std::max<int64_t>(
-          1, absl::ToInt64Seconds(test_options.max_execution_duration)));
-
-  if (!stdin_data.empty()) {
-    // We must only create the buffer if there is data, as buffers of size zero
-    // are not supported.
-    ASSIGN_OR_RETURN(std::unique_ptr<sandbox2::Buffer> input_buffer,
-                     sandbox2::Buffer::CreateWithSize(stdin_data.size()));
-    absl::c_copy(stdin_data, input_buffer->data());
-    // The dup here is very important. MapFd takes ownership of the FD in its
-    // first argument. But buffer expects to retain ownership. We get around
-    // this by duplicating the file descriptor.
-    executor->ipc()->MapFd(dup(input_buffer->fd()), STDIN_FILENO);
+      .set_rlimit_cpu(internal::CpuTimeLimitSeconds(test_options));
+
+  int stdin_fd = SandboxWithOutputFds::kInvalidFd;
+  if (!stdin_data.has_value()) {
+    stdin_fd = executor->ipc()->ReceiveFd(STDIN_FILENO);
+  } else if (!stdin_data->empty()) {
+    // The input is only copied the first time it is used. MapFd takes
+    // ownership of the returned file descriptor.
+    ASSIGN_OR_RETURN(const int input_fd,
+                     InputCache::Default().Open(*stdin_data));
+    executor->ipc()->MapFd(input_fd, STDIN_FILENO);
   } else {
     // Otherwise, we explicitly close the stdin pipe.
     const int stdout_fd = executor->ipc()->ReceiveFd(STDIN_FILENO);
@@ -320,24 +703,188 @@ absl::StatusOr<SandboxWithOutputFds> TesterSandboxer::CreateSandboxWithFds(
   const int stdout_fd = executor->ipc()->ReceiveFd(STDOUT_FILENO);
   const int stderr_fd = executor->ipc()->ReceiveFd(STDERR_FILENO);
 
-  ASSIGN_OR_RETURN(std::unique_ptr<sandbox2::Policy> policy,
-                   CreatePolicy(command[0], ro_files, ro_dirs, rw_dirs));
-  return SandboxWithOutputFds(absl::make_unique<sandbox2::Sandbox2>(
-                                  std::move(executor), std::move(policy)),
-                              stdout_fd, stderr_fd);
+  SandboxWithOutputFds sandbox_with_fds(
+      absl::make_unique<sandbox2::Sandbox2>(std::move(executor),
+                                            std::move(policy)),
+      stdout_fd, stderr_fd, stdin_fd);
+  sandbox_with_fds.set_fd_reservation(std::move(fd_reservation));
+  return sandbox_with_fds;
 }
 
-// Test makes multiple attempts to test the code. This is because our sandbox
-// uses a large number of file descriptors (especially when multiple threads are
-// running a sandbox). Because these are a global resource that are often in
-// contention (especially on testing machines), this causes occasional flakes.
-// Retrying seems to be enough to prevent these.
+// Test makes multiple attempts to test the code. Our sandboxes use a large
+// number of file descriptors, which are a global resource, so sandboxes wait
+// for them in FdBudget::Default() rather than failing to start. Retries with
+// backoff are left for the rare failures that remain, and are counted in the
+// scheduler's stats.
 absl::StatusOr<MultiTestResult> TesterSandboxer::Test(
     absl::string_view code, const std::vector<absl::string_view>& test_inputs,
     const TestOptions& test_options,
     const std::vector<absl::string_view>& expected_test_outputs,
     std::function<bool(std::string_view a, std::string_view b)> compare_outputs)
     const {
+  return TestImpl(
+      code, test_inputs, test_options, expected_test_outputs,
+      [&](int test_index, ExecutionResult& result) {
+        return compare_outputs(result.stdout,
+                               expected_test_outputs[test_index]);
+      },
+      /*comparator_factory=*/nullptr,
+      /*cancellation=*/nullptr, /*on_result=*/nullptr);
+}
+
+absl::StatusOr<MultiTestResult> TesterSandboxer::Test(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const ExpectedOutputs& expected_test_outputs) const {
+  return TestImpl(
+      code, test_inputs, test_options, expected_test_outputs.texts(),
+      [&](int test_index, ExecutionResult& result) {
+        return expected_test_outputs[test_index].Matches(result.stdout);
+      },
+      /*comparator_factory=*/nullptr,
+      /*cancellation=*/nullptr, /*on_result=*/nullptr);
+}
+
+absl::StatusOr<MultiTestResult> TesterSandboxer::Test(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    const StreamingComparatorFactory& comparator_factory) const {
+  return TestWithComparators(code, test_inputs, test_options,
+                             expected_test_outputs, comparator_factory,
+                             /*cancellation=*/nullptr, /*on_result=*/nullptr);
+}
+
+absl::StatusOr<MultiTestResult> TesterSandboxer::Test(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    const Checker& checker) const {
+  return TestWithChecker(code, test_inputs, test_options,
+                         expected_test_outputs, checker,
+                         /*cancellation=*/nullptr, /*on_result=*/nullptr);
+}
+
+TestHandle TesterSandboxer::TestAsync(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    std::function<bool(std::string_view a, std::string_view b)> compare_outputs,
+    TestResultCallback on_result) const {
+  return StartAsync([this, code = std::string(code), test_inputs, test_options,
+                     expected_test_outputs,
+                     compare_outputs = std::move(compare_outputs),
+                     on_result = std::move(on_result)](
+                        CancellationToken* cancellation) {
+    return TestImpl(
+        code, test_inputs, test_options, expected_test_outputs,
+        [&](int test_index, ExecutionResult& result) {
+          return compare_outputs(result.stdout,
+                                 expected_test_outputs[test_index]);
+        },
+        /*comparator_factory=*/nullptr, cancellation, on_result);
+  });
+}
+
+TestHandle TesterSandboxer::TestAsync(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const ExpectedOutputs& expected_test_outputs,
+    TestResultCallback on_result) const {
+  return StartAsync([this, code = std::string(code), test_inputs, test_options,
+                     &expected_test_outputs, on_result = std::move(on_result)](
+                        CancellationToken* cancellation) {
+    return TestImpl(
+        code, test_inputs, test_options, expected_test_outputs.texts(),
+        [&](int test_index, ExecutionResult& result) {
+          return expected_test_outputs[test_index].Matches(result.stdout);
+        },
+        /*comparator_factory=*/nullptr, cancellation, on_result);
+  });
+}
+
+TestHandle TesterSandboxer::TestAsync(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    StreamingComparatorFactory comparator_factory,
+    TestResultCallback on_result) const {
+  return StartAsync([this, code = std::string(code), test_inputs, test_options,
+                     expected_test_outputs,
+                     comparator_factory = std::move(comparator_factory),
+                     on_result = std::move(on_result)](
+                        CancellationToken* cancellation) {
+    return TestWithComparators(code, test_inputs, test_options,
+                               expected_test_outputs, comparator_factory,
+                               cancellation, on_result);
+  });
+}
+
+TestHandle TesterSandboxer::TestAsync(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    Checker checker, TestResultCallback on_result) const {
+  return StartAsync([this, code = std::string(code), test_inputs, test_options,
+                     expected_test_outputs, checker = std::move(checker),
+                     on_result = std::move(on_result)](
+                        CancellationToken* cancellation) {
+    return TestWithChecker(code, test_inputs, test_options,
+                           expected_test_outputs, checker, cancellation,
+                           on_result);
+  });
+}
+
+absl::StatusOr<MultiTestResult> TesterSandboxer::TestWithComparators(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    const StreamingComparatorFactory& comparator_factory,
+    CancellationToken* cancellation,
+    const TestResultCallback& on_result) const {
+  if (comparator_factory == nullptr) {
+    return absl::InvalidArgumentError("comparator_factory must be set.");
+  }
+  if (expected_test_outputs.empty() && !test_inputs.empty()) {
+    return absl::InvalidArgumentError(
+        "Streaming comparison requires expected outputs.");
+  }
+  return TestImpl(code, test_inputs, test_options, expected_test_outputs,
+                  /*output_matches=*/nullptr, comparator_factory, cancellation,
+                  on_result);
+}
+
+absl::StatusOr<MultiTestResult> TesterSandboxer::TestWithChecker(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    const Checker& checker, CancellationToken* cancellation,
+    const TestResultCallback& on_result) const {
+  if (expected_test_outputs.empty() && !test_inputs.empty()) {
+    return absl::InvalidArgumentError("Checkers require expected outputs.");
+  }
+  ASSIGN_OR_RETURN(const std::shared_ptr<const CompiledChecker> compiled,
+                   GetCompiledChecker(checker, test_options));
+  return TestImpl(
+      code, test_inputs, test_options, expected_test_outputs,
+      [&](int test_index, ExecutionResult& result) {
+        return RunChecker(*compiled, test_inputs[test_index],
+                          expected_test_outputs[test_index], test_options,
+                          result);
+      },
+      /*comparator_factory=*/nullptr, cancellation, on_result);
+}
+
+absl::StatusOr<MultiTestResult> TesterSandboxer::TestImpl(
+    absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+    const TestOptions& test_options,
+    const std::vector<absl::string_view>& expected_test_outputs,
+    const std::function<absl::StatusOr<bool>(int test_index,
+                                              ExecutionResult& result)>&
+        output_matches,
+    const StreamingComparatorFactory& comparator_factory,
+    CancellationToken* cancellation,
+    const TestResultCallback& on_result) const {
   const bool checking_outputs = !expected_test_outputs.empty();
   if (checking_outputs) {
     if (test_inputs.size() != expected_test_outputs.size()) {
@@ -352,102 +899,416 @@ absl::StatusOr<MultiTestResult> TesterSandboxer::Test(
         "stop_on_first_failure does not work if expected outputs are not "
         "provided.");
   }
+  RETURN_IF_ERROR(CheckNotInterrupted(cancellation, test_options.deadline));
   MultiTestResult multi_test_result;
-  std::unique_ptr<TempPath> temp_path = absl::make_unique<TempPath>();
-  if (!temp_path) {
-    return absl::UnknownError("Unable to create temporary directory for code.");
+  WorkspacePool* workspace_pool = test_options.workspace_pool;
+  if (workspace_pool == nullptr) {
+    ASSIGN_OR_RETURN(workspace_pool, WorkspacePool::Default());
   }
+  // Wiped and returned to the pool once testing is done.
+  ASSIGN_OR_RETURN(std::unique_ptr<WorkspacePool::Workspace> workspace,
+                   workspace_pool->Acquire());
+  ExecutionScheduler& scheduler = test_options.scheduler != nullptr
+                                      ? *test_options.scheduler
+                                      : ExecutionScheduler::Default();
   // Compile and return if unsuccessful.
   ASSIGN_OR_RETURN(multi_test_result.compilation_result, RetryIfFail([&] {
-                     return CompileCode(code, temp_path->path(),
+                     return CompileCode(code, workspace->path(),
                                         kMaxCompilationDuration);
-                   }));
+                   }, &scheduler));
+  workspace->UpdateUsage();
   if (multi_test_result.compilation_result.program_status !=
       ProgramStatus::kSuccess) {
     return multi_test_result;
   }
+  RETURN_IF_ERROR(CheckNotInterrupted(cancellation, test_options.deadline));
 
   multi_test_result.test_results.resize(test_inputs.size());
   absl::Status overall_status;
   absl::Mutex output_mutex;
-  // If we should stop on first failure, we set this on failures. We always set
-  // it on failures to execute.
-  bool should_stop = false;
+  // If we should stop on first failure, we cancel this on failures. We always
+  // cancel it on failures to execute. Cancelling it skips queued tests and
+  // kills running ones, whose results are then dropped.
+  CancellationToken stop_tests;
+  std::optional<ScopedCancellationCallback> forward_cancellation;
+  if (cancellation != nullptr) {
+    forward_cancellation.emplace(*cancellation,
+                                 [&stop_tests] { stop_tests.Cancel(); });
+  }
+
+  TestOptions recheck_options = test_options;
+  recheck_options.walltime_limit_multiplier =
+      std::min(test_options.walltime_limit_multiplier,
+               std::max(kRecheckWalltimeLimitMultiplier,
+                        1 + 2 * test_options.timeout_recheck_band));
+
+  ASSIGN_OR_RETURN(std::unique_ptr<TestRunner> test_runner,
+                   CreateTestRunner(test_options, workspace->path()));
+  std::unique_ptr<SandboxPool> sandbox_pool;
+  if (test_runner == nullptr && test_options.use_sandbox_pool) {
+    sandbox_pool = absl::make_unique<SandboxPool>(
+        [&]() -> absl::StatusOr<SandboxWithOutputFds> {
+          return CreatePooledTestSandbox(test_options, workspace->path());
+        },
+        /*capacity=*/test_options.num_threads,
+        /*expected_acquires=*/test_inputs.size(),
+        &scheduler,
+        /*memory_bytes=*/test_options.memory_limit_bytes +
+            kSandboxMemoryOverheadBytes);
+  }
 
   {
-    ThreadPool pool(test_options.num_threads);
-    pool.StartWorkers();
+    // Destroying the submission waits for all of its tests to finish.
+    std::unique_ptr<ExecutionScheduler::Submission> submission =
+        scheduler.Submit(test_options.num_threads,
+                         test_options.scheduler_weight,
+                         /*memory_bytes=*/test_options.memory_limit_bytes +
+                             kSandboxMemoryOverheadBytes);
     for (int i = 0; i < test_inputs.size(); ++i) {
-      pool.Schedule([&, i] {
-        absl::StatusOr<ExecutionResult> test_result =
-            RetryIfFail([&]() -> absl::StatusOr<ExecutionResult> {
-              {
-                absl::ReaderMutexLock l(&output_mutex);
-                if (should_stop) {
-                  return absl::CancelledError("should_stop");
-                }
+      submission->Schedule([&, i] {
+        // Rechecks always run in a fresh sandbox, so that they can be pinned.
+        auto run_test = [&](bool on_timing_cpu) {
+          return RetryIfFail([&]() -> absl::StatusOr<ExecutionResult> {
+            RETURN_IF_ERROR(
+                CheckNotInterrupted(&stop_tests, test_options.deadline));
+            // Comparators hold the state of a single run.
+            std::unique_ptr<StreamingOutputComparator> comparator;
+            if (comparator_factory != nullptr) {
+              comparator = comparator_factory(expected_test_outputs[i]);
+            }
+            if (test_runner != nullptr && !on_timing_cpu) {
+              absl::StatusOr<ExecutionResult> result =
+                  test_runner->Run(test_inputs[i], test_options, stop_tests);
+              if (result.ok() && comparator != nullptr) {
+                SetStreamingVerdict(*comparator,
+                                    !comparator->Consume(result->stdout),
+                                    *result);
               }
-              return RunCodeOnInput(test_inputs[i], test_options,
-                                    temp_path->path());
-            });
+              if (result.status().code() != absl::StatusCode::kUnavailable) {
+                return result;
+              }
+            }
+            return RunCodeOnInput(
+                test_inputs[i], on_timing_cpu ? recheck_options : test_options,
+                workspace->path(), on_timing_cpu ? nullptr : sandbox_pool.get(),
+                comparator.get(), stop_tests, on_timing_cpu);
+          }, &scheduler);
+        };
+        absl::StatusOr<ExecutionResult> test_result =
+            run_test(/*on_timing_cpu=*/false);
+        if (test_result.ok() &&
+            internal::NeedsTimeoutRecheck(test_options, *test_result)) {
+          absl::MutexLock l(&TimingCpuMutex());
+          test_result = run_test(/*on_timing_cpu=*/true);
+        }
         if (test_result.status().code() == absl::StatusCode::kCancelled) {
           return;
         }
-        absl::MutexLock l(&output_mutex);
-        overall_status.Update(test_result.status());
-        if (!test_result.ok()) {
-          // If we see a not-OK status, we are not going to return any results,
-          // so should stop immediately.
-          should_stop = true;
-        } else if (checking_outputs) {
-          const bool matches =
-              compare_outputs(test_result->stdout, expected_test_outputs[i]);
-          if (test_options.stop_on_first_failure && !matches) {
-            should_stop = true;
+        // Checkers run in sandboxes of their own, so outputs are checked
+        // before taking the lock.
+        absl::StatusOr<bool> matches = false;
+        if (test_result.ok() && checking_outputs) {
+          if (comparator_factory != nullptr) {
+            matches = *test_result->passed;
+          } else {
+            matches = output_matches(i, *test_result);
           }
-          test_result->passed = matches;
         }
-        if (test_result.ok()) {
+        {
+          absl::MutexLock l(&output_mutex);
+          overall_status.Update(test_result.status());
+          overall_status.Update(matches.status());
+          if (!test_result.ok() || !matches.ok()) {
+            // If we see a not-OK status, we are not going to return any
+            // results, so should stop immediately.
+            stop_tests.Cancel();
+            return;
+          }
+          if (checking_outputs) {
+            if (test_options.stop_on_first_failure && !*matches) {
+              stop_tests.Cancel();
+            }
+            test_result->passed = *matches;
+          }
           multi_test_result.test_results[i] = *std::move(test_result);
         }
-      });
+        // Only this task writes the result of test i.
+        if (on_result != nullptr) {
+          on_result(i, multi_test_result.test_results[i]);
+        }
+      }, /*priority=*/i < test_options.num_public_tests);
     }
   }
 
+  // Tests that were killed on cancellation are not reported in overall_status.
+  if (cancellation != nullptr && cancellation->IsCancelled()) {
+    return absl::CancelledError("Testing was cancelled.");
+  }
   RETURN_IF_ERROR(overall_status);
 
   return multi_test_result;
 }
 
+absl::StatusOr<std::unique_ptr<TestRunner>> TesterSandboxer::CreateTestRunner(
+    const TestOptions& test_options, absl::string_view temp_path) const {
+  return nullptr;
+}
+
+absl::StatusOr<SandboxWithOutputFds> TesterSandboxer::CreatePooledTestSandbox(
+    const TestOptions& test_options, absl::string_view temp_path) const {
+  return absl::UnimplementedError(
+      "This sandboxer does not support use_sandbox_pool.");
+}
+
+absl::StatusOr<SandboxWithOutputFds> TesterSandboxer::CreateCheckerSandbox(
+    const std::vector<int>& checker_fds, FdBudget::Reservation fd_reservation,
+    const TestOptions& test_options, absl::string_view temp_path) const {
+  CloseFds(checker_fds);
+  return absl::UnimplementedError("This sandboxer does not support checkers.");
+}
+
+absl::StatusOr<std::shared_ptr<const TesterSandboxer::CompiledChecker>>
+TesterSandboxer::GetCompiledChecker(const Checker& checker,
+                                    const TestOptions& test_options) const {
+  // Only checkers in the default pool are cached, as other pools may be
+  // destroyed before the cache.
+  WorkspacePool* workspace_pool = test_options.workspace_pool;
+  const bool cached = workspace_pool == nullptr;
+  if (cached) {
+    absl::MutexLock l(&checkers_mu_);
+    auto it = checker_index_.find(checker.code);
+    if (it != checker_index_.end()) {
+      checkers_.splice(checkers_.begin(), checkers_, it->second);
+      return it->second->second;
+    }
+  }
+  if (workspace_pool == nullptr) {
+    ASSIGN_OR_RETURN(workspace_pool, WorkspacePool::Default());
+  }
+  // Compiled without the lock, so that tests of other problems don't wait.
+  auto compiled = std::make_shared<CompiledChecker>();
+  ASSIGN_OR_RETURN(compiled->workspace, workspace_pool->Acquire());
+  ASSIGN_OR_RETURN(const ExecutionResult compilation_result, RetryIfFail([&] {
+                     return CompileCode(checker.code,
+                                        compiled->workspace->path(),
+                                        kMaxCompilationDuration);
+                   }));
+  compiled->workspace->UpdateUsage();
+  if (compilation_result.program_status != ProgramStatus::kSuccess) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "The checker failed to compile: ", compilation_result.stderr));
+  }
+  if (!cached) {
+    return compiled;
+  }
+  absl::MutexLock l(&checkers_mu_);
+  // If another call compiled the same checker meanwhile, its build is kept.
+  auto it = checker_index_.find(checker.code);
+  if (it != checker_index_.end()) {
+    checkers_.splice(checkers_.begin(), checkers_, it->second);
+    return it->second->second;
+  }
+  checkers_.emplace_front(checker.code, std::move(compiled));
+  checker_index_[checker.code] = checkers_.begin();
+  if (checkers_.size() > kMaxCachedCheckers) {
+    // Calls that are using the evicted checker keep it alive.
+    checker_index_.erase(checkers_.back().first);
+    checkers_.pop_back();
+  }
+  return checkers_.front().second;
+}
+
+absl::StatusOr<bool> TesterSandboxer::RunChecker(
+    const CompiledChecker& checker, absl::string_view test_input,
+    absl::string_view expected_output, const TestOptions& test_options,
+    ExecutionResult& test_result) const {
+  const absl::string_view output = test_result.stdout;
+  const TestOptions checker_options{
+      .max_execution_duration = kMaxCheckerDuration,
+      .walltime_limit_multiplier = kCheckerWalltimeLimitMultiplier,
+  };
+  ASSIGN_OR_RETURN(
+      const ExecutionResult result,
+      RetryIfFail([&]() -> absl::StatusOr<ExecutionResult> {
+        // The file descriptors are consumed by each attempt. They are
+        // reserved before they are opened.
+        ASSIGN_OR_RETURN(FdBudget::Reservation fd_reservation,
+                         internal::ReserveSandboxFds(kCheckerFds));
+        ASSIGN_OR_RETURN(const std::vector<int> checker_fds,
+                         OpenCheckerFds(test_input, output, expected_output));
+        ASSIGN_OR_RETURN(
+            SandboxWithOutputFds sandbox_with_fds,
+            CreateCheckerSandbox(checker_fds, std::move(fd_reservation),
+                                 checker_options, checker.workspace->path()));
+        if (!sandbox_with_fds.Sandbox().RunAsync()) {
+          return absl::UnknownError("Failed to run sandbox on checking.");
+        }
+        sandbox_with_fds.Sandbox().set_walltime_limit(
+            internal::WalltimeLimit(checker_options));
+        sandbox_with_fds.DrainOutputsAsync();
+        absl::StatusOr<std::string> stdout_contents = sandbox_with_fds.Stdout();
+        absl::StatusOr<std::string> stderr_contents = sandbox_with_fds.Stderr();
+        RETURN_IF_ERROR(stdout_contents.status());
+        RETURN_IF_ERROR(stderr_contents.status());
+        ExecutionResult execution_result =
+            internal::ExecutionResultFromTestSandboxResult(
+                sandbox_with_fds.Sandbox().AwaitResult());
+        execution_result.stdout = *std::move(stdout_contents);
+        execution_result.stderr = *std::move(stderr_contents);
+        return execution_result;
+      }, test_options.scheduler != nullptr ? test_options.scheduler
+                                           : &ExecutionScheduler::Default()));
+  // A checker that fails on an output rejects it, rather than failing the
+  // whole Test call.
+  absl::StatusOr<bool> verdict = internal::CheckerVerdict(result);
+  if (!verdict.ok()) {
+    test_result.checker_error = std::string(verdict.status().message());
+    return false;
+  }
+  return *verdict;
+}
+
 absl::StatusOr<ExecutionResult> TesterSandboxer::RunCodeOnInput(
     absl::string_view test_input, const TestOptions& test_options,
-    absl::string_view temp_path) const {
-  ASSIGN_OR_RETURN(SandboxWithOutputFds sandbox_with_fds,
-                   CreateTestSandbox(test_input, test_options, temp_path));
+    absl::string_view temp_path, SandboxPool* sandbox_pool,
+    StreamingOutputComparator* comparator, CancellationToken& cancellation,
+    bool on_timing_cpu) const {
+  // Created before the sandbox, so that failing to create it never leaves a
+  // sandbox running, and destroyed after it.
+  std::unique_ptr<Cgroup> cgroup;
+  if (test_options.cgroup.has_value()) {
+    ASSIGN_OR_RETURN(cgroup, Cgroup::Create(*test_options.cgroup,
+                                            test_options.memory_limit_bytes));
+  }
+  // Pooled sandboxes are already running, but wait at their gate until their
+  // input is written. Sandboxes of tests with a cgroup wait there too, since
+  // they run without RLIMIT_AS, and must not run the code before they have
+  // been moved into the cgroup. Sandboxers without gates keep RLIMIT_AS.
+  absl::StatusOr<SandboxWithOutputFds> created;
+  bool gated = true;
+  if (sandbox_pool != nullptr) {
+    created = sandbox_pool->Acquire();
+  } else if (test_options.cgroup.has_value()) {
+    created = CreatePooledTestSandbox(test_options, temp_path);
+    if (absl::IsUnimplemented(created.status())) {
+      TestOptions sandbox_options = test_options;
+      sandbox_options.cgroup.reset();
+      created = CreateTestSandbox(test_input, sandbox_options, temp_path);
+      gated = false;
+    }
+  } else {
+    created = CreateTestSandbox(test_input, test_options, temp_path);
+    gated = false;
+  }
+  ASSIGN_OR_RETURN(SandboxWithOutputFds sandbox_with_fds, std::move(created));
+  sandbox2::Sandbox2* sandbox = &sandbox_with_fds.Sandbox();
   const absl::Time start_time = absl::Now();
-  if (!sandbox_with_fds.Sandbox().RunAsync()) {
+  if (sandbox_pool == nullptr && !sandbox->RunAsync()) {
     return absl::UnknownError("Failed to run sandbox on execution.");
   }
-  // Set a wall time limit to guard against code that sleeps forever.
-  sandbox_with_fds.Sandbox().set_walltime_limit(
-      test_options.max_execution_duration * 30);
-  absl::StatusOr<std::string> stdout_contents;
-  absl::StatusOr<std::string> stderr_contents;
-  {
-    ThreadPool pool(2);
-    pool.StartWorkers();
-    pool.Schedule([&] { stdout_contents = sandbox_with_fds.Stdout(); });
-    pool.Schedule([&] { stderr_contents = sandbox_with_fds.Stderr(); });
-  }
-  RETURN_IF_ERROR(stdout_contents.status());
-  RETURN_IF_ERROR(stderr_contents.status());
-  sandbox2::Result result = sandbox_with_fds.Sandbox().AwaitResult();
+  // Set a wall time limit to guard against code that sleeps forever, and to
+  // stop at the deadline. A zero limit would disable it.
+  sandbox->set_walltime_limit(std::min(
+      internal::WalltimeLimit(test_options),
+      std::max(test_options.deadline - start_time, absl::Milliseconds(1))));
+  // From here on, the sandbox is killed on errors. Gated sandboxes would exit
+  // once their gate is closed, but ungated ones are already running the code.
+  auto kill_and_return = [sandbox](absl::Status status) {
+    sandbox->Kill();
+    sandbox->AwaitResult();
+    return status;
+  };
+  // Memory that the sandboxee used before it was moved is not counted. For
+  // gated sandboxes that is just the interpreter or binary starting up.
+  if (cgroup != nullptr) {
+    if (absl::Status status = cgroup->AddProcess(sandbox->pid());
+        !status.ok()) {
+      return kill_and_return(std::move(status));
+    }
+  }
+  const TimingCpus& timing_cpus = GetTimingCpus();
+  const ExecutionScheduler::SlotCpus* slot_cpus =
+      ExecutionScheduler::CurrentSlotCpus();
+  const cpu_set_t* pinned_cpus = nullptr;
+  if (on_timing_cpu && timing_cpus.timing_cpu >= 0) {
+    pinned_cpus = &timing_cpus.timing_set;
+  } else if (slot_cpus != nullptr) {
+    // Pinned slots are already kept off the timing CPU.
+    pinned_cpus = &slot_cpus->set;
+  } else if (test_options.timeout_recheck_band > 0 &&
+             timing_cpus.has_other_cpus) {
+    pinned_cpus = &timing_cpus.other_set;
+  }
+  if (pinned_cpus != nullptr) {
+    if (absl::Status status = SetCpuAffinity(sandbox->pid(), *pinned_cpus);
+        !status.ok()) {
+      return kill_and_return(std::move(status));
+    }
+  }
+  const ScopedCancellationCallback kill_on_cancel(
+      cancellation, [sandbox] { sandbox->Kill(); });
+  // Set on a reactor thread, and read once the outputs are complete.
+  bool diverged = false;
+  OutputReactor::ChunkCallback on_stdout;
+  if (comparator != nullptr) {
+    on_stdout = [comparator, sandbox, &diverged](absl::string_view chunk) {
+      if (!diverged && !comparator->Consume(chunk)) {
+        diverged = true;
+        sandbox->Kill();
+      }
+    };
+  }
+  sandbox_with_fds.DrainOutputsAsync(std::move(on_stdout));
+  absl::Status io_status;
+  if (gated) {
+    io_status = sandbox_with_fds.WriteStdinAndClose(test_input);
+  }
+  absl::StatusOr<std::string> stdout_contents = sandbox_with_fds.Stdout();
+  absl::StatusOr<std::string> stderr_contents = sandbox_with_fds.Stderr();
+  io_status.Update(stdout_contents.status());
+  io_status.Update(stderr_contents.status());
+  if (!io_status.ok()) {
+    return kill_and_return(std::move(io_status));
+  }
+  sandbox2::Result result = sandbox->AwaitResult();
   const absl::Time end_time = absl::Now();
+  if (cancellation.IsCancelled()) {
+    return absl::CancelledError("Test was cancelled.");
+  }
   ExecutionResult execution_result =
       internal::ExecutionResultFromTestSandboxResult(result);
+  if (execution_result.program_status == ProgramStatus::kTimeout &&
+      end_time >= test_options.deadline) {
+    return absl::DeadlineExceededError(
+        "Testing did not finish before its deadline.");
+  }
   execution_result.stdout = *std::move(stdout_contents);
   execution_result.stderr = *std::move(stderr_contents);
   execution_result.execution_duration = end_time - start_time;
+  if (cgroup != nullptr) {
+    ASSIGN_OR_RETURN(const Cgroup::Usage usage, cgroup->ReadUsage());
+    if (execution_result.resource_usage.has_value()) {
+      execution_result.resource_usage->peak_cgroup_memory_bytes =
+          usage.peak_memory_bytes;
+    }
+    if (usage.oom_kills > 0 &&
+        execution_result.program_status != ProgramStatus::kSuccess) {
+      execution_result.program_status = ProgramStatus::kMemoryLimitExceeded;
+    }
+  }
+  internal::ClassifyMemoryLimitExceeded(test_options.memory_limit_bytes,
+                                        execution_result);
+  internal::CheckCpuTime(test_options, execution_result);
+  if (pinned_cpus != nullptr) {
+    execution_result.pinned_cpus = CpusInSet(*pinned_cpus);
+  }
+  if (on_timing_cpu) {
+    absl::StrAppend(&execution_result.sandbox_result,
+                    " Rechecked on the timing CPU.");
+  }
+  if (comparator != nullptr) {
+    SetStreamingVerdict(*comparator, diverged, execution_result);
+  }
   return execution_result;
 }
 
@@ -458,8 +1319,7 @@ namespace internal {
 #define MADV_FREE 0x8
 #endif
 
-sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary,
-                                         const Mappings& mappings) {
+sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary) {
   sandbox2::PolicyBuilder builder;
 
   builder.AllowSyscall(__NR_arch_prctl);
@@ -593,6 +1453,21 @@ sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary,
   builder.AddFile("/proc/cpuinfo");
   builder.AddFile("/proc/stat");
 
+  builder.AddLibrariesForBinary(binary);
+
+  builder.AllowLlvmSanitizers();
+
+  // Disables stack traces on violations, crashes, timeouts and signals.
+  // Done to reduce the amount of unnecessary clutter in the output logs.
+  builder.CollectStacktracesOnViolation(false);
+  builder.CollectStacktracesOnSignal(false);
+  builder.CollectStacktracesOnTimeout(false);
+  builder.CollectStacktracesOnKill(false);
+
+  return builder;
+}
+
+void AddMappings(sandbox2::PolicyBuilder& builder, const Mappings& mappings) {
   std::filesystem::path cwd_path;
   {
     std::string cwd;
@@ -613,18 +1488,12 @@ sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary,
     builder.AddDirectory((cwd_path / d).string(),
                          /*is_ro=*/false);
   }
+}
 
-  builder.AddLibrariesForBinary(binary);
-
-  builder.AllowLlvmSanitizers();
-
-  // Disables stack traces on violations, crashes, timeouts and signals.
-  // Done to reduce the amount of unnecessary clutter in the output logs.
-  builder.CollectStacktracesOnViolation(false);
-  builder.CollectStacktracesOnSignal(false);
-  builder.CollectStacktracesOnTimeout(false);
-  builder.CollectStacktracesOnKill(false);
-
+sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary,
+                                         const Mappings& mappings) {
+  sandbox2::PolicyBuilder builder = CreateBasePolicy(binary);
+  AddMappings(builder, mappings);
   return builder;
 }
 
@@ -655,10 +1524,158 @@ ExecutionResult ExecutionResultFromTestSandboxResult(
   } else {
     execution_result.program_status = ProgramStatus::kFailed;
   }
+  if (sandbox_result.final_status() == sandbox2::Result::SIGNALED) {
+    execution_result.exit_signal = sandbox_result.reason_code();
+  } else if (sandbox_result.final_status() == sandbox2::Result::OK) {
+    execution_result.exit_code = sandbox_result.reason_code();
+  }
+  // The monitor's own usage would not include the sandboxee's CPU time.
+  execution_result.resource_usage =
+      ResourceUsageFromRusage(sandbox_result.GetRUsageSandboxee());
   execution_result.sandbox_result = sandbox_result.ToString();
   return execution_result;
 }
 
+ResourceUsage ResourceUsageFromRusage(const rusage& usage) {
+  ResourceUsage resource_usage;
+  resource_usage.user_cpu_time = absl::DurationFromTimeval(usage.ru_utime);
+  resource_usage.system_cpu_time = absl::DurationFromTimeval(usage.ru_stime);
+  // ru_maxrss is in KiB.
+  resource_usage.peak_rss_bytes = static_cast<int64_t>(usage.ru_maxrss) * 1024;
+  resource_usage.voluntary_context_switches = usage.ru_nvcsw;
+  resource_usage.involuntary_context_switches = usage.ru_nivcsw;
+  return resource_usage;
+}
+
+absl::StatusOr<FdBudget::Reservation> ReserveFds(int64_t num_fds) {
+  return FdBudget::Default().Acquire(num_fds, kMaxFdBudgetWait);
+}
+
+absl::StatusOr<FdBudget::Reservation> ReserveSandboxFds(
+    int64_t num_mapped_fds) {
+  return ReserveFds(kFdsPerSandbox + num_mapped_fds);
+}
+
+absl::Duration WalltimeLimit(const TestOptions& test_options) {
+  return test_options.max_execution_duration *
+         test_options.walltime_limit_multiplier;
+}
+
+int64_t CpuTimeLimitSeconds(const TestOptions& test_options) {
+  const int64_t seconds =
+      test_options.check_cpu_time
+          ? absl::ToInt64Seconds(
+                absl::Ceil(test_options.max_execution_duration,
+                           absl::Seconds(1)))
+          : absl::ToInt64Seconds(test_options.max_execution_duration);
+  return std::max<int64_t>(1, seconds);
+}
+
+void CheckCpuTime(const TestOptions& test_options, ExecutionResult& result) {
+  if (!test_options.check_cpu_time || !result.resource_usage.has_value() ||
+      result.program_status == ProgramStatus::kTimeout) {
+    return;
+  }
+  const absl::Duration cpu_time = result.resource_usage->user_cpu_time +
+                                  result.resource_usage->system_cpu_time;
+  if (cpu_time > test_options.max_execution_duration) {
+    result.program_status = ProgramStatus::kTimeout;
+    absl::StrAppend(&result.sandbox_result, " CPU time ",
+                    absl::FormatDuration(cpu_time), " exceeded the limit of ",
+                    absl::FormatDuration(test_options.max_execution_duration),
+                    ".");
+  }
+}
+
+bool NeedsTimeoutRecheck(const TestOptions& test_options,
+                         const ExecutionResult& result) {
+  // Without the sandboxee's CPU time there is no telling how close it was.
+  if (test_options.timeout_recheck_band <= 0 ||
+      !result.resource_usage.has_value()) {
+    return false;
+  }
+  if (result.program_status != ProgramStatus::kTimeout &&
+      result.program_status != ProgramStatus::kSuccess) {
+    return false;
+  }
+  // Tests that timed out far below the limit were killed by the wall time
+  // limit while sleeping or blocked, which a reserved CPU does not change.
+  const absl::Duration cpu_time = result.resource_usage->user_cpu_time +
+                                  result.resource_usage->system_cpu_time;
+  const absl::Duration band =
+      test_options.max_execution_duration * test_options.timeout_recheck_band;
+  return cpu_time >= test_options.max_execution_duration - band &&
+         cpu_time <= test_options.max_execution_duration + band;
+}
+
+void ClassifyMemoryLimitExceeded(int64_t memory_limit_bytes,
+                                 ExecutionResult& result) {
+  // Signals sent for exceeding the cpu time limit. Other signals, e.g. SIGABRT
+  // after an uncaught std::bad_alloc, may be caused by running out of memory.
+  const bool killed_for_cpu_time =
+      result.exit_signal.has_value() &&
+      (*result.exit_signal == SIGXCPU || *result.exit_signal == SIGKILL);
+  if (result.program_status != ProgramStatus::kFailed &&
+      (result.program_status != ProgramStatus::kTimeout ||
+       !result.exit_signal.has_value() || killed_for_cpu_time)) {
+    return;
+  }
+  if (!result.resource_usage.has_value()) {
+    return;
+  }
+  const int64_t peak_rss_bytes = result.resource_usage->peak_rss_bytes;
+  const bool reached_limit = peak_rss_bytes >= memory_limit_bytes;
+  const bool allocation_failed =
+      peak_rss_bytes >= memory_limit_bytes * kOutOfMemoryMinRssFraction &&
+      absl::c_any_of(kOutOfMemoryMessages, [&](absl::string_view message) {
+        return absl::StrContains(result.stderr, message);
+      });
+  if (reached_limit || allocation_failed) {
+    result.program_status = ProgramStatus::kMemoryLimitExceeded;
+  }
+}
+
+bool IsRetryableError(const absl::Status& status) {
+  switch (status.code()) {
+    // Sandboxes that fail to start or to report their results, e.g. because
+    // the process ran out of file descriptors or threads.
+    case absl::StatusCode::kUnknown:
+    case absl::StatusCode::kResourceExhausted:
+    case absl::StatusCode::kUnavailable:
+    case absl::StatusCode::kAborted:
+      return true;
+    default:
+      return false;
+  }
+}
+
+absl::StatusOr<bool> CheckerVerdict(const ExecutionResult& result) {
+  if (result.exit_code.has_value()) {
+    switch (*result.exit_code) {
+      case 0:
+        return true;
+      case 1:
+      case 2:
+        return false;
+    }
+  }
+  return absl::InternalError(
+      absl::StrCat("The checker did not exit with a verdict: ",
+                   result.sandbox_result, "\nstderr: ", result.stderr));
+}
+
+absl::Duration RetryBackoff(int retry, absl::BitGenRef gen) {
+  absl::Duration backoff = kInitialRetryBackoff;
+  for (int i = 0; i < retry && backoff < kMaxRetryBackoff; ++i) {
+    backoff *= 2;
+  }
+  backoff = std::min(backoff, kMaxRetryBackoff);
+  // Half of the backoff is random.
+  return backoff / 2 +
+         absl::Microseconds(absl::Uniform<int64_t>(
+             gen, 0, absl::ToInt64Microseconds(backoff / 2) + 1));
+}
+
 }  // namespace internal
 
 }  // namespace deepmind::code_contests
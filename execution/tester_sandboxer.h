@@ -21,26 +21,41 @@
 //   CompileCode: This should compile the code provided, and write any binaries
 //     to the temp path.
 //   CreateTestSandbox: This should create the sandbox used to test an input.
+// To support checkers, also implement CreateCheckerSandbox.
 
 #ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_TESTER_SANDBOXER_H_
 #define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_TESTER_SANDBOXER_H_
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/resource.h>
 
 #include <functional>
+#include <future>  // NOLINT(build/c++11)
 #include <iostream>
+#include <list>
 #include <memory>
 #include <optional>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
 #include "absl/status/status.h"
+#include "absl/random/bit_gen_ref.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
-#include "execution/temp_path.h"
+#include "execution/cancellation.h"
+#include "execution/cgroup.h"
+#include "execution/execution_scheduler.h"
+#include "execution/fd_budget.h"
+#include "execution/output_matcher.h"
+#include "execution/output_reactor.h"
+#include "execution/workspace_pool.h"
 #include "sandboxed_api/sandbox2/policy.h"
 #include "sandboxed_api/sandbox2/policybuilder.h"
 #include "sandboxed_api/sandbox2/result.h"
@@ -48,7 +63,28 @@
 
 namespace deepmind::code_contests {
 
-enum class ProgramStatus { kUnknown, kSuccess, kFailed, kTimeout };
+class SandboxPool;
+
+enum class ProgramStatus {
+  kUnknown,
+  kSuccess,
+  kFailed,
+  kTimeout,
+  kMemoryLimitExceeded
+};
+
+// The resources used by a program, as reported by the kernel when it exited.
+struct ResourceUsage {
+  absl::Duration user_cpu_time;
+  absl::Duration system_cpu_time;
+  int64_t peak_rss_bytes = 0;
+  int64_t voluntary_context_switches = 0;
+  int64_t involuntary_context_switches = 0;
+  // The peak memory usage of the test's cgroup, if it ran in one. Unlike
+  // peak_rss_bytes, this includes all processes of the test and the kernel
+  // memory that they use.
+  std::optional<int64_t> peak_cgroup_memory_bytes;
+};
 
 // The result of a single test execution.
 struct ExecutionResult {
@@ -66,10 +102,26 @@ struct ExecutionResult {
   // The execution's duration. Note that this does not
   // include the compilation time.
   absl::Duration execution_duration;
+  // The resources used by the execution, if known. Unlike execution_duration,
+  // the CPU times do not depend on how busy the machine is.
+  std::optional<ResourceUsage> resource_usage;
+  // The signal that terminated the program, if it was terminated by one.
+  std::optional<int> exit_signal;
+  // The exit code of the program, if it exited on its own.
+  std::optional<int> exit_code;
+  // The CPUs that the program was pinned to, or empty if it was not pinned.
+  std::vector<int> pinned_cpus;
   // A string describing the sandbox result.
   std::string sandbox_result;
   // Whether the output passed, if we are checking outputs.
   std::optional<bool> passed;
+  // If the output was checked with a StreamingOutputComparator and did not
+  // pass, the byte offset in stdout at which it stopped matching.
+  std::optional<int64_t> output_mismatch_offset;
+  // If the output was checked with a Checker that did not reach a verdict,
+  // e.g. because it crashed or timed out, what went wrong. The output did not
+  // pass then.
+  std::optional<std::string> checker_error;
 
   // Returns the equivalent of calling .ToStatus() on the sandbox result. Most
   // users will not need this functionality.
@@ -92,20 +144,73 @@ inline constexpr int64_t kDefaultMemoryLimitBytes = INT64_C(256) << 20;
 
 struct TestOptions {
   absl::Duration max_execution_duration = absl::Seconds(10);
+  // Tests are killed after this multiple of max_execution_duration of wall
+  // time, which guards against code that sleeps or blocks forever.
+  double walltime_limit_multiplier = 30;
+  // RLIMIT_CPU only has a granularity of a second. If set, it is rounded up
+  // instead of down, and tests that used more CPU time than
+  // max_execution_duration are reported as timed out, so that limits below a
+  // second or between whole seconds are enforced precisely.
+  bool check_cpu_time = false;
+  // If positive, tests that timed out or succeeded with a CPU time within
+  // this fraction of max_execution_duration are run again before their
+  // verdict is final. Reruns are run one at a time in the process, on a CPU
+  // that other tests are kept off, so that their timing does not depend on
+  // how busy the machine is, and with a wall time limit of about twice
+  // max_execution_duration, so that tests that sleep don't hold that CPU.
+  // Best combined with check_cpu_time. Tests run by a TestRunner are not kept
+  // off that CPU, but are rerun in a sandbox.
+  double timeout_recheck_band = 0;
+  // The maximum number of tests of this call that run at once. Tests of all
+  // calls share the slots of `scheduler`.
   int num_threads = 1;
+  // The first `num_public_tests` inputs are public tests. They are run ahead of
+  // the other tests of all calls, since they reject most wrong programs.
+  int num_public_tests = 0;
+  // How many turns the tests of this call get in each round of the scheduler's
+  // round-robin, relative to other calls.
+  int scheduler_weight = 1;
+  // The scheduler to run tests on. Defaults to ExecutionScheduler::Default().
+  // If its slots are pinned, tests that run in sandboxes are pinned to the
+  // CPUs of their slot. If it has a memory budget, each running test reserves
+  // memory_limit_bytes plus 32 MiB of it.
+  ExecutionScheduler* scheduler = nullptr;
   int64_t memory_limit_bytes = kDefaultMemoryLimitBytes;
+  // If set, each test runs in its own cgroup, which enforces
+  // memory_limit_bytes on the memory that the test uses instead of on its
+  // address space. Only sandboxers that implement CreatePooledTestSandbox can
+  // hold a test until it has been moved into its cgroup; tests of other
+  // sandboxers keep the limit on their address space as well. Tests with a
+  // cgroup are never run by a TestRunner (e.g. the Python fork server).
+  std::optional<CgroupOptions> cgroup;
+  // Testing stops with a DeadlineExceededError at this time, killing any tests
+  // that are still running.
+  absl::Time deadline = absl::InfiniteFuture();
   bool stop_on_first_failure = false;
+  // Whether to start test sandboxes ahead of time, so that running a test only
+  // requires attaching its input. When set, sandboxes read stdin from a pipe
+  // instead of a buffer, see SandboxPool. Only supported by sandboxers that
+  // implement CreatePooledTestSandbox.
+  bool use_sandbox_pool = false;
+  // The pool that the directories of the code and its binary, and of the
+  // checker, are taken from. Defaults to WorkspacePool::Default(). Checkers
+  // are only cached across calls in the default pool; with another pool, each
+  // call compiles its checker again.
+  WorkspacePool* workspace_pool = nullptr;
 };
 
 // A class that holds a sandbox, with (optional) file descriptors for its
 // stdout and stderr. The file descriptors are closed when they are read from,
 // or when this object is destroyed, and both stdout and stderr are cached on
-// reading, so can be read multiple times.
+// reading, so can be read multiple times. A sandbox may also hold the writing
+// end of its stdin, if the input was not known when it was created, and of its
+// gate, see set_gate_fd.
 class SandboxWithOutputFds {
  public:
   explicit SandboxWithOutputFds(std::unique_ptr<sandbox2::Sandbox2> sandbox,
                                 int stdout_fd = kInvalidFd,
-                                int stderr_fd = kInvalidFd);
+                                int stderr_fd = kInvalidFd,
+                                int stdin_fd = kInvalidFd);
   virtual ~SandboxWithOutputFds();
 
   // Disable copying.
@@ -118,24 +223,152 @@ class SandboxWithOutputFds {
 
   absl::StatusOr<std::string> Stdout();
   absl::StatusOr<std::string> Stderr();
+  // Starts reading stdout and stderr on the process-wide OutputReactor, so
+  // that the sandboxee doesn't block on full pipes while the caller does
+  // something else. Stdout() and Stderr() then wait for the outputs to be
+  // closed. `on_stdout` is called with stdout as it is read.
+  void DrainOutputsAsync(OutputReactor::ChunkCallback on_stdout = nullptr);
+  // Opens the gate, if the sandbox has one, then writes `data` to stdin and
+  // closes it. It is not an error for the sandboxee to exit without reading
+  // all of its input.
+  absl::Status WriteStdinAndClose(absl::string_view data);
+  // Returns the writing end of stdin, transferring ownership to the caller.
+  int ReleaseStdinFd();
+  // Takes ownership of `fd`, the writing end of a pipe that the sandboxee
+  // waits to read a byte from before it runs the tested code. It exits instead
+  // if the pipe is closed without one, e.g. when the sandbox is destroyed.
+  void set_gate_fd(int fd) { gate_fd_ = fd; }
+  // Holds `reservation` until the sandbox and its file descriptors are gone.
+  void set_fd_reservation(FdBudget::Reservation reservation) {
+    fd_reservation_ = std::move(reservation);
+  }
   sandbox2::Sandbox2& Sandbox() { return *sandbox_; }
 
   static constexpr int kInvalidFd = -1;
 
  private:
+  // Declared first, so that it is released last.
+  FdBudget::Reservation fd_reservation_;
   std::unique_ptr<sandbox2::Sandbox2> sandbox_;
   int stdout_fd_;
   int stderr_fd_;
+  int stdin_fd_;
+  int gate_fd_ = kInvalidFd;
   std::optional<absl::StatusOr<std::string>> stdout_cache_;
   std::optional<absl::StatusOr<std::string>> stderr_cache_;
+  // Set while the outputs are drained by the OutputReactor.
+  std::future<OutputReactor::Outputs> pending_outputs_;
+
+  void AwaitPendingOutputs();
+};
+
+// Runs tests of a single compiled program without creating a sandbox per test,
+// e.g. by forking them from a long-lived sandboxed process.
+class TestRunner {
+ public:
+  virtual ~TestRunner() = default;
+
+  // Runs the compiled program on `test_input`. Returns an UnavailableError if
+  // the test could not be run by this runner, in which case the caller runs it
+  // in a fresh sandbox instead. As for tests run in sandboxes, the program is
+  // killed and a CancelledError returned once `cancellation` is cancelled, and
+  // a DeadlineExceededError if it times out at test_options.deadline.
+  virtual absl::StatusOr<ExecutionResult> Run(
+      absl::string_view test_input, const TestOptions& test_options,
+      CancellationToken& cancellation) = 0;
 };
 
 // Returns a copy of the environment variables for the current process.
 std::vector<std::string> CopyEnviron();
 
-// Checks whether output is the same, up to whitespace and floating point
-// errors.
-bool OutputsMatch(absl::string_view output, absl::string_view expected);
+// Compares the output of a program with its expected output while the program
+// is running, so that the program can be stopped as soon as its output can no
+// longer match. A comparator is used for a single run of a program.
+class StreamingOutputComparator {
+ public:
+  virtual ~StreamingOutputComparator() = default;
+
+  // Consumes the next chunk of stdout. Returns false once the output can no
+  // longer match, after which it is not called again.
+  virtual bool Consume(absl::string_view chunk) = 0;
+  // Called at the end of the output, unless Consume returned false. Returns
+  // whether the output matches.
+  virtual bool Finish() = 0;
+  // The byte offset in the output at which it stopped matching. Only valid
+  // after Consume or Finish returned false.
+  virtual int64_t mismatch_offset() const = 0;
+};
+
+// The streaming equivalent of OutputsMatch. Output stops matching as soon as a
+// token differs, there are more tokens than expected, or it is more than
+// `max_output_bytes` long.
+class TokenOutputComparator : public StreamingOutputComparator {
+ public:
+  explicit TokenOutputComparator(absl::string_view expected);
+  TokenOutputComparator(absl::string_view expected, int64_t max_output_bytes);
+
+  bool Consume(absl::string_view chunk) override;
+  bool Finish() override;
+  int64_t mismatch_offset() const override { return mismatch_offset_; }
+
+ private:
+  // Compares the token in `partial_token_` with the next expected token.
+  bool CompleteToken();
+  bool Mismatch(int64_t offset);
+
+  std::vector<std::string> expected_tokens_;
+  int64_t max_output_bytes_;
+  int64_t num_consumed_bytes_ = 0;
+  size_t next_token_ = 0;
+  std::string partial_token_;
+  int64_t partial_token_offset_ = 0;
+  // OutputsMatch accepts identical outputs even where TokensMatch would not
+  // accept a pair of identical tokens (e.g. "nan"). Outputs with such a token
+  // only match if all tokens are identical.
+  bool identical_so_far_ = true;
+  std::optional<int64_t> identical_token_mismatch_offset_;
+  int64_t mismatch_offset_ = -1;
+};
+
+// Creates a comparator for a single test.
+using StreamingComparatorFactory =
+    std::function<std::unique_ptr<StreamingOutputComparator>(
+        absl::string_view expected_output)>;
+
+// Called with the index and the result of each test as it finishes. Tests that
+// are skipped or killed on cancellation are not reported. It may be called
+// from several threads at once.
+using TestResultCallback =
+    std::function<void(int test_index, const ExecutionResult& result)>;
+
+// A handle for tests that are run asynchronously.
+struct TestHandle {
+  TestHandle() = default;
+  TestHandle(TestHandle&&) = default;
+  // Waits for the result of this handle, if any, before taking `other`'s.
+  TestHandle& operator=(TestHandle&& other);
+  // Waits for the result, unless it has been retrieved.
+  ~TestHandle();
+
+  // Becomes ready when testing has finished or stopped.
+  std::future<absl::StatusOr<MultiTestResult>> result;
+  // Cancelling this kills running tests and skips queued ones. The result is
+  // then a CancelledError.
+  std::shared_ptr<CancellationToken> cancellation;
+};
+
+// A program that decides whether the output of a test is correct, for problems
+// that accept more than one output. It is written in the language of the
+// TesterSandboxer that runs it, and reads the input of the test from file
+// descriptor 3, the output of the tested program from 4, and the expected
+// output from 5. It accepts the output by exiting with 0, and rejects it by
+// exiting with 1 or 2. Anything else, such as crashing, timing out or exiting
+// with another code, rejects the output too, and is reported in the
+// checker_error of the test's result. Only failing to compile the checker, or
+// to run it at all, makes Test return an error.
+struct Checker {
+  std::string code;
+};
 
 // The TesterSandboxer class can execute tests with any suitable sandboxees.
 //
@@ -165,15 +398,92 @@ class TesterSandboxer {
       const std::vector<absl::string_view>& expected_test_outputs = {},
       std::function<bool(std::string_view a, std::string_view b)>
           compare_outputs = OutputsMatch) const;
+  // As above, but outputs are compared with OutputsMatch, against expected
+  // outputs that were compiled once, e.g. for all programs of a problem.
+  absl::StatusOr<MultiTestResult> Test(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const ExpectedOutputs& expected_test_outputs) const;
+  // As the first version of Test, but each test's stdout is checked by a
+  // comparator from `comparator_factory` while the test runs. A test whose
+  // output stops matching before it is complete is killed and reported as
+  // failed, even if it would have timed out. Tests that are run by a
+  // TestRunner are compared in the same way, but only after they finish.
+  absl::StatusOr<MultiTestResult> Test(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      const StreamingComparatorFactory& comparator_factory) const;
+  // As the first version of Test, but outputs are judged by `checker`, which
+  // runs in a sandbox right after each test, in the test's scheduler slot. The
+  // checker is compiled once and cached by its code, for as long as this
+  // object exists. An error is returned if it does not compile.
+  absl::StatusOr<MultiTestResult> Test(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      const Checker& checker) const;
+  // As the first version of Test, but returns right away. `on_result` is
+  // called as each test finishes. This object and the data viewed by
+  // `test_inputs` and `expected_test_outputs` must stay alive until the result
+  // is ready. Calls are run by a fixed number of threads shared by the
+  // process, and wait for one to become free, so `on_result` must not wait
+  // for the results of other calls.
+  TestHandle TestAsync(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options = TestOptions(),
+      const std::vector<absl::string_view>& expected_test_outputs = {},
+      std::function<bool(std::string_view a, std::string_view b)>
+          compare_outputs = OutputsMatch,
+      TestResultCallback on_result = nullptr) const;
+  // Asynchronous versions of the other versions of Test, as above. Errors
+  // that Test would return, e.g. for a checker that does not compile, are
+  // returned through the handle.
+  TestHandle TestAsync(absl::string_view code,
+                       const std::vector<absl::string_view>& test_inputs,
+                       const TestOptions& test_options,
+                       const ExpectedOutputs& expected_test_outputs,
+                       TestResultCallback on_result = nullptr) const;
+  TestHandle TestAsync(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      StreamingComparatorFactory comparator_factory,
+      TestResultCallback on_result = nullptr) const;
+  TestHandle TestAsync(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      Checker checker, TestResultCallback on_result = nullptr) const;
 
  protected:
+  // `mapped_fds` become file descriptors 3, 4, ... of the sandboxee. The
+  // sandbox takes ownership of them, even if it is not created. If
+  // `stdin_data` is not set, the returned object keeps the writing end of the
+  // sandboxee's stdin. `fd_reservation` covers the file descriptors of the
+  // sandbox, including `mapped_fds`, which callers reserve with
+  // internal::ReserveSandboxFds before opening them. If it is empty, the
+  // sandbox reserves its file descriptors itself.
   absl::StatusOr<SandboxWithOutputFds> CreateSandboxWithFds(
-      const std::vector<std::string>& command, absl::string_view stdin_data,
+      const std::vector<std::string>& command,
+      std::optional<absl::string_view> stdin_data,
       const std::vector<std::string>& ro_files,
       const std::vector<std::string>& ro_dirs,
       const std::vector<std::string>& rw_dirs, const TestOptions& test_options,
       const std::string& cwd = "",
-      const std::vector<std::string>& env = CopyEnviron()) const;
+      const std::vector<std::string>& env = CopyEnviron(),
+      const std::vector<int>& mapped_fds = {},
+      FdBudget::Reservation fd_reservation = {}) const;
+  // As above, but with an explicit policy. If `stdin_data` is not set, the
+  // returned object keeps the writing end of the sandboxee's stdin.
+  absl::StatusOr<SandboxWithOutputFds> CreateSandboxWithPolicy(
+      const std::vector<std::string>& command,
+      std::optional<absl::string_view> stdin_data,
+      std::unique_ptr<sandbox2::Policy> policy, const TestOptions& test_options,
+      const std::string& cwd = "",
+      const std::vector<std::string>& env = CopyEnviron(),
+      const std::vector<int>& mapped_fds = {},
+      FdBudget::Reservation fd_reservation = {}) const;
   // Compiles `code`, writing output (such as a binary) to `temp_path`.
   virtual absl::StatusOr<ExecutionResult> CompileCode(
       absl::string_view code, absl::string_view temp_path,
@@ -183,18 +493,101 @@ class TesterSandboxer {
   virtual absl::StatusOr<SandboxWithOutputFds> CreateTestSandbox(
       absl::string_view test_input, const TestOptions& test_options,
       absl::string_view temp_path) const = 0;
+  // As CreateTestSandbox, but for a SandboxPool: the sandbox reads stdin from
+  // a pipe, and has a gate (see SandboxWithOutputFds::set_gate_fd) that it
+  // waits at before it runs the code, so that it can be started before its
+  // test. Not supported by default.
+  virtual absl::StatusOr<SandboxWithOutputFds> CreatePooledTestSandbox(
+      const TestOptions& test_options, absl::string_view temp_path) const;
   // Returns a policy for sandboxes. These should have permission to read the
   // code and binary, as well as read-write access to `temp_path`.
   virtual absl::StatusOr<std::unique_ptr<sandbox2::Policy>> CreatePolicy(
       absl::string_view binary_path, const std::vector<std::string>& ro_files,
       const std::vector<std::string>& ro_dirs,
       const std::vector<std::string>& rw_dirs) const = 0;
+  // Optionally returns a runner for the previously compiled code, to be used
+  // instead of CreateTestSandbox. Returns nullptr by default. Runners must
+  // enforce all of `test_options`, so sandboxers return nullptr for options
+  // that their runner does not support.
+  virtual absl::StatusOr<std::unique_ptr<TestRunner>> CreateTestRunner(
+      const TestOptions& test_options, absl::string_view temp_path) const;
+  // Creates a sandbox for running a checker that was compiled in
+  // `temp_path`, with `checker_fds` mapped as described for Checker. The
+  // sandbox takes ownership of them, even if it is not created, and of
+  // `fd_reservation`, which covers them and the sandbox. Checkers are not
+  // supported by default.
+  virtual absl::StatusOr<SandboxWithOutputFds> CreateCheckerSandbox(
+      const std::vector<int>& checker_fds, FdBudget::Reservation fd_reservation,
+      const TestOptions& test_options, absl::string_view temp_path) const;
 
  private:
-  // Runs the previously compiled code on `test_input`.
+  // The cached build of a checker.
+  struct CompiledChecker {
+    std::unique_ptr<WorkspacePool::Workspace> workspace;
+  };
+
+  // Returns the build of `checker`, compiling it into the workspace pool of
+  // `test_options` if it is not cached.
+  absl::StatusOr<std::shared_ptr<const CompiledChecker>> GetCompiledChecker(
+      const Checker& checker, const TestOptions& test_options) const;
+  // Returns whether `checker` accepts the output of `test_result` for the
+  // test. If the checker does not reach a verdict, the output is rejected and
+  // the checker_error of `test_result` is set.
+  absl::StatusOr<bool> RunChecker(const CompiledChecker& checker,
+                                  absl::string_view test_input,
+                                  absl::string_view expected_output,
+                                  const TestOptions& test_options,
+                                  ExecutionResult& test_result) const;
+
+  // Implement the streaming and checker versions of Test and TestAsync.
+  absl::StatusOr<MultiTestResult> TestWithComparators(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      const StreamingComparatorFactory& comparator_factory,
+      CancellationToken* cancellation,
+      const TestResultCallback& on_result) const;
+  absl::StatusOr<MultiTestResult> TestWithChecker(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      const Checker& checker, CancellationToken* cancellation,
+      const TestResultCallback& on_result) const;
+
+  // Implements all versions of Test; exactly one of `output_matches` and
+  // `comparator_factory` is set if expected outputs are provided.
+  // `output_matches` is called with the index of a test and its result, which
+  // it may annotate. Both `cancellation` and `on_result` are optional.
+  absl::StatusOr<MultiTestResult> TestImpl(
+      absl::string_view code, const std::vector<absl::string_view>& test_inputs,
+      const TestOptions& test_options,
+      const std::vector<absl::string_view>& expected_test_outputs,
+      const std::function<absl::StatusOr<bool>(int test_index,
+                                                ExecutionResult& result)>&
+          output_matches,
+      const StreamingComparatorFactory& comparator_factory,
+      CancellationToken* cancellation,
+      const TestResultCallback& on_result) const;
+  // Runs the previously compiled code on `test_input`. If `sandbox_pool` is
+  // provided, the sandbox is taken from it instead of being created. If
+  // `comparator` is provided, stdout is checked with it while the code runs.
+  // The sandbox is killed if `cancellation` is cancelled. If
+  // `on_timing_cpu` is set, the code runs on the CPU reserved for rechecking
+  // timeouts, which only one test may use at a time.
   absl::StatusOr<ExecutionResult> RunCodeOnInput(
       absl::string_view test_input, const TestOptions& test_options,
-      absl::string_view temp_path) const;
+      absl::string_view temp_path, SandboxPool* sandbox_pool,
+      StreamingOutputComparator* comparator, CancellationToken& cancellation,
+      bool on_timing_cpu) const;
+
+  using CheckerEntry =
+      std::pair<std::string, std::shared_ptr<const CompiledChecker>>;
+
+  mutable absl::Mutex checkers_mu_;
+  // Keyed by the code of the checker, most recently used first.
+  mutable std::list<CheckerEntry> checkers_ ABSL_GUARDED_BY(checkers_mu_);
+  mutable absl::flat_hash_map<std::string, std::list<CheckerEntry>::iterator>
+      checker_index_ ABSL_GUARDED_BY(checkers_mu_);
 };
 
 namespace internal {
@@ -210,6 +603,11 @@ struct Mappings {
 sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary,
                                          const Mappings& mappings);
 
+// The parts of CreateBasePolicy that do and don't depend on the mappings, so
+// that the latter can be cached across programs run by the same binary.
+sandbox2::PolicyBuilder CreateBasePolicy(absl::string_view binary);
+void AddMappings(sandbox2::PolicyBuilder& builder, const Mappings& mappings);
+
 // These are useful helper functions for filling in test results.
 
 // Converts a sandbox result from a compilation into a ExecutionResult struct.
@@ -220,6 +618,54 @@ ExecutionResult ExecutionResultFromCompilationSandboxResult(
 ExecutionResult ExecutionResultFromTestSandboxResult(
     const sandbox2::Result& sandbox_result);
 
+ResourceUsage ResourceUsageFromRusage(const rusage& usage);
+
+// Reserves `num_fds` file descriptors of FdBudget::Default(), waiting for them
+// as long as creating a sandbox does.
+absl::StatusOr<FdBudget::Reservation> ReserveFds(int64_t num_fds);
+// Reserves the file descriptors that a sandbox holds in this process, and
+// `num_mapped_fds` more that its creator opens for it, e.g. to map them into
+// the sandboxee. They are reserved before they are opened, so that opening
+// them never exceeds the budget.
+absl::StatusOr<FdBudget::Reservation> ReserveSandboxFds(
+    int64_t num_mapped_fds);
+
+// The limits that tests are run with.
+absl::Duration WalltimeLimit(const TestOptions& test_options);
+int64_t CpuTimeLimitSeconds(const TestOptions& test_options);
+
+// Changes the status of a test to kTimeout if check_cpu_time is set and the
+// test used more CPU time than max_execution_duration.
+void CheckCpuTime(const TestOptions& test_options, ExecutionResult& result);
+
+// Returns whether a test should be run again on the reserved CPU, because
+// timeout_recheck_band is set and its verdict may depend on contention: it
+// timed out or succeeded with a CPU time of the sandboxee within the band
+// around max_execution_duration.
+bool NeedsTimeoutRecheck(const TestOptions& test_options,
+                         const ExecutionResult& result);
+
+// Changes the status of a test that did not succeed to kMemoryLimitExceeded if
+// its peak RSS reached `memory_limit_bytes`, or reached a quarter of it and
+// its stderr shows that it failed to allocate memory. Must be called once
+// stderr and resource_usage are set.
+void ClassifyMemoryLimitExceeded(int64_t memory_limit_bytes,
+                                 ExecutionResult& result);
+
+// Returns whether a failure to run a test may go away if the test is run
+// again, such as a sandbox that failed to start. Other failures, e.g. invalid
+// arguments, are returned right away.
+bool IsRetryableError(const absl::Status& status);
+
+// Returns whether a checker that exited with `result` accepted the output, or
+// an error if it did not exit with 0, 1 or 2.
+absl::StatusOr<bool> CheckerVerdict(const ExecutionResult& result);
+
+// Returns how long to wait before retry number `retry` (from 0): 2 ms doubling
+// up to 100 ms, of which the upper half is random, so that tests that failed
+// together don't retry together.
+absl::Duration RetryBackoff(int retry, absl::BitGenRef gen);
+
 inline bool GetCurrentWorkingDirectory(std::string* s) {
   constexpr size_t len = 1ul << 16;
   auto buffer = absl::make_unique<char[]>(len);
@@ -14,15 +14,23 @@
 
 #include "execution/tester_sandboxer.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <memory>
 #include <optional>
 #include <ostream>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <tuple>
 #include <type_traits>
 #include <utility>
@@ -33,26 +41,49 @@
 #include "absl/algorithm/container.h"
 #include "absl/base/log_severity.h"
 #include "absl/flags/flag.h"
+#include "absl/random/random.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/ascii.h"
 #include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/synchronization/notification.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
+#include "contest_problem.pb.h"
+#include "execution/concurrency_controller.h"
+#include "execution/cpu_affinity.h"
+#include "execution/dataset_image.h"
+#include "execution/dataset_index.h"
+#include "execution/execution_scheduler.h"
+#include "execution/fd_budget.h"
+#include "execution/input_cache.h"
+#include "execution/output_matcher.h"
+#include "execution/policy_cache.h"
+#include "execution/problem_limits.h"
 #include "execution/py_locations.h"
 #include "execution/py_tester_sandboxer.h"
 #include "execution/status_macros.h"
 #include "execution/status_matchers.h"
+#include "execution/timeout_calibrator.h"
+#include "execution/work_stealing_pool.h"
+#include "execution/workspace_pool.h"
+#include "riegeli/bytes/fd_writer.h"
+#include "riegeli/records/record_writer.h"
 #include "sandboxed_api/sandbox2/sandbox2.h"
 #include "execution/simple_threadpool.h"
 
 ABSL_FLAG(bool, test_py2, false,
           "Whether to test python2. Requires a working python2 binary to be "
           "installed.");
+ABSL_FLAG(std::string, cgroup_parent, "",
+          "A cgroup v2 to create test cgroups in, to test running tests in "
+          "cgroups. Requires the memory, pids and cpu controllers to be "
+          "enabled for its children.");
 
 namespace deepmind::code_contests {
 namespace {
@@ -78,6 +109,11 @@ MATCHER_P(HasStderr, value, "") { return arg.stderr == value; }
 MATCHER_P(HasStderrSubstring, value, "") {
   return absl::StrContains(arg.stderr, value);
 }
+MATCHER_P(HasPassed, value, "") { return arg.passed == value; }
+MATCHER_P(HasExitCode, value, "") { return arg.exit_code == value; }
+MATCHER_P(HasOutputMismatchOffset, value, "") {
+  return arg.output_mismatch_offset == value;
+}
 MATCHER_P2(HasDurationBetween, low, high, "") {
   return low < arg.execution_duration && arg.execution_duration < high;
 }
@@ -117,6 +153,8 @@ struct LanguageTestParams {
   std::string loops_forever;
   // A program that sleeps for two seconds.
   std::string sleeps_2_seconds;
+  // A program that exits after using about 0.6 seconds of CPU time.
+  std::string uses_600ms_of_cpu;
   // A program that contains unicode.
   std::string has_unicode;
   // A program that attempts to chdir to /tmp.
@@ -142,6 +180,8 @@ std::ostream& operator<<(std::ostream& os, const LanguageTestParams& params) {
      << params.loops_forever << "\n\n"
      << "sleeps_2_seconds:\n"
      << params.sleeps_2_seconds << "\n\n"
+     << "uses_600ms_of_cpu:\n"
+     << params.uses_600ms_of_cpu << "\n\n"
      << "has_unicode:\n"
      << params.has_unicode << "\n\n"
      << "does_chdir:\n"
@@ -188,6 +228,11 @@ while True:
   x += math.sin(x)
 )py",
       .sleeps_2_seconds = "import time; time.sleep(2)",
+      .uses_600ms_of_cpu = R"py(
+import os
+while sum(os.times()[:2]) < 0.6:
+  pass
+)py",
       .has_unicode = "print('money')  # £££££",
       .does_chdir = "import os; os.chdir('/tmp')",
   };
@@ -203,7 +248,15 @@ while True:
   py2.hello = "print 'hello'";
   py2.has_unicode = "print 'money'   # £££££";
 
-  std::vector<LanguageTestParams> params = {py3};
+  // Py3 run from a fork server should behave exactly like Py3.
+  LanguageTestParams py3_fork_server = py3;
+  py3_fork_server.name = "py3_fork_server";
+  py3_fork_server.init = []() {
+    return std::make_unique<Py3TesterSandboxer>(
+        Py3InterpreterPath(), Py3LibraryPaths(), PyExecutionMode::kForkServer);
+  };
+
+  std::vector<LanguageTestParams> params = {py3, py3_fork_server};
   if (absl::GetFlag(FLAGS_test_py2)) {
     params.push_back(py2);
   }
@@ -223,8 +276,8 @@ TEST_P(TesterSandboxerLanguageTest, RunsHelloWorldTest) {
   EXPECT_THAT(
       tester_sandboxer->Test(params.hello, {""}),
       IsOkAndHolds(TestResultsMatches(ElementsAre(AllOf(
-          HasProgramStatus(ProgramStatus::kSuccess), HasStdout("hello\n"),
-          HasStderr(""),
+          HasProgramStatus(ProgramStatus::kSuccess), HasExitCode(0),
+          HasStdout("hello\n"), HasStderr(""),
           HasDurationBetween(absl::ZeroDuration(), absl::Seconds(10)))))));
 }
 
@@ -284,7 +337,8 @@ TEST_P(TesterSandboxerLanguageTest, FailsIfCodeAsserts) {
   std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
   EXPECT_THAT(tester_sandboxer->Test(params.asserts, {""}),
               IsOkAndHolds(TestResultsMatches(ElementsAre(AllOf(
-                  HasProgramStatus(ProgramStatus::kFailed), HasStdout(""))))));
+                  HasProgramStatus(ProgramStatus::kFailed), HasExitCode(1),
+                  HasStdout(""))))));
 }
 
 TEST_P(TesterSandboxerLanguageTest, CanExecuteInParallel) {
@@ -311,6 +365,55 @@ TEST_P(TesterSandboxerLanguageTest, CanExecuteInParallel) {
   }
 }
 
+TEST_P(TesterSandboxerLanguageTest, SharesSchedulerBetweenTestCalls) {
+  constexpr int kNumCalls = 4;
+  ExecutionScheduler scheduler(/*num_slots=*/2);
+  TestOptions options;
+  options.num_threads = 2;
+  options.num_public_tests = 1;
+  options.scheduler = &scheduler;
+  std::vector<absl::StatusOr<MultiTestResult>> results;
+  absl::Mutex mu;
+  {
+    ThreadPool pool(kNumCalls);
+    pool.StartWorkers();
+    for (int i = 0; i < kNumCalls; ++i) {
+      pool.Schedule([&] {
+        const LanguageTestParams& params = GetParam();
+        auto result = params.init()->Test(params.hello, {"", "", ""}, options);
+        absl::MutexLock l(&mu);
+        results.push_back(std::move(result));
+      });
+    }
+  }
+  ASSERT_THAT(results, testing::SizeIs(kNumCalls));
+  for (const absl::StatusOr<MultiTestResult>& result : results) {
+    ASSERT_THAT(result, IsOkAndHolds(TestResultsMatches(
+                            Each(HasProgramStatus(ProgramStatus::kSuccess)))));
+  }
+  const ExecutionScheduler::Stats stats = scheduler.stats();
+  EXPECT_EQ(stats.num_started, 3 * kNumCalls);
+  EXPECT_EQ(stats.queue_depth, 0);
+  EXPECT_EQ(stats.num_submissions, 0);
+}
+
+TEST_P(TesterSandboxerLanguageTest, PinsSandboxesToSlotCpus) {
+  ExecutionScheduler scheduler(/*num_slots=*/2, /*cpus_per_slot=*/1);
+  ASSERT_THAT(scheduler.slot_cpus(), SizeIs(2));
+  TestOptions options;
+  options.num_threads = 2;
+  options.scheduler = &scheduler;
+  const LanguageTestParams& params = GetParam();
+  ASSERT_OK_AND_ASSIGN(MultiTestResult result,
+                       params.init()->Test(params.hello, {"", ""}, options));
+  for (const ExecutionResult& test_result : result.test_results) {
+    EXPECT_EQ(test_result.program_status, ProgramStatus::kSuccess);
+    EXPECT_THAT(test_result.pinned_cpus,
+                testing::AnyOf(ElementsAre(scheduler.slot_cpus()[0].cpus[0]),
+                               ElementsAre(scheduler.slot_cpus()[1].cpus[0])));
+  }
+}
+
 // This test is about parallelising within a single test call.
 TEST_P(TesterSandboxerLanguageTest, CanTestInParallel) {
   const LanguageTestParams& params = GetParam();
@@ -327,6 +430,53 @@ TEST_P(TesterSandboxerLanguageTest, CanTestInParallel) {
           AllOf(SizeIs(8), Each(HasProgramStatus(ProgramStatus::kTimeout))))));
 }
 
+TEST_P(TesterSandboxerLanguageTest, CanTestInParallelWithSandboxPool) {
+  const LanguageTestParams& params = GetParam();
+  absl::string_view null_string = "";
+  std::vector<absl::string_view> many_inputs(8, null_string);
+  TestOptions options;
+  options.num_threads = 4;
+  options.max_execution_duration = absl::Seconds(2);
+  options.use_sandbox_pool = true;
+  const auto result =
+      params.init()->Test(params.loops_forever, many_inputs, options);
+  ASSERT_THAT(
+      result,
+      IsOkAndHolds(TestResultsMatches(
+          AllOf(SizeIs(8), Each(HasProgramStatus(ProgramStatus::kTimeout))))));
+}
+
+TEST_P(TesterSandboxerLanguageTest, RunsCatTestWithSandboxPool) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.num_threads = 2;
+  options.use_sandbox_pool = true;
+  const std::string long_string = CreateLargeInput();
+  EXPECT_THAT(
+      tester_sandboxer->Test(params.cat, {"hello", "", long_string}, options),
+      IsOkAndHolds(TestResultsMatches(ElementsAre(
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess), HasStdout("hello")),
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess), HasStdout("")),
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess),
+                HasStdout(long_string))))));
+}
+
+TEST_P(TesterSandboxerLanguageTest, RunsCatTestOnSharedInputs) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.num_threads = 4;
+  const std::string long_string = CreateLargeInput();
+  const std::vector<absl::string_view> inputs(8, long_string);
+  const InputCache::Stats before = InputCache::Default().stats();
+  EXPECT_THAT(tester_sandboxer->Test(params.cat, inputs, options),
+              IsOkAndHolds(TestResultsMatches(
+                  AllOf(SizeIs(8), Each(HasStdout(long_string))))));
+  // Each sandbox reads the input from the start, although they share a memfd.
+  EXPECT_GE(InputCache::Default().stats().hits - before.hits, 7);
+}
+
 TEST_P(TesterSandboxerLanguageTest, HandlesTimeout) {
   const LanguageTestParams& params = GetParam();
   std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
@@ -337,6 +487,105 @@ TEST_P(TesterSandboxerLanguageTest, HandlesTimeout) {
                   ElementsAre(HasProgramStatus(ProgramStatus::kTimeout)))));
 }
 
+TEST_P(TesterSandboxerLanguageTest, TestAsyncReportsEachResult) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.num_threads = 2;
+  const std::vector<absl::string_view> inputs = {"a", "b", "c"};
+  absl::Mutex mu;
+  std::vector<std::pair<int, std::string>> reported;
+  TestHandle handle = tester_sandboxer->TestAsync(
+      params.cat, inputs, options, /*expected_test_outputs=*/{"a", "x", "c"},
+      OutputsMatch, [&](int test_index, const ExecutionResult& result) {
+        absl::MutexLock l(&mu);
+        reported.emplace_back(test_index, result.stdout);
+      });
+  EXPECT_THAT(handle.result.get(),
+              IsOkAndHolds(TestResultsMatches(ElementsAre(
+                  HasPassed(true), HasPassed(false), HasPassed(true)))));
+  EXPECT_THAT(reported, testing::UnorderedElementsAre(
+                            testing::Pair(0, "a"), testing::Pair(1, "b"),
+                            testing::Pair(2, "c")));
+}
+
+TEST_P(TesterSandboxerLanguageTest, TestAsyncCancelKillsRunningTests) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.num_threads = 2;
+  options.max_execution_duration = absl::Seconds(10);
+  const std::vector<absl::string_view> inputs(4, "");
+  const absl::Time start = absl::Now();
+  TestHandle handle =
+      tester_sandboxer->TestAsync(params.loops_forever, inputs, options);
+  absl::SleepFor(absl::Seconds(1));
+  handle.cancellation->Cancel();
+  EXPECT_THAT(handle.result.get(), StatusIs(absl::StatusCode::kCancelled));
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+}
+
+TEST_P(TesterSandboxerLanguageTest, StopsAtDeadline) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.num_threads = 2;
+  options.max_execution_duration = absl::Seconds(10);
+  options.deadline = absl::Now() + absl::Seconds(2);
+  const std::vector<absl::string_view> inputs(4, "");
+  EXPECT_THAT(tester_sandboxer->Test(params.loops_forever, inputs, options),
+              StatusIs(absl::StatusCode::kDeadlineExceeded));
+  EXPECT_LT(absl::Now() - options.deadline, absl::Seconds(3));
+}
+
+TEST_P(TesterSandboxerLanguageTest, ReportsResourceUsage) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  ASSERT_OK_AND_ASSIGN(MultiTestResult result,
+                       tester_sandboxer->Test(params.hello, {""}));
+  ASSERT_THAT(result.test_results, SizeIs(1));
+  const ExecutionResult& test_result = result.test_results[0];
+  ASSERT_TRUE(test_result.resource_usage.has_value());
+  EXPECT_GT(test_result.resource_usage->peak_rss_bytes, 0);
+  EXPECT_FALSE(test_result.exit_signal.has_value());
+}
+
+TEST_P(TesterSandboxerLanguageTest, ReportsCpuTimeOfTheProgram) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.max_execution_duration = absl::Seconds(1);
+  ASSERT_OK_AND_ASSIGN(
+      MultiTestResult result,
+      tester_sandboxer->Test(params.loops_forever, {""}, options));
+  ASSERT_THAT(result.test_results, SizeIs(1));
+  const std::optional<ResourceUsage>& usage =
+      result.test_results[0].resource_usage;
+  ASSERT_TRUE(usage.has_value());
+  EXPECT_GT(usage->user_cpu_time + usage->system_cpu_time,
+            absl::Milliseconds(100));
+}
+
+TEST_P(TesterSandboxerLanguageTest, HandlesSubSecondTimeout) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  TestOptions options;
+  options.max_execution_duration = absl::Milliseconds(500);
+  options.walltime_limit_multiplier = 2;
+  options.check_cpu_time = true;
+  // The program finishes before the whole-second RLIMIT_CPU kills it, so only
+  // checking its CPU time catches it.
+  EXPECT_THAT(tester_sandboxer->Test(params.uses_600ms_of_cpu, {""}, options),
+              IsOkAndHolds(TestResultsMatches(ElementsAre(AllOf(
+                  HasProgramStatus(ProgramStatus::kTimeout),
+                  HasDurationBetween(absl::ZeroDuration(),
+                                     absl::Seconds(3)))))));
+  options.max_execution_duration = absl::Seconds(2);
+  EXPECT_THAT(tester_sandboxer->Test(params.uses_600ms_of_cpu, {""}, options),
+              IsOkAndHolds(TestResultsMatches(
+                  ElementsAre(HasProgramStatus(ProgramStatus::kSuccess)))));
+}
+
 TEST_P(TesterSandboxerLanguageTest, DurationSetCorrectly) {
   const LanguageTestParams& params = GetParam();
   std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
@@ -458,6 +707,24 @@ TEST_P(TesterSandboxerLanguageTest, ExpectedOutputsStopOnFirstFailure) {
       1);
 }
 
+TEST_P(TesterSandboxerLanguageTest, ExpectedOutputsWithStreamingComparator) {
+  const LanguageTestParams& params = GetParam();
+  std::unique_ptr<TesterSandboxer> tester_sandboxer = params.init();
+  const std::string long_string = CreateLargeInput();
+  EXPECT_THAT(
+      tester_sandboxer->Test(
+          params.cat, {"Hello 1.0", "hello 2", long_string, "a b"},
+          TestOptions(), {"hello\n1", "hello 3", long_string, "a"},
+          [](absl::string_view expected) {
+            return std::make_unique<TokenOutputComparator>(expected);
+          }),
+      IsOkAndHolds(TestResultsMatches(ElementsAre(
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess), HasPassed(true)),
+          AllOf(HasPassed(false), HasOutputMismatchOffset(6)),
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess), HasPassed(true)),
+          AllOf(HasPassed(false), HasOutputMismatchOffset(2))))));
+}
+
 // Below are all tests that are specific to a language, so cannot be included in
 // the parameterized test.
 
@@ -505,6 +772,404 @@ sys.stdout.write(input())
                   ElementsAre(HasProgramStatus(ProgramStatus::kFailed)))));
 }
 
+TEST(TesterSandboxerTest, Py3PooledSandboxesWaitForTheirTests) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  // Takes long enough that the sandbox of the second test is started while
+  // the first test runs.
+  std::string program = R"py(import time
+print(time.time())
+time.sleep(0.5)
+)py";
+  TestOptions options;
+  options.num_threads = 1;
+  options.use_sandbox_pool = true;
+  ASSERT_OK_AND_ASSIGN(MultiTestResult result,
+                       tester_sandboxer->Test(program, {"", ""}, options));
+  ASSERT_THAT(result.test_results, SizeIs(2));
+  double start_times[2];
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_TRUE(absl::SimpleAtod(
+        absl::StripAsciiWhitespace(result.test_results[i].stdout),
+        &start_times[i]));
+  }
+  // The code of the second test only runs once the first test has finished.
+  EXPECT_GE(start_times[1] - start_times[0], 0.5);
+}
+
+TEST(TesterSandboxerTest, Py3ForkServerConfinesTests) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths(),
+                                           PyExecutionMode::kForkServer);
+  // Each attempt to reach beyond the test's own process must fail without
+  // killing the test, and leave the server to run the next test.
+  std::string program = R"py(import os, resource
+def attempt(f):
+  try:
+    f()
+    print('allowed')
+  except (OSError, ValueError):
+    print('denied')
+attempt(lambda: os.kill(os.getppid(), 9))
+attempt(os.fork)
+attempt(lambda: resource.setrlimit(resource.RLIMIT_CPU, (1, 1)))
+os.kill(os.getpid(), 0)
+)py";
+  EXPECT_THAT(tester_sandboxer->Test(program, {"", ""}),
+              IsOkAndHolds(TestResultsMatches(Each(
+                  AllOf(HasProgramStatus(ProgramStatus::kSuccess),
+                        HasStdout("denied\ndenied\ndenied\n"))))));
+}
+
+TEST(TesterSandboxerTest, PyReusesPoliciesAcrossTests) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  EXPECT_THAT(tester_sandboxer->Test("print(input())", {"a"}),
+              IsOkAndHolds(TestResultsMatches(
+                  Each(HasProgramStatus(ProgramStatus::kSuccess)))));
+  // The caches are shared by the whole process, so other tests may use them
+  // concurrently.
+  const PyTesterSandboxer::PolicyCacheStats before =
+      PyTesterSandboxer::GetPolicyCacheStats();
+  EXPECT_THAT(tester_sandboxer->Test("print(input())", {"a", "b", "c"}),
+              IsOkAndHolds(TestResultsMatches(
+                  Each(HasProgramStatus(ProgramStatus::kSuccess)))));
+  const PyTesterSandboxer::PolicyCacheStats after =
+      PyTesterSandboxer::GetPolicyCacheStats();
+
+  // Compilation and every test reuse the policies of the first call, although
+  // its workspace was a different one.
+  EXPECT_GE(after.program.hits - before.program.hits, 4);
+}
+
+TEST(PolicyCacheTest, KeepsMostRecentlyUsedBuilders) {
+  PolicyCache cache(/*capacity=*/2);
+  int num_created = 0;
+  auto create = [&num_created] {
+    ++num_created;
+    return sandbox2::PolicyBuilder();
+  };
+  cache.Get("a", create);
+  cache.Get("b", create);
+  cache.Get("a", create);
+  // Evicts "b", which was used least recently.
+  cache.Get("c", create);
+  cache.Get("a", create);
+  EXPECT_EQ(num_created, 3);
+  cache.Get("b", create);
+  EXPECT_EQ(num_created, 4);
+
+  const PolicyCache::Stats stats = cache.stats();
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.misses, 4);
+}
+
+TEST(TesterSandboxerTest, StreamingComparatorStopsDivergingProgram) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  const std::string program = R"py(
+import sys
+while True:
+  print('no', flush=True)
+)py";
+  TestOptions options;
+  options.max_execution_duration = absl::Seconds(10);
+  EXPECT_THAT(
+      tester_sandboxer->Test(
+          program, {""}, options, {"no yes"},
+          [](absl::string_view expected) {
+            return std::make_unique<TokenOutputComparator>(expected);
+          }),
+      IsOkAndHolds(TestResultsMatches(ElementsAre(AllOf(
+          HasProgramStatus(ProgramStatus::kFailed), HasPassed(false),
+          HasOutputMismatchOffset(3),
+          HasDurationBetween(absl::ZeroDuration(), absl::Seconds(5)))))));
+}
+
+TEST(TesterSandboxerTest, StopOnFirstFailureKillsRunningTests) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  const std::string program = R"py(
+if input() == 'loop':
+  while True:
+    pass
+print('no')
+)py";
+  ExecutionScheduler scheduler(/*num_slots=*/3);
+  TestOptions options;
+  options.num_threads = 3;
+  options.scheduler = &scheduler;
+  options.max_execution_duration = absl::Seconds(10);
+  options.stop_on_first_failure = true;
+  const absl::Time start = absl::Now();
+  ASSERT_OK_AND_ASSIGN(
+      MultiTestResult result,
+      tester_sandboxer->Test(program, {"loop", "loop", "wrong"}, options,
+                             {"yes", "yes", "yes"}));
+  // The looping tests are killed when the last test fails, well before they
+  // would time out.
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+  EXPECT_THAT(result.test_results,
+              ElementsAre(HasPassed(std::nullopt), HasPassed(std::nullopt),
+                          HasPassed(false)));
+}
+
+TEST(TesterSandboxerTest, Py3ChecksOutputsWithChecker) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  // Accepts any order of the expected numbers.
+  const Checker checker{.code = R"py(
+import os, sys
+input, output, expected = (os.fdopen(fd).read().split() for fd in (3, 4, 5))
+sys.exit(0 if sorted(output) == sorted(expected) else 1)
+)py"};
+  const std::string program = R"py(
+print(*reversed(input().split()))
+)py";
+  EXPECT_THAT(
+      tester_sandboxer->Test(program, {"1 2 3", "4 5"}, TestOptions(),
+                             {"3 1 2", "4 6"}, checker),
+      IsOkAndHolds(TestResultsMatches(ElementsAre(
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess), HasPassed(true)),
+          AllOf(HasProgramStatus(ProgramStatus::kSuccess),
+                HasPassed(false))))));
+  EXPECT_THAT(tester_sandboxer->Test(program, {"1"}, TestOptions(), {"1"},
+                                     Checker{.code = "def"}),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  // Checkers that fail reject the output instead of failing the test run.
+  for (const absl::string_view code : {"import sys; sys.exit(3)", "1 / 0"}) {
+    EXPECT_THAT(
+        tester_sandboxer->Test(program, {"1"}, TestOptions(), {"1"},
+                               Checker{.code = std::string(code)}),
+        IsOkAndHolds(TestResultsMatches(ElementsAre(AllOf(
+            HasPassed(false),
+            testing::Field(&ExecutionResult::checker_error,
+                           testing::Optional(testing::Not(
+                               testing::IsEmpty()))))))));
+  }
+}
+
+TEST(TesterSandboxerTest, Py3CompilesCheckersIntoTheWorkspacePool) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<WorkspacePool> pool,
+      WorkspacePool::Create(WorkspacePoolOptions{
+          .root = absl::StrCat(testing::TempDir(), "/checker_workspaces"),
+          .mount_tmpfs = false,
+      }));
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  const Checker checker{.code = "import sys; sys.exit(0)"};
+  EXPECT_THAT(tester_sandboxer->Test("print(1)", {"1"},
+                                     TestOptions{.workspace_pool = pool.get()},
+                                     {"2"}, checker),
+              IsOkAndHolds(TestResultsMatches(ElementsAre(HasPassed(true)))));
+  // The code and the checker each took a workspace from the pool, and the
+  // checker's isn't kept, so that the pool can be destroyed.
+  const WorkspacePool::Stats stats = pool->stats();
+  EXPECT_EQ(stats.num_acquired, 2);
+  EXPECT_EQ(stats.num_in_use, 0);
+}
+
+TEST(TesterSandboxerTest, Py3TestAsyncChecksOutputsWithChecker) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  const Checker checker{.code = R"py(
+import os, sys
+input, output, expected = (os.fdopen(fd).read().split() for fd in (3, 4, 5))
+sys.exit(0 if sorted(output) == sorted(expected) else 1)
+)py"};
+  const std::string program = "print(*reversed(input().split()))";
+  const std::vector<absl::string_view> inputs = {"1 2", "3 4"};
+  std::atomic<int> num_reported{0};
+  TestHandle handle = tester_sandboxer->TestAsync(
+      program, inputs, TestOptions(), {"2 1", "3 5"}, checker,
+      [&num_reported](int, const ExecutionResult&) { ++num_reported; });
+  EXPECT_THAT(handle.result.get(),
+              IsOkAndHolds(TestResultsMatches(
+                  ElementsAre(HasPassed(true), HasPassed(false)))));
+  EXPECT_EQ(num_reported, 2);
+
+  // Errors are returned through the handle.
+  handle = tester_sandboxer->TestAsync(program, inputs, TestOptions(),
+                                       {"2 1", "3 4"}, Checker{.code = "def"});
+  EXPECT_THAT(handle.result.get(),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(TesterSandboxerTest, Py3ReportsMemoryLimitExceeded) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  EXPECT_THAT(
+      tester_sandboxer->Test(R"py(
+chunks = []
+while True:
+  chunks.append(b'x' * (1 << 20))
+)py",
+                             {""}),
+      IsOkAndHolds(TestResultsMatches(ElementsAre(
+          HasProgramStatus(ProgramStatus::kMemoryLimitExceeded)))));
+}
+
+TEST(TesterSandboxerTest, Py3EnforcesMemoryLimitWithCgroups) {
+  if (absl::GetFlag(FLAGS_cgroup_parent).empty()) {
+    GTEST_SKIP() << "--cgroup_parent is not set.";
+  }
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  TestOptions options;
+  options.cgroup = CgroupOptions{.parent = absl::GetFlag(FLAGS_cgroup_parent)};
+  // Reserving address space is not limited, but using memory is.
+  ASSERT_OK_AND_ASSIGN(
+      MultiTestResult result,
+      tester_sandboxer->Test(R"py(
+import mmap
+reserved = mmap.mmap(-1, 1 << 30)
+used = bytearray(int(input()))
+)py",
+                             {"1000000", "1000000000"}, options));
+  EXPECT_THAT(result.test_results,
+              ElementsAre(HasProgramStatus(ProgramStatus::kSuccess),
+                          HasProgramStatus(
+                              ProgramStatus::kMemoryLimitExceeded)));
+  ASSERT_TRUE(result.test_results[0].resource_usage.has_value());
+  EXPECT_THAT(result.test_results[0].resource_usage->peak_cgroup_memory_bytes,
+              testing::Optional(testing::Gt(0)));
+}
+
+TEST(TesterSandboxerTest, Py3FailsTestsIfCgroupCannotBeCreated) {
+  std::unique_ptr<TesterSandboxer> tester_sandboxer =
+      std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
+                                           Py3LibraryPaths());
+  TestOptions options;
+  options.cgroup = CgroupOptions{
+      .parent = absl::StrCat(testing::TempDir(), "/no_such_cgroup")};
+  EXPECT_FALSE(tester_sandboxer->Test("print(input())", {"1"}, options).ok());
+}
+
+TEST(TesterSandboxerTest, RechecksBorderlineTestsOnTimingCpu) {
+  Py3TesterSandboxer tester(Py3InterpreterPath(), Py3LibraryPaths());
+  TestOptions options;
+  options.num_threads = 4;
+  // Every successful test is within the band.
+  options.timeout_recheck_band = 1;
+  ASSERT_OK_AND_ASSIGN(
+      MultiTestResult result,
+      tester.Test("print(input())", {"1", "2", "3", "4"}, options,
+                  {"1", "2", "3", "4"}));
+  EXPECT_THAT(result.test_results,
+              Each(AllOf(HasProgramStatus(ProgramStatus::kSuccess),
+                         testing::Field(&ExecutionResult::sandbox_result,
+                                        testing::HasSubstr("Rechecked")))));
+}
+
+TEST(TimeoutCalibratorTest, CalibratesFromPassingReferenceSolutions) {
+  Py3TesterSandboxer tester(Py3InterpreterPath(), Py3LibraryPaths());
+  ContestProblem problem;
+  problem.set_name("calibration_test");
+  ContestProblem::Solution* wrong = problem.add_solutions();
+  wrong->set_language(ContestProblem::Solution::PYTHON3);
+  wrong->set_solution("print(0)");
+  ContestProblem::Solution* slow = problem.add_solutions();
+  slow->set_language(ContestProblem::Solution::PYTHON3);
+  slow->set_solution(R"py(
+x = int(input())
+for _ in range(3000000):
+  pass
+print(x)
+)py");
+  const std::string cache_path =
+      absl::StrCat(testing::TempDir(), "/calibration_cache.json");
+  std::remove(cache_path.c_str());
+  CalibrationOptions calibration;
+  calibration.multiplier = 4;
+  calibration.min_time_limit = absl::Milliseconds(10);
+  calibration.cache_path = cache_path;
+  TestOptions base_options;
+  base_options.max_execution_duration = absl::Seconds(100);
+
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<TimeoutCalibrator> calibrator,
+                       TimeoutCalibrator::Create(&tester, calibration));
+  ASSERT_OK_AND_ASSIGN(
+      absl::Duration reference_time,
+      calibrator->ReferenceTime(problem, {"1", "2"}, {"1", "2"},
+                                base_options));
+  EXPECT_GT(reference_time, absl::ZeroDuration());
+  ASSERT_OK_AND_ASSIGN(
+      TestOptions options,
+      calibrator->CalibratedTestOptions(problem, {"1", "2"}, {"1", "2"},
+                                        base_options));
+  EXPECT_EQ(options.max_execution_duration,
+            std::max(4 * reference_time, absl::Milliseconds(10)));
+  EXPECT_TRUE(options.check_cpu_time);
+
+  // The reference time is read from the cache, without running solutions.
+  const ContestProblem::Solution correct = *slow;
+  problem.clear_solutions();
+  ASSERT_OK_AND_ASSIGN(calibrator,
+                       TimeoutCalibrator::Create(&tester, calibration));
+  EXPECT_THAT(calibrator->ReferenceTime(problem, {"1", "2"}, {"1", "2"},
+                                        base_options),
+              IsOkAndHolds(reference_time));
+  // Other problems without passing solutions are not calibrated.
+  problem.set_name("uncalibrated");
+  EXPECT_THAT(calibrator->CalibratedTestOptions(problem, {"1"}, {"1"},
+                                                base_options),
+              IsOkAndHolds(testing::Field(&TestOptions::max_execution_duration,
+                                          absl::Seconds(100))));
+  // That is cached as well, so their solutions are not run again.
+  *problem.add_solutions() = correct;
+  EXPECT_THAT(calibrator->ReferenceTime(problem, {"1"}, {"1"}, base_options),
+              StatusIs(absl::StatusCode::kNotFound));
+  // Other inputs are calibrated separately.
+  EXPECT_THAT(calibrator->ReferenceTime(problem, {"2"}, {"2"}, base_options),
+              IsOk());
+}
+
+TEST(TimeoutCalibratorTest, MergesCachesOfCalibratorsSharingThem) {
+  Py3TesterSandboxer tester(Py3InterpreterPath(), Py3LibraryPaths());
+  const std::string cache_path =
+      absl::StrCat(testing::TempDir(), "/shared_calibration_cache.json");
+  std::remove(cache_path.c_str());
+  CalibrationOptions calibration;
+  calibration.cache_path = cache_path;
+  // Both are created before either has saved anything, as in two processes.
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<TimeoutCalibrator> first,
+                       TimeoutCalibrator::Create(&tester, calibration));
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<TimeoutCalibrator> second,
+                       TimeoutCalibrator::Create(&tester, calibration));
+  ContestProblem problem;
+  ContestProblem::Solution* solution = problem.add_solutions();
+  solution->set_language(ContestProblem::Solution::PYTHON3);
+  solution->set_solution("print(input())");
+  problem.set_name("first");
+  ASSERT_THAT(first->ReferenceTime(problem, {"1"}, {"1"}, TestOptions()),
+              IsOk());
+  // Names need not be valid UTF-8.
+  problem.set_name("caf\xe9");
+  ASSERT_THAT(second->ReferenceTime(problem, {"1"}, {"1"}, TestOptions()),
+              IsOk());
+
+  // Without solutions, both are only found in the cache.
+  problem.clear_solutions();
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<TimeoutCalibrator> loaded,
+                       TimeoutCalibrator::Create(&tester, calibration));
+  EXPECT_THAT(loaded->ReferenceTime(problem, {"1"}, {"1"}, TestOptions()),
+              IsOk());
+  problem.set_name("first");
+  EXPECT_THAT(loaded->ReferenceTime(problem, {"1"}, {"1"}, TestOptions()),
+              IsOk());
+}
+
 TEST(TesterSandboxerTest, PyProgramHash) {
   std::unique_ptr<TesterSandboxer> tester_sandboxer =
       std::make_unique<Py3TesterSandboxer>(Py3InterpreterPath(),
@@ -560,6 +1225,747 @@ TEST(TesterSandboxerTest, CannotStopOnFirstFailureIfNoOutputs) {
                        "outputs are not provided."));
 }
 
+TEST(ClassifyMemoryLimitExceededTest, DetectsFailedAllocations) {
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kFailed;
+  result.resource_usage =
+      ResourceUsage{.peak_rss_bytes = kDefaultMemoryLimitBytes / 2};
+  result.stderr = "Traceback (most recent call last):\nMemoryError\n";
+  internal::ClassifyMemoryLimitExceeded(kDefaultMemoryLimitBytes, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kMemoryLimitExceeded);
+
+  // Uncaught exceptions abort C++ programs.
+  result.program_status = ProgramStatus::kTimeout;
+  result.exit_signal = SIGABRT;
+  result.stderr = "terminate called after throwing 'std::bad_alloc'";
+  internal::ClassifyMemoryLimitExceeded(kDefaultMemoryLimitBytes, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kMemoryLimitExceeded);
+}
+
+TEST(ClassifyMemoryLimitExceededTest, IgnoresMessagesFarFromTheLimit) {
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kFailed;
+  result.resource_usage =
+      ResourceUsage{.peak_rss_bytes = kDefaultMemoryLimitBytes / 10};
+  result.stderr = "Traceback (most recent call last):\nMemoryError\n";
+  internal::ClassifyMemoryLimitExceeded(kDefaultMemoryLimitBytes, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kFailed);
+}
+
+TEST(ClassifyMemoryLimitExceededTest, DetectsPeakRss) {
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kFailed;
+  result.resource_usage = ResourceUsage{.peak_rss_bytes = 2 << 20};
+  internal::ClassifyMemoryLimitExceeded(/*memory_limit_bytes=*/1 << 20,
+                                        result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kMemoryLimitExceeded);
+}
+
+TEST(ClassifyMemoryLimitExceededTest, KeepsOtherStatuses) {
+  ExecutionResult result;
+  result.stderr = "MemoryError";
+  for (const ProgramStatus status :
+       {ProgramStatus::kSuccess, ProgramStatus::kTimeout}) {
+    result.program_status = status;
+    internal::ClassifyMemoryLimitExceeded(kDefaultMemoryLimitBytes, result);
+    EXPECT_EQ(result.program_status, status);
+  }
+  // Exceeding the cpu time limit is a timeout.
+  result.program_status = ProgramStatus::kTimeout;
+  result.exit_signal = SIGXCPU;
+  internal::ClassifyMemoryLimitExceeded(kDefaultMemoryLimitBytes, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kTimeout);
+  // As is failing without running out of memory.
+  result.program_status = ProgramStatus::kFailed;
+  result.exit_signal.reset();
+  result.stderr = "AssertionError";
+  internal::ClassifyMemoryLimitExceeded(kDefaultMemoryLimitBytes, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kFailed);
+}
+
+TEST(CheckCpuTimeTest, RoundsCpuTimeLimitUpWhenChecking) {
+  TestOptions options;
+  options.max_execution_duration = absl::Milliseconds(1500);
+  EXPECT_EQ(internal::CpuTimeLimitSeconds(options), 1);
+  options.check_cpu_time = true;
+  EXPECT_EQ(internal::CpuTimeLimitSeconds(options), 2);
+  options.max_execution_duration = absl::Milliseconds(200);
+  EXPECT_EQ(internal::CpuTimeLimitSeconds(options), 1);
+}
+
+TEST(CheckCpuTimeTest, ReportsTimeoutAboveLimit) {
+  TestOptions options;
+  options.max_execution_duration = absl::Milliseconds(500);
+  options.check_cpu_time = true;
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kSuccess;
+  result.resource_usage = ResourceUsage{
+      .user_cpu_time = absl::Milliseconds(300),
+      .system_cpu_time = absl::Milliseconds(100)};
+  internal::CheckCpuTime(options, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kSuccess);
+
+  result.resource_usage->user_cpu_time = absl::Milliseconds(450);
+  internal::CheckCpuTime(options, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kTimeout);
+}
+
+TEST(CheckCpuTimeTest, OnlyChecksWhenEnabled) {
+  TestOptions options;
+  options.max_execution_duration = absl::Milliseconds(500);
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kSuccess;
+  result.resource_usage = ResourceUsage{.user_cpu_time = absl::Seconds(1)};
+  internal::CheckCpuTime(options, result);
+  EXPECT_EQ(result.program_status, ProgramStatus::kSuccess);
+}
+
+TEST(TestOptionsForProblemTest, AppliesLimitsOfTheProblem) {
+  ContestProblem problem;
+  problem.mutable_time_limit()->set_nanos(500000000);
+  problem.set_memory_limit_bytes(INT64_C(64) << 20);
+  TestOptions base;
+  base.num_threads = 3;
+  const TestOptions options = TestOptionsForProblem(
+      problem,
+      ProblemLimitsOptions{.time_limit_multiplier = 3,
+                           .walltime_limit_multiplier = 4},
+      base);
+  EXPECT_EQ(options.max_execution_duration, absl::Milliseconds(1500));
+  EXPECT_EQ(options.walltime_limit_multiplier, 4);
+  EXPECT_TRUE(options.check_cpu_time);
+  EXPECT_EQ(options.memory_limit_bytes, INT64_C(64) << 20);
+  EXPECT_EQ(options.num_threads, 3);
+}
+
+TEST(TestOptionsForProblemTest, KeepsBaseLimitsWhereProblemHasNone) {
+  TestOptions base;
+  base.max_execution_duration = absl::Seconds(7);
+  const TestOptions options =
+      TestOptionsForProblem(ContestProblem(), ProblemLimitsOptions(), base);
+  EXPECT_EQ(options.max_execution_duration, absl::Seconds(7));
+  EXPECT_FALSE(options.check_cpu_time);
+  EXPECT_EQ(options.memory_limit_bytes, kDefaultMemoryLimitBytes);
+}
+
+TEST(NeedsTimeoutRecheckTest, RechecksBorderlineResults) {
+  TestOptions options;
+  options.max_execution_duration = absl::Seconds(1);
+  options.timeout_recheck_band = 0.1;
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kSuccess;
+  result.resource_usage = ResourceUsage{
+      .user_cpu_time = absl::Milliseconds(900),
+      .system_cpu_time = absl::Milliseconds(50)};
+  EXPECT_TRUE(internal::NeedsTimeoutRecheck(options, result));
+  // Killed just above the limit.
+  result.program_status = ProgramStatus::kTimeout;
+  result.resource_usage->user_cpu_time = absl::Milliseconds(1050);
+  EXPECT_TRUE(internal::NeedsTimeoutRecheck(options, result));
+}
+
+TEST(NeedsTimeoutRecheckTest, KeepsClearResults) {
+  TestOptions options;
+  options.max_execution_duration = absl::Seconds(1);
+  options.timeout_recheck_band = 0.1;
+  ExecutionResult result;
+  result.program_status = ProgramStatus::kSuccess;
+  result.resource_usage = ResourceUsage{.user_cpu_time = absl::Seconds(0.5)};
+  EXPECT_FALSE(internal::NeedsTimeoutRecheck(options, result));
+  result.program_status = ProgramStatus::kTimeout;
+  result.resource_usage->user_cpu_time = absl::Seconds(2);
+  EXPECT_FALSE(internal::NeedsTimeoutRecheck(options, result));
+  // Killed by the wall time limit while sleeping.
+  result.resource_usage->user_cpu_time = absl::Milliseconds(200);
+  EXPECT_FALSE(internal::NeedsTimeoutRecheck(options, result));
+  // The CPU time of the sandboxee is unknown.
+  result.resource_usage.reset();
+  result.execution_duration = absl::Seconds(1);
+  EXPECT_FALSE(internal::NeedsTimeoutRecheck(options, result));
+  result.resource_usage = ResourceUsage{.user_cpu_time = absl::Seconds(1)};
+  result.program_status = ProgramStatus::kFailed;
+  result.resource_usage->user_cpu_time = absl::Seconds(1);
+  EXPECT_FALSE(internal::NeedsTimeoutRecheck(options, result));
+  // Nothing is rechecked without a band.
+  result.program_status = ProgramStatus::kSuccess;
+  options.timeout_recheck_band = 0;
+  EXPECT_FALSE(internal::NeedsTimeoutRecheck(options, result));
+}
+
+TEST(CheckerVerdictTest, MapsExitCodesToVerdicts) {
+  ExecutionResult result;
+  result.exit_code = 0;
+  EXPECT_THAT(internal::CheckerVerdict(result), IsOkAndHolds(true));
+  result.exit_code = 1;
+  EXPECT_THAT(internal::CheckerVerdict(result), IsOkAndHolds(false));
+  result.exit_code = 2;
+  EXPECT_THAT(internal::CheckerVerdict(result), IsOkAndHolds(false));
+  result.exit_code = 3;
+  EXPECT_THAT(internal::CheckerVerdict(result),
+              StatusIs(absl::StatusCode::kInternal));
+  // Checkers that time out or are killed have no exit code.
+  result.exit_code = std::nullopt;
+  result.exit_signal = SIGKILL;
+  EXPECT_THAT(internal::CheckerVerdict(result),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST(RetryTest, ClassifiesRetryableErrors) {
+  EXPECT_TRUE(internal::IsRetryableError(
+      absl::UnknownError("Failed to run sandbox on execution.")));
+  EXPECT_TRUE(internal::IsRetryableError(
+      absl::ResourceExhaustedError("Out of file descriptors.")));
+  EXPECT_FALSE(internal::IsRetryableError(
+      absl::InvalidArgumentError("Empty command provided")));
+  EXPECT_FALSE(
+      internal::IsRetryableError(absl::NotFoundError("No such cgroup.")));
+}
+
+TEST(RetryTest, BacksOffExponentiallyWithJitter) {
+  absl::BitGen gen;
+  for (int i = 0; i < 100; ++i) {
+    const absl::Duration first = internal::RetryBackoff(0, gen);
+    EXPECT_GE(first, absl::Milliseconds(1));
+    EXPECT_LE(first, absl::Milliseconds(2));
+    const absl::Duration third = internal::RetryBackoff(2, gen);
+    EXPECT_GE(third, absl::Milliseconds(4));
+    EXPECT_LE(third, absl::Milliseconds(8));
+    const absl::Duration last = internal::RetryBackoff(20, gen);
+    EXPECT_GE(last, absl::Milliseconds(50));
+    EXPECT_LE(last, absl::Milliseconds(100));
+  }
+}
+
+TEST(FdBudgetTest, WaitsForReleasedDescriptors) {
+  FdBudget budget(/*capacity=*/10);
+  ASSERT_OK_AND_ASSIGN(FdBudget::Reservation first,
+                       budget.Acquire(6, absl::InfiniteDuration()));
+  EXPECT_THAT(budget.Acquire(6, absl::Milliseconds(10)),
+              StatusIs(absl::StatusCode::kResourceExhausted));
+  std::thread releaser([&first] {
+    absl::SleepFor(absl::Milliseconds(20));
+    first = FdBudget::Reservation();
+  });
+  ASSERT_OK_AND_ASSIGN(FdBudget::Reservation second,
+                       budget.Acquire(6, absl::InfiniteDuration()));
+  releaser.join();
+  EXPECT_EQ(second.fds(), 6);
+  // Reservations larger than the budget are granted while it is unused.
+  EXPECT_THAT(budget.Acquire(20, absl::ZeroDuration()),
+              StatusIs(absl::StatusCode::kResourceExhausted));
+  second = FdBudget::Reservation();
+  EXPECT_THAT(budget.Acquire(20, absl::ZeroDuration()), IsOk());
+  const FdBudget::Stats stats = budget.stats();
+  EXPECT_EQ(stats.reserved, 0);
+  EXPECT_EQ(stats.max_reserved, 20);
+  EXPECT_EQ(stats.num_waits, 3);
+  EXPECT_EQ(stats.num_timeouts, 2);
+}
+
+TEST(FdBudgetTest, CachedInputsHoldAtMostHalfOfTheBudget) {
+  FdBudget budget(/*capacity=*/4);
+  {
+    InputCache cache(/*max_bytes=*/1 << 20, &budget);
+    for (const absl::string_view input : {"1", "2", "3"}) {
+      ASSERT_OK_AND_ASSIGN(const int fd, cache.Open(input));
+      close(fd);
+    }
+    // The third input did not fit, and was opened without being cached.
+    EXPECT_EQ(budget.stats().reserved, 2);
+    EXPECT_EQ(cache.stats().cached_bytes, 2);
+    EXPECT_FALSE(budget.TryAcquire(1).has_value());
+  }
+  EXPECT_EQ(budget.stats().reserved, 0);
+  EXPECT_EQ(budget.stats().num_waits, 0);
+}
+
+// Waits until the workspaces released so far are wiped.
+void AwaitWipes(const WorkspacePool& pool) {
+  while (pool.stats().num_wiping > 0) {
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+}
+
+TEST(WorkspacePoolTest, RecyclesWipedWorkspaces) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<WorkspacePool> pool,
+      WorkspacePool::Create(WorkspacePoolOptions{
+          .root = absl::StrCat(testing::TempDir(), "/recycles_workspaces"),
+          .mount_tmpfs = false,
+          .num_ready = 1,
+      }));
+  std::string path;
+  {
+    ASSERT_OK_AND_ASSIGN(std::unique_ptr<WorkspacePool::Workspace> workspace,
+                         pool->Acquire());
+    path = workspace->path();
+    ASSERT_THAT(WriteFileContents(absl::StrCat(path, "/code.py"), "print(1)"),
+                IsOk());
+    // Usage is only measured when asked to, rather than on every Acquire.
+    EXPECT_EQ(pool->UsedBytes(), 0);
+    workspace->UpdateUsage();
+    EXPECT_EQ(pool->UsedBytes(), 8);
+  }
+  AwaitWipes(*pool);
+  EXPECT_EQ(pool->UsedBytes(), 0);
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<WorkspacePool::Workspace> workspace,
+                       pool->Acquire());
+  EXPECT_EQ(workspace->path(), path);
+  EXPECT_TRUE(std::filesystem::is_empty(path));
+  const WorkspacePool::Stats stats = pool->stats();
+  EXPECT_EQ(stats.num_created, 1);
+  EXPECT_EQ(stats.num_acquired, 2);
+  EXPECT_EQ(stats.num_recycled, 1);
+  EXPECT_EQ(stats.num_in_use, 1);
+}
+
+TEST(WorkspacePoolTest, RejectsWorkspacesOverQuota) {
+  ASSERT_OK_AND_ASSIGN(
+      std::unique_ptr<WorkspacePool> pool,
+      WorkspacePool::Create(WorkspacePoolOptions{
+          .root = absl::StrCat(testing::TempDir(), "/rejects_over_quota"),
+          .mount_tmpfs = false,
+          .quota_bytes = 4,
+          .max_quota_wait = absl::Milliseconds(10),
+      }));
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<WorkspacePool::Workspace> workspace,
+                       pool->Acquire());
+  ASSERT_THAT(
+      WriteFileContents(absl::StrCat(workspace->path(), "/a.out"), "binary"),
+      IsOk());
+  workspace->UpdateUsage();
+  EXPECT_THAT(pool->Acquire(), StatusIs(absl::StatusCode::kResourceExhausted));
+  // The quota is available again once the workspace is wiped.
+  workspace.reset();
+  AwaitWipes(*pool);
+  EXPECT_THAT(pool->Acquire(), IsOk());
+  const WorkspacePool::Stats stats = pool->stats();
+  EXPECT_EQ(stats.num_quota_waits, 1);
+  EXPECT_EQ(stats.num_quota_rejections, 1);
+}
+
+// Writes a dataset of problems with the given names, from Codeforces contest
+// 1000 with indices A, B, ... Each problem has a public and a generated test
+// whose input and output are its name and "public" or "generated".
+void WriteDataset(const std::string& path,
+                  const std::vector<std::string>& names) {
+  riegeli::RecordWriter<riegeli::FdWriter<>> writer(
+      std::forward_as_tuple(path, O_WRONLY | O_CREAT | O_TRUNC));
+  for (int i = 0; i < names.size(); ++i) {
+    ContestProblem problem;
+    problem.set_name(names[i]);
+    problem.set_cf_contest_id(1000);
+    problem.set_cf_index(std::string(1, 'A' + i));
+    ContestProblem::Test* test = problem.add_public_tests();
+    test->set_input(names[i]);
+    test->set_output("public");
+    test = problem.add_generated_tests();
+    test->set_input(names[i]);
+    test->set_output("generated");
+    writer.WriteRecord(problem);
+  }
+  ASSERT_TRUE(writer.Close()) << writer.status();
+}
+
+TEST(DatasetIndexTest, SeeksToProblemsAndRebuildsStaleIndex) {
+  const std::string path = absl::StrCat(testing::TempDir(), "/dataset");
+  WriteDataset(path, {"first", "second", "third"});
+  {
+    ASSERT_OK_AND_ASSIGN(std::unique_ptr<DatasetIndex> index,
+                         DatasetIndex::Open(path));
+    EXPECT_EQ(index->num_problems(), 3);
+    EXPECT_THAT(index->FindByName("third"),
+                IsOkAndHolds(testing::Property(&ContestProblem::cf_index,
+                                               "C")));
+    EXPECT_THAT(index->FindByCodeforcesId(1000, "A"),
+                IsOkAndHolds(testing::Property(&ContestProblem::name,
+                                               "first")));
+    EXPECT_THAT(index->FindByName("fourth"),
+                StatusIs(absl::StatusCode::kNotFound));
+    EXPECT_EQ(index->stats().num_builds, 1);
+  }
+  // Other processes load the saved index.
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<DatasetIndex> index,
+                       DatasetIndex::Open(path));
+  EXPECT_EQ(index->stats().num_loads, 1);
+  EXPECT_EQ(index->stats().num_builds, 0);
+  // Changing the dataset invalidates the index.
+  WriteDataset(path, {"zeroth", "first", "second", "third"});
+  EXPECT_THAT(index->FindByName("third"),
+              IsOkAndHolds(testing::Property(&ContestProblem::cf_index,
+                                             "D")));
+  EXPECT_EQ(index->stats().num_builds, 1);
+}
+
+TEST(DatasetIndexTest, DoesNotSaveNamesThatAreNotUtf8) {
+  const std::string path = absl::StrCat(testing::TempDir(), "/latin1_dataset");
+  WriteDataset(path, {"caf\xe9", "first"});
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_OK_AND_ASSIGN(std::unique_ptr<DatasetIndex> index,
+                         DatasetIndex::Open(path));
+    EXPECT_THAT(index->FindByName("caf\xe9"),
+                IsOkAndHolds(testing::Property(&ContestProblem::cf_index,
+                                               "A")));
+    EXPECT_EQ(index->stats().num_loads, 0);
+    EXPECT_EQ(index->stats().num_builds, 1);
+  }
+}
+
+TEST(DatasetImageTest, SharesImageAndRebuildsItForNewDataset) {
+  const std::string path = absl::StrCat(testing::TempDir(), "/image_dataset");
+  WriteDataset(path, {"first", "second", "first"});
+  const DatasetImageOptions options{.directory = testing::TempDir()};
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<DatasetImage> image,
+                       DatasetImage::Attach(path, options));
+  EXPECT_TRUE(image->built());
+  EXPECT_EQ(image->num_problems(), 3);
+  // Other processes map the same image.
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<DatasetImage> attached,
+                       DatasetImage::Attach(path, options));
+  EXPECT_FALSE(attached->built());
+  EXPECT_EQ(attached->image_path(), image->image_path());
+  ASSERT_OK_AND_ASSIGN(DatasetImage::ProblemView view,
+                       attached->FindByName("second"));
+  EXPECT_EQ(view.num_public_tests, 1);
+  EXPECT_EQ(view.num_private_tests, 0);
+  EXPECT_EQ(view.num_generated_tests, 1);
+  EXPECT_THAT(view.inputs, ElementsAre("second", "second"));
+  EXPECT_THAT(view.outputs, ElementsAre("public", "generated"));
+  ASSERT_OK_AND_ASSIGN(ContestProblem problem, view.ParseMetadata());
+  EXPECT_EQ(problem.cf_index(), "B");
+  EXPECT_EQ(problem.public_tests_size(), 0);
+  // As with the index, the first problem of a name wins.
+  EXPECT_THAT(attached->FindByName("first"),
+              IsOkAndHolds(testing::Field(&DatasetImage::ProblemView::name,
+                                          "first")));
+  EXPECT_THAT(attached->FindByName("first")->ParseMetadata(),
+              IsOkAndHolds(testing::Property(&ContestProblem::cf_index,
+                                             "A")));
+  EXPECT_THAT(attached->FindByName("third"),
+              StatusIs(absl::StatusCode::kNotFound));
+
+  // Changing the dataset replaces the image, while mapped images stay valid.
+  // Temporary files of builds that died are removed too.
+  const std::string abandoned_path = absl::StrCat(image->image_path(),
+                                                  ".tmp.", getpid() + 1);
+  std::ofstream(abandoned_path) << "abandoned";
+  WriteDataset(path, {"zeroth", "first"});
+  ASSERT_OK_AND_ASSIGN(std::unique_ptr<DatasetImage> rebuilt,
+                       DatasetImage::Attach(path, options));
+  EXPECT_TRUE(rebuilt->built());
+  EXPECT_EQ(rebuilt->num_problems(), 2);
+  EXPECT_FALSE(std::filesystem::exists(image->image_path()));
+  EXPECT_FALSE(std::filesystem::exists(abandoned_path));
+  EXPECT_THAT(view.outputs, ElementsAre("public", "generated"));
+}
+
+TEST(CpuAffinityTest, ParsesCpuLists) {
+  EXPECT_THAT(ParseCpuList("0-2,5,7-8\n"),
+              IsOkAndHolds(ElementsAre(0, 1, 2, 5, 7, 8)));
+  EXPECT_THAT(ParseCpuList(""), IsOkAndHolds(testing::IsEmpty()));
+  EXPECT_THAT(ParseCpuList("3-1"),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(ParseCpuList("a"), StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST(CpuAffinityTest, AllocatesSlotsWithinNodes) {
+  CpuTopology topology;
+  topology.nodes = {{0, 1, 2, 3, 8, 9}, {4, 5, 6, 7}};
+  // Slots alternate between nodes, and none spans two.
+  EXPECT_THAT(AllocateSlotCpus(topology, /*num_slots=*/4, /*cpus_per_slot=*/2),
+              ElementsAre(ElementsAre(0, 1), ElementsAre(4, 5),
+                          ElementsAre(2, 3), ElementsAre(6, 7)));
+  // The first node has room for one more slot, after which CPUs are shared.
+  EXPECT_THAT(AllocateSlotCpus(topology, /*num_slots=*/6, /*cpus_per_slot=*/2),
+              ElementsAre(ElementsAre(0, 1), ElementsAre(4, 5),
+                          ElementsAre(2, 3), ElementsAre(6, 7),
+                          ElementsAre(8, 9), ElementsAre(4, 5)));
+  // Slots are never larger than a node.
+  EXPECT_THAT(AllocateSlotCpus(topology, /*num_slots=*/1, /*cpus_per_slot=*/8),
+              ElementsAre(ElementsAre(0, 1, 2, 3, 8, 9)));
+  EXPECT_THAT(AllocateSlotCpus(CpuTopology(), /*num_slots=*/2,
+                               /*cpus_per_slot=*/1),
+              testing::IsEmpty());
+}
+
+TEST(WorkStealingPoolTest, RunsNestedAndBulkTasks) {
+  std::atomic<int> num_run{0};
+  {
+    WorkStealingPool pool(/*num_threads=*/4);
+    for (int i = 0; i < 100; ++i) {
+      pool.Schedule([&pool, &num_run] {
+        ++num_run;
+        pool.Schedule([&num_run] { ++num_run; });
+      });
+    }
+    std::vector<Task> tasks;
+    for (int i = 0; i < 100; ++i) {
+      tasks.push_back([&num_run] { ++num_run; });
+    }
+    pool.ScheduleBulk(std::move(tasks));
+  }
+  EXPECT_EQ(num_run, 300);
+}
+
+TEST(WorkStealingPoolTest, TaskGroupWaitsForItsTasks) {
+  WorkStealingPool pool(/*num_threads=*/2);
+  std::atomic<int> num_run{0};
+  TaskGroup outer(pool);
+  for (int i = 0; i < 4; ++i) {
+    // Waiting for a group from a worker runs its tasks, instead of blocking
+    // the worker.
+    outer.Schedule([&pool, &num_run] {
+      TaskGroup inner(pool);
+      for (int j = 0; j < 10; ++j) {
+        inner.Schedule([&num_run] { ++num_run; });
+      }
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+  EXPECT_EQ(num_run, 40);
+}
+
+TEST(WorkStealingPoolTest, CancelSkipsQueuedTasks) {
+  WorkStealingPool pool(/*num_threads=*/1);
+  absl::Notification started;
+  absl::Notification release;
+  std::atomic<int> num_run{0};
+  TaskGroup group(pool);
+  group.Schedule([&] {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  started.WaitForNotification();
+  for (int i = 0; i < 10; ++i) {
+    group.Schedule([&num_run] { ++num_run; });
+  }
+  group.Cancel();
+  EXPECT_TRUE(group.IsCancelled());
+  release.Notify();
+  group.Wait();
+  EXPECT_EQ(num_run, 0);
+}
+
+TEST(WorkStealingPoolTest, BoundedQueueBlocksProducers) {
+  WorkStealingPool pool(/*num_threads=*/1, /*max_queued_tasks=*/2);
+  absl::Notification started;
+  absl::Notification release;
+  pool.Schedule([&] {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  started.WaitForNotification();
+  pool.Schedule([] {});
+  pool.Schedule([] {});
+  std::atomic<bool> scheduled{false};
+  std::thread producer([&] {
+    pool.Schedule([] {});
+    scheduled = true;
+  });
+  absl::SleepFor(absl::Milliseconds(50));
+  EXPECT_FALSE(scheduled);
+  release.Notify();
+  producer.join();
+  EXPECT_TRUE(scheduled);
+}
+
+TEST(TaskTest, StoresSmallCallablesInline) {
+  int x = 0;
+  Task small([&x] { ++x; });
+  EXPECT_TRUE(small.is_inline());
+  Task moved = std::move(small);
+  EXPECT_FALSE(small);
+  moved();
+  EXPECT_EQ(x, 1);
+  std::array<char, 2 * Task::kInlineSize> large = {};
+  Task large_task([&x, large] { x += large.size(); });
+  EXPECT_FALSE(large_task.is_inline());
+  large_task();
+  EXPECT_EQ(x, 1 + 2 * Task::kInlineSize);
+}
+
+TEST(ExecutionSchedulerTest, ConcurrencyLimitCapsRunningTasks) {
+  ExecutionScheduler scheduler(/*num_slots=*/4);
+  scheduler.set_concurrency_limit(1);
+  absl::Mutex mu;
+  int num_running = 0;
+  int max_running = 0;
+  {
+    std::unique_ptr<ExecutionScheduler::Submission> submission =
+        scheduler.Submit(/*max_concurrency=*/4);
+    for (int i = 0; i < 8; ++i) {
+      submission->Schedule([&mu, &num_running, &max_running] {
+        {
+          absl::MutexLock l(&mu);
+          max_running = std::max(max_running, ++num_running);
+        }
+        absl::SleepFor(absl::Milliseconds(5));
+        absl::MutexLock l(&mu);
+        --num_running;
+      });
+    }
+  }
+  EXPECT_EQ(max_running, 1);
+  EXPECT_EQ(scheduler.stats().num_started, 8);
+  scheduler.set_concurrency_limit(100);
+  EXPECT_EQ(scheduler.stats().concurrency_limit, 4);
+}
+
+TEST(ExecutionSchedulerTest, GivesSubmissionsTurnsByWeight) {
+  ExecutionScheduler scheduler(/*num_slots=*/1);
+  absl::Mutex mu;
+  std::string order;
+  absl::Notification started;
+  absl::Notification release;
+  {
+    std::unique_ptr<ExecutionScheduler::Submission> light =
+        scheduler.Submit(/*max_concurrency=*/1, /*weight=*/1);
+    light->Schedule([&started, &release] {
+      started.Notify();
+      release.WaitForNotification();
+    });
+    started.WaitForNotification();
+    std::unique_ptr<ExecutionScheduler::Submission> heavy =
+        scheduler.Submit(/*max_concurrency=*/1, /*weight=*/3);
+    for (int i = 0; i < 3; ++i) {
+      light->Schedule([&mu, &order] {
+        absl::MutexLock l(&mu);
+        order += 'L';
+      });
+    }
+    for (int i = 0; i < 6; ++i) {
+      heavy->Schedule([&mu, &order] {
+        absl::MutexLock l(&mu);
+        order += 'H';
+      });
+    }
+    release.Notify();
+  }
+  EXPECT_EQ(order, "LHHHLHHHL");
+}
+
+TEST(ExecutionSchedulerTest, BackfillsAroundTasksThatDontFitInMemory) {
+  ExecutionScheduler scheduler(/*num_slots=*/2);
+  scheduler.set_memory_budget(100, /*max_backfill_delay=*/absl::Seconds(60));
+  absl::Notification started;
+  absl::Notification release;
+  std::unique_ptr<ExecutionScheduler::Submission> big =
+      scheduler.Submit(/*max_concurrency=*/2, /*weight=*/1,
+                       /*memory_bytes=*/60);
+  big->Schedule([&started, &release] {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  started.WaitForNotification();
+  // Doesn't fit next to the first big task, so the small tasks overtake it.
+  std::atomic<bool> second_big_started{false};
+  big->Schedule([&second_big_started] { second_big_started = true; });
+  {
+    std::unique_ptr<ExecutionScheduler::Submission> small =
+        scheduler.Submit(/*max_concurrency=*/2, /*weight=*/1,
+                         /*memory_bytes=*/20);
+    small->Schedule([] {});
+    small->Schedule([] {});
+  }
+  EXPECT_FALSE(second_big_started);
+  ExecutionScheduler::Stats stats = scheduler.stats();
+  EXPECT_EQ(stats.memory_budget_bytes, 100);
+  EXPECT_EQ(stats.reserved_memory_bytes, 60);
+  EXPECT_EQ(stats.num_memory_blocked, 1);
+  EXPECT_EQ(stats.num_backfilled, 2);
+  release.Notify();
+  big.reset();
+  EXPECT_TRUE(second_big_started);
+  stats = scheduler.stats();
+  EXPECT_EQ(stats.reserved_memory_bytes, 0);
+  EXPECT_GT(stats.total_memory_blocked_time, absl::ZeroDuration());
+}
+
+TEST(ExecutionSchedulerTest, ReservesMemoryOutsideTasks) {
+  ExecutionScheduler scheduler(/*num_slots=*/1);
+  EXPECT_TRUE(scheduler.TryReserveMemory(1000));
+  scheduler.ReleaseMemory(1000);
+  scheduler.set_memory_budget(100);
+  EXPECT_TRUE(scheduler.TryReserveMemory(30));
+  // Would not leave room for a task of the same size.
+  EXPECT_FALSE(scheduler.TryReserveMemory(40));
+  EXPECT_EQ(scheduler.stats().reserved_memory_bytes, 30);
+  scheduler.ReleaseMemory(30);
+  EXPECT_EQ(scheduler.stats().reserved_memory_bytes, 0);
+}
+
+TEST(ExecutionSchedulerTest, StopsBackfillingAfterMaxDelay) {
+  ExecutionScheduler scheduler(/*num_slots=*/2);
+  scheduler.set_memory_budget(100, /*max_backfill_delay=*/absl::ZeroDuration());
+  absl::Notification started;
+  absl::Notification release;
+  std::unique_ptr<ExecutionScheduler::Submission> big =
+      scheduler.Submit(/*max_concurrency=*/2, /*weight=*/1,
+                       /*memory_bytes=*/60);
+  big->Schedule([&started, &release] {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  started.WaitForNotification();
+  std::atomic<int> order{0};
+  std::atomic<int> second_big_order{-1};
+  big->Schedule([&order, &second_big_order] { second_big_order = order++; });
+  std::unique_ptr<ExecutionScheduler::Submission> small =
+      scheduler.Submit(/*max_concurrency=*/1, /*weight=*/1,
+                       /*memory_bytes=*/20);
+  for (int i = 0; i < 4; ++i) {
+    small->Schedule([&order] { order++; });
+  }
+  absl::SleepFor(absl::Milliseconds(50));
+  // At most one small task started before the big task got the reservation.
+  EXPECT_LE(order.load(), 1);
+  release.Notify();
+  big.reset();
+  small.reset();
+  EXPECT_LE(second_big_order.load(), 1);
+  EXPECT_EQ(order.load(), 5);
+}
+
+TEST(ConcurrencyControllerTest, IncreasesAdditivelyAndDecreasesOnCongestion) {
+  ConcurrencyControllerOptions options;
+  options.min_concurrency = 2;
+  options.max_concurrency = 10;
+  std::string reason;
+  ConcurrencySignals idle;
+  idle.cpu_utilization = 0.5;
+  idle.queue_depth = 3;
+  EXPECT_EQ(ConcurrencyController::NextLimit(4, idle, options, &reason), 5);
+  EXPECT_THAT(reason, testing::StartsWith("increased"));
+  EXPECT_EQ(ConcurrencyController::NextLimit(10, idle, options, &reason), 10);
+
+  ConcurrencySignals busy = idle;
+  busy.cpu_utilization = 0.95;
+  EXPECT_EQ(ConcurrencyController::NextLimit(4, busy, options, &reason), 4);
+  ConcurrencySignals no_demand = idle;
+  no_demand.queue_depth = 0;
+  EXPECT_EQ(ConcurrencyController::NextLimit(4, no_demand, options, &reason),
+            4);
+
+  ConcurrencySignals errors = idle;
+  errors.infrastructure_errors = 1;
+  EXPECT_EQ(ConcurrencyController::NextLimit(8, errors, options, &reason), 5);
+  EXPECT_EQ(reason, "decreased: infrastructure errors");
+  ConcurrencySignals few_fds = idle;
+  few_fds.fd_headroom = 0.1;
+  EXPECT_EQ(ConcurrencyController::NextLimit(3, few_fds, options, &reason), 2);
+  ConcurrencySignals run_queue = idle;
+  run_queue.run_queue_per_cpu = 2;
+  EXPECT_EQ(ConcurrencyController::NextLimit(2, run_queue, options, &reason),
+            2);
+  ConcurrencySignals slow_canary = idle;
+  slow_canary.canary_slowdown = 2;
+  EXPECT_EQ(ConcurrencyController::NextLimit(10, slow_canary, options,
+                                             &reason),
+            7);
+  EXPECT_EQ(reason, "decreased: slow canary");
+}
+
 TEST(SandboxWithOutputFdsTest, CanReadStdout) {
   int pipe_ends[2];
   ASSERT_EQ(pipe(pipe_ends), 0);
@@ -604,6 +2010,82 @@ TEST(SandboxWithOutputFdsTest, CanReadStderrAfterMove) {
   EXPECT_THAT(sandbox2.Stderr(), IsOkAndHolds("hello"));
 }
 
+TEST(SandboxWithOutputFdsTest, CanReadOutputsDrainedAsync) {
+  int stdout_ends[2];
+  int stderr_ends[2];
+  ASSERT_EQ(pipe(stdout_ends), 0);
+  ASSERT_EQ(pipe(stderr_ends), 0);
+  SandboxWithOutputFds sandbox(nullptr, stdout_ends[0], stderr_ends[0]);
+  sandbox.DrainOutputsAsync();
+  SandboxWithOutputFds sandbox2 = std::move(sandbox);
+  // More than fits into a pipe, so this only finishes if it's being drained.
+  const std::string long_string = CreateLargeInput();
+  ASSERT_EQ(write(stdout_ends[1], long_string.data(), long_string.size()),
+            long_string.size());
+  ASSERT_EQ(write(stderr_ends[1], "hello", 5), 5);
+  ASSERT_EQ(close(stdout_ends[1]), 0);
+  ASSERT_EQ(close(stderr_ends[1]), 0);
+  EXPECT_THAT(sandbox2.Stdout(), IsOkAndHolds(long_string));
+  EXPECT_THAT(sandbox2.Stderr(), IsOkAndHolds("hello"));
+  EXPECT_THAT(sandbox2.Stdout(), IsOkAndHolds(long_string));
+}
+
+// Feeds `output` to a TokenOutputComparator in chunks of `chunk_size` bytes.
+bool StreamedOutputsMatch(absl::string_view output, absl::string_view expected,
+                          int chunk_size = 1) {
+  TokenOutputComparator comparator(expected);
+  for (int i = 0; i < output.size(); i += chunk_size) {
+    if (!comparator.Consume(output.substr(i, chunk_size))) {
+      return false;
+    }
+  }
+  return comparator.Finish();
+}
+
+TEST(TokenOutputComparatorTest, MatchesLikeOutputsMatch) {
+  const std::vector<std::pair<absl::string_view, absl::string_view>> cases = {
+      {"abc def", "abc def"}, {"abc def", "abc deg"}, {"abc def", "abc"},
+      {"abc", "abc def"},     {"ABC dEf", "abc def"}, {"1.000001", "1.0"},
+      {"1.0001", "1.0"},      {"nan", "nan"},         {"nan 1", "nan 1.0"},
+      {" a\n\tb \r\v", "a b"}, {"a\fb", "a b"},       {"", ""},
+  };
+  for (const auto& [output, expected] : cases) {
+    for (int chunk_size : {1, 2, 3, 100}) {
+      EXPECT_EQ(StreamedOutputsMatch(output, expected, chunk_size),
+                OutputsMatch(output, expected))
+          << "output: \"" << output << "\", expected: \"" << expected
+          << "\", chunk size: " << chunk_size;
+    }
+  }
+}
+
+TEST(TokenOutputComparatorTest, StopsAtFirstDifferingToken) {
+  TokenOutputComparator comparator("1 2 3");
+  EXPECT_TRUE(comparator.Consume("1 "));
+  EXPECT_FALSE(comparator.Consume("5 3"));
+  EXPECT_EQ(comparator.mismatch_offset(), 2);
+}
+
+TEST(TokenOutputComparatorTest, StopsAtExtraToken) {
+  TokenOutputComparator comparator("1 2");
+  EXPECT_FALSE(comparator.Consume("1 2 3"));
+  EXPECT_EQ(comparator.mismatch_offset(), 4);
+}
+
+TEST(TokenOutputComparatorTest, StopsWhenOutputTooLong) {
+  TokenOutputComparator comparator("1", /*max_output_bytes=*/8);
+  EXPECT_TRUE(comparator.Consume("1     "));
+  EXPECT_FALSE(comparator.Consume("     "));
+  EXPECT_EQ(comparator.mismatch_offset(), 8);
+}
+
+TEST(TokenOutputComparatorTest, ReportsMissingTokensAtEnd) {
+  TokenOutputComparator comparator("1 2");
+  EXPECT_TRUE(comparator.Consume("1 "));
+  EXPECT_FALSE(comparator.Finish());
+  EXPECT_EQ(comparator.mismatch_offset(), 2);
+}
+
 TEST(OutputsMatchTest, MatchingStrings) {
   EXPECT_TRUE(OutputsMatch("abc def", "abc def"));
 }
@@ -628,5 +2110,42 @@ TEST(OutputsMatchTest, NonCloseFloatsNotAccepted) {
   EXPECT_FALSE(OutputsMatch("abc 123", "abc 123.1"));
 }
 
+TEST(OutputsMatchTest, WhitespaceIgnoredInLongOutputs) {
+  std::string output, expected;
+  for (int i = 0; i < 1000; ++i) {
+    absl::StrAppend(&output, i, i % 7 == 0 ? "\r\n" : " ");
+    absl::StrAppend(&expected, i, "\t\v ");
+  }
+  EXPECT_TRUE(OutputsMatch(output, expected));
+  EXPECT_FALSE(OutputsMatch(absl::StrCat(output, "1000"), expected));
+}
+
+TEST(OutputsMatchTest, LargeIntegersComparedExactly) {
+  EXPECT_TRUE(OutputsMatch("9223372036854775807", "+9223372036854775807"));
+  EXPECT_FALSE(OutputsMatch("10000000000000001", "10000000000000000"));
+  EXPECT_TRUE(OutputsMatch("10000000000000001", "1e16"));
+}
+
+TEST(OutputsMatchTest, NanOnlyAcceptedInEqualOutputs) {
+  EXPECT_TRUE(OutputsMatch("NaN 1", "nan 1"));
+  EXPECT_FALSE(OutputsMatch("nan 1", "nan 1.000001"));
+  EXPECT_TRUE(OutputsMatch("inf 1", "INF 1"));
+}
+
+TEST(CompiledOutputTest, MatchesLikeOutputsMatch) {
+  const std::vector<absl::string_view> outputs = {
+      "abc def", "abc DEF", "abc deg", "abc def 123", "abc 123",
+      "abc 123.000001", "abc 123.1", "\n abc\t123 \n", "nan 1",
+      "NaN 1.000001", "", "10000000000000001", "+10000000000000001", "1e16"};
+  for (absl::string_view expected : outputs) {
+    const CompiledOutput compiled(expected);
+    for (absl::string_view output : outputs) {
+      EXPECT_EQ(compiled.Matches(output), OutputsMatch(output, expected))
+          << "\"" << output << "\" vs \"" << expected << "\"";
+    }
+  }
+  EXPECT_EQ(CompiledOutput("1 2\n3").num_tokens(), 3);
+}
+
 }  // namespace
 }  // namespace deepmind::code_contests
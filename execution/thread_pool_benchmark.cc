@@ -0,0 +1,120 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures task throughput of ThreadPool and WorkStealingPool.
+//
+// Each repetition schedules --num_tasks tasks from a single thread, which each
+// spin for --task_iterations iterations. With --fan_out, each of those tasks
+// schedules that many subtasks from its worker instead of spinning.
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/synchronization/blocking_counter.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "execution/simple_threadpool.h"
+#include "execution/work_stealing_pool.h"
+
+ABSL_FLAG(int, num_threads, 8, "Number of worker threads.");
+ABSL_FLAG(int, num_tasks, 100000, "Number of tasks per repetition.");
+ABSL_FLAG(int, task_iterations, 100, "Work done by each task.");
+ABSL_FLAG(int, fan_out, 0,
+          "If positive, each task schedules this many subtasks.");
+ABSL_FLAG(int, repetitions, 5, "Number of repetitions per pool.");
+
+namespace deepmind::code_contests {
+namespace {
+
+std::atomic<int64_t> sink{0};
+
+void Spin(int iterations) {
+  int64_t x = 0;
+  for (int i = 0; i < iterations; ++i) {
+    x += i * i;
+  }
+  sink.fetch_add(x, std::memory_order_relaxed);
+}
+
+// Returns the number of leaf tasks of a repetition.
+int64_t NumLeafTasks() {
+  const int64_t fan_out = absl::GetFlag(FLAGS_fan_out);
+  return absl::GetFlag(FLAGS_num_tasks) * (fan_out > 0 ? fan_out : 1);
+}
+
+// Measures tasks per second. Tasks are passed to Schedule as lambdas, which
+// ThreadPool wraps in a std::function.
+template <typename Pool>
+double MeasureTasksPerSecond(Pool& pool) {
+  const int num_tasks = absl::GetFlag(FLAGS_num_tasks);
+  const int iterations = absl::GetFlag(FLAGS_task_iterations);
+  const int fan_out = absl::GetFlag(FLAGS_fan_out);
+  const int repetitions = absl::GetFlag(FLAGS_repetitions);
+  absl::Duration total;
+  for (int r = 0; r < repetitions; ++r) {
+    absl::BlockingCounter done(NumLeafTasks());
+    const absl::Time start = absl::Now();
+    for (int i = 0; i < num_tasks; ++i) {
+      pool.Schedule([&pool, &done, iterations, fan_out] {
+        if (fan_out <= 0) {
+          Spin(iterations);
+          done.DecrementCount();
+          return;
+        }
+        for (int j = 0; j < fan_out; ++j) {
+          pool.Schedule([&done, iterations] {
+            Spin(iterations);
+            done.DecrementCount();
+          });
+        }
+      });
+    }
+    done.Wait();
+    total += absl::Now() - start;
+  }
+  return repetitions * NumLeafTasks() / absl::ToDoubleSeconds(total);
+}
+
+void RunBenchmark() {
+  const int num_threads = absl::GetFlag(FLAGS_num_threads);
+  double thread_pool_rate;
+  {
+    ThreadPool pool(num_threads);
+    pool.StartWorkers();
+    thread_pool_rate = MeasureTasksPerSecond(pool);
+  }
+  double work_stealing_rate;
+  {
+    WorkStealingPool pool(num_threads);
+    work_stealing_rate = MeasureTasksPerSecond(pool);
+  }
+  std::cout << "tasks: " << NumLeafTasks() << " x "
+            << absl::GetFlag(FLAGS_task_iterations) << " iterations\n"
+            << "ThreadPool:       " << thread_pool_rate << " tasks/sec\n"
+            << "WorkStealingPool: " << work_stealing_rate << " tasks/sec\n"
+            << "speedup: " << work_stealing_rate / thread_pool_rate << "x\n";
+}
+
+}  // namespace
+}  // namespace deepmind::code_contests
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+  deepmind::code_contests::RunBenchmark();
+  return 0;
+}
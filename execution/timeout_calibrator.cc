@@ -0,0 +1,295 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/timeout_calibrator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "contest_problem.pb.h"
+#include "execution/status_macros.h"
+#include "execution/tester_sandboxer.h"
+#include "farmhash.h"
+#include "nlohmann/json.hpp"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+using json = nlohmann::json;
+
+constexpr int kCacheVersion = 3;
+
+using ReferenceTimes =
+    absl::flat_hash_map<std::string, std::optional<absl::Duration>>;
+
+// Problems are calibrated separately for each language and set of inputs, as
+// the same name can refer to different tests in different datasets. Names are
+// fingerprinted too, since JSON keys must be valid UTF-8 and names need not.
+std::string CacheKey(const ContestProblem& problem,
+                     ContestProblem::Solution::Language language,
+                     const std::vector<absl::string_view>& inputs) {
+  std::string inputs_data;
+  for (absl::string_view input : inputs) {
+    // Length-prefixed, so that different splits of the same bytes differ.
+    absl::StrAppend(&inputs_data, input.size(), ":", input);
+  }
+  return absl::StrCat(absl::Hex(farmhash::Fingerprint64(problem.name()),
+                                absl::kZeroPad16),
+                      "/", ContestProblem::Solution::Language_Name(language),
+                      "/",
+                      absl::Hex(farmhash::Fingerprint64(inputs_data),
+                                absl::kZeroPad16));
+}
+
+absl::Status NoPassingReferenceSolution(const ContestProblem& problem) {
+  return absl::NotFoundError(absl::StrCat(
+      "None of the reference solutions of ", problem.name(), " passed."));
+}
+
+bool AllTestsPassed(const MultiTestResult& result) {
+  if (result.compilation_result.program_status != ProgramStatus::kSuccess) {
+    return false;
+  }
+  return std::all_of(result.test_results.begin(), result.test_results.end(),
+                     [](const ExecutionResult& test_result) {
+                       return test_result.program_status ==
+                                  ProgramStatus::kSuccess &&
+                              test_result.passed.value_or(false);
+                     });
+}
+
+// CPU time does not depend on how many tests run at once, unlike wall time.
+absl::Duration CpuTime(const ExecutionResult& result) {
+  if (!result.resource_usage.has_value()) {
+    return result.execution_duration;
+  }
+  return result.resource_usage->user_cpu_time +
+         result.resource_usage->system_cpu_time;
+}
+
+// Reads the cache at `path`, which is empty if the file does not exist.
+absl::StatusOr<ReferenceTimes> ReadCache(const std::string& path) {
+  ReferenceTimes reference_times;
+  if (!std::filesystem::exists(path)) {
+    return reference_times;
+  }
+  std::ifstream ifs(path);
+  std::stringstream contents;
+  contents << ifs.rdbuf();
+  const json cache = json::parse(contents.str(), /*cb=*/nullptr,
+                                 /*allow_exceptions=*/false);
+  if (cache.is_discarded() || !cache.is_object() ||
+      cache.value("version", 0) != kCacheVersion ||
+      !cache.contains("reference_seconds") ||
+      !cache["reference_seconds"].is_object()) {
+    return absl::DataLossError(
+        absl::StrCat("Malformed timeout calibration cache: ", path));
+  }
+  for (const auto& [key, seconds] : cache["reference_seconds"].items()) {
+    if (seconds.is_null()) {
+      reference_times[key] = std::nullopt;
+      continue;
+    }
+    if (!seconds.is_number()) {
+      return absl::DataLossError(
+          absl::StrCat("Malformed timeout calibration cache: ", path));
+    }
+    reference_times[key] = absl::Seconds(seconds.get<double>());
+  }
+  return reference_times;
+}
+
+// Replaces the cache at `path` with `reference_times`.
+absl::Status WriteCache(const std::string& path,
+                        const ReferenceTimes& reference_times) {
+  json cache;
+  cache["version"] = kCacheVersion;
+  cache["reference_seconds"] = json::object();
+  for (const auto& [key, reference_time] : reference_times) {
+    // Problems without passing reference solutions are stored as null.
+    cache["reference_seconds"][key] =
+        reference_time.has_value()
+            ? json(absl::ToDoubleSeconds(*reference_time))
+            : json(nullptr);
+  }
+  // Replace the cache atomically, so that it is never seen half-written.
+  const std::string temp_path = absl::StrCat(path, ".tmp.", getpid());
+  std::ofstream ofs(temp_path);
+  ofs << cache.dump(2);
+  ofs.close();
+  if (!ofs) {
+    std::error_code error;
+    std::filesystem::remove(temp_path, error);
+    return absl::UnknownError(absl::StrCat(
+        "Failed to write timeout calibration cache to ", temp_path));
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    return absl::UnknownError(
+        absl::StrCat("Failed to replace timeout calibration cache ", path));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<TimeoutCalibrator>> TimeoutCalibrator::Create(
+    const TesterSandboxer* tester, CalibrationOptions options) {
+  std::unique_ptr<TimeoutCalibrator> calibrator(
+      new TimeoutCalibrator(tester, std::move(options)));
+  {
+    absl::MutexLock l(&calibrator->mu_);
+    RETURN_IF_ERROR(calibrator->LoadCache());
+  }
+  return calibrator;
+}
+
+absl::StatusOr<absl::Duration> TimeoutCalibrator::ReferenceTime(
+    const ContestProblem& problem, const std::vector<absl::string_view>& inputs,
+    const std::vector<absl::string_view>& expected_outputs,
+    const TestOptions& base_options) {
+  const std::string key = CacheKey(problem, options_.language, inputs);
+  {
+    absl::MutexLock l(&mu_);
+    auto it = reference_times_.find(key);
+    if (it != reference_times_.end()) {
+      if (!it->second.has_value()) {
+        return NoPassingReferenceSolution(problem);
+      }
+      return *it->second;
+    }
+  }
+
+  absl::Duration reference_time;
+  int num_run = 0;
+  int num_passed = 0;
+  for (const ContestProblem::Solution& solution : problem.solutions()) {
+    if (num_run == options_.num_reference_solutions) {
+      break;
+    }
+    if (solution.language() != options_.language) {
+      continue;
+    }
+    ++num_run;
+    ASSIGN_OR_RETURN(const MultiTestResult result,
+                     tester_->Test(solution.solution(), inputs, base_options,
+                                   expected_outputs));
+    // Solutions can fail in this environment, e.g. by exceeding its limits.
+    if (!AllTestsPassed(result)) {
+      continue;
+    }
+    ++num_passed;
+    for (const ExecutionResult& test_result : result.test_results) {
+      reference_time = std::max(reference_time, CpuTime(test_result));
+    }
+  }
+
+  // Problems without passing solutions are cached too, so that their
+  // solutions are not run again for each set of samples.
+  absl::MutexLock l(&mu_);
+  if (num_passed == 0) {
+    reference_times_[key] = std::nullopt;
+    RETURN_IF_ERROR(SaveCache());
+    return NoPassingReferenceSolution(problem);
+  }
+  reference_times_[key] = reference_time;
+  RETURN_IF_ERROR(SaveCache());
+  return reference_time;
+}
+
+absl::StatusOr<TestOptions> TimeoutCalibrator::CalibratedTestOptions(
+    const ContestProblem& problem, const std::vector<absl::string_view>& inputs,
+    const std::vector<absl::string_view>& expected_outputs,
+    const TestOptions& base_options) {
+  absl::StatusOr<absl::Duration> reference_time =
+      ReferenceTime(problem, inputs, expected_outputs, base_options);
+  if (absl::IsNotFound(reference_time.status())) {
+    return base_options;
+  }
+  RETURN_IF_ERROR(reference_time.status());
+  TestOptions options = base_options;
+  options.max_execution_duration =
+      std::min(base_options.max_execution_duration,
+               std::max(options_.min_time_limit,
+                        *reference_time * options_.multiplier));
+  options.check_cpu_time = true;
+  return options;
+}
+
+absl::Status TimeoutCalibrator::LoadCache() {
+  if (options_.cache_path.empty()) {
+    return absl::OkStatus();
+  }
+  ASSIGN_OR_RETURN(reference_times_, ReadCache(options_.cache_path));
+  return absl::OkStatus();
+}
+
+absl::Status TimeoutCalibrator::SaveCache() {
+  if (options_.cache_path.empty()) {
+    return absl::OkStatus();
+  }
+  // Processes that share the cache take turns, so that each one merges the
+  // entries that the others saved instead of dropping them.
+  const std::string lock_path = absl::StrCat(options_.cache_path, ".lock");
+  const int lock_fd =
+      open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat("Opening ", lock_path, " failed with errno ", errno));
+  }
+  int result;
+  do {
+    result = flock(lock_fd, LOCK_EX);
+  } while (result != 0 && errno == EINTR);
+  if (result != 0) {
+    close(lock_fd);
+    return absl::UnknownError(
+        absl::StrCat("Locking ", lock_path, " failed with errno ", errno));
+  }
+  absl::StatusOr<ReferenceTimes> saved = ReadCache(options_.cache_path);
+  absl::Status status = saved.status();
+  if (status.ok()) {
+    // This process's own entries are newer.
+    for (auto& [key, reference_time] : *saved) {
+      reference_times_.try_emplace(key, reference_time);
+    }
+    status = WriteCache(options_.cache_path, reference_times_);
+  }
+  // Releases the lock.
+  close(lock_fd);
+  return status;
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,111 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Calibrates the time limits of problems on the current machine, by running
+// some of their correct solutions.
+//
+// Most programs that exceed a flat time limit loop forever, so a limit of a
+// few times the runtime of the slowest correct solution stops them much
+// earlier, without changing the verdicts of programs that finish.
+//
+// Reference runtimes are cached in a JSON file, so that each problem is only
+// calibrated once per machine. Problems none of whose reference solutions
+// pass are cached as well, so that they are not run again. Processes can
+// share the cache: each save merges the entries that other processes saved,
+// while holding a lock file next to the cache, which is never removed.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_TIMEOUT_CALIBRATOR_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_TIMEOUT_CALIBRATOR_H_
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "contest_problem.pb.h"
+#include "execution/tester_sandboxer.h"
+
+namespace deepmind::code_contests {
+
+struct CalibrationOptions {
+  // The language of the reference solutions, which `tester` must run.
+  ContestProblem::Solution::Language language =
+      ContestProblem::Solution::PYTHON3;
+  // The number of correct solutions to run per problem.
+  int num_reference_solutions = 3;
+  // Calibrated time limits are this multiple of the reference runtime.
+  double multiplier = 3.0;
+  // Calibrated time limits are at least this long, so that short runtimes
+  // are not affected by noise.
+  absl::Duration min_time_limit = absl::Milliseconds(500);
+  // The file to cache reference runtimes in. Not cached on disk if empty.
+  std::string cache_path;
+};
+
+class TimeoutCalibrator {
+ public:
+  // Loads the cache, if there is one. `tester` must outlive this object.
+  static absl::StatusOr<std::unique_ptr<TimeoutCalibrator>> Create(
+      const TesterSandboxer* tester, CalibrationOptions options);
+
+  TimeoutCalibrator(const TimeoutCalibrator&) = delete;
+  TimeoutCalibrator& operator=(const TimeoutCalibrator&) = delete;
+
+  // Returns the CPU time of the slowest test of the slowest reference
+  // solution, running them with `base_options`. Returns a NotFoundError if
+  // none of the reference solutions passed all tests. Results, including
+  // NotFoundErrors, are cached by fingerprints of the problem name and the
+  // inputs, and by language.
+  absl::StatusOr<absl::Duration> ReferenceTime(
+      const ContestProblem& problem,
+      const std::vector<absl::string_view>& inputs,
+      const std::vector<absl::string_view>& expected_outputs,
+      const TestOptions& base_options);
+
+  // Returns `base_options` with a time limit of `multiplier` times the
+  // reference time, but no longer than the time limit of `base_options`.
+  // Returns `base_options` unchanged if no reference solution passed.
+  absl::StatusOr<TestOptions> CalibratedTestOptions(
+      const ContestProblem& problem,
+      const std::vector<absl::string_view>& inputs,
+      const std::vector<absl::string_view>& expected_outputs,
+      const TestOptions& base_options);
+
+ private:
+  TimeoutCalibrator(const TesterSandboxer* tester, CalibrationOptions options)
+      : tester_(tester), options_(std::move(options)) {}
+
+  absl::Status LoadCache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Also adds the entries that other processes saved meanwhile.
+  absl::Status SaveCache() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const TesterSandboxer* const tester_;
+  const CalibrationOptions options_;
+  absl::Mutex mu_;
+  // Reference times by CacheKey, or nullopt if no reference solution passed.
+  absl::flat_hash_map<std::string, std::optional<absl::Duration>>
+      reference_times_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_TIMEOUT_CALIBRATOR_H_
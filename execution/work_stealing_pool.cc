@@ -0,0 +1,255 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/work_stealing_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+// The pool and queue of the current worker thread, if any.
+thread_local const WorkStealingPool* current_pool = nullptr;
+thread_local int current_worker = -1;
+// The queue that the next task scheduled from this thread is put in, if it is
+// not a worker. Producers don't share a counter, so that they don't contend.
+thread_local uint64_t next_queue = 0;
+
+// How long a worker waiting for a group sleeps when there is nothing to run.
+constexpr absl::Duration kGroupWaitPollInterval = absl::Milliseconds(1);
+
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(int num_threads, int64_t max_queued_tasks)
+    : max_queued_tasks_(max_queued_tasks) {
+  num_threads = std::max(1, num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    queues_.push_back(std::make_unique<WorkerQueue>());
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&WorkStealingPool::WorkLoop, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    absl::MutexLock l(&mu_);
+    shutting_down_ = true;
+  }
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void WorkStealingPool::Schedule(Task task) {
+  ScheduleTask(std::move(task), /*group=*/nullptr);
+}
+
+void WorkStealingPool::ScheduleBulk(std::vector<Task> tasks) {
+  ScheduleTasks(std::move(tasks), /*group=*/nullptr);
+}
+
+bool WorkStealingPool::InWorkerThread() const { return current_pool == this; }
+
+void WorkStealingPool::ScheduleTask(Task&& task, TaskGroup* group) {
+  const bool in_worker_thread = InWorkerThread();
+  if (!in_worker_thread) {
+    WaitForRoom();
+  }
+  WorkerQueue& queue =
+      in_worker_thread
+          ? *queues_[current_worker]
+          : *queues_[next_queue++ % queues_.size()];
+  {
+    absl::MutexLock l(&queue.mu);
+    queue.items.emplace_back(std::move(task), group);
+  }
+  num_queued_.fetch_add(1);
+  Wake();
+}
+
+void WorkStealingPool::ScheduleTasks(std::vector<Task> tasks,
+                                     TaskGroup* group) {
+  if (tasks.empty()) {
+    return;
+  }
+  const int num_queues = queues_.size();
+  if (InWorkerThread()) {
+    WorkerQueue& queue = *queues_[current_worker];
+    absl::MutexLock l(&queue.mu);
+    for (Task& task : tasks) {
+      queue.items.emplace_back(std::move(task), group);
+    }
+    num_queued_.fetch_add(tasks.size());
+  } else if (max_queued_tasks_ > 0) {
+    // Tasks are queued one at a time, so that the bound holds within a bulk.
+    for (Task& task : tasks) {
+      ScheduleTask(std::move(task), group);
+    }
+    return;
+  } else {
+    // Spread the tasks in contiguous runs, taking each queue's lock once.
+    const size_t first_queue = next_queue;
+    next_queue += num_queues;
+    const size_t run_length = (tasks.size() + num_queues - 1) / num_queues;
+    for (size_t start = 0, i = 0; start < tasks.size();
+         start += run_length, ++i) {
+      WorkerQueue& queue = *queues_[(first_queue + i) % num_queues];
+      const size_t end = std::min(tasks.size(), start + run_length);
+      absl::MutexLock l(&queue.mu);
+      for (size_t j = start; j < end; ++j) {
+        queue.items.emplace_back(std::move(tasks[j]), group);
+      }
+    }
+    num_queued_.fetch_add(tasks.size());
+  }
+  Wake();
+}
+
+void WorkStealingPool::WaitForRoom() {
+  if (max_queued_tasks_ <= 0 || HasRoom()) {
+    return;
+  }
+  absl::MutexLock l(&mu_);
+  ++num_waiting_;
+  mu_.Await(absl::Condition(this, &WorkStealingPool::HasRoom));
+  --num_waiting_;
+}
+
+void WorkStealingPool::Wake() {
+  // A waiter increments num_waiting_ before checking its condition, so either
+  // it sees the change that led here, or this sees it waiting. Releasing mu_
+  // makes waiters reevaluate their conditions.
+  if (num_waiting_.load() > 0) {
+    absl::MutexLock l(&mu_);
+  }
+}
+
+bool WorkStealingPool::RunOneTask(int worker) {
+  Item item;
+  bool found = false;
+  const int num_queues = queues_.size();
+  for (int i = 0; i < num_queues && !found; ++i) {
+    WorkerQueue& queue = *queues_[(worker + i) % num_queues];
+    absl::MutexLock l(&queue.mu);
+    if (queue.items.empty()) {
+      continue;
+    }
+    // Take the newest task of our own queue, or the oldest of another.
+    if (i == 0) {
+      item = std::move(queue.items.back());
+      queue.items.pop_back();
+    } else {
+      item = std::move(queue.items.front());
+      queue.items.pop_front();
+    }
+    found = true;
+  }
+  if (!found) {
+    return false;
+  }
+  num_queued_.fetch_sub(1);
+  if (max_queued_tasks_ > 0) {
+    Wake();
+  }
+  if (item.group == nullptr || !item.group->IsCancelled()) {
+    item.task();
+  }
+  // Release anything the task holds before its group may finish.
+  item.task = nullptr;
+  if (item.group != nullptr) {
+    item.group->Finish();
+  }
+  return true;
+}
+
+void WorkStealingPool::WorkLoop(int worker) {
+  current_pool = this;
+  current_worker = worker;
+  for (;;) {
+    if (RunOneTask(worker)) {
+      continue;
+    }
+    absl::MutexLock l(&mu_);
+    ++num_waiting_;
+    mu_.Await(absl::Condition(this, &WorkStealingPool::HasTaskOrShuttingDown));
+    --num_waiting_;
+    if (shutting_down_ && num_queued_.load() == 0) {
+      return;
+    }
+  }
+}
+
+bool WorkStealingPool::HasTaskOrShuttingDown() const {
+  return num_queued_.load() > 0 || shutting_down_;
+}
+
+bool WorkStealingPool::HasRoom() const {
+  return num_queued_.load() < max_queued_tasks_;
+}
+
+void TaskGroup::Schedule(Task task) {
+  {
+    absl::MutexLock l(&mu_);
+    ++num_pending_;
+  }
+  pool_.ScheduleTask(std::move(task), this);
+}
+
+void TaskGroup::ScheduleBulk(std::vector<Task> tasks) {
+  {
+    absl::MutexLock l(&mu_);
+    num_pending_ += tasks.size();
+  }
+  pool_.ScheduleTasks(std::move(tasks), this);
+}
+
+void TaskGroup::Wait() {
+  if (!pool_.InWorkerThread()) {
+    absl::MutexLock l(&mu_);
+    mu_.Await(absl::Condition(this, &TaskGroup::Done));
+    return;
+  }
+  // Blocking a worker could deadlock, if all workers waited for tasks that
+  // are still queued.
+  for (;;) {
+    {
+      absl::MutexLock l(&mu_);
+      if (Done()) {
+        return;
+      }
+    }
+    if (!pool_.RunOneTask(current_worker)) {
+      absl::MutexLock l(&mu_);
+      mu_.AwaitWithTimeout(absl::Condition(this, &TaskGroup::Done),
+                           kGroupWaitPollInterval);
+    }
+  }
+}
+
+void TaskGroup::Finish() {
+  absl::MutexLock l(&mu_);
+  --num_pending_;
+}
+
+}  // namespace deepmind::code_contests
@@ -0,0 +1,245 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A thread pool in which each worker has its own queue, and idle workers steal
+// tasks from the queues of the others, so that workers don't all contend on a
+// single lock as in simple_threadpool.h.
+//
+// Workers run the tasks of their own queue in LIFO order, so that tasks
+// scheduled by a task run while its data is still in cache, and steal the
+// oldest tasks of other queues. Tasks scheduled from other threads are spread
+// over the queues in turn.
+//
+// Tasks can be scheduled in a TaskGroup, which can be waited for and
+// cancelled independently of the other tasks of the pool.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_WORK_STEALING_POOL_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_WORK_STEALING_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <new>
+#include <thread>  // NOLINT(build/c++11)
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+
+namespace deepmind::code_contests {
+
+class TaskGroup;
+
+// A move-only callable that takes no arguments. Unlike std::function, it
+// stores callables of up to kInlineSize bytes, such as lambdas that capture a
+// few pointers, without allocating.
+class Task {
+ public:
+  static constexpr size_t kInlineSize = 6 * sizeof(void*);
+
+  Task() = default;
+  Task(std::nullptr_t) {}  // NOLINT(google-explicit-constructor)
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, Task> &&
+                std::is_invocable_v<std::decay_t<F>&>>>
+  Task(F&& f) {  // NOLINT(google-explicit-constructor)
+    using Callable = std::decay_t<F>;
+    if constexpr (kFitsInline<Callable>) {
+      new (storage_) Callable(std::forward<F>(f));
+      ops_ = &InlineOps<Callable>::kOps;
+    } else {
+      new (storage_) Callable*(new Callable(std::forward<F>(f)));
+      ops_ = &HeapOps<Callable>::kOps;
+    }
+  }
+  ~Task() { Reset(); }
+
+  Task(Task&& other) noexcept { MoveFrom(other); }
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+  void operator()() { ops_->invoke(storage_); }
+  // Whether the callable is stored without a separate allocation.
+  bool is_inline() const { return ops_ != nullptr && ops_->is_inline; }
+
+ private:
+  struct Ops {
+    void (*invoke)(void* storage);
+    // Moves the callable to `to`, and destroys it at `from`.
+    void (*relocate)(void* from, void* to);
+    void (*destroy)(void* storage);
+    bool is_inline;
+  };
+
+  template <typename F>
+  static constexpr bool kFitsInline =
+      sizeof(F) <= kInlineSize && alignof(F) <= alignof(void*) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+  template <typename F>
+  struct InlineOps {
+    static F& Get(void* storage) { return *static_cast<F*>(storage); }
+    static void Invoke(void* storage) { Get(storage)(); }
+    static void Relocate(void* from, void* to) {
+      new (to) F(std::move(Get(from)));
+      Get(from).~F();
+    }
+    static void Destroy(void* storage) { Get(storage).~F(); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy,
+                                 /*is_inline=*/true};
+  };
+
+  template <typename F>
+  struct HeapOps {
+    static F*& Get(void* storage) { return *static_cast<F**>(storage); }
+    static void Invoke(void* storage) { (*Get(storage))(); }
+    static void Relocate(void* from, void* to) { new (to) F*(Get(from)); }
+    static void Destroy(void* storage) { delete Get(storage); }
+    static constexpr Ops kOps = {&Invoke, &Relocate, &Destroy,
+                                 /*is_inline=*/false};
+  };
+
+  void MoveFrom(Task& other) {
+    ops_ = other.ops_;
+    if (ops_ != nullptr) {
+      ops_->relocate(other.storage_, storage_);
+      other.ops_ = nullptr;
+    }
+  }
+  void Reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  alignas(void*) unsigned char storage_[kInlineSize];
+  const Ops* ops_ = nullptr;
+};
+
+class WorkStealingPool {
+ public:
+  // If `max_queued_tasks` is positive, threads other than the pool's workers
+  // block in Schedule while at least that many tasks are queued. Workers never
+  // block, so that tasks can schedule other tasks without deadlocking.
+  explicit WorkStealingPool(int num_threads, int64_t max_queued_tasks = 0);
+  // Runs all queued tasks, then stops the workers.
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  void Schedule(Task task);
+  // Schedules all of `tasks`, waking the workers once.
+  void ScheduleBulk(std::vector<Task> tasks);
+
+  int num_threads() const { return workers_.size(); }
+  // Returns whether the calling thread is one of the pool's workers.
+  bool InWorkerThread() const;
+
+ private:
+  friend class TaskGroup;
+
+  struct Item {
+    Item() = default;
+    Item(Task&& task, TaskGroup* group)
+        : task(std::move(task)), group(group) {}
+
+    Task task;
+    // The group that the task belongs to, if any.
+    TaskGroup* group = nullptr;
+  };
+
+  struct WorkerQueue {
+    absl::Mutex mu;
+    std::deque<Item> items ABSL_GUARDED_BY(mu);
+  };
+
+  void ScheduleTask(Task&& task, TaskGroup* group);
+  void ScheduleTasks(std::vector<Task> tasks, TaskGroup* group);
+  // Blocks a thread that is not a worker while the queues are full.
+  void WaitForRoom();
+  // Wakes the threads that wait on mu_ to reevaluate their conditions.
+  void Wake();
+  // Runs a task of the calling worker's queue or, failing that, a task stolen
+  // from another queue. Returns false if all queues were empty.
+  bool RunOneTask(int worker);
+  void WorkLoop(int worker);
+
+  bool HasTaskOrShuttingDown() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool HasRoom() const;
+
+  const int64_t max_queued_tasks_;
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::atomic<int64_t> num_queued_{0};
+  // The number of threads waiting on mu_, so that schedulers and workers only
+  // take it when someone needs to be woken.
+  std::atomic<int> num_waiting_{0};
+  absl::Mutex mu_;
+  bool shutting_down_ ABSL_GUARDED_BY(mu_) = false;
+  std::vector<std::thread> workers_;
+};
+
+// A set of tasks of a WorkStealingPool that can be waited for and cancelled.
+class TaskGroup {
+ public:
+  explicit TaskGroup(WorkStealingPool& pool) : pool_(pool) {}
+  // Waits for the tasks of the group.
+  ~TaskGroup() { Wait(); }
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void Schedule(Task task);
+  void ScheduleBulk(std::vector<Task> tasks);
+
+  // Waits until all tasks scheduled so far have finished or were skipped. If
+  // called from a worker of the pool, the worker runs other tasks meanwhile.
+  void Wait();
+  // Skips the tasks of the group that have not started yet. Running tasks can
+  // check IsCancelled to stop early.
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool IsCancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  friend class WorkStealingPool;
+
+  // Called by the pool when a task of the group has finished or was skipped.
+  void Finish();
+  bool Done() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    return num_pending_ == 0;
+  }
+
+  WorkStealingPool& pool_;
+  std::atomic<bool> cancelled_{false};
+  mutable absl::Mutex mu_;
+  int64_t num_pending_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_WORK_STEALING_POOL_H_
@@ -0,0 +1,327 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "execution/workspace_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "execution/status_macros.h"
+
+namespace deepmind::code_contests {
+
+namespace {
+
+// Returns the total size of the regular files under `dir`. Files that are
+// removed while it runs are skipped.
+int64_t DirectorySize(const std::string& dir) {
+  int64_t size = 0;
+  std::error_code error;
+  for (auto it = std::filesystem::recursive_directory_iterator(
+           dir, std::filesystem::directory_options::skip_permission_denied,
+           error);
+       !error && it != std::filesystem::recursive_directory_iterator();
+       it.increment(error)) {
+    std::error_code size_error;
+    if (it->is_regular_file(size_error)) {
+      const uintmax_t file_size = it->file_size(size_error);
+      if (!size_error) {
+        size += file_size;
+      }
+    }
+  }
+  return size;
+}
+
+// Removes the contents of `dir`, but not `dir` itself.
+void RemoveContents(const std::string& dir) {
+  std::error_code error;
+  std::vector<std::filesystem::path> entries;
+  for (const std::filesystem::directory_entry& entry :
+       std::filesystem::directory_iterator(dir, error)) {
+    entries.push_back(entry.path());
+  }
+  for (const std::filesystem::path& entry : entries) {
+    std::filesystem::remove_all(entry, error);
+  }
+}
+
+}  // namespace
+
+WorkspacePool::Workspace::~Workspace() {
+  pool_->Release(path_, measured_bytes_);
+}
+
+void WorkspacePool::Workspace::UpdateUsage() {
+  const int64_t bytes = pool_->MeasureWorkspace(path_);
+  pool_->UpdateUsage(measured_bytes_, bytes);
+  measured_bytes_ = bytes;
+}
+
+absl::StatusOr<WorkspacePool*> WorkspacePool::Default() {
+  static const auto* const pool = [] {
+    // Without a tmpfs of its own, the root is on disk, so that code under test
+    // can't fill up memory by writing files.
+    std::error_code error;
+    auto* pool = new absl::StatusOr<std::unique_ptr<WorkspacePool>>(
+        Create(WorkspacePoolOptions{
+            .root = absl::StrCat(
+                std::filesystem::temp_directory_path(error).string(),
+                "/code_contests_", getpid()),
+        }));
+    // The pool is never destroyed, since workspaces may outlive any other
+    // point of destruction, so its root is removed on exit instead.
+    if (pool->ok()) {
+      std::atexit([] { (*Default())->RemoveRoot(); });
+    }
+    return pool;
+  }();
+  if (!pool->ok()) {
+    return pool->status();
+  }
+  return pool->value().get();
+}
+
+absl::StatusOr<std::unique_ptr<WorkspacePool>> WorkspacePool::Create(
+    WorkspacePoolOptions options) {
+  if (options.root.empty()) {
+    return absl::InvalidArgumentError("The workspace root must be set.");
+  }
+  std::error_code error;
+  std::filesystem::create_directories(options.root, error);
+  if (error) {
+    return absl::UnknownError(absl::StrCat("Creating ", options.root,
+                                           " failed: ", error.message()));
+  }
+  std::unique_ptr<WorkspacePool> pool(new WorkspacePool(std::move(options)));
+  const WorkspacePoolOptions& pool_options = pool->options_;
+  absl::MutexLock l(&pool->mu_);
+  // Without CAP_SYS_ADMIN, the root is used as is.
+  if (pool_options.mount_tmpfs) {
+    const std::string data =
+        absl::StrCat("size=", pool_options.quota_bytes, ",mode=0755");
+    pool->stats_.mounted_tmpfs =
+        mount("tmpfs", pool_options.root.c_str(), "tmpfs",
+              MS_NOSUID | MS_NODEV, data.c_str()) == 0;
+  }
+  for (int i = 0; i < pool_options.num_ready; ++i) {
+    ASSIGN_OR_RETURN(std::string path, pool->CreateWorkspace());
+    pool->ready_.push_back(std::move(path));
+  }
+  pool->stats_.num_ready = pool->ready_.size();
+  return pool;
+}
+
+WorkspacePool::WorkspacePool(WorkspacePoolOptions options)
+    : options_(std::move(options)),
+      wipe_thread_(&WorkspacePool::WipeLoop, this) {}
+
+WorkspacePool::~WorkspacePool() { RemoveRoot(); }
+
+void WorkspacePool::RemoveRoot() {
+  {
+    absl::MutexLock l(&mu_);
+    if (stopping_) {
+      return;
+    }
+    stopping_ = true;
+  }
+  wipe_thread_.join();
+  absl::MutexLock l(&mu_);
+  if (stats_.mounted_tmpfs) {
+    umount2(options_.root.c_str(), MNT_DETACH);
+  }
+  std::error_code error;
+  std::filesystem::remove_all(options_.root, error);
+}
+
+absl::StatusOr<std::unique_ptr<WorkspacePool::Workspace>>
+WorkspacePool::Acquire() {
+  if (UsedBytes() >= options_.quota_bytes) {
+    // Wiping may free enough.
+    {
+      absl::MutexLock l(&mu_);
+      ++stats_.num_quota_waits;
+      mu_.AwaitWithTimeout(
+          absl::Condition(this, &WorkspacePool::NoWipesPending),
+          options_.max_quota_wait);
+    }
+    const int64_t used_bytes = UsedBytes();
+    if (used_bytes >= options_.quota_bytes) {
+      absl::MutexLock l(&mu_);
+      ++stats_.num_quota_rejections;
+      return absl::ResourceExhaustedError(
+          absl::StrCat("Workspaces use ", used_bytes, " bytes, the quota is ",
+                       options_.quota_bytes, "."));
+    }
+  }
+  absl::MutexLock l(&mu_);
+  std::string path;
+  if (ready_.empty()) {
+    ASSIGN_OR_RETURN(path, CreateWorkspace());
+  } else {
+    path = std::move(ready_.back());
+    ready_.pop_back();
+  }
+  ++stats_.num_acquired;
+  ++stats_.num_in_use;
+  stats_.num_ready = ready_.size();
+  return std::unique_ptr<Workspace>(new Workspace(this, std::move(path)));
+}
+
+int64_t WorkspacePool::UsedBytes() const {
+  {
+    absl::MutexLock l(&mu_);
+    if (!stats_.mounted_tmpfs) {
+      return stats_.measured_bytes;
+    }
+  }
+  struct statvfs fs;
+  if (statvfs(options_.root.c_str(), &fs) != 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+}
+
+WorkspacePool::Stats WorkspacePool::stats() const {
+  absl::MutexLock l(&mu_);
+  return stats_;
+}
+
+absl::StatusOr<std::string> WorkspacePool::CreateWorkspace() {
+  std::string path = absl::StrCat(options_.root, "/", next_id_++);
+  std::error_code error;
+  if (!std::filesystem::create_directory(path, error)) {
+    return absl::UnknownError(
+        absl::StrCat("Creating workspace ", path, " failed: ",
+                     error ? error.message() : "it already exists"));
+  }
+  ++stats_.num_created;
+  return path;
+}
+
+int64_t WorkspacePool::MeasureWorkspace(const std::string& path) const {
+  {
+    absl::MutexLock l(&mu_);
+    if (stats_.mounted_tmpfs) {
+      return 0;
+    }
+  }
+  return DirectorySize(path);
+}
+
+void WorkspacePool::UpdateUsage(int64_t old_bytes, int64_t new_bytes) {
+  absl::MutexLock l(&mu_);
+  stats_.measured_bytes += new_bytes - old_bytes;
+}
+
+void WorkspacePool::Release(const std::string& path, int64_t measured_bytes) {
+  // Measured again, since tests may have written to it.
+  const int64_t bytes = MeasureWorkspace(path);
+  absl::MutexLock l(&mu_);
+  to_wipe_.push_back(Released{.path = path, .measured_bytes = bytes});
+  stats_.measured_bytes += bytes - measured_bytes;
+  --stats_.num_in_use;
+  ++stats_.num_wiping;
+}
+
+void WorkspacePool::WipeLoop() {
+  for (;;) {
+    std::string path;
+    {
+      absl::MutexLock l(&mu_);
+      mu_.Await(absl::Condition(this, &WorkspacePool::HasWipesOrStopping));
+      if (to_wipe_.empty()) {
+        return;
+      }
+      // Stays queued until wiped, so that Acquire can wait for it.
+      path = to_wipe_.front().path;
+    }
+    RemoveContents(path);
+    bool keep;
+    {
+      absl::MutexLock l(&mu_);
+      stats_.measured_bytes -= to_wipe_.front().measured_bytes;
+      to_wipe_.pop_front();
+      --stats_.num_wiping;
+      keep = !stopping_ && ready_.size() < options_.num_ready;
+      if (keep) {
+        ready_.push_back(path);
+        ++stats_.num_recycled;
+        stats_.num_ready = ready_.size();
+      }
+    }
+    if (!keep) {
+      std::error_code error;
+      std::filesystem::remove_all(path, error);
+    }
+  }
+}
+
+bool WorkspacePool::HasWipesOrStopping() const {
+  return !to_wipe_.empty() || stopping_;
+}
+
+bool WorkspacePool::NoWipesPending() const { return to_wipe_.empty(); }
+
+absl::Status WriteFileContents(const std::string& path,
+                               absl::string_view contents) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+  if (fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat("Opening ", path, " failed with errno ", errno));
+  }
+  while (!contents.empty()) {
+    const ssize_t n = write(fd, contents.data(), contents.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      const int write_errno = errno;
+      close(fd);
+      return write_errno == ENOSPC
+                 ? absl::ResourceExhaustedError(
+                       absl::StrCat("Writing ", path, " exceeded the quota."))
+                 : absl::UnknownError(absl::StrCat(
+                       "Writing ", path, " failed with errno ", write_errno));
+    }
+    contents.remove_prefix(n);
+  }
+  if (close(fd) != 0) {
+    return absl::UnknownError(
+        absl::StrCat("Closing ", path, " failed with errno ", errno));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace deepmind::code_contests
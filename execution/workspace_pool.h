@@ -0,0 +1,175 @@
+// Copyright 2022 DeepMind Technologies Limited
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A pool of directories, in which programs are compiled and run.
+//
+// Every Test call needs a directory for the program and whatever its
+// compilation writes, such as __pycache__. Workspaces are created ahead of
+// time, preferably on a tmpfs of the pool's own, and when a Test call is done
+// with one, it is wiped on a background thread and handed out again. The total
+// size of the workspaces is limited by a quota, so that long runs don't fill
+// up memory or disk.
+
+#ifndef LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_WORKSPACE_POOL_H_
+#define LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_WORKSPACE_POOL_H_
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <utility>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace deepmind::code_contests {
+
+struct WorkspacePoolOptions {
+  // The directory that workspaces are created in. The pool mounts a tmpfs of
+  // quota_bytes on it if it may, and otherwise uses the directory as is. Code
+  // under test can write to its workspace, so without a tmpfs of its own the
+  // root should be on disk rather than on a shared tmpfs such as /dev/shm,
+  // where those writes would take memory that the quota only limits loosely.
+  std::string root;
+  bool mount_tmpfs = true;
+  // The number of empty workspaces that are kept ready.
+  int num_ready = 8;
+  // The total size of the files in all workspaces. The kernel enforces it if
+  // the pool has its own tmpfs. Otherwise, Acquire waits while it is exceeded
+  // by the workspaces, as last measured (see Workspace::UpdateUsage).
+  int64_t quota_bytes = INT64_C(1) << 30;
+  // How long Acquire waits for workspaces to be wiped, when over quota.
+  absl::Duration max_quota_wait = absl::Seconds(10);
+};
+
+class WorkspacePool {
+ public:
+  struct Stats {
+    // Whether the pool has its own tmpfs.
+    bool mounted_tmpfs = false;
+    int num_ready = 0;
+    int num_in_use = 0;
+    int num_wiping = 0;
+    int64_t num_created = 0;
+    int64_t num_acquired = 0;
+    // Number of workspaces that were wiped and made ready again.
+    int64_t num_recycled = 0;
+    // Number of Acquire calls that waited because the quota was exceeded, and
+    // that failed because it still was.
+    int64_t num_quota_waits = 0;
+    int64_t num_quota_rejections = 0;
+    // The size of the workspaces that are in use or waiting to be wiped, as
+    // last measured. Only tracked if the pool has no tmpfs of its own.
+    int64_t measured_bytes = 0;
+  };
+
+  // A directory of the pool. It is wiped and returned to the pool when
+  // destroyed.
+  class Workspace {
+   public:
+    ~Workspace();
+
+    Workspace(const Workspace&) = delete;
+    Workspace& operator=(const Workspace&) = delete;
+
+    const std::string& path() const { return path_; }
+    // Measures the files in the workspace, and counts them towards the quota
+    // until it is wiped. Call after writing to it, e.g. after compiling code
+    // into it. Workspaces are measured again when they are released.
+    void UpdateUsage();
+
+   private:
+    friend class WorkspacePool;
+
+    Workspace(WorkspacePool* pool, std::string path)
+        : pool_(pool), path_(std::move(path)) {}
+
+    WorkspacePool* const pool_;
+    const std::string path_;
+    int64_t measured_bytes_ = 0;
+  };
+
+  // Returns the pool shared by the whole process, or an error if it could not
+  // be created. Its root is in the temporary directory (e.g. /tmp), with a
+  // tmpfs of its own if the process may mount one, and is removed when the
+  // process exits.
+  static absl::StatusOr<WorkspacePool*> Default();
+
+  static absl::StatusOr<std::unique_ptr<WorkspacePool>> Create(
+      WorkspacePoolOptions options);
+  // Waits for workspaces to be wiped, then removes the root. All workspaces
+  // must have been destroyed.
+  ~WorkspacePool();
+
+  WorkspacePool(const WorkspacePool&) = delete;
+  WorkspacePool& operator=(const WorkspacePool&) = delete;
+
+  // Returns an empty workspace. Returns a ResourceExhaustedError if the quota
+  // is exceeded for longer than max_quota_wait.
+  absl::StatusOr<std::unique_ptr<Workspace>> Acquire();
+
+  // The total size of the files in the pool: of its tmpfs if it has one, and
+  // otherwise of its workspaces as last measured.
+  int64_t UsedBytes() const;
+  Stats stats() const;
+
+ private:
+  explicit WorkspacePool(WorkspacePoolOptions options);
+
+  struct Released {
+    std::string path;
+    int64_t measured_bytes;
+  };
+
+  absl::StatusOr<std::string> CreateWorkspace()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Returns the size of the files in the workspace at `path`, or 0 if the pool
+  // has a tmpfs of its own, which is measured as a whole.
+  int64_t MeasureWorkspace(const std::string& path) const;
+  // Replaces the last measurement of a workspace in the usage.
+  void UpdateUsage(int64_t old_bytes, int64_t new_bytes);
+  // Measures the workspace at `path` and queues it to be wiped.
+  void Release(const std::string& path, int64_t measured_bytes);
+  void WipeLoop();
+  // Stops wiping workspaces and removes the root, with its tmpfs. Only the
+  // first call does anything.
+  void RemoveRoot();
+
+  bool HasWipesOrStopping() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  bool NoWipesPending() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const WorkspacePoolOptions options_;
+  mutable absl::Mutex mu_;
+  std::vector<std::string> ready_ ABSL_GUARDED_BY(mu_);
+  std::deque<Released> to_wipe_ ABSL_GUARDED_BY(mu_);
+  int64_t next_id_ ABSL_GUARDED_BY(mu_) = 0;
+  bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+  Stats stats_ ABSL_GUARDED_BY(mu_);
+  std::thread wipe_thread_;
+};
+
+// Writes `contents` to a new file at `path` with plain write(2) calls, without
+// the buffering of std::ofstream, and reports failures.
+absl::Status WriteFileContents(const std::string& path,
+                               absl::string_view contents);
+
+}  // namespace deepmind::code_contests
+
+#endif  // LEARNING_DEEPMIND_RESEARCH_CODEGEN_EXECUTION_WORKSPACE_POOL_H_